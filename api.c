@@ -136,7 +136,7 @@ static const char SEPARATOR = '|';
 #define SEPSTR "|"
 static const char GPUSEP = ',';
 
-static const char *APIVERSION = "1.32";
+static const char *APIVERSION = "1.33";
 static const char *DEAD = "Dead";
 #if defined(HAVE_OPENCL) || defined(HAVE_AN_FPGA) || defined(HAVE_AN_ASIC)
 static const char *SICK = "Sick";
@@ -251,6 +251,7 @@ static const char *OSINFO =
 #define _DEBUGSET	"DEBUG"
 #define _SETCONFIG	"SETCONFIG"
 #define _USBSTATS	"USBSTATS"
+#define _LATENCY	"LATENCY"
 
 static const char ISJSON = '{';
 #define JSON0		"{"
@@ -293,6 +294,7 @@ static const char ISJSON = '{';
 #define JSON_DEBUGSET	JSON1 _DEBUGSET JSON2
 #define JSON_SETCONFIG	JSON1 _SETCONFIG JSON2
 #define JSON_USBSTATS	JSON1 _USBSTATS JSON2
+#define JSON_LATENCY	JSON1 _LATENCY JSON2
 #define JSON_END	JSON4 JSON5
 #define JSON_END_TRUNCATED	JSON4_TRUNCATED JSON5
 
@@ -440,6 +442,7 @@ static const char *JSON_PARAMETER = "parameter";
 #define MSG_SETQUOTA 122
 #define MSG_LOCKOK 123
 #define MSG_LOCKDIS 124
+#define MSG_LATENCY 125
 
 enum code_severity {
 	SEVERITY_ERR,
@@ -646,6 +649,7 @@ struct CODES {
 #endif
  { SEVERITY_SUCC,  MSG_LOCKOK,	PARAM_NONE,	"Lock stats created" },
  { SEVERITY_WARN,  MSG_LOCKDIS,	PARAM_NONE,	"Lock stats not enabled" },
+ { SEVERITY_SUCC,  MSG_LATENCY,	PARAM_NONE,	"Latency" },
  { SEVERITY_FAIL, 0, 0, NULL }
 };
 
@@ -2097,6 +2101,7 @@ static void ascstatus(struct io_data *io_data, int asc, bool isjson, bool precom
 		root = api_add_int(root, "Accepted", &(cgpu->accepted), false);
 		root = api_add_int(root, "Rejected", &(cgpu->rejected), false);
 		root = api_add_int(root, "Hardware Errors", &(cgpu->hw_errors), false);
+		root = api_add_int(root, "Duplicate Nonces", &(cgpu->dup_nonces), false);
 		root = api_add_utility(root, "Utility", &(cgpu->utility), false);
 		int last_share_pool = cgpu->last_share_pool_time > 0 ?
 					cgpu->last_share_pool : -1;
@@ -2183,6 +2188,7 @@ static void pgastatus(struct io_data *io_data, int pga, bool isjson, bool precom
 		root = api_add_int(root, "Accepted", &(cgpu->accepted), false);
 		root = api_add_int(root, "Rejected", &(cgpu->rejected), false);
 		root = api_add_int(root, "Hardware Errors", &(cgpu->hw_errors), false);
+		root = api_add_int(root, "Duplicate Nonces", &(cgpu->dup_nonces), false);
 		root = api_add_utility(root, "Utility", &(cgpu->utility), false);
 		int last_share_pool = cgpu->last_share_pool_time > 0 ?
 					cgpu->last_share_pool : -1;
@@ -2553,6 +2559,7 @@ static void poolstatus(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __m
 		root = api_add_int(root, "Works", &pool->works, false);
 		root = api_add_uint(root, "Discarded", &(pool->discarded_work), false);
 		root = api_add_uint(root, "Stale", &(pool->stale_shares), false);
+		root = api_add_uint(root, "Duplicate Nonces", &(pool->dup_nonces), false);
 		root = api_add_uint(root, "Get Failures", &(pool->getfail_occasions), false);
 		root = api_add_uint(root, "Remote Failures", &(pool->remotefail_occasions), false);
 		root = api_add_escape(root, "User", pool->rpc_user, false);
@@ -3842,6 +3849,95 @@ static void usbstats(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __may
 #endif
 }
 
+static const char *latency_stages[LAT_STAGES] = {
+	"Parse",
+	"Detect",
+	"Discard",
+	"Flush",
+	"Wake"
+};
+
+static int latencyrow(struct io_data *io_data, int i, const char *id, const char *stage, struct latency_hist *hist, bool isjson)
+{
+	struct api_data *root = NULL;
+	char buf[TMPBUFSIZ], buckets[LAT_BUCKETS * 21];
+	double min, avg, max, p50, p90, p99;
+	int b, top, len = 0;
+
+	min = hist->min / 1000.0;
+	avg = hist->count ? (double)hist->total / hist->count / 1000.0 : 0;
+	max = hist->max / 1000.0;
+	p50 = lat_hist_pct(hist, 50) / 1000.0;
+	p90 = lat_hist_pct(hist, 90) / 1000.0;
+	p99 = lat_hist_pct(hist, 99) / 1000.0;
+
+	for (top = LAT_BUCKETS - 1; top > 0 && !lat_hist_bucket(hist, top); top--)
+		;
+	buckets[0] = '\0';
+	for (b = 0; b <= top; b++)
+		len += snprintf(buckets + len, sizeof(buckets) - len, "%s%"PRIu64,
+				b ? "/" : "", lat_hist_bucket(hist, b));
+
+	root = api_add_string(root, "ID", (char *)id, false);
+	root = api_add_const(root, "Stage", stage, false);
+	root = api_add_uint64(root, "Count", &(hist->count), false);
+	root = api_add_double(root, "Min", &min, true);
+	root = api_add_double(root, "Avg", &avg, true);
+	root = api_add_double(root, "Max", &max, true);
+	root = api_add_double(root, "P50", &p50, true);
+	root = api_add_double(root, "P90", &p90, true);
+	root = api_add_double(root, "P99", &p99, true);
+	root = api_add_string(root, "Histogram", buckets, true);
+
+	root = print_data(root, buf, isjson, isjson && (i > 0));
+	io_add(io_data, buf);
+
+	return ++i;
+}
+
+/* Notify to restart latencies of each stratum pool and, per device, the
+ * latency from notify to the device being handed work from the new job */
+static void latency(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __maybe_unused char *param, bool isjson, __maybe_unused char group)
+{
+	struct latency_hist hist[LAT_STAGES];
+	bool io_open = false;
+	char id[20];
+	int i = 0, j, stage;
+
+	message(io_data, MSG_LATENCY, 0, NULL, isjson);
+
+	if (isjson)
+		io_open = io_add(io_data, COMSTR JSON_LATENCY);
+
+	for (j = 0; j < total_pools; j++) {
+		struct pool *pool = pools[j];
+
+		mutex_lock(&lat_lock);
+		memcpy(hist, pool->latency, sizeof(hist));
+		mutex_unlock(&lat_lock);
+
+		if (!hist[LAT_PARSE].count)
+			continue;
+		sprintf(id, "POOL%d", pool->pool_no);
+		for (stage = 0; stage < LAT_STAGES; stage++)
+			i = latencyrow(io_data, i, id, latency_stages[stage], &hist[stage], isjson);
+	}
+
+	for (j = 0; j < total_devices; j++) {
+		struct cgpu_info *cgpu = get_devices(j);
+
+		mutex_lock(&lat_lock);
+		memcpy(hist, &cgpu->job_latency, sizeof(hist[0]));
+		mutex_unlock(&lat_lock);
+
+		sprintf(id, "%s%d", cgpu->drv->name, cgpu->device_id);
+		i = latencyrow(io_data, i, id, "Device", &hist[0], isjson);
+	}
+
+	if (isjson && io_open)
+		io_close(io_data);
+}
+
 #ifdef HAVE_AN_FPGA
 static void pgaset(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __maybe_unused char *param, bool isjson, __maybe_unused char group)
 {
@@ -3919,12 +4015,17 @@ static void dozero(struct io_data *io_data, __maybe_unused SOCKETTYPE c, char *p
 
 	bool all = false;
 	bool bs = false;
+	bool usb = false;
 	if (strcasecmp(param, "all") == 0)
 		all = true;
 	else if (strcasecmp(param, "bestshare") == 0)
 		bs = true;
+#ifdef USE_USBUTILS
+	else if (strcasecmp(param, "usbstats") == 0)
+		usb = true;
+#endif
 
-	if (all == false && bs == false) {
+	if (all == false && bs == false && usb == false) {
 		message(io_data, MSG_ZERINV, 0, param, isjson);
 		return;
 	}
@@ -3943,11 +4044,15 @@ static void dozero(struct io_data *io_data, __maybe_unused SOCKETTYPE c, char *p
 		zero_stats();
 	if (bs)
 		zero_bestshare();
+#ifdef USE_USBUTILS
+	if (usb)
+		usb_zero_stats();
+#endif
 
 	if (dosum)
-		message(io_data, MSG_ZERSUM, 0, all ? "All" : "BestShare", isjson);
+		message(io_data, MSG_ZERSUM, 0, all ? "All" : (bs ? "BestShare" : "USB"), isjson);
 	else
-		message(io_data, MSG_ZERNOSUM, 0, all ? "All" : "BestShare", isjson);
+		message(io_data, MSG_ZERNOSUM, 0, all ? "All" : (bs ? "BestShare" : "USB"), isjson);
 }
 
 static void dohotplug(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __maybe_unused char *param, bool isjson, __maybe_unused char group)
@@ -4313,6 +4418,7 @@ struct CMDS {
 #endif
 	{ "asccount",		asccount,	false },
 	{ "lockstats",		lockstats,	true },
+	{ "latency",		latency,	false },
 	{ NULL,			NULL,		false }
 };
 
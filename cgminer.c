@@ -92,9 +92,15 @@ char *curly = ":D";
 #if defined(unix) || defined(__APPLE__)
 	#include <errno.h>
 	#include <fcntl.h>
+	#include <poll.h>
 	#include <sys/wait.h>
 #endif
 
+#ifdef __linux
+#define USE_STRATUM_REACTOR
+#include <sys/epoll.h>
+#endif
+
 #ifdef USE_AVALON
 #include "driver-avalon.h"
 #endif
@@ -233,6 +239,11 @@ bool use_curses;
 static bool opt_submit_stale = true;
 static int opt_shares;
 bool opt_fail_only;
+static int opt_standby_pools;
+#ifndef WIN32
+static char *opt_pool_replay;
+static float opt_pool_replay_speed = 1.0;
+#endif
 static bool opt_fix_protocol;
 static bool opt_lowmem;
 bool opt_autofan;
@@ -255,6 +266,10 @@ static bool no_work;
 char *opt_icarus_options = NULL;
 char *opt_icarus_timing = NULL;
 char *opt_ztex_clock = NULL;
+char *opt_ztex_profiles = NULL;
+char *opt_serial_inventory = NULL;
+char *opt_serial_fpga_scantime = NULL;
+int opt_serial_fpga_engine;
 bool opt_worktime;
 #ifdef USE_AVALON
 char *opt_avalon_options = NULL;
@@ -267,6 +282,9 @@ char *opt_klondike_options = NULL;
 char *opt_usb_select = NULL;
 int opt_usbdump = -1;
 bool opt_usb_list_all;
+char *opt_usb_emulate;
+int opt_usb_emulate_latency = 1;
+char *opt_usb_record;
 cgsem_t usb_resource_sem;
 static pthread_t usb_poll_thread;
 static bool usb_polling;
@@ -326,6 +344,7 @@ static pthread_cond_t lp_cond;
 
 pthread_mutex_t restart_lock;
 pthread_cond_t restart_cond;
+pthread_mutex_t lat_lock;
 
 pthread_cond_t gws_cond;
 
@@ -341,6 +360,8 @@ int total_accepted, total_rejected, total_diff1;
 int total_getworks, total_stale, total_discarded;
 double total_diff_accepted, total_diff_rejected, total_diff_stale;
 static int staged_rollable;
+/* Getworks queued on the curl multi thread that will be staged shortly */
+static int getworks_queued;
 unsigned int new_blocks;
 static unsigned int work_block;
 unsigned int found_blocks;
@@ -581,7 +602,8 @@ uint64_t next(void) {
 
 static void sharelog(const char*disposition, const struct work*work)
 {
-	char *target, *hash, *data;
+	char target[sizeof(work->target) * 2 + 1], hash[sizeof(work->hash) * 2 + 1];
+	char data[sizeof(work->data) * 2 + 1];
 	struct cgpu_info *cgpu;
 	unsigned long int t;
 	struct pool *pool;
@@ -596,15 +618,12 @@ static void sharelog(const char*disposition, const struct work*work)
 	cgpu = get_thr_cgpu(thr_id);
 	pool = work->pool;
 	t = (unsigned long int)(work->tv_work_found.tv_sec);
-	target = bin2hex(work->target, sizeof(work->target));
-	hash = bin2hex(work->hash, sizeof(work->hash));
-	data = bin2hex(work->data, sizeof(work->data));
+	__bin2hex(target, work->target, sizeof(work->target));
+	__bin2hex(hash, work->hash, sizeof(work->hash));
+	__bin2hex(data, work->data, sizeof(work->data));
 
 	// timestamp,disposition,target,pool,dev,thr,sharehash,sharedata
 	rv = snprintf(s, sizeof(s), "%lu,%s,%s,%s,%s%u,%u,%s,%s\n", t, disposition, target, pool->rpc_url, cgpu->drv->name, cgpu->device_id, thr_id, hash, data);
-	free(target);
-	free(hash);
-	free(data);
 	if (rv >= (int)(sizeof(s)))
 		s[sizeof(s) - 1] = '\0';
 	else if (rv < 0) {
@@ -678,12 +697,9 @@ struct pool *add_pool(void)
 	pools = realloc(pools, sizeof(struct pool *) * (total_pools + 2));
 	pools[total_pools++] = pool;
 	mutex_init(&pool->pool_lock);
-	if (unlikely(pthread_cond_init(&pool->cr_cond, NULL)))
-		quit(1, "Failed to pthread_cond_init in add_pool");
 	cglock_init(&pool->data_lock);
 	mutex_init(&pool->stratum_lock);
 	cglock_init(&pool->gbt_lock);
-	INIT_LIST_HEAD(&pool->curlring);
 
 	/* Make sure the pool doesn't think we've been idle since time 0 */
 	pool->tv_idle.tv_sec = ~0UL;
@@ -785,6 +801,13 @@ static char *add_serial(char *arg)
 	string_elist_add(arg, &scan_devices);
 	return NULL;
 }
+
+static char *set_serial_fpga_scantime(const char *arg)
+{
+	opt_set_charp(arg, &opt_serial_fpga_scantime);
+
+	return NULL;
+}
 #endif
 
 void get_intrange(char *arg, int *val1, int *val2)
@@ -1053,6 +1076,13 @@ static char* set_sharelog(char *arg)
 	return NULL;
 }
 
+static char *set_pool_capture(const char *arg)
+{
+	if (!capture_open(arg))
+		return "Failed to open pool capture file";
+	return NULL;
+}
+
 static char *temp_cutoff_str = NULL;
 
 char *set_temp_cutoff(char *arg)
@@ -1386,6 +1416,9 @@ static struct opt_table opt_config_table[] = {
 	OPT_WITH_ARG("--ztex-clock",				// KRAMBLE
 		     set_ztex_clock, NULL, NULL,
 		     opt_hidden),
+	OPT_WITH_ARG("--ztex-profiles",
+		     opt_set_charp, NULL, &opt_ztex_profiles,
+		     "File to keep each ztex FPGA's learned clock error rates and bitstream in across restarts"),
 #endif
 #ifdef USE_AVALON
 	OPT_WITHOUT_ARG("--avalon-auto",
@@ -1466,6 +1499,17 @@ static struct opt_table opt_config_table[] = {
 	OPT_WITHOUT_ARG("--per-device-stats",
 			opt_set_bool, &want_per_device_stats,
 			"Force verbose mode and output per-device statistics"),
+	OPT_WITH_ARG("--pool-capture",
+		     set_pool_capture, NULL, NULL,
+		     "Record all stratum traffic to and from pools with timestamps to file"),
+#ifndef WIN32
+	OPT_WITH_ARG("--pool-replay",
+		     opt_set_charp, NULL, &opt_pool_replay,
+		     "Mine against local pools replaying the traffic in a --pool-capture file"),
+	OPT_WITH_ARG("--pool-replay-speed",
+		     opt_set_floatval, opt_show_floatval, &opt_pool_replay_speed,
+		     "Speed to replay --pool-replay traffic at relative to how it was captured, 0 for as fast as possible"),
+#endif
 	OPT_WITHOUT_ARG("--protocol-dump|-P",
 			opt_set_bool, &opt_protocol,
 			"Verbose dump of protocol-level activities"),
@@ -1500,6 +1544,17 @@ static struct opt_table opt_config_table[] = {
 	OPT_WITH_ARG("--scan-serial|-S",
 		     add_serial, NULL, NULL,
 		     "Serial port to probe for Serial FPGA Mining device"),
+#endif
+#ifdef USE_FPGA_SERIAL
+	OPT_WITH_ARG("--serial-inventory",
+		     opt_set_charp, NULL, &opt_serial_inventory,
+		     "File to keep the serial ports found in, so unchanged ones are not probed again on restart"),
+	OPT_WITH_ARG("--serialfpga-engine",
+		     set_int_0_to_9999, opt_show_intval, &opt_serial_fpga_engine,
+		     "Run SerialFPGA boards from N event loop threads rather than a thread each, 0 for a thread each (linux only)"),
+	OPT_WITH_ARG("--serialfpga-scantime",
+		     set_serial_fpga_scantime, NULL, NULL,
+		     "Set SerialFPGA ms per work, 0 to derive it from the hash rate - one value for all or comma separated (default: 0)"),
 #endif
 	OPT_WITH_ARG("--scan-time|-s",
 		     set_int_0_to_9999, opt_show_intval, &opt_scantime,
@@ -1530,6 +1585,9 @@ static struct opt_table opt_config_table[] = {
 	OPT_WITH_ARG("--socks-proxy",
 		     opt_set_charp, NULL, &opt_socks_proxy,
 		     "Set socks4 proxy (host:port)"),
+	OPT_WITH_ARG("--standby-pools",
+		     set_int_0_to_9999, opt_show_intval, &opt_standby_pools,
+		     "Number of backup stratum pools to keep connected with work ready for instant failover"),
 #ifdef HAVE_SYSLOG_H
 	OPT_WITHOUT_ARG("--syslog",
 			opt_set_bool, &use_syslog,
@@ -1577,9 +1635,18 @@ static struct opt_table opt_config_table[] = {
 	OPT_WITH_ARG("--usb-dump",
 		     set_int_0_to_10, opt_show_intval, &opt_usbdump,
 		     opt_hidden),
+	OPT_WITH_ARG("--usb-emulate",
+		     opt_set_charp, NULL, &opt_usb_emulate,
+		     "Add emulated USB devices, comma separated model[:count] of icarus, bitforce or a --usb-record file"),
+	OPT_WITH_ARG("--usb-emulate-latency",
+		     set_int_0_to_9999, opt_show_intval, &opt_usb_emulate_latency,
+		     "Milliseconds added to each emulated USB transfer"),
 	OPT_WITHOUT_ARG("--usb-list-all",
 			opt_set_bool, &opt_usb_list_all,
 			opt_hidden),
+	OPT_WITH_ARG("--usb-record",
+		     opt_set_charp, NULL, &opt_usb_record,
+		     "Record USB device transfers to <arg>-<bus>-<dev>.usb for --usb-emulate"),
 #endif
 #ifdef HAVE_OPENCL
 	OPT_WITH_ARG("--vectors|-v",
@@ -1806,8 +1873,20 @@ char *display_devs(int *ndevs)
 }
 #endif
 
+#ifndef WIN32
+static char *benchmark_recv(const char *arg)
+{
+	exit(bench_recv_line(arg) ? 0 : 1);
+}
+#endif
+
 /* These options are available from commandline only */
 static struct opt_table opt_cmdline_table[] = {
+#ifndef WIN32
+	OPT_WITH_ARG("--benchmark-recv",
+		     benchmark_recv, NULL, NULL,
+		     "Replay a file of captured pool traffic through the stratum line reader, report its speed and exit"),
+#endif
 	OPT_WITH_ARG("--config|-c",
 		     load_config, NULL, NULL,
 		     "Load a JSON-format configuration file\n"
@@ -1959,19 +2038,21 @@ static void calc_diff(struct work *work, double known);
 char *workpadding = "000000800000000000000000000000000000000000000000000000000000000000000000000000000000000080020000";
 
 #ifdef HAVE_LIBCURL
-/* Process transactions with GBT by storing the binary value of the first
- * transaction, and the hashes of the remaining transactions since these
- * remain constant with an altered coinbase when generating work. Must be
- * entered under gbt_lock */
+/* Process transactions with GBT by storing the merkle branch along the path of
+ * the first transaction, the coinbase, since the hashes of the remaining
+ * transactions remain constant with an altered coinbase when generating work.
+ * Must be entered under gbt_lock */
 static bool __build_gbt_txns(struct pool *pool, json_t *res_val)
 {
+	unsigned char *txn_hashes;
 	json_t *txn_array;
 	bool ret = false;
 	size_t cal_len;
-	int i;
+	int i, txns;
 
-	free(pool->txn_hashes);
-	pool->txn_hashes = NULL;
+	free(pool->merklebin);
+	pool->merklebin = NULL;
+	pool->merkles = 0;
 	pool->gbt_txns = 0;
 
 	txn_array = json_object_get(res_val, "transactions");
@@ -1983,8 +2064,10 @@ static bool __build_gbt_txns(struct pool *pool, json_t *res_val)
 	if (!pool->gbt_txns)
 		goto out;
 
-	pool->txn_hashes = calloc(32 * (pool->gbt_txns + 1), 1);
-	if (unlikely(!pool->txn_hashes))
+	/* Leaves of the tree with room for the coinbase and a duplicated last
+	 * hash, the coinbase's own slot is never read */
+	txn_hashes = calloc(32 * (pool->gbt_txns + 2), 1);
+	if (unlikely(!txn_hashes))
 		quit(1, "Failed to calloc txn_hashes in __build_gbt_txns");
 
 	for (i = 0; i < pool->gbt_txns; i++) {
@@ -2001,42 +2084,49 @@ static bool __build_gbt_txns(struct pool *pool, json_t *res_val)
 		if (unlikely(!hex2bin(txn_bin, txn, txn_len / 2)))
 			quit(1, "Failed to hex2bin txn_bin");
 
-		gen_hash(txn_bin, pool->txn_hashes + (32 * i), txn_len / 2);
+		gen_hash(txn_bin, txn_hashes + (32 * (i + 1)), txn_len / 2);
 		free(txn_bin);
 	}
-out:
-	return ret;
-}
-
-static unsigned char *__gbt_merkleroot(struct pool *pool)
-{
-	unsigned char *merkle_hash;
-	int i, txns;
-
-	merkle_hash = calloc(32 * (pool->gbt_txns + 2), 1);
-	if (unlikely(!merkle_hash))
-		quit(1, "Failed to calloc merkle_hash in __gbt_merkleroot");
-
-	gen_hash(pool->coinbase, merkle_hash, pool->coinbase_len);
 
-	if (pool->gbt_txns)
-		memcpy(merkle_hash + 32, pool->txn_hashes, pool->gbt_txns * 32);
+	/* One branch hash per level of the tree */
+	pool->merklebin = calloc(32 * 32, 1);
+	if (unlikely(!pool->merklebin))
+		quit(1, "Failed to calloc merklebin in __build_gbt_txns");
 
 	txns = pool->gbt_txns + 1;
 	while (txns > 1) {
 		if (txns % 2) {
-			memcpy(&merkle_hash[txns * 32], &merkle_hash[(txns - 1) * 32], 32);
+			memcpy(&txn_hashes[txns * 32], &txn_hashes[(txns - 1) * 32], 32);
 			txns++;
 		}
-		for (i = 0; i < txns; i += 2){
+		memcpy(pool->merklebin + (pool->merkles++ * 32), txn_hashes + 32, 32);
+		for (i = 2; i < txns; i += 2) {
 			unsigned char hashout[32];
 
-			gen_hashd(merkle_hash + (i * 32), hashout, 64);
-			memcpy(merkle_hash + (i / 2 * 32), hashout, 32);
+			gen_hashd(txn_hashes + (i * 32), hashout, 64);
+			memcpy(txn_hashes + (i / 2 * 32), hashout, 32);
 		}
 		txns /= 2;
 	}
-	return merkle_hash;
+	free(txn_hashes);
+out:
+	return ret;
+}
+
+/* Hashes the coinbase up the stored merkle branch, the same as for stratum
+ * work */
+static void __gbt_merkleroot(struct pool *pool, unsigned char *merkle_root)
+{
+	unsigned char merkle_sha[64];
+	int i;
+
+	gen_hash(pool->coinbase, merkle_root, pool->coinbase_len);
+	memcpy(merkle_sha, merkle_root, 32);
+	for (i = 0; i < pool->merkles; i++) {
+		memcpy(merkle_sha + 32, pool->merklebin + (i * 32), 32);
+		gen_hashd(merkle_sha, merkle_root, 64);
+		memcpy(merkle_sha, merkle_root, 32);
+	}
 }
 
 static bool work_decode(struct pool *pool, struct work *work, json_t *val);
@@ -2082,7 +2172,7 @@ static void update_gbt(struct pool *pool)
 
 static void gen_gbt_work(struct pool *pool, struct work *work)
 {
-	unsigned char *merkleroot;
+	unsigned char merkleroot[32];
 	struct timeval now;
 
 	cgtime(&now);
@@ -2093,7 +2183,7 @@ static void gen_gbt_work(struct pool *pool, struct work *work)
 	memcpy(pool->coinbase + pool->nonce2_offset, &pool->nonce2, 4);
 	pool->nonce2++;
 	cg_dwlock(&pool->gbt_lock);
-	merkleroot = __gbt_merkleroot(pool);
+	__gbt_merkleroot(pool, merkleroot);
 
 	memcpy(work->data, &pool->gbt_version, 4);
 	memcpy(work->data + 4, pool->previousblockhash, 32);
@@ -2112,17 +2202,16 @@ static void gen_gbt_work(struct pool *pool, struct work *work)
 	cg_runlock(&pool->gbt_lock);
 
 	flip32(work->data + 4 + 32, merkleroot);
-	free(merkleroot);
 	memset(work->data + 4 + 32 + 32 + 4 + 4, 0, 4); /* nonce */
 
 	hex2bin(work->data + 4 + 32 + 32 + 4 + 4 + 4, workpadding, 48);
 
 	if (opt_debug) {
-		char *header = bin2hex(work->data, 128);
+		char header[128 * 2 + 1];
 
+		__bin2hex(header, work->data, 128);
 		applog(LOG_DEBUG, "Generated GBT header %s", header);
 		applog(LOG_DEBUG, "Work coinbase %s", work->coinbase);
-		free(header);
 	}
 
 	calc_midstate(work);
@@ -2197,6 +2286,7 @@ static bool gbt_decode(struct pool *pool, json_t *res_val)
 	pool->coinbase = calloc(cal_len, 1);
 	if (unlikely(!pool->coinbase))
 		quit(1, "Failed to calloc pool coinbase in gbt_decode");
+	pool->coinbase_size = cal_len;
 	hex2bin(pool->coinbase, pool->coinbasetxn, 42);
 	extra_len = (uint8_t *)(pool->coinbase + 41);
 	orig_len = *extra_len;
@@ -2772,7 +2862,7 @@ static void reject_pool(struct pool *pool)
 	pool->enabled = POOL_REJECTING;
 }
 
-static void restart_threads(void);
+static void restart_threads(struct work *work);
 
 /* Theoretically threads could race when modifying accepted and
  * rejected values but the chance of two submits completing at the
@@ -2830,7 +2920,7 @@ share_result(json_t *val, json_t *res, json_t *err, const struct work *work,
 		/* If we know we found the block we know better than anyone
 		 * that new work is needed. */
 		if (unlikely(work->block))
-			restart_threads();
+			restart_threads(NULL);
 	} else {
 		mutex_lock(&stats_lock);
 		cgpu->rejected++;
@@ -2948,27 +3038,32 @@ static void print_status(int thr_id)
 		text_print_status(thr_id);
 }
 
-static bool submit_upstream_work(struct work *work, CURL *curl, bool resubmit)
+struct submit_ent {
+	struct work *work;
+	bool resubmit;
+	struct timeval tv_submit;
+};
+
+static void submit_upstream_reply(json_t *val, int rolltime, void *userdata);
+
+/* Queues the share on the curl multi thread, with submit_upstream_reply
+ * handling the result */
+static void submit_upstream_work(struct work *work, bool resubmit)
 {
-	char *hexstr = NULL;
-	json_t *val, *res, *err;
-	char *s;
-	bool rc = false;
-	int thr_id = work->thr_id;
-	struct cgpu_info *cgpu;
+	struct submit_ent *sreq;
 	struct pool *pool = work->pool;
-	int rolltime;
-	struct timeval tv_submit, tv_submit_reply;
-	char hashshow[64 + 4] = "";
-	char worktime[200] = "";
-	struct timeval now;
-	double dev_runtime;
+	char *s;
 	uint32_t data32[48];
 	char data8[192];
+	char hexstr[sizeof(data8) * 2 + 1];
 	uint32_t *data_cast_as_32;
 	int i;
 
-	cgpu = get_thr_cgpu(thr_id);
+	sreq = calloc(sizeof(struct submit_ent), 1);
+	if (unlikely(!sreq))
+		quit(1, "Failed to calloc sreq in submit_upstream_work");
+	sreq->work = work;
+	sreq->resubmit = resubmit;
 
 	/* Recast as uint32_t and copy */
 	data_cast_as_32 = (uint32_t*) work->data;
@@ -3002,45 +3097,43 @@ static bool submit_upstream_work(struct work *work, CURL *curl, bool resubmit)
 	}
 	
 	/* build hex string */
-	hexstr = bin2hex(data8, sizeof(data8));
+	__bin2hex(hexstr, (const unsigned char *)data8, sizeof(data8));
 
 	/* build JSON-RPC request */
 	/* dcr shouldn't hit this yet */
 	if (work->gbt) {
-		char *gbt_block, *varint;
+		char gbt_block[80 * 2 + 2 + 4 * 2 + 1];
 		unsigned char data[80];
+		size_t len;
 
 		flip80(data, work->data);
-		gbt_block = bin2hex(data, 80);
+		len = __bin2hex(gbt_block, data, 80);
 
 		if (work->gbt_txns < 0xfd) {
 			uint8_t val = work->gbt_txns;
 
-			varint = bin2hex((const unsigned char *)&val, 1);
+			__bin2hex(gbt_block + len, (const unsigned char *)&val, 1);
 		} else if (work->gbt_txns <= 0xffff) {
 			uint16_t val = htole16(work->gbt_txns);
 
-			gbt_block = realloc_strcat(gbt_block, "fd");
-			varint = bin2hex((const unsigned char *)&val, 2);
+			strcpy(gbt_block + len, "fd");
+			__bin2hex(gbt_block + len + 2, (const unsigned char *)&val, 2);
 		} else {
 			uint32_t val = htole32(work->gbt_txns);
 
-			gbt_block = realloc_strcat(gbt_block, "fe");
-			varint = bin2hex((const unsigned char *)&val, 4);
+			strcpy(gbt_block + len, "fe");
+			__bin2hex(gbt_block + len + 2, (const unsigned char *)&val, 4);
 		}
-		gbt_block = realloc_strcat(gbt_block, varint);
-		free(varint);
-		gbt_block = realloc_strcat(gbt_block, work->coinbase);
 
 		s = strdup("{\"id\": 0, \"method\": \"submitblock\", \"params\": [\"");
 		s = realloc_strcat(s, gbt_block);
+		s = realloc_strcat(s, work->coinbase);
 		if (work->job_id) {
 			s = realloc_strcat(s, "\", {\"workid\": \"");
 			s = realloc_strcat(s, work->job_id);
 			s = realloc_strcat(s, "\"}]}");
 		} else
 			s = realloc_strcat(s, "\", {}]}");
-		free(gbt_block);
 	} else {
 		s = strdup("{\"method\": \"getwork\", \"params\": [ \"");
 		s = realloc_strcat(s, hexstr);
@@ -3049,25 +3142,54 @@ static bool submit_upstream_work(struct work *work, CURL *curl, bool resubmit)
 	applog(LOG_DEBUG, "DBG: sending %s submit RPC call: %s", pool->rpc_url, s);
 	s = realloc_strcat(s, "\n");
 
-	cgtime(&tv_submit);
+	cgtime(&sreq->tv_submit);
 	/* issue JSON-RPC request */
-	val = json_rpc_call(curl, pool->rpc_url, pool->rpc_cert, pool->rpc_userpass, s, false, false, &rolltime, pool, true);
-	cgtime(&tv_submit_reply);
+	json_rpc_async(pool->rpc_url, pool->rpc_cert, pool->rpc_userpass, s, false, false, pool, true, submit_upstream_reply, sreq);
 	free(s);
+}
+
+static void *submit_retry_thread(void *userdata);
+
+static void submit_upstream_reply(json_t *val, __maybe_unused int rolltime, void *userdata)
+{
+	struct submit_ent *sreq = (struct submit_ent *)userdata;
+	struct work *work = sreq->work;
+	bool resubmit = sreq->resubmit;
+	json_t *res, *err;
+	int thr_id = work->thr_id;
+	struct cgpu_info *cgpu;
+	struct pool *pool = work->pool;
+	struct timeval tv_submit_reply;
+	char hashshow[64 + 4] = "";
+	char worktime[200] = "";
+	struct timeval now;
+	double dev_runtime;
+
+	cgpu = get_thr_cgpu(thr_id);
+	cgtime(&tv_submit_reply);
 
 	if (unlikely(!val)) {
+		pthread_t pth;
+
 		applog(LOG_INFO, "submit_upstream_work json_rpc_call failed");
 		if (!pool_tset(pool, &pool->submit_fail)) {
 			total_ro++;
 			pool->remotefail_occasions++;
-			if (opt_lowmem) {
+			if (opt_lowmem)
 				applog(LOG_WARNING, "Pool %d communication failure, discarding shares", pool->pool_no);
-				goto out;
-			}
-			applog(LOG_WARNING, "Pool %d communication failure, caching submissions", pool->pool_no);
+			else
+				applog(LOG_WARNING, "Pool %d communication failure, caching submissions", pool->pool_no);
 		}
-		cgsleep_ms(5000);
-		goto out;
+		if (opt_lowmem) {
+			applog(LOG_NOTICE, "Pool %d share being discarded to minimise memory cache", pool->pool_no);
+			free_work(work);
+			free(sreq);
+			return;
+		}
+		/* Can't wait here on the curl multi thread */
+		if (unlikely(pthread_create(&pth, NULL, submit_retry_thread, (void *)sreq)))
+			quit(1, "Failed to create submit_retry_thread");
+		return;
 	} else if (pool_tclear(pool, &pool->submit_fail))
 		applog(LOG_WARNING, "Pool %d communication resumed, submitting work", pool->pool_no);
 
@@ -3086,9 +3208,9 @@ static bool submit_upstream_work(struct work *work, CURL *curl, bool resubmit)
 							(struct timeval *)&(work->tv_getwork_reply));
 			double work_time = tdiff((struct timeval *)&(work->tv_work_found),
 							(struct timeval *)&(work->tv_work_start));
-			double work_to_submit = tdiff(&tv_submit,
+			double work_to_submit = tdiff(&sreq->tv_submit,
 							(struct timeval *)&(work->tv_work_found));
-			double submit_time = tdiff(&tv_submit_reply, &tv_submit);
+			double submit_time = tdiff(&tv_submit_reply, &sreq->tv_submit);
 			int diffplaces = 3;
 
 			time_t tmp_time = work->tv_getwork.tv_sec;
@@ -3146,31 +3268,29 @@ static bool submit_upstream_work(struct work *work, CURL *curl, bool resubmit)
 	}
 
 	json_decref(val);
-
-	rc = true;
-out:
-	free(hexstr);
-	return rc;
+	free_work(work);
+	free(sreq);
 }
 
-static bool get_upstream_work(struct work *work, CURL *curl)
+static void stage_work(struct work *work);
+static void pool_died(struct pool *pool);
+static void pool_resus(struct pool *pool);
+
+struct getwork_ent {
+	struct work *work;
+	bool clear_lagging;
+};
+
+static void get_upstream_reply(json_t *val, int rolltime, void *userdata)
 {
+	struct getwork_ent *greq = (struct getwork_ent *)userdata;
+	struct work *work = greq->work;
 	struct pool *pool = work->pool;
 	struct cgminer_pool_stats *pool_stats = &(pool->cgminer_pool_stats);
 	struct timeval tv_elapsed;
-	json_t *val = NULL;
 	bool rc = false;
-	char *url;
-
-	applog(LOG_DEBUG, "DBG: sending %s get RPC call: %s", pool->rpc_url, pool->rpc_req);
 
-	url = pool->rpc_url;
-
-	cgtime(&work->tv_getwork);
-
-	val = json_rpc_call(curl, url, pool->rpc_cert,
-			    pool->rpc_userpass, pool->rpc_req, false,
-			    false, &work->rolltime, pool, false);
+	work->rolltime = rolltime;
 	pool_stats->getwork_attempts++;
 
 	if (likely(val)) {
@@ -3196,7 +3316,6 @@ static bool get_upstream_work(struct work *work, CURL *curl)
 	}
 	pool_stats->getwork_calls++;
 
-	work->pool = pool;
 	work->longpoll = false;
 	work->getwork_mode = GETWORK_MODE_POOL;
 	calc_diff(work, 0);
@@ -3206,7 +3325,56 @@ static bool get_upstream_work(struct work *work, CURL *curl)
 	if (likely(val))
 		json_decref(val);
 
-	return rc;
+	if (rc) {
+		if (greq->clear_lagging)
+			pool_tclear(pool, &pool->lagging);
+		if (pool_tclear(pool, &pool->idle))
+			pool_resus(pool);
+
+		applog(LOG_DEBUG, "Generated getwork work");
+		stage_work(work);
+	} else {
+		applog(LOG_DEBUG, "Pool %d json_rpc_call failed on get work, retrying in 5s", pool->pool_no);
+		/* Make sure the pool just hasn't stopped serving
+		 * requests but is up as we'll keep hammering it */
+		if (++pool->seq_getfails > mining_threads + opt_queue)
+			pool_died(pool);
+		mutex_lock(&pool->pool_lock);
+		cgtime(&pool->tv_getfail);
+		mutex_unlock(&pool->pool_lock);
+		free_work(work);
+	}
+	free(greq);
+
+	mutex_lock(stgd_lock);
+	getworks_queued--;
+	pthread_cond_signal(&gws_cond);
+	mutex_unlock(stgd_lock);
+}
+
+/* Queues a getwork on the curl multi thread, with get_upstream_reply staging
+ * the work it returns */
+static void get_upstream_work(struct work *work, bool clear_lagging)
+{
+	struct pool *pool = work->pool;
+	struct getwork_ent *greq;
+
+	greq = malloc(sizeof(struct getwork_ent));
+	if (unlikely(!greq))
+		quit(1, "Failed to malloc greq in get_upstream_work");
+	greq->work = work;
+	greq->clear_lagging = clear_lagging;
+
+	applog(LOG_DEBUG, "DBG: sending %s get RPC call: %s", pool->rpc_url, pool->rpc_req);
+
+	mutex_lock(stgd_lock);
+	getworks_queued++;
+	mutex_unlock(stgd_lock);
+
+	cgtime(&work->tv_getwork);
+	json_rpc_async(pool->rpc_url, pool->rpc_cert, pool->rpc_userpass,
+		       pool->rpc_req, false, false, pool, false,
+		       get_upstream_reply, greq);
 }
 #endif /* HAVE_LIBCURL */
 
@@ -3472,6 +3640,8 @@ static void kill_timeout(struct thr_info *thr)
 	cg_completion_timeout(&thr_info_cancel, thr, 1000);
 }
 
+static void free_nonce_filter(struct cgpu_info *cgpu);
+
 static void kill_mining(void)
 {
 	struct thr_info *thr;
@@ -3492,8 +3662,16 @@ static void kill_mining(void)
 #else
 		if (pth && pth->p)
 			pthread_join(*pth, NULL);
+#endif
+#ifndef WIN32
+		if (thr)
+			cgwake_destroy(&thr->restart_wake);
 #endif
 	}
+
+	/* The devices are done with their nonce tables */
+	for (i = 0; i < total_devices; i++)
+		free_nonce_filter(get_devices(i));
 }
 
 static void __kill_work(void)
@@ -3607,66 +3785,6 @@ static void sighandler(int __maybe_unused sig)
 }
 
 #ifdef HAVE_LIBCURL
-/* Called with pool_lock held. Recruit an extra curl if none are available for
- * this pool. */
-static void recruit_curl(struct pool *pool)
-{
-	struct curl_ent *ce = calloc(sizeof(struct curl_ent), 1);
-
-	if (unlikely(!ce))
-		quit(1, "Failed to calloc in recruit_curl");
-
-	ce->curl = curl_easy_init();
-	if (unlikely(!ce->curl))
-		quit(1, "Failed to init in recruit_curl");
-
-	list_add(&ce->node, &pool->curlring);
-	pool->curls++;
-}
-
-/* Grab an available curl if there is one. If not, then recruit extra curls
- * unless we are in a submit_fail situation, or we have opt_delaynet enabled
- * and there are already 5 curls in circulation. Limit total number to the
- * number of mining threads per pool as well to prevent blasting a pool during
- * network delays/outages. */
-static struct curl_ent *pop_curl_entry(struct pool *pool)
-{
-	int curl_limit = opt_delaynet ? 5 : (mining_threads + opt_queue) * 2;
-	bool recruited = false;
-	struct curl_ent *ce;
-
-	mutex_lock(&pool->pool_lock);
-retry:
-	if (!pool->curls) {
-		recruit_curl(pool);
-		recruited = true;
-	} else if (list_empty(&pool->curlring)) {
-		if (pool->curls >= curl_limit) {
-			pthread_cond_wait(&pool->cr_cond, &pool->pool_lock);
-			goto retry;
-		} else {
-			recruit_curl(pool);
-			recruited = true;
-		}
-	}
-	ce = list_entry(pool->curlring.next, struct curl_ent, node);
-	list_del(&ce->node);
-	mutex_unlock(&pool->pool_lock);
-
-	if (recruited)
-		applog(LOG_DEBUG, "Recruited curl for pool %d", pool->pool_no);
-	return ce;
-}
-
-static void push_curl_entry(struct curl_ent *ce, struct pool *pool)
-{
-	mutex_lock(&pool->pool_lock);
-	list_add_tail(&ce->node, &pool->curlring);
-	cgtime(&ce->tv);
-	pthread_cond_broadcast(&pool->cr_cond);
-	mutex_unlock(&pool->pool_lock);
-}
-
 static bool stale_work(struct work *work, bool share);
 
 static inline bool should_roll(struct work *work)
@@ -3719,45 +3837,36 @@ static void roll_work(struct work *work)
 	work->id = total_work++;
 }
 
-static void *submit_work_thread(void *userdata)
+/* Resubmits a share after a failed submission, unless it went stale */
+static void *submit_retry_thread(void *userdata)
 {
-	struct work *work = (struct work *)userdata;
+	struct submit_ent *sreq = (struct submit_ent *)userdata;
+	struct work *work = sreq->work;
 	struct pool *pool = work->pool;
-	bool resubmit = false;
-	struct curl_ent *ce;
 
 	pthread_detach(pthread_self());
 
-	RenameThread("submit_work");
-
-	applog(LOG_DEBUG, "Creating extra submit work thread");
+	RenameThread("submit_retry");
 
-	ce = pop_curl_entry(pool);
-	/* submit solution to bitcoin via JSON-RPC */
-	while (!submit_upstream_work(work, ce->curl, resubmit)) {
-		if (opt_lowmem) {
-			applog(LOG_NOTICE, "Pool %d share being discarded to minimise memory cache", pool->pool_no);
-			break;
-		}
-		resubmit = true;
-		if (stale_work(work, true)) {
-			applog(LOG_NOTICE, "Pool %d share became stale while retrying submit, discarding", pool->pool_no);
-
-			mutex_lock(&stats_lock);
-			total_stale++;
-			pool->stale_shares++;
-			total_diff_stale += work->work_difficulty;
-			pool->diff_stale += work->work_difficulty;
-			mutex_unlock(&stats_lock);
+	free(sreq);
+	cgsleep_ms(5000);
+	if (stale_work(work, true)) {
+		applog(LOG_NOTICE, "Pool %d share became stale while retrying submit, discarding", pool->pool_no);
 
-			free_work(work);
-			break;
-		}
+		mutex_lock(&stats_lock);
+		total_stale++;
+		pool->stale_shares++;
+		total_diff_stale += work->work_difficulty;
+		pool->diff_stale += work->work_difficulty;
+		mutex_unlock(&stats_lock);
 
-		/* pause, then restart work-request loop */
-		applog(LOG_INFO, "json_rpc_call failed on submit_work, retrying");
+		free_work(work);
+		return NULL;
 	}
-	push_curl_entry(ce, pool);
+
+	/* pause, then restart work-request loop */
+	applog(LOG_INFO, "json_rpc_call failed on submit_work, retrying");
+	submit_upstream_work(work, true);
 
 	return NULL;
 }
@@ -3844,16 +3953,15 @@ static struct work *clone_work(struct work *work)
 }
 
 #else /* HAVE_LIBCURL */
-static void *submit_work_thread(void __maybe_unused *userdata)
+static void submit_upstream_work(struct work *work, bool __maybe_unused resubmit)
 {
-	pthread_detach(pthread_self());
-	return NULL;
+	free_work(work);
 }
 #endif /* HAVE_LIBCURL */
 
-/* Return an adjusted ntime if we're submitting work that a device has
- * internally offset the ntime. */
-static char *offset_ntime(const char *ntime, int noffset)
+/* Adjusts the ntime hex string in place if we're submitting work that a
+ * device has internally offset the ntime. */
+static void offset_ntime(char *ntime, int noffset)
 {
 	unsigned char bin[4];
 	uint32_t h32, *be32 = (uint32_t *)bin;
@@ -3862,7 +3970,7 @@ static char *offset_ntime(const char *ntime, int noffset)
 	h32 = *be32 + noffset;
 	*be32 = h32;
 
-	return bin2hex(bin, 4);
+	__bin2hex(ntime, bin, 4);
 }
 
 /* Duplicates any dynamically allocated arrays within the work struct to
@@ -3889,7 +3997,8 @@ static void _copy_work(struct work *work, const struct work *base_work, int noff
 
 			ntime += noffset;
 			*work_ntime = ntime;
-			work->ntime = offset_ntime(base_work->ntime, noffset);
+			work->ntime = strdup(base_work->ntime);
+			offset_ntime(work->ntime, noffset);
 		} else
 			work->ntime = strdup(base_work->ntime);
 	} else if (noffset) {
@@ -4074,6 +4183,7 @@ static struct pool *priority_pool(int choice)
 }
 
 static void clear_pool_work(struct pool *pool);
+static void stage_work(struct work *work);
 
 /* Specifies whether we can switch to this pool or not. */
 static bool pool_unusable(struct pool *pool)
@@ -4085,6 +4195,33 @@ static bool pool_unusable(struct pool *pool)
 	return false;
 }
 
+static void gen_stratum_work(struct pool *pool, struct work *work);
+
+/* Stage work from the latest notify of a hot standby pool as soon as we fail
+ * over to it so devices don't wait on the getwork thread. The pool is still
+ * subscribed so this needs no round trip, and the work is only generated here
+ * so standby pools don't use up nonce2 or work ids on every notify */
+static void stage_standby_work(struct pool *pool)
+{
+	int i, staged = 0;
+
+	if (!pool->has_stratum || !pool->stratum_active || !pool->stratum_notify)
+		return;
+	for (i = 0; i < mining_threads; i++) {
+		struct work *work = make_work();
+
+		gen_stratum_work(pool, work);
+		if (stale_work(work, false)) {
+			free_work(work);
+			break;
+		}
+		stage_work(work);
+		staged++;
+	}
+	if (staged)
+		applog(LOG_INFO, "Staged %d standby works from pool %d", staged, pool->pool_no);
+}
+
 void switch_pools(struct pool *selected)
 {
 	struct pool *pool, *last_pool;
@@ -4157,6 +4294,7 @@ void switch_pools(struct pool *selected)
 		applog(LOG_WARNING, "Switching to pool %d %s", pool->pool_no, pool->rpc_url);
 		if (pool_localgen(pool) || opt_fail_only)
 			clear_pool_work(last_pool);
+		stage_standby_work(pool);
 	}
 
 	mutex_lock(&lp_lock);
@@ -4234,21 +4372,108 @@ int restart_wait(struct thr_info *thr, unsigned int mstime)
 
 	return rc;
 }
-	
+
+/* For drivers that block on a device fd. Waits up to mstime for fd to become
+ * readable or for a work restart on thr, fd being -1 to only wait for a
+ * restart. Returns 1 if fd is readable, 0 on timeout or work restart and -1 if
+ * poll fails. Without poll on windows it returns 1 straight away leaving the
+ * driver's own read to wait */
+int restart_poll(struct thr_info *thr, int fd, unsigned int mstime)
+{
+#ifndef WIN32
+	int64_t end = cgtimer_us() + (int64_t)mstime * 1000;
+	struct pollfd pfd[2];
+	int ret, ms;
+
+	pfd[0].fd = thr->restart_wake.rfd;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = fd;
+	pfd[1].events = POLLIN;
+
+	while (!thr->work_restart) {
+		ms = (end - cgtimer_us() + 999) / 1000;
+		if (ms <= 0)
+			return 0;
+		ret = poll(pfd, fd < 0 ? 1 : 2, ms);
+		if (unlikely(ret < 0)) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (fd >= 0 && pfd[1].revents)
+			return 1;
+		/* Either restarting or left over from a restart already acted
+		 * on, the loop test tells which */
+		if (pfd[0].revents)
+			cgwake_clear(&thr->restart_wake);
+	}
+	return 0;
+#else
+	if (fd < 0) {
+		restart_wait(thr, mstime);
+		return 0;
+	}
+	return 1;
+#endif
+}
+
 static void flush_queue(struct cgpu_info *cgpu);
 
-static void restart_threads(void)
+/* The latest restart and when the notify that caused it was received, 0 if it
+ * was not caused by a notify. Under lat_lock */
+static unsigned int restart_no;
+static int64_t restart_us_notify;
+
+/* Records how long after its notify was received work reached stage */
+static void trace_restart(struct work *work, enum latency_stage stage)
+{
+	int64_t us;
+
+	if (!work || !work->us_notify)
+		return;
+	us = cgtimer_us() - work->us_notify;
+	mutex_lock(&lat_lock);
+	lat_hist_add(&work->pool->latency[stage], us);
+	mutex_unlock(&lat_lock);
+}
+
+/* Called as a device is handed work to record the time from the last restart's
+ * notify being received to the device getting work from that job or later */
+static void trace_job(struct cgpu_info *cgpu, struct work *work)
+{
+	if (likely(cgpu->job_restart == restart_no))
+		return;
+
+	mutex_lock(&lat_lock);
+	if (cgpu->job_restart != restart_no && work->us_notify >= restart_us_notify) {
+		if (restart_us_notify)
+			lat_hist_add(&cgpu->job_latency, cgtimer_us() - restart_us_notify);
+		cgpu->job_restart = restart_no;
+	}
+	mutex_unlock(&lat_lock);
+}
+
+/* work is the work that triggered the restart, if any, and is used to trace
+ * how long each stage of the restart takes after its notify arrived */
+static void restart_threads(struct work *work)
 {
 	struct pool *cp = current_pool();
 	struct cgpu_info *cgpu;
 	int i;
 
+	trace_restart(work, LAT_DETECT);
+	mutex_lock(&lat_lock);
+	restart_no++;
+	restart_us_notify = work ? work->us_notify : 0;
+	mutex_unlock(&lat_lock);
+
 	/* Artificially set the lagging flag to avoid pool not providing work
 	 * fast enough  messages after every long poll */
 	pool_tset(cp, &cp->lagging);
 
 	/* Discard staged work that is now stale */
 	discard_stale();
+	trace_restart(work, LAT_DISCARD);
 
 	rd_lock(&mining_thr_lock);
 	for (i = 0; i < mining_threads; i++) {
@@ -4256,14 +4481,19 @@ static void restart_threads(void)
 		if (unlikely(!cgpu))
 			continue;
 		mining_thr[i]->work_restart = true;
+#ifndef WIN32
+		cgwake_signal(&mining_thr[i]->restart_wake);
+#endif
 		flush_queue(cgpu);
 		cgpu->drv->flush_work(cgpu);
 	}
 	rd_unlock(&mining_thr_lock);
+	trace_restart(work, LAT_FLUSH);
 
 	mutex_lock(&restart_lock);
 	pthread_cond_broadcast(&restart_cond);
 	mutex_unlock(&restart_lock);
+	trace_restart(work, LAT_WAKE);
 
 #ifdef USE_USBUTILS
 	/* Cancels any cancellable usb transfers. Flagged as such it means they
@@ -4325,12 +4555,10 @@ static bool block_exists(char *hexstr)
 /* Tests if this work is from a block that has been seen before */
 static inline bool from_existing_block(struct work *work)
 {
-	char *hexstr = bin2hex(work->data + 8, 18);
-	bool ret;
+	char hexstr[18 * 2 + 1];
 
-	ret = block_exists(hexstr);
-	free(hexstr);
-	return ret;
+	__bin2hex(hexstr, work->data + 8, 18);
+	return block_exists(hexstr);
 }
 
 static int block_sort(struct block *blocka, struct block *blockb)
@@ -4426,7 +4654,7 @@ static bool test_work_current(struct work *work)
 			applog(LOG_NOTICE, "New block detected on network before longpoll");
 		else
 			applog(LOG_NOTICE, "New block detected on network");
-		restart_threads();
+		restart_threads(work);
 	} else {
 		if (memcmp(pool->prev_block, bedata, 32)) {
 			/* Work doesn't match what this pool has stored as
@@ -4461,7 +4689,7 @@ static bool test_work_current(struct work *work)
 					applog(LOG_NOTICE, "%sLONGPOLL from pool %d requested work restart",
 					       work->gbt ? "GBT " : "", work->pool->pool_no);
 				}
-				restart_threads();
+				restart_threads(work);
 			}
 		}
 	}
@@ -4835,6 +5063,12 @@ void write_config(FILE *fcfg)
 		fprintf(fcfg, ",\n\"icarus-options\" : \"%s\"", json_escape(opt_icarus_options));
 	if (opt_icarus_timing)
 		fprintf(fcfg, ",\n\"icarus-timing\" : \"%s\"", json_escape(opt_icarus_timing));
+	if (opt_serial_inventory)
+		fprintf(fcfg, ",\n\"serial-inventory\" : \"%s\"", json_escape(opt_serial_inventory));
+	if (opt_ztex_profiles)
+		fprintf(fcfg, ",\n\"ztex-profiles\" : \"%s\"", json_escape(opt_ztex_profiles));
+	if (opt_serial_fpga_scantime)
+		fprintf(fcfg, ",\n\"serialfpga-scantime\" : \"%s\"", json_escape(opt_serial_fpga_scantime));
 #ifdef USE_KLONDIKE
 	if (opt_klondike_options)
 		fprintf(fcfg, ",\n\"klondike-options\" : \"%s\"", json_escape(opt_icarus_options));
@@ -4892,6 +5126,7 @@ void zero_stats(void)
 		pool->accepted = 0;
 		pool->rejected = 0;
 		pool->stale_shares = 0;
+		pool->dup_nonces = 0;
 		pool->discarded_work = 0;
 		pool->getfail_occasions = 0;
 		pool->remotefail_occasions = 0;
@@ -4901,6 +5136,9 @@ void zero_stats(void)
 		pool->diff_rejected = 0;
 		pool->diff_stale = 0;
 		pool->last_share_diff = 0;
+		mutex_lock(&lat_lock);
+		memset(pool->latency, 0, sizeof(pool->latency));
+		mutex_unlock(&lat_lock);
 	}
 
 	zero_bestshare();
@@ -4913,6 +5151,7 @@ void zero_stats(void)
 		cgpu->accepted = 0;
 		cgpu->rejected = 0;
 		cgpu->hw_errors = 0;
+		cgpu->dup_nonces = 0;
 		cgpu->utility = 0.0;
 		cgpu->last_share_pool_time = 0;
 		cgpu->diff1 = 0;
@@ -4920,6 +5159,10 @@ void zero_stats(void)
 		cgpu->diff_rejected = 0;
 		cgpu->last_share_diff = 0;
 		mutex_unlock(&hash_lock);
+
+		mutex_lock(&lat_lock);
+		memset(&cgpu->job_latency, 0, sizeof(cgpu->job_latency));
+		mutex_unlock(&lat_lock);
 	}
 }
 
@@ -5628,6 +5871,29 @@ static int cp_prio(void)
 	return prio;
 }
 
+/* Whether this pool is one of the --standby-pools highest priority backup
+ * stratum pools kept connected with work ready to fail over to. Dead pools
+ * don't take a slot, so the next live pool gets it */
+static bool pool_standby(struct pool *pool)
+{
+	struct pool *cp = current_pool();
+	int i, standby = 0;
+
+	if (!opt_standby_pools || pool == cp || !pool->has_stratum)
+		return false;
+	for (i = 0; i < total_pools && standby < opt_standby_pools; i++) {
+		struct pool *tp = priority_pool(i);
+
+		if (tp == cp || !tp->has_stratum || tp->enabled != POOL_ENABLED ||
+		    tp->idle)
+			continue;
+		if (tp == pool)
+			return true;
+		standby++;
+	}
+	return false;
+}
+
 /* We only need to maintain a secondary pool connection when we need the
  * capacity to get work from the backup pools while still on the primary */
 static bool cnx_needed(struct pool *pool)
@@ -5652,6 +5918,9 @@ static bool cnx_needed(struct pool *pool)
 	cp = current_pool();
 	if (cp == pool)
 		return true;
+	/* Hot standby pools stay subscribed and authorised */
+	if (pool_standby(pool))
+		return true;
 	if (!pool_localgen(cp) && (!opt_fail_only || !cp->hdr_path))
 		return true;
 	/* If we're waiting for a response from shares submitted, keep the
@@ -5696,6 +5965,308 @@ static bool supports_resume(struct pool *pool)
 	return ret;
 }
 
+/* Parses one line received from a stratum pool and, on a clean notify,
+ * generates a work item to update the current block database */
+static void stratum_dispatch(struct pool *pool, char *s)
+{
+	if (!parse_method(pool, s) && !parse_stratum_response(pool, s)) {
+		applog(LOG_INFO, "Unknown stratum msg: %s", s);
+		return;
+	}
+
+	if (pool->swork.clean) {
+		struct work *work = make_work();
+
+		/* Generate a single work item to update the current
+		 * block database */
+		pool->swork.clean = false;
+		gen_stratum_work(pool, work);
+		work->longpoll = true;
+		/* Return value doesn't matter. We're just informing
+		 * that we may need to restart. */
+		test_work_current(work);
+		free_work(work);
+	}
+}
+
+/* Drop a connection we don't need to maintain while mining on another pool
+ * and bring it back up when we switch to this pool. Returns false if the pool
+ * was removed in the meantime. */
+static bool stratum_standby(struct pool *pool)
+{
+	suspend_stratum(pool);
+	clear_stratum_shares(pool);
+	clear_pool_work(pool);
+
+	wait_lpcurrent(pool);
+	if (!restart_stratum(pool)) {
+		pool_died(pool);
+		while (!restart_stratum(pool)) {
+			if (pool->removed)
+				return false;
+			cgsleep_ms(30000);
+		}
+	}
+	return true;
+}
+
+/* Reconnect after the receive side of a stratum connection failed. Returns
+ * false if the pool was removed in the meantime. */
+static bool stratum_reconnect(struct pool *pool)
+{
+	applog(LOG_NOTICE, "Stratum connection to pool %d interrupted", pool->pool_no);
+	pool->getfail_occasions++;
+	total_go++;
+
+	/* If the socket to our stratum pool disconnects, all
+	 * tracked submitted shares are lost and we will leak
+	 * the memory if we don't discard their records. */
+	if (!supports_resume(pool) || opt_lowmem)
+		clear_stratum_shares(pool);
+	clear_pool_work(pool);
+	if (pool == current_pool())
+		restart_threads(NULL);
+
+	if (restart_stratum(pool))
+		return true;
+
+	pool_died(pool);
+	while (!restart_stratum(pool)) {
+		if (pool->removed)
+			return false;
+		cgsleep_ms(30000);
+	}
+	stratum_resumed(pool);
+	return true;
+}
+
+#ifdef USE_STRATUM_REACTOR
+/* On linux one reactor thread waits on the sockets of all connected stratum
+ * pools with epoll instead of each pool having its own receive thread. A pool
+ * is only given a thread of its own while it is reconnecting or parked as an
+ * unneeded backup, after which it is attached to the reactor again.
+ * The reactor only receives. Connecting, subscribing and authorising still
+ * block in those helper threads, and shares are still sent by each pool's
+ * stratum_sthread, so a pool's socket is only on the reactor once it is up. */
+#define REACTOR_EVENTS 64
+
+static int reactor_epfd = -1;
+static int reactor_wake[2];
+static pthread_mutex_t reactor_lock;
+
+static void *stratum_reactor(void *userdata);
+
+static void reactor_attach(struct pool *pool)
+{
+	struct epoll_event ev;
+	char c = 0;
+
+	mutex_lock(&reactor_lock);
+	if (reactor_epfd < 0) {
+		pthread_t pth;
+
+		reactor_epfd = epoll_create(REACTOR_EVENTS);
+		if (unlikely(reactor_epfd < 0))
+			quit(1, "Failed to epoll_create in reactor_attach");
+		if (unlikely(pipe(reactor_wake)))
+			quit(1, "Failed to create reactor_wake pipe");
+		fcntl(reactor_wake[0], F_SETFL, O_NONBLOCK);
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.ptr = NULL;
+		if (unlikely(epoll_ctl(reactor_epfd, EPOLL_CTL_ADD, reactor_wake[0], &ev)))
+			quit(1, "Failed to add reactor_wake to epoll");
+		if (unlikely(pthread_create(&pth, NULL, stratum_reactor, NULL)))
+			quit(1, "Failed to create stratum reactor thread");
+	}
+
+	cgtime(&pool->tv_reactor_recv);
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = pool;
+	mutex_lock(&pool->stratum_lock);
+	pool->reactor_fd = pool->sock;
+	pool->reactor_gen = pool->sock_gen;
+	if (unlikely(epoll_ctl(reactor_epfd, EPOLL_CTL_ADD, pool->reactor_fd, &ev)))
+		applog(LOG_WARNING, "Failed to add pool %d socket to stratum reactor", pool->pool_no);
+	mutex_unlock(&pool->stratum_lock);
+	pool->reconnect_pending = false;
+	pool->reactor_attached = true;
+	mutex_unlock(&reactor_lock);
+
+	/* Have the reactor check for lines already buffered */
+	if (write(reactor_wake[1], &c, 1) < 0)
+		applog(LOG_DEBUG, "Failed to wake stratum reactor");
+}
+
+static void reactor_detach(struct pool *pool)
+{
+	mutex_lock(&reactor_lock);
+	if (pool->reactor_attached) {
+		/* A closed socket has already left the epoll set and its fd
+		 * number may now be another pool's socket */
+		mutex_lock(&pool->stratum_lock);
+		if (pool->sock_gen == pool->reactor_gen)
+			epoll_ctl(reactor_epfd, EPOLL_CTL_DEL, pool->reactor_fd, NULL);
+		mutex_unlock(&pool->stratum_lock);
+		pool->reactor_attached = false;
+	}
+	mutex_unlock(&reactor_lock);
+}
+
+static void *stratum_reconnect_thread(void *userdata)
+{
+	struct pool *pool = (struct pool *)userdata;
+	char threadname[16];
+
+	pthread_detach(pthread_self());
+
+	snprintf(threadname, 16, "StratumR/%d", pool->pool_no);
+	RenameThread(threadname);
+
+	if (stratum_reconnect(pool))
+		reactor_attach(pool);
+	return NULL;
+}
+
+static void *stratum_restart_thread(void *userdata)
+{
+	struct pool *pool = (struct pool *)userdata;
+	char threadname[16];
+
+	pthread_detach(pthread_self());
+
+	snprintf(threadname, 16, "StratumC/%d", pool->pool_no);
+	RenameThread(threadname);
+
+	if (restart_stratum(pool) || stratum_reconnect(pool))
+		reactor_attach(pool);
+	return NULL;
+}
+
+static void *stratum_standby_thread(void *userdata)
+{
+	struct pool *pool = (struct pool *)userdata;
+	char threadname[16];
+
+	pthread_detach(pthread_self());
+
+	snprintf(threadname, 16, "StratumB/%d", pool->pool_no);
+	RenameThread(threadname);
+
+	if (stratum_standby(pool))
+		reactor_attach(pool);
+	return NULL;
+}
+
+static void reactor_handoff(struct pool *pool, void *(*fn)(void *))
+{
+	pthread_t pth;
+
+	reactor_detach(pool);
+	if (unlikely(pthread_create(&pth, NULL, fn, (void *)pool)))
+		quit(1, "Failed to create stratum reactor handoff thread");
+}
+
+/* Hand every complete line received on this pool to the parsers */
+static void reactor_read(struct pool *pool)
+{
+	bool closed = false;
+	char *s;
+
+	while (pool->reactor_attached && pool->sock_gen == pool->reactor_gen &&
+	       (s = recv_line_nowait(pool, &closed)) != NULL) {
+		cgtime(&pool->tv_reactor_recv);
+		/* Check this pool hasn't died while being a backup pool and
+		 * has not had its idle flag cleared */
+		stratum_resumed(pool);
+		stratum_dispatch(pool, s);
+		if (pool->reconnect_pending) {
+			reactor_handoff(pool, stratum_restart_thread);
+			return;
+		}
+	}
+	if (!pool->reactor_attached)
+		return;
+	/* The socket may have been lost or replaced under us */
+	if (!pool->sock || closed)
+		reactor_handoff(pool, stratum_reconnect_thread);
+	else if (pool->sock_gen != pool->reactor_gen) {
+		reactor_detach(pool);
+		reactor_attach(pool);
+	}
+}
+
+/* Checks done once a second for each attached pool that stratum_rthread
+ * would otherwise have done around each select */
+static void reactor_check(void)
+{
+	struct timeval now;
+	int i;
+
+	cgtime(&now);
+	for (i = 0; i < total_pools; i++) {
+		struct pool *pool = pools[i];
+
+		if (!pool->reactor_attached)
+			continue;
+		if (unlikely(pool->removed)) {
+			reactor_detach(pool);
+			continue;
+		}
+		if (!pool->sock || pool->sock_gen != pool->reactor_gen ||
+		    pool->sockbuf_tail > pool->sockbuf_head)
+			reactor_read(pool);
+		else if (!cnx_needed(pool) && !sock_full(pool))
+			reactor_handoff(pool, stratum_standby_thread);
+		/* The protocol specifies that notify messages should be sent
+		 * every minute so if we fail to receive any for 90 seconds we
+		 * assume the connection has been dropped and treat this pool
+		 * as dead */
+		else if (tdiff(&now, &pool->tv_reactor_recv) > 90) {
+			applog(LOG_DEBUG, "Stratum reactor timed out on pool %d", pool->pool_no);
+			reactor_handoff(pool, stratum_reconnect_thread);
+		}
+	}
+}
+
+static void *stratum_reactor(__maybe_unused void *userdata)
+{
+	struct epoll_event evs[REACTOR_EVENTS];
+	struct timeval last_check, now;
+
+	pthread_detach(pthread_self());
+	RenameThread("StratumReactor");
+
+	cgtime(&last_check);
+	while (42) {
+		bool woken = false;
+		int i, nfds;
+
+		nfds = epoll_wait(reactor_epfd, evs, REACTOR_EVENTS, 1000);
+		for (i = 0; i < nfds; i++) {
+			struct pool *pool = (struct pool *)evs[i].data.ptr;
+
+			if (!pool) {
+				char buf[64];
+
+				while (read(reactor_wake[0], buf, sizeof(buf)) > 0)
+					;
+				woken = true;
+				continue;
+			}
+			reactor_read(pool);
+		}
+
+		cgtime(&now);
+		if (woken || tdiff(&now, &last_check) >= 1) {
+			reactor_check();
+			copy_time(&last_check, &now);
+		}
+	}
+	return NULL;
+}
+#else /* USE_STRATUM_REACTOR */
 /* One stratum receive thread per pool that has stratum waits on the socket
  * checking for new messages and for the integrity of the socket connection. We
  * reset the connection based on the integrity of the receive side only as the
@@ -5722,21 +6293,8 @@ static void *stratum_rthread(void *userdata)
 		/* Check to see whether we need to maintain this connection
 		 * indefinitely or just bring it up when we switch to this
 		 * pool */
-		if (!sock_full(pool) && !cnx_needed(pool)) {
-			suspend_stratum(pool);
-			clear_stratum_shares(pool);
-			clear_pool_work(pool);
-
-			wait_lpcurrent(pool);
-			if (!restart_stratum(pool)) {
-				pool_died(pool);
-				while (!restart_stratum(pool)) {
-					if (pool->removed)
-						goto out;
-					cgsleep_ms(30000);
-				}
-			}
-		}
+		if (!sock_full(pool) && !cnx_needed(pool) && !stratum_standby(pool))
+			break;
 
 		FD_ZERO(&rd);
 		FD_SET(pool->sock, &rd);
@@ -5753,29 +6311,8 @@ static void *stratum_rthread(void *userdata)
 		} else
 			s = recv_line(pool);
 		if (!s) {
-			applog(LOG_NOTICE, "Stratum connection to pool %d interrupted", pool->pool_no);
-			pool->getfail_occasions++;
-			total_go++;
-
-			/* If the socket to our stratum pool disconnects, all
-			 * tracked submitted shares are lost and we will leak
-			 * the memory if we don't discard their records. */
-			if (!supports_resume(pool) || opt_lowmem)
-				clear_stratum_shares(pool);
-			clear_pool_work(pool);
-			if (pool == current_pool())
-				restart_threads();
-
-			if (restart_stratum(pool))
-				continue;
-
-			pool_died(pool);
-			while (!restart_stratum(pool)) {
-				if (pool->removed)
-					goto out;
-				cgsleep_ms(30000);
-			}
-			stratum_resumed(pool);
+			if (!stratum_reconnect(pool))
+				break;
 			continue;
 		}
 
@@ -5783,27 +6320,12 @@ static void *stratum_rthread(void *userdata)
 		 * has not had its idle flag cleared */
 		stratum_resumed(pool);
 
-		if (!parse_method(pool, s) && !parse_stratum_response(pool, s))
-			applog(LOG_INFO, "Unknown stratum msg: %s", s);
-		else if (pool->swork.clean) {
-			struct work *work = make_work();
-
-			/* Generate a single work item to update the current
-			 * block database */
-			pool->swork.clean = false;
-			gen_stratum_work(pool, work);
-			work->longpoll = true;
-			/* Return value doesn't matter. We're just informing
-			 * that we may need to restart. */
-			test_work_current(work);
-			free_work(work);
-		}
-		free(s);
+		stratum_dispatch(pool, s);
 	}
 
-out:
 	return NULL;
 }
+#endif /* USE_STRATUM_REACTOR */
 
 /* Each pool has one stratum send thread for sending shares to avoid many
  * threads being created for submission since all sends need to be serialised
@@ -5852,7 +6374,7 @@ static void *stratum_sthread(void *userdata)
 		sshare->sshare_time = time(NULL);
 		/* This work item is freed in parse_stratum_response */
 		sshare->work = work;
-		nonce = *((uint32_t *)(work->data + 76));
+		nonce = *((uint32_t *)(work->data + 140));
 		__bin2hex(noncehex, (const unsigned char *)&nonce, 4);
 		memset(s, 0, 1024);
 
@@ -5937,8 +6459,12 @@ static void init_stratum_threads(struct pool *pool)
 
 	if (unlikely(pthread_create(&pool->stratum_sthread, NULL, stratum_sthread, (void *)pool)))
 		quit(1, "Failed to create stratum sthread");
+#ifdef USE_STRATUM_REACTOR
+	reactor_attach(pool);
+#else
 	if (unlikely(pthread_create(&pool->stratum_rthread, NULL, stratum_rthread, (void *)pool)))
 		quit(1, "Failed to create stratum rthread");
+#endif
 }
 
 static void *longpoll_thread(void *userdata);
@@ -6150,7 +6676,9 @@ static void pool_resus(struct pool *pool)
 		applog(LOG_INFO, "Pool %d %s alive", pool->pool_no, pool->rpc_url);
 }
 
-static struct work *hash_pop(void)
+/* Pops staged work, waiting for some to arrive unless blocking is false in
+ * which case NULL is returned when nothing is staged */
+static struct work *hash_pop(bool blocking)
 {
 	struct work *work = NULL, *tmp;
 	int hc;
@@ -6161,6 +6689,12 @@ static struct work *hash_pop(void)
 		struct timeval now;
 		int rc;
 
+		if (!blocking) {
+			/* Still have the getwork scheduler make more */
+			pthread_cond_signal(&gws_cond);
+			goto out_unlock;
+		}
+
 		cgtime(&now);
 		then.tv_sec = now.tv_sec + 10;
 		then.tv_nsec = now.tv_usec * 1000;
@@ -6198,6 +6732,7 @@ static struct work *hash_pop(void)
 
 	/* Signal hash_pop again in case there are mutliple hash_pop waiters */
 	pthread_cond_signal(&getq->cond);
+out_unlock:
 	mutex_unlock(stgd_lock);
 
 	return work;
@@ -6262,10 +6797,10 @@ void set_target(unsigned char *dest_target, double diff)
 	*data64 = htole64(h64);
 
 	if (opt_debug) {
-		char *htarget = bin2hex(target, 32);
+		char htarget[32 * 2 + 1];
 
+		__bin2hex(htarget, target, 32);
 		applog(LOG_DEBUG, "Generated target %s", htarget);
-		free(htarget);
 	}
 	memcpy(dest_target, target, 32);
 }
@@ -6313,18 +6848,17 @@ static void gen_stratum_work(struct pool *pool, struct work *work)
 	work->job_id = strdup(pool->swork.job_id);
 	work->nonce1 = strdup(pool->nonce1);
 	work->ntime = strdup(pool->swork.ntime);
+	work->us_notify = pool->swork.us_notify;
 	cg_runlock(&pool->data_lock);
 
 	if (opt_debug) {
-		char *header, *merkle_hash;
+		char header[128 * 2 + 1], merkle_hash[32 * 2 + 1];
 
-		header = bin2hex(work->data, 128);
-		merkle_hash = bin2hex((const unsigned char *)merkle_root, 32);
+		__bin2hex(header, work->data, 128);
+		__bin2hex(merkle_hash, merkle_root, 32);
 		applog(LOG_DEBUG, "Generated stratum merkle %s", merkle_hash);
 		applog(LOG_DEBUG, "Generated stratum header %s", header);
 		applog(LOG_DEBUG, "Work job_id %s nonce2 %d ntime %s", work->job_id, work->nonce2, work->ntime);
-		free(header);
-		free(merkle_hash);
 	}
 
 	calc_midstate(work);
@@ -6345,14 +6879,18 @@ static void gen_stratum_work(struct pool *pool, struct work *work)
 	cgtime(&work->tv_staged);
 }
 
-struct work *get_work(struct thr_info *thr, const int thr_id)
+static struct work *__get_work(struct thr_info *thr, const int thr_id, bool blocking)
 {
 	struct work *work = NULL;
 
 	thread_reportout(thr);
 	applog(LOG_DEBUG, "Popping work from get queue to get work");
 	while (!work) {
-		work = hash_pop();
+		work = hash_pop(blocking);
+		if (!work) {
+			thread_reportin(thr);
+			return NULL;
+		}
 		if (stale_work(work, false)) {
 			discard_work(work);
 			work = NULL;
@@ -6381,16 +6919,28 @@ struct work *get_work(struct thr_info *thr, const int thr_id)
 	
 	work->thr_id = thr_id;
 	thread_reportin(thr);
+	trace_job(thr->cgpu, work);
 	work->mined = true;
 	work->device_diff = MIN(thr->cgpu->drv->max_diff, work->work_difficulty);
 	return work;
 }
 
+struct work *get_work(struct thr_info *thr, const int thr_id)
+{
+	return __get_work(thr, thr_id, true);
+}
+
+/* As get_work but returns NULL instead of waiting when no work is staged, for
+ * drivers that service several devices from one thread */
+struct work *get_work_nowait(struct thr_info *thr, const int thr_id)
+{
+	return __get_work(thr, thr_id, false);
+}
+
 /* Submit a copy of the tested, statistic recorded work item asynchronously */
 static void submit_work_async(struct work *work)
 {
 	struct pool *pool = work->pool;
-	pthread_t submit_thread;
 
 	cgtime(&work->tv_work_found);
 
@@ -6423,9 +6973,8 @@ static void submit_work_async(struct work *work)
 			free_work(work);
 		}
 	} else {
-		applog(LOG_DEBUG, "Pushing submit work to work thread");
-		if (unlikely(pthread_create(&submit_thread, NULL, submit_work_thread, (void *)work)))
-			quit(1, "Failed to create submit_work_thread");
+		applog(LOG_DEBUG, "Pushing submit work to curl multi thread");
+		submit_upstream_work(work, false);
 	}
 }
 
@@ -6442,6 +6991,115 @@ void inc_hw_errors(struct thr_info *thr)
 	thr->cgpu->drv->hw_error(thr);
 }
 
+/* Size of the per device table of recently returned nonce fingerprints, must
+ * be a power of 2 */
+#define NONCE_FILTER_SIZE 1024
+
+/* 64 bit FNV-1a of the work header with the nonce field skipped, followed by
+ * the nonce itself. The header carries the job (prev hash and merkle root),
+ * nonce2 and ntime so identical nonces on different work never match. */
+static uint64_t nonce_fingerprint(struct work *work, uint32_t nonce)
+{
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	int i;
+
+	for (i = 0; i < 180; i++) {
+		if (i == 140)
+			i += 4;
+		hash ^= work->data[i];
+		hash *= 0x100000001b3ULL;
+	}
+	for (i = 0; i < 4; i++) {
+		hash ^= (nonce >> (i * 8)) & 0xff;
+		hash *= 0x100000001b3ULL;
+	}
+	/* 0 marks an empty slot */
+	return hash ? hash : 1;
+}
+
+/* The table slot for fp, with nonce_lock held. The table is cleared when
+ * work from a newer block than it holds turns up, but not for late nonces
+ * from older work, which would otherwise clear it back and forth. */
+static uint64_t *nonce_slot(struct cgpu_info *cgpu, struct work *work, uint64_t fp)
+{
+	if (unlikely(!cgpu->nonce_filter)) {
+		cgpu->nonce_filter = calloc(NONCE_FILTER_SIZE, sizeof(uint64_t));
+		if (unlikely(!cgpu->nonce_filter))
+			quit(1, "Failed to calloc nonce_filter in nonce_slot");
+		cgpu->nonce_filter_block = work->work_block;
+	} else if ((int)(work->work_block - cgpu->nonce_filter_block) > 0) {
+		memset(cgpu->nonce_filter, 0, NONCE_FILTER_SIZE * sizeof(uint64_t));
+		cgpu->nonce_filter_block = work->work_block;
+	}
+	return &cgpu->nonce_filter[fp & (NONCE_FILTER_SIZE - 1)];
+}
+
+static void count_dup_nonce(struct cgpu_info *cgpu, struct work *work, uint32_t nonce)
+{
+	applog(LOG_INFO, "%s%d: duplicate nonce %08x ignored", cgpu->drv->name,
+	       cgpu->device_id, nonce);
+
+	mutex_lock(&stats_lock);
+	cgpu->dup_nonces++;
+	work->pool->dup_nonces++;
+	mutex_unlock(&stats_lock);
+}
+
+/* Returns true if this device has already returned nonce for the same work
+ * and it was a valid share, in which case it is counted and should be dropped
+ * before being tested or submitted. Only valid nonces are remembered, by
+ * claim_nonce(), so a device repeating a bad nonce still gets a HW error each
+ * time. The table is direct mapped so an old entry may be evicted and slip
+ * through, but distinct nonces are never reported as duplicates. */
+bool dup_nonce(struct thr_info *thr, struct work *work, uint32_t nonce)
+{
+	struct cgpu_info *cgpu = thr->cgpu;
+	uint64_t fp = nonce_fingerprint(work, nonce);
+	bool dup;
+
+	mutex_lock(&cgpu->nonce_lock);
+	dup = (*nonce_slot(cgpu, work, fp) == fp);
+	mutex_unlock(&cgpu->nonce_lock);
+
+	if (likely(!dup))
+		return false;
+
+	count_dup_nonce(cgpu, work, nonce);
+	return true;
+}
+
+/* Remembers a nonce that tested valid, checking and setting its slot in one
+ * step under nonce_lock. Returns false, and counts it as a duplicate, if
+ * another thread got the same nonce in first after both passed dup_nonce() */
+static bool claim_nonce(struct thr_info *thr, struct work *work, uint32_t nonce)
+{
+	struct cgpu_info *cgpu = thr->cgpu;
+	uint64_t fp = nonce_fingerprint(work, nonce), *slot;
+	bool dup;
+
+	mutex_lock(&cgpu->nonce_lock);
+	slot = nonce_slot(cgpu, work, fp);
+	dup = (*slot == fp);
+	*slot = fp;
+	mutex_unlock(&cgpu->nonce_lock);
+
+	if (likely(!dup))
+		return true;
+
+	count_dup_nonce(cgpu, work, nonce);
+	return false;
+}
+
+/* Frees the nonce table, it is allocated again if the device returns more
+ * nonces */
+static void free_nonce_filter(struct cgpu_info *cgpu)
+{
+	mutex_lock(&cgpu->nonce_lock);
+	free(cgpu->nonce_filter);
+	cgpu->nonce_filter = NULL;
+	mutex_unlock(&cgpu->nonce_lock);
+}
+
 /* Fills in the work nonce and builds the output data in work->hash */
 static void rebuild_nonce(struct work *work, uint32_t nonce)
 {
@@ -6526,12 +7184,18 @@ void submit_tested_work(struct thr_info *thr, struct work *work)
 	submit_work_async(work_out);
 }
 
-/* Returns true if nonce for work was a valid share */
+/* Returns true if nonce for work was a valid share. A duplicate of a valid
+ * share also returns true, since it isn't a HW error, but isn't submitted
+ * again */
 bool submit_nonce(struct thr_info *thr, struct work *work, uint32_t nonce)
 {
-	if (test_nonce(work, nonce))
-		submit_tested_work(thr, work);
-	else {
+	if (dup_nonce(thr, work, nonce))
+		return true;
+
+	if (test_nonce(work, nonce)) {
+		if (claim_nonce(thr, work, nonce))
+			submit_tested_work(thr, work);
+	} else {
 		inc_hw_errors(thr);
 		return false;
 	}
@@ -6550,10 +7214,18 @@ bool submit_noffset_nonce(struct thr_info *thr, struct work *work_in, uint32_t n
 	bool ret = false;
 
 	_copy_work(work, work_in, noffset);
+	if (dup_nonce(thr, work, nonce)) {
+		free_work(work);
+		return true;
+	}
 	if (!test_nonce(work, nonce)) {
 		inc_hw_errors(thr);
 		goto out;
 	}
+	if (!claim_nonce(thr, work, nonce)) {
+		free_work(work);
+		return true;
+	}
 	ret = true;
 	update_work_stats(thr, work);
 	if (!fulltest(work->hash, work->target)) {
@@ -7315,33 +7987,6 @@ void reinit_device(struct cgpu_info *cgpu)
 
 static struct timeval rotate_tv;
 
-/* We reap curls if they are unused for over a minute */
-static void reap_curl(struct pool *pool)
-{
-	struct curl_ent *ent, *iter;
-	struct timeval now;
-	int reaped = 0;
-
-	cgtime(&now);
-
-	mutex_lock(&pool->pool_lock);
-	list_for_each_entry_safe(ent, iter, &pool->curlring, node) {
-		if (pool->curls < 2)
-			break;
-		if (now.tv_sec - ent->tv.tv_sec > 300) {
-			reaped++;
-			pool->curls--;
-			list_del(&ent->node);
-			curl_easy_cleanup(ent->curl);
-			free(ent);
-		}
-	}
-	mutex_unlock(&pool->pool_lock);
-
-	if (reaped)
-		applog(LOG_DEBUG, "Reaped %d curl%s from pool %d", reaped, reaped > 1 ? "s" : "", pool->pool_no);
-}
-
 static void *watchpool_thread(void __maybe_unused *userdata)
 {
 	int intervals = 0;
@@ -7361,9 +8006,6 @@ static void *watchpool_thread(void __maybe_unused *userdata)
 		for (i = 0; i < total_pools; i++) {
 			struct pool *pool = pools[i];
 
-			if (!opt_benchmark)
-				reap_curl(pool);
-
 			/* Get a rolling utility per pool over 10 mins */
 			if (intervals > 19) {
 				int shares = pool->diff1 - pool->last_shares;
@@ -8091,6 +8733,7 @@ void enable_device(struct cgpu_info *cgpu)
 		gpu_threads += cgpu->threads;
 	}
 #endif
+	mutex_init(&cgpu->nonce_lock);
 	rwlock_init(&cgpu->qlock);
 	cgpu->queued_work = NULL;
 }
@@ -8193,6 +8836,9 @@ static void hotplug_process(void)
 			thr->id = mining_threads;
 			thr->cgpu = cgpu;
 			thr->device_thread = j;
+#ifndef WIN32
+			cgwake_init(&thr->restart_wake);
+#endif
 
 			if (cgpu->drv->thread_prepare && !cgpu->drv->thread_prepare(thr))
 				continue;
@@ -8355,6 +9001,12 @@ int main(int argc, char *argv[])
 	if (unlikely(pthread_cond_init(&lp_cond, NULL)))
 		quit(1, "Failed to pthread_cond_init lp_cond");
 
+#ifdef USE_STRATUM_REACTOR
+	mutex_init(&reactor_lock);
+#endif
+
+	mutex_init(&lat_lock);
+
 	mutex_init(&restart_lock);
 	if (unlikely(pthread_cond_init(&restart_cond, NULL)))
 		quit(1, "Failed to pthread_cond_init restart_cond");
@@ -8432,6 +9084,27 @@ int main(int argc, char *argv[])
 		successful_connect = true;
 	}
 
+#ifndef WIN32
+	if (opt_pool_replay) {
+		int *ports, replays;
+
+		replays = replay_start(opt_pool_replay, opt_pool_replay_speed, &ports);
+		if (replays < 1)
+			quit(1, "Failed to start replay of %s", opt_pool_replay);
+		for (i = 0; i < replays; i++) {
+			struct pool *pool = add_pool();
+			char *url = malloc(64);
+
+			if (unlikely(!url))
+				quit(1, "Failed to malloc replay url");
+			snprintf(url, 64, "stratum+tcp://127.0.0.1:%d", ports[i]);
+			setup_url(pool, url);
+			pool->rpc_user = pool->rpc_pass = "replay";
+		}
+		free(ports);
+	}
+#endif
+
 #ifdef HAVE_CURSES
 	if (opt_realquiet || opt_display_devs)
 		use_curses = false;
@@ -8680,6 +9353,9 @@ begin_bench:
 			thr->id = k;
 			thr->cgpu = cgpu;
 			thr->device_thread = j;
+#ifndef WIN32
+			cgwake_init(&thr->restart_wake);
+#endif
 
 			if (!cgpu->drv->thread_prepare(thr))
 				continue;
@@ -8808,10 +9484,13 @@ begin_bench:
 		if (!pool_localgen(cp) && !ts && !opt_fail_only)
 			lagging = true;
 
+		/* Getworks still in flight will be staged shortly */
+		ts += getworks_queued;
+
 		/* Wait until hash_pop tells us we need to create more work */
 		if (ts > max_staged) {
 			pthread_cond_wait(&gws_cond, stgd_lock);
-			ts = __total_staged();
+			ts = __total_staged() + getworks_queued;
 		}
 		mutex_unlock(stgd_lock);
 
@@ -8853,7 +9532,8 @@ retry:
 		}
 
 #ifdef HAVE_LIBCURL
-		struct curl_ent *ce;
+		struct timeval now;
+		int getfail_ms;
 
 		/* GBT is current disabled for DCR */
 		/* if (pool->has_gbt) {            */
@@ -8879,28 +9559,21 @@ retry:
 			continue;
 		}
 
-		work->pool = pool;
-		ce = pop_curl_entry(pool);
-		/* obtain new work from bitcoin via JSON-RPC */
-		if (!get_upstream_work(work, ce->curl)) {
-			applog(LOG_DEBUG, "Pool %d json_rpc_call failed on get work, retrying in 5s", pool->pool_no);
-			/* Make sure the pool just hasn't stopped serving
-			 * requests but is up as we'll keep hammering it */
-			if (++pool->seq_getfails > mining_threads + opt_queue)
-				pool_died(pool);
-			cgsleep_ms(5000);
-			push_curl_entry(ce, pool);
+		/* Back off from a pool for 5 seconds after a failed getwork. The
+		 * failure time is set on the curl multi thread */
+		cgtime(&now);
+		mutex_lock(&pool->pool_lock);
+		getfail_ms = ms_tdiff(&now, &pool->tv_getfail);
+		mutex_unlock(&pool->pool_lock);
+		if (getfail_ms < 5000) {
+			cgsleep_ms(5000 - getfail_ms);
 			pool = select_pool(!opt_fail_only);
 			goto retry;
 		}
-		if (ts >= max_staged)
-			pool_tclear(pool, &pool->lagging);
-		if (pool_tclear(pool, &pool->idle))
-			pool_resus(pool);
 
-		applog(LOG_DEBUG, "Generated getwork work");
-		stage_work(work);
-		push_curl_entry(ce, pool);
+		work->pool = pool;
+		/* obtain new work from bitcoin via JSON-RPC */
+		get_upstream_work(work, ts >= max_staged);
 #endif
 	}
 
@@ -147,29 +147,31 @@ static bool hfa_send_packet(struct cgpu_info *hashfast, struct hf_header *h, int
 
 static bool hfa_get_header(struct cgpu_info *hashfast, struct hf_header *h, uint8_t *computed_crc)
 {
-	int amount, ret, orig_len, len, ofs = 0, reads = 0;
-	char buf[512];
-	char *header;
+	int amount, ret, len = sizeof(*h), ofs = 0, reads = 0;
+	char *frame, *header;
 
 	/* Read for up to 200ms till we find the first occurrence of HF_PREAMBLE
 	 * though it should be the first byte unless we get woefully out of
-	 * sync. */
-	orig_len = len = sizeof(*h);
+	 * sync. The frames are read in place from the endpoint's ring so only
+	 * the header itself is copied out. */
 	do {
-
 		if (++reads > 20)
 			return false;
 
-		ret = usb_read_timeout(hashfast, buf + ofs, len, &amount, 10, C_HF_GETHEADER);
+		ret = usb_read_frame_timeout(hashfast, &frame, len - ofs, &amount, 10, C_HF_GETHEADER);
 		if (unlikely(ret && ret != LIBUSB_ERROR_TIMEOUT))
 			return false;
+		header = frame;
+		if (!ofs && amount) {
+			header = memchr(frame, HF_PREAMBLE, amount);
+			if (!header)
+				continue;
+			amount -= header - frame;
+		}
+		memcpy((char *)h + ofs, header, amount);
 		ofs += amount;
-		header = memchr(buf, HF_PREAMBLE, ofs);
-		if (header)
-			len -= ofs - (header - buf);
-	} while (len);
+	} while (ofs < len);
 
-	memcpy(h, header, orig_len);
 	*computed_crc = hfa_crc8((uint8_t *)h);
 
 	return true;
@@ -336,10 +338,10 @@ static void hfa_send_shutdown(struct cgpu_info *hashfast)
 static void hfa_clear_readbuf(struct cgpu_info *hashfast)
 {
 	int amount, ret;
-	char buf[512];
+	char *frame;
 
 	do {
-		ret = usb_read(hashfast, buf, 512, &amount, C_HF_CLEAR_READ);
+		ret = usb_read_frame(hashfast, &frame, 512, &amount, C_HF_CLEAR_READ);
 	} while (!ret || amount);
 }
 
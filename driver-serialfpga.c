@@ -11,6 +11,7 @@
 
 #include <float.h>
 #include <limits.h>
+#include <math.h>
 #include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -24,6 +25,12 @@
 #include <windows.h>
 #endif
 
+#ifdef __linux
+#define USE_SERIAL_ENGINE
+#include <fcntl.h>
+#include <sys/epoll.h>
+#endif
+
 #include "compat.h"
 #include "miner.h"
 #include "fpgautils.h"
@@ -43,24 +50,251 @@
 // Inverse Of Default H/s
 #define DEFAULT_HASH_PER_SEC 0.000001	// 1MH/s
 
+// Seconds To Send A Job Down The Serial Line (10 Bits Per Byte)
+#define SERIAL_JOB_TIME ((double)(44 * 10) / SERIAL_IO_SPEED)
+
+// Ignore Gaps Between Scans Longer Than This When Measuring Latency
+#define SERIAL_MAX_LATENCY 0.5
+
+// Nonces Kept For Estimating The Hash Rate, And How Many Before A Line Is Fitted
+#define SERIAL_HISTORY 64
+#define SERIAL_MIN_HISTORY 4
+
+// Samples Further Than This Many Deviations From The Fit Are Outliers,
+// Though Never Closer Than SERIAL_MIN_RESIDUAL Seconds
+#define SERIAL_OUTLIER_MADS 4
+#define SERIAL_MIN_RESIDUAL 0.002
+
+// Range Of ms Per Work, Both Computed And Set
+#define SERIAL_FPGA_MIN_READ_TIME 100
+#define SERIAL_FPGA_MAX_READ_TIME 600000
+
 // Function Prototypes
 static void serial_fpga_close(struct thr_info *thr);
-static bool serial_fpga_detect_one(const char *devpath);
+static bool serial_fpga_probe(struct serial_probe *probe);
+static bool serial_fpga_add(struct serial_probe *probe);
 static void serial_fpga_detect(bool __maybe_unused hotplug);
 static bool serial_fpga_prepare(__maybe_unused struct thr_info *thr);
 static int64_t serial_fpga_scanwork(struct thr_info *thr);
+static struct api_data *serial_fpga_api_stats(struct cgpu_info *cgpu);
 static void serial_fpga_statline_before(char *buf, size_t bufsiz, struct cgpu_info *cgpu);
 static void serial_fpga_shutdown(__maybe_unused struct thr_info *thr);
 static void serial_fpga_identify(struct cgpu_info *cgpu);
 static char *serial_fpga_set(struct cgpu_info *cgpu, char *option, char *setting, char *replybuf);
 
 
+// A Valid Nonce And The Seconds After Sending Its Work That It Arrived
+struct SERIAL_SAMPLE {
+	uint32_t nonce;
+	double elapsed;
+};
+
 struct FPGA_INFO {
 	int device_fd;
 	int timeout;
 	double Hs;		// Seconds Per Hash
+	double W;		// Seconds From Sending Work To Nonce 0
+	bool Hs_measured;	// Hs Came From A Nonce, Not The Default
+	struct SERIAL_SAMPLE history[SERIAL_HISTORY];
+	int history_count;
+	int history_next;
+	int outliers;		// In The Last Fit
+	uint64_t samples;
+	double fullnonce;	// Seconds To Sweep The Whole Nonce Range
+	double latency;		// Seconds From A Scan Ending To The Next Job Sent
+	struct timeval tv_scan_end;
+	int scan_time;		// ms Per Work Override, 0 For Auto
+	int read_time;		// ms Spent On The Current Work
+	struct work *next_work;	// Preloaded While The Current Work Runs
+	uint32_t next_job[11];	// next_work's Job, Ready To Send
+	struct timeval tv_job;	// When The Current Job Was Sent
+	double job_fullnonce;	// Its Expected Range Time, 0 If Unknown
+	double idle;		// Seconds Without A Job After A Range Ran Out
+	double last_idle;
+	struct work *work;	// The Work The Board Is Hashing
+	struct timeval tv_start;	// When Its Job Was Sent
+	int shard;		// Serial Engine Running The Board, -1 For Its Own Thread
+	// Serial Engine Only
+	struct thr_info *thr;	// The Board's Mining Thread, If Prepared
+	unsigned char nonce_buf[SERIAL_READ_SIZE];
+	int nonce_got;
+	struct timeval tv_nonce;	// When The First Byte Of nonce_buf Arrived
+	int ep_fd;		// device_fd As Added To epoll
+	int64_t hashes_done;
+	struct timeval tv_hashmeter;
+	struct timeval tv_retry;
 };
 
+// The Boards One Serial Engine Thread Runs. Threads Are Prepared One Board At
+// A Time, So The First Board Prepared Runs The Engine Once The Rest Are Ready.
+// Boards Hotplugged Later Are Queued On pending For The Running Engine To Take
+struct SERIAL_SHARD {
+	pthread_mutex_t lock;	// Guards Everything But ready And wake
+	int count;		// Boards Added
+	int prepared;		// Boards Whose Threads Have Been Prepared
+	struct thr_info **pending;	// Prepared Boards The Engine Hasn't Taken
+	int pending_count;
+	bool running;
+	struct cgpu_info *leader;
+	cgsem_t ready;
+	cgwake_t wake;		// Signalled When pending Gains A Board
+};
+
+static struct SERIAL_SHARD *serial_shards;
+
+static int serial_option_offset = -1;
+
+// Get This Device's Value From --serialfpga-scantime, The Last One Repeating
+static int serial_fpga_scan_time(int this_option_offset)
+{
+	char *ptr, *comma;
+	int i, val;
+
+	if (opt_serial_fpga_scantime == NULL)
+		return 0;
+
+	ptr = opt_serial_fpga_scantime;
+	for (i = 0; i < this_option_offset; i++) {
+		comma = strchr(ptr, ',');
+		if (comma == NULL)
+			break;
+		ptr = comma + 1;
+	}
+
+	val = atoi(ptr);
+	if (val < 0)
+		val = 0;
+	if (val > SERIAL_FPGA_MAX_READ_TIME)
+		val = SERIAL_FPGA_MAX_READ_TIME;
+	return val;
+}
+
+static int serial_cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+// Sorts The Values
+static double serial_median(double *values, int count)
+{
+	qsort(values, count, sizeof(double), serial_cmp_double);
+	if (count & 1)
+		return values[count / 2];
+	return (values[count / 2 - 1] + values[count / 2]) / 2;
+}
+
+// Fit elapsed = W + Hs * nonce Over The Nonces Of Recent Works. A Theil-Sen
+// Fit (Median Of Pairwise Slopes) Finds The Line Despite Outliers, Then Least
+// Squares Over The Samples Near It Gives The Estimate. Until There Are Enough
+// Samples The Median Of elapsed / nonce Is Used Instead
+static void serial_fpga_estimate(struct FPGA_INFO *info)
+{
+	double slopes[SERIAL_HISTORY * (SERIAL_HISTORY - 1) / 2];
+	double resid[SERIAL_HISTORY];
+	struct SERIAL_SAMPLE *a, *b;
+	double Hs, W, limit, sx, sy, sxx, sxy, n, d;
+	int count = info->history_count;
+	int i, j, nslopes = 0, outliers = 0;
+
+	if (count < SERIAL_MIN_HISTORY) {
+		for (i = 0; i < count; i++) {
+			a = &info->history[i];
+			if (a->nonce)
+				slopes[nslopes++] = a->elapsed / a->nonce;
+		}
+		if (!nslopes)
+			return;
+		info->Hs = serial_median(slopes, nslopes);
+		info->W = 0;
+		info->outliers = 0;
+		info->Hs_measured = true;
+		return;
+	}
+
+	for (i = 0; i < count; i++) {
+		a = &info->history[i];
+		for (j = i + 1; j < count; j++) {
+			b = &info->history[j];
+			if (a->nonce != b->nonce)
+				slopes[nslopes++] = (b->elapsed - a->elapsed) / ((double)b->nonce - (double)a->nonce);
+		}
+	}
+	if (!nslopes)
+		return;
+	Hs = serial_median(slopes, nslopes);
+
+	for (i = 0; i < count; i++)
+		resid[i] = info->history[i].elapsed - Hs * info->history[i].nonce;
+	W = serial_median(resid, count);
+
+	// Median Absolute Deviation, Scaled To A Standard Deviation
+	for (i = 0; i < count; i++) {
+		a = &info->history[i];
+		resid[i] = fabs(a->elapsed - W - Hs * a->nonce);
+	}
+	limit = SERIAL_OUTLIER_MADS * 1.4826 * serial_median(resid, count);
+	if (limit < SERIAL_MIN_RESIDUAL)
+		limit = SERIAL_MIN_RESIDUAL;
+
+	n = sx = sy = sxx = sxy = 0;
+	for (i = 0; i < count; i++) {
+		a = &info->history[i];
+		if (fabs(a->elapsed - W - Hs * a->nonce) > limit) {
+			outliers++;
+			continue;
+		}
+		n++;
+		sx += a->nonce;
+		sy += a->elapsed;
+		sxx += (double)a->nonce * a->nonce;
+		sxy += (double)a->nonce * a->elapsed;
+	}
+	d = n * sxx - sx * sx;
+	if (n >= 2 && d > 0 && n * sxy - sx * sy > 0) {
+		Hs = (n * sxy - sx * sy) / d;
+		W = (sy - Hs * sx) / n;
+	}
+
+	if (Hs <= 0)
+		return;
+	info->Hs = Hs;
+	info->W = W;
+	info->outliers = outliers;
+	info->Hs_measured = true;
+}
+
+// Switch Work Just Before The Board Exhausts The Nonce Range, Early Enough
+// That The Next Job Arrives As It Finishes
+static void serial_fpga_set_read_time(struct FPGA_INFO *info)
+{
+	double read_time;
+
+	if (info->scan_time > 0) {
+		info->read_time = info->scan_time;
+		return;
+	}
+
+	// No Measured Hash Rate Yet, Fall Back To The Fixed Scan Time
+	if (!info->Hs_measured) {
+		info->read_time = info->timeout * 1000;
+		return;
+	}
+
+	info->fullnonce = info->W + info->Hs * (((double)0xffffffff) + 1);
+	read_time = (info->fullnonce - info->latency - SERIAL_JOB_TIME) * 1000;
+
+	// Work Older Than The Expiry Is Stale Anyway
+	if (opt_expiry > 0 && read_time > opt_expiry * 1000)
+		read_time = opt_expiry * 1000;
+	if (read_time > SERIAL_FPGA_MAX_READ_TIME)
+		read_time = SERIAL_FPGA_MAX_READ_TIME;
+	if (read_time < SERIAL_FPGA_MIN_READ_TIME)
+		read_time = SERIAL_FPGA_MIN_READ_TIME;
+	info->read_time = (int)read_time;
+}
+
 
 static void serial_fpga_close(struct thr_info *thr)
 {
@@ -71,28 +305,50 @@ static void serial_fpga_close(struct thr_info *thr)
 	
 	close(info->device_fd);
 	info->device_fd = -1;
+	info->ep_fd = -1;
 	
 }
 
-static bool serial_fpga_detect_one(const char *devpath)
+// Called From Several Threads At Once, So Only Touches The Port Itself
+static bool serial_fpga_probe(struct serial_probe *probe)
 {
-	struct FPGA_INFO *info;
-	struct cgpu_info *serial_fpga;
 	int fd;
 
-	applog(LOG_DEBUG, "serial_fpga_detect_one...");
+	applog(LOG_DEBUG, "serial_fpga_probe...");
 	
-	fd = serial_open(devpath, SERIAL_IO_SPEED, SERIAL_READ_TIMEOUT, true);
+	fd = serial_open(probe->devpath, SERIAL_IO_SPEED, SERIAL_READ_TIMEOUT, true);
 	if (fd == -1) {
-		applog(LOG_ERR, "Serial FPGA Detect: Failed to open %s", devpath);
+		applog(LOG_ERR, "Serial FPGA Detect: Failed to open %s", probe->devpath);
 		return false;
 	}
 
 //
-	applog(LOG_DEBUG, "Serial FPGA Detect: Test skipped for: %s", devpath);
+	applog(LOG_DEBUG, "Serial FPGA Detect: Test skipped for: %s", probe->devpath);
 	close(fd);
 //
 
+	return true;
+}
+
+// Save The Measured Hash Rate So The Board Starts With It Next Time
+static void serial_fpga_remember(struct cgpu_info *serial_fpga, struct FPGA_INFO *info)
+{
+	char settings[SERIAL_SETTINGS_SIZE];
+
+	if (!info->Hs_measured)
+		return;
+	snprintf(settings, sizeof(settings), "Hs=%.6e W=%.6f", info->Hs, info->W);
+	serial_inventory_update(serial_fpga->drv, serial_fpga->device_path, settings);
+}
+
+static bool serial_fpga_add(struct serial_probe *probe)
+{
+	const char *devpath = probe->devpath;
+	struct FPGA_INFO *info;
+	struct cgpu_info *serial_fpga;
+	int this_option_offset;
+	double Hs, W;
+
 	serial_fpga = calloc(1, sizeof(struct cgpu_info));
 	if (unlikely(!serial_fpga))
 		quit(1, "Failed to calloc cgpu for %s in usb_alloc_cgpu", devpath);
@@ -113,18 +369,106 @@ static bool serial_fpga_detect_one(const char *devpath)
 
 	info->device_fd = -1;
 	info->Hs = DEFAULT_HASH_PER_SEC;
+
+	// The Rate Last Measured, If The Port Is Unchanged Since
+	if (sscanf(probe->settings, "Hs=%lf W=%lf", &Hs, &W) == 2 && Hs > 0) {
+		info->Hs = Hs;
+		info->W = W;
+		info->Hs_measured = true;
+		applog(LOG_DEBUG, "Serial FPGA %s starting at %.1fMH/s from the inventory",
+		       devpath, 1 / (Hs * 1000000));
+	}
 	
 	if (opt_scantime > 0)
 		info->timeout = opt_scantime;
 	else
 		info->timeout = SERIAL_FPGA_TIMEOUT;
+
+	this_option_offset = ++serial_option_offset;
+	info->scan_time = serial_fpga_scan_time(this_option_offset);
+	serial_fpga_set_read_time(info);
+
+	info->shard = -1;
+	info->ep_fd = -1;
+	if (opt_serial_fpga_engine > 0) {
+#ifdef USE_SERIAL_ENGINE
+		struct SERIAL_SHARD *shard;
+
+		if (!serial_shards) {
+			int i;
+
+			serial_shards = calloc(opt_serial_fpga_engine, sizeof(struct SERIAL_SHARD));
+			if (unlikely(!serial_shards))
+				quit(1, "Failed to calloc serial_shards");
+			for (i = 0; i < opt_serial_fpga_engine; i++) {
+				mutex_init(&serial_shards[i].lock);
+				cgsem_init(&serial_shards[i].ready);
+				cgwake_init(&serial_shards[i].wake);
+			}
+		}
+		info->shard = this_option_offset % opt_serial_fpga_engine;
+		shard = &serial_shards[info->shard];
+		mutex_lock(&shard->lock);
+		shard->count++;
+		mutex_unlock(&shard->lock);
+#else
+		if (!this_option_offset)
+			applog(LOG_WARNING, "Serial FPGA engine not supported on this platform, using a thread per board");
+#endif
+	}
 	
 	return true;
 }
 
+// Open The Board's Port, Non Blocking When A Serial Engine Runs It
+static bool serial_fpga_open(struct cgpu_info *serial_fpga, struct FPGA_INFO *info)
+{
+	info->device_fd = serial_open(serial_fpga->device_path, SERIAL_IO_SPEED, SERIAL_READ_TIMEOUT, false);
+	if (info->device_fd == -1)
+		return false;
+#ifdef USE_SERIAL_ENGINE
+	if (info->shard >= 0)
+		fcntl(info->device_fd, F_SETFL, fcntl(info->device_fd, F_GETFL) | O_NONBLOCK);
+#endif
+	return true;
+}
+
 static void serial_fpga_detect(bool __maybe_unused hotplug)
 {
-	serial_detect(&serial_fpga_drv, serial_fpga_detect_one);
+	serial_detect_parallel(&serial_fpga_drv, serial_fpga_probe, serial_fpga_add);
+}
+
+// Note A Board's Thread Is Prepared, Letting Its Shard's Engine Start Once
+// Every Board Has Been, Or Handing It To The Engine If Already Running
+static void serial_fpga_shard_prepared(struct thr_info *thr, bool ok)
+{
+#ifdef USE_SERIAL_ENGINE
+	struct FPGA_INFO *info = thr->cgpu->device_data;
+	struct SERIAL_SHARD *shard;
+
+	if (info->shard < 0)
+		return;
+
+	shard = &serial_shards[info->shard];
+	mutex_lock(&shard->lock);
+	if (ok) {
+		info->thr = thr;
+		shard->pending = realloc(shard->pending, sizeof(struct thr_info *) * (shard->pending_count + 1));
+		if (unlikely(!shard->pending))
+			quit(1, "Failed to realloc serial shard pending");
+		shard->pending[shard->pending_count++] = thr;
+		if (!shard->leader)
+			shard->leader = thr->cgpu;
+	}
+	if (shard->running) {
+		if (ok)
+			cgwake_signal(&shard->wake);
+	} else if (++shard->prepared == shard->count) {
+		shard->running = true;
+		cgsem_post(&shard->ready);
+	}
+	mutex_unlock(&shard->lock);
+#endif
 }
 
 static bool serial_fpga_prepare(__maybe_unused struct thr_info *thr)
@@ -137,174 +481,609 @@ static bool serial_fpga_prepare(__maybe_unused struct thr_info *thr)
 	if (info->device_fd == -1) {
 		
 		applog(LOG_INFO, "Open Serial FPGA on %s", serial_fpga->device_path);
-		info->device_fd = serial_open(serial_fpga->device_path, SERIAL_IO_SPEED, SERIAL_READ_TIMEOUT, false);
-		if (unlikely(info->device_fd == -1)) {
+		if (unlikely(!serial_fpga_open(serial_fpga, info))) {
 			applog(LOG_ERR, "Failed to open Serial FPGA on %s",
 				   serial_fpga->device_path);
+			serial_fpga_shard_prepared(thr, false);
 			return false;
 		}
 	}
-	
+
+	serial_fpga_shard_prepared(thr, true);
 	return true;
 }
 
-static int64_t serial_fpga_scanwork(struct thr_info *thr)
+static bool stale_work(struct work *work, bool share);
+static void hashmeter(int thr_id, struct timeval *diff, uint64_t hashes_done);
+
+// Build The 44 Byte Job For A Work: The Midstate, Its Words Swapped As The
+// Board Wants Them, Then The Remaining 12 Bytes Of The Block Header
+static void serial_fpga_prepare_job(struct work *work, uint32_t *job)
 {
-	struct cgpu_info *serial_fpga;
-	int fd;
-	int ret;
+	int j;
 
-	struct FPGA_INFO *info;
+//  Currently, extra nonces are not supported
+	memset((unsigned char*)work->data + 144, 0, 12);
 
-	unsigned char ob_bin[44], nonce_buf[SERIAL_READ_SIZE];
-	char *ob_hex;
-	uint32_t nonce;
-	int64_t hash_count;
-	struct timeval tv_start, tv_finish, elapsed, tv_end, diff;
-	int curr_hw_errors, i, j;
-	uint32_t * ob;
-	ob = (uint32_t *)ob_bin;
-
-	int count;
-	double Hs, W, fullnonce;
-	int read_count;
-	int64_t estimate_hashes;
-	uint32_t values;
-	int64_t hash_count_range;
+	calc_midstate(work);
 
-	struct work *work;
+	memcpy(job, work->midstate, 32);			// Midstate
+	memcpy(job + 8, work->data + 128, 12);		// Remaining Bytes From Block Header
 
-	applog(LOG_DEBUG, "serial_fpga_scanwork...");
-	
-	if (thr->cgpu->deven == DEV_DISABLED)
-		return -1;
-	
+	// Send Bytes To FPGA In Reverse Order
+	for (j = 0; j < 8; j++)
+		job[j] = swab32(job[j]);
+}
 
-	serial_fpga = thr->cgpu;
-	info = serial_fpga->device_data;
-	work = get_work(thr, thr->id);
+// Get And Prepare The Next Work While The Board Hashes The Current One. A
+// Serial Engine Can't Wait For Work With Its Other Boards To Run, So Returns
+// false There If None Is Staged Yet
+static bool serial_fpga_preload(struct thr_info *thr, struct FPGA_INFO *info)
+{
+	if (info->shard >= 0)
+		info->next_work = get_work_nowait(thr, thr->id);
+	else
+		info->next_work = get_work(thr, thr->id);
+	if (!info->next_work)
+		return false;
+	serial_fpga_prepare_job(info->next_work, info->next_job);
+	return true;
+}
+
+static void serial_fpga_discard_next(struct FPGA_INFO *info)
+{
+	if (info->next_work) {
+		free_work(info->next_work);
+		info->next_work = NULL;
+	}
+}
+
+// Send The Next Job To The Board. Returns -1 If The Port Can't Be Opened,
+// 0 If The Job Couldn't Be Sent Or 1 Once The Board Is Working On It
+static int serial_fpga_send_job(struct thr_info *thr, struct FPGA_INFO *info)
+{
+	struct cgpu_info *serial_fpga = thr->cgpu;
+	char ob_hex[sizeof(info->next_job) * 2 + 1];
+	uint32_t job[11];
+	struct work *work;
+	double latency, idle;
+	int ret;
+
+	// Normally Preloaded While The Last Work Ran, Though It May Have Gone
+	// Stale Since Without A Restart
+	if (info->next_work && stale_work(info->next_work, false))
+		serial_fpga_discard_next(info);
+	if (!info->next_work && !serial_fpga_preload(thr, info))
+		return 0;
+	work = info->next_work;
+	info->next_work = NULL;
+	memcpy(job, info->next_job, sizeof(job));
 	
 	if (info->device_fd == -1) {
 		
 		applog(LOG_INFO, "Attemping to Reopen Serial FPGA on %s", serial_fpga->device_path);
-		fd = serial_open(serial_fpga->device_path, SERIAL_IO_SPEED, SERIAL_READ_TIMEOUT, false);
-		if (unlikely(-1 == fd)) {
+		if (unlikely(!serial_fpga_open(serial_fpga, info))) {
 			applog(LOG_ERR, "Failed to open Serial FPGA on %s",
 				   serial_fpga->device_path);
+			free_work(work);
 			return -1;
 		}
-		else
-			info->device_fd = fd;
-	}
-
-	fd = info->device_fd;
-	
-	memset(ob_bin, 0, sizeof(ob_bin));
-
-//  Currently, extra nonces are not supported
-//
-	memset((unsigned char*)work->data + 144, 0, 12);
-//
-//
-	
-	calc_midstate(work);
-
-	memcpy(ob_bin, work->midstate, 32);			// Midstate
-	memcpy(ob_bin + 32, work->data + 128, 12);	// Remaining Bytes From Block Header
-
-	// Send Bytes To FPGA In Reverse Order
-	unsigned char swap[44];
-	uint32_t * sw;
-	sw = (uint32_t *)swap;
-	for (j=0; j<8; j++) {
-		sw[j] = swab32(ob[j]);
-	}
-	
-	memcpy(swap + 32, ob_bin + 32, 12);
-
-	for (j=0; j<44; j++) {
-		ob_bin[j] = swap[j];
 	}
-	
-//unsigned char* b = (unsigned char*)(ob_bin);
-//applog(LOG_WARNING, "swap: %02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x", b[28],b[29],b[30],b[31],b[32],b[33],b[34],b[35],b[36],b[37],b[38],b[39],b[40],b[41],b[42],b[43]);
-//applog(LOG_WARNING, "swap: %02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x", b[0],b[1],b[2],b[3],b[4],b[5],b[6],b[7],b[8],b[9],b[10],b[11],b[12],b[13],b[14],b[15],b[16],b[17],b[18],b[19],b[20],b[21],b[22],b[23],b[24],b[25],b[26],b[27],b[28],b[29],b[30],b[31],b[32],b[33],b[34],b[35],b[36],b[37],b[38],b[39],b[40],b[41],b[42],b[43]);
-
-	
-//#ifndef WIN32
-//	tcflush(fd, TCOFLUSH);
-//#endif
 
 	// Send Data To FPGA
-	ret = write(fd, ob_bin, sizeof(ob_bin));
+	ret = write(info->device_fd, job, sizeof(job));
 
-	if (ret != sizeof(ob_bin)) {
+	if (ret != sizeof(job)) {
 			applog(LOG_ERR, "%s%i: Serial Send Error (ret=%d)", serial_fpga->drv->name, serial_fpga->device_id, ret);
 		serial_fpga_close(thr);
 		dev_error(serial_fpga, REASON_DEV_COMMS_ERROR);
+		free_work(work);
 		return 0;
 	}
 
 	if (opt_debug) {
-		ob_hex = bin2hex(ob_bin, sizeof(ob_bin));
+		__bin2hex(ob_hex, (unsigned char *)job, sizeof(job));
 		applog(LOG_DEBUG, "Serial FPGA %d sent: %s",
 			serial_fpga->device_id, ob_hex);
-		free(ob_hex);
 	}
 
-	elapsed.tv_sec = 0;
-	elapsed.tv_usec = 0;
-	cgtime(&tv_start);
+	info->work = work;
+	cgtime(&info->tv_start);
+
+	// Time From The Last Scan Timing Out To This Job Being Sent
+	if (info->tv_scan_end.tv_sec) {
+		latency = tdiff(&info->tv_start, &info->tv_scan_end);
+		if (latency < SERIAL_MAX_LATENCY) {
+			if (info->latency > 0)
+				info->latency = info->latency * 0.9 + latency * 0.1;
+			else
+				info->latency = latency;
+		}
+	}
+
+	serial_fpga_set_read_time(info);
+
+	// The Board Sat Idle If Its Last Range Ran Out Before This Job Arrived
+	if (info->job_fullnonce > 0) {
+		idle = tdiff(&info->tv_start, &info->tv_job) - info->job_fullnonce;
+		info->last_idle = idle > 0 ? idle : 0;
+		info->idle += info->last_idle;
+	}
+	info->tv_job = info->tv_start;
+	info->job_fullnonce = info->Hs_measured ? info->fullnonce : 0;
+
+	// Get The Next Job Ready Now, Rather Than With The Board Idle Later
+	serial_fpga_preload(thr, info);
 
 	applog(LOG_DEBUG, "%s%i: Begin Scan For Nonces", serial_fpga->drv->name, serial_fpga->device_id);
-	while (thr && !thr->work_restart) {
+	return 1;
+}
 
-		memset(nonce_buf,0,4);
+// A Whole Nonce Arrived At tv_end For The Current Job
+static void serial_fpga_nonce(struct thr_info *thr, struct FPGA_INFO *info, unsigned char *nonce_buf, struct timeval *tv_end)
+{
+	struct cgpu_info *serial_fpga = thr->cgpu;
+	int curr_hw_errors;
+	uint32_t nonce;
+
+	memcpy((char *)&nonce, nonce_buf, SERIAL_READ_SIZE);
+		
+#if !defined (__BIG_ENDIAN__) && !defined(MIPSEB)
+	nonce = swab32(nonce);
+#endif
+
+	curr_hw_errors = serial_fpga->hw_errors;
+
+	applog(LOG_INFO, "%s%i: Nonce Found - %08X (%5.1fMhz)", serial_fpga->drv->name, serial_fpga->device_id, nonce, (double)(1/(info->Hs * 1000000)));
+	submit_nonce(thr, info->work, nonce);
+
+	// Update Hashrate
+	// HW Errors, Including Late Nonces From The Previous Work, Are Left Out
+	if (serial_fpga->hw_errors == curr_hw_errors) {
+		info->history[info->history_next].nonce = nonce;
+		info->history[info->history_next].elapsed = tdiff(tv_end, &info->tv_start);
+		info->history_next = (info->history_next + 1) % SERIAL_HISTORY;
+		if (info->history_count < SERIAL_HISTORY)
+			info->history_count++;
+		info->samples++;
+
+		serial_fpga_estimate(info);
+		serial_fpga_set_read_time(info);
+
+		// Saved Again On Shutdown, But Not If cgminer Never Gets That Far
+		if (info->samples == SERIAL_HISTORY)
+			serial_fpga_remember(serial_fpga, info);
+	}
+}
+
+// Finish With The Current Job, Returning The Hashes The Board Did On It
+static int64_t serial_fpga_end_job(struct thr_info *thr, struct FPGA_INFO *info, bool timed_out)
+{
+	struct timeval tv_end;
+	double hashes;
+
+	cgtime(&tv_end);
+
+	// The Preloaded Work Predates Whatever Caused The Restart
+	if (thr->work_restart)
+		serial_fpga_discard_next(info);
+
+	// Only A Timed Out Scan Wants The Next Job Straight Away
+	if (timed_out)
+		info->tv_scan_end = tv_end;
+	else
+		info->tv_scan_end.tv_sec = 0;
+
+	// Estimate Number Of Hashes, No More Than The Nonce Range As The Board
+	// Idles Once It Is Done
+	hashes = (tdiff(&tv_end, &info->tv_start) - info->W) / info->Hs;
+	if (hashes < 0)
+		hashes = 0;
+	if (hashes > ((double)0xffffffff) + 1)
+		hashes = ((double)0xffffffff) + 1;
+
+	free_work(info->work);
+	info->work = NULL;
+	return hashes;
+}
+
+static int64_t serial_fpga_scanwork(struct thr_info *thr)
+{
+	struct cgpu_info *serial_fpga;
+	int fd;
+	int ret;
+
+	struct FPGA_INFO *info;
+
+	unsigned char nonce_buf[SERIAL_READ_SIZE];
+	struct timeval tv_end;
+	int elapsed_ms;
+	bool timed_out = false;
+
+	applog(LOG_DEBUG, "serial_fpga_scanwork...");
 	
-		// Check Serial Port For 1/10 Sec For Nonce  
-		ret = read(fd, nonce_buf, SERIAL_READ_SIZE);
+	serial_fpga = thr->cgpu;
+	info = serial_fpga->device_data;
+
+	if (thr->cgpu->deven == DEV_DISABLED) {
+		serial_fpga_discard_next(info);
+		return -1;
+	}
+
+	ret = serial_fpga_send_job(thr, info);
+	if (ret <= 0)
+		return ret;
+
+	fd = info->device_fd;
+
+	while (thr && !thr->work_restart) {
+		int wait_ms, got;
 
 		// Calculate Elapsed Time
 		cgtime(&tv_end);
-		timersub(&tv_end, &tv_start, &elapsed);
-
+		elapsed_ms = ms_tdiff(&tv_end, &info->tv_start);
+		if (elapsed_ms >= info->read_time) {
+			applog(LOG_DEBUG, "%s%i: End Scan For Nonces - Time = %d ms", serial_fpga->drv->name, serial_fpga->device_id, elapsed_ms);
+			timed_out = true;
+			break;
+		}
 
-		if (ret == 0) {		// No Nonce Found
-			if (elapsed.tv_sec > info->timeout) {
-				applog(LOG_DEBUG, "%s%i: End Scan For Nonces - Time = %d sec", serial_fpga->drv->name, serial_fpga->device_id, elapsed.tv_sec);
-				break;
-			}
+		// Wait For A Nonce, Or Wake Straight Away For New Work
+		wait_ms = info->read_time - elapsed_ms;
+		ret = restart_poll(thr, fd, wait_ms);
+		if (ret == 0)
 			continue;
+		if (ret < 0) {
+			applog(LOG_ERR, "%s%i: Serial Poll Error (errno=%d)", serial_fpga->drv->name, serial_fpga->device_id, errno);
+			serial_fpga_close(thr);
+			dev_error(serial_fpga, REASON_DEV_COMMS_ERROR);
+			break;
 		}
-		else if (ret < SERIAL_READ_SIZE) {
-			applog(LOG_ERR, "%s%i: Serial Read Error (ret=%d)", serial_fpga->drv->name, serial_fpga->device_id, ret);
+
+		// Collect The Whole Nonce, Each Read Waiting Up To 1/10 Sec
+		memset(nonce_buf,0,4);
+		got = 0;
+		do {
+			ret = read(fd, nonce_buf + got, SERIAL_READ_SIZE - got);
+			if (ret > 0)
+				got += ret;
+		} while (ret > 0 && got < SERIAL_READ_SIZE);
+
+		cgtime(&tv_end);
+
+		if (got == 0)		// No Nonce Found
+			continue;
+		else if (got < SERIAL_READ_SIZE) {
+			applog(LOG_ERR, "%s%i: Serial Read Error (ret=%d)", serial_fpga->drv->name, serial_fpga->device_id, got);
 			serial_fpga_close(thr);
 			dev_error(serial_fpga, REASON_DEV_COMMS_ERROR);
 			break;
 		}
 
-		memcpy((char *)&nonce, nonce_buf, SERIAL_READ_SIZE);
-		
-#if !defined (__BIG_ENDIAN__) && !defined(MIPSEB)
-		nonce = swab32(nonce);
-#endif
+		serial_fpga_nonce(thr, info, nonce_buf, &tv_end);
+	}
 
-		curr_hw_errors = serial_fpga->hw_errors;
+	return serial_fpga_end_job(thr, info, timed_out);
+}
+
+#ifdef USE_SERIAL_ENGINE
+/* With --serialfpga-engine each of N threads runs its share of the boards
+ * from one epoll loop instead of every board having a thread blocked on its
+ * port. The loop waits on each board's port and its mining thread's restart
+ * fd, sending jobs, collecting nonces and ending timed out work for all of
+ * them, and feeds each board's hashes to the hashmeter under its own thread
+ * so per device stats are unchanged. The first board prepared in each shard has
+ * its mining thread run the loop, the other boards' threads exit once started.
+ * Work is fetched without waiting, a board with none staged is retried
+ * shortly rather than stalling the others. */
+#define SERIAL_ENGINE_EVENTS 64
+
+// Marks An epoll Event As A Board's Restart fd Rather Than Its Port
+#define SERIAL_EV_WAKE 1
+
+// Marks An epoll Event As The Shard's Wake, Boards Are Pending
+#define SERIAL_EV_SHARD (~(uint64_t)0)
+
+// ms To Wait Before Retrying A Board That Failed To Take A Job
+#define SERIAL_RETRY_TIME 1000
 
-		applog(LOG_INFO, "%s%i: Nonce Found - %08X (%5.1fMhz)", serial_fpga->drv->name, serial_fpga->device_id, nonce, (double)(1/(info->Hs * 1000000)));
-		submit_nonce(thr, work, nonce);
+// ms To Wait Before Looking Again For Work For A Board With None Staged
+#define SERIAL_WORK_WAIT 10
 
-		// Update Hashrate
-		if (serial_fpga->hw_errors == curr_hw_errors)
-			info->Hs = ((double)(elapsed.tv_sec) + ((double)(elapsed.tv_usec))/((double)1000000)) / (double)nonce;
+// Feed A Board's Hashes To The Hashmeter, At Most 5 Times A Second As In
+// hash_driver_work
+static void serial_engine_hashmeter(struct thr_info *thr, struct FPGA_INFO *info, struct timeval *now)
+{
+	struct timeval diff;
 
+	timersub(now, &info->tv_hashmeter, &diff);
+	if ((info->hashes_done && (diff.tv_sec > 0 || diff.tv_usec > 200000)) ||
+	    diff.tv_sec >= opt_log_interval) {
+		hashmeter(thr->id, &diff, info->hashes_done);
+		info->hashes_done = 0;
+		copy_time(&info->tv_hashmeter, now);
 	}
+}
 
-	// Estimate Number Of Hashes
-	hash_count = ((double)(elapsed.tv_sec) + ((double)(elapsed.tv_usec))/((double)1000000)) / info->Hs;
-	
-	free_work(work);
-	return hash_count;
+static void serial_engine_error(struct thr_info *thr, struct FPGA_INFO *info, const char *what)
+{
+	struct cgpu_info *serial_fpga = thr->cgpu;
+
+	applog(LOG_ERR, "%s%i: Serial %s Error (errno=%d)", serial_fpga->drv->name, serial_fpga->device_id, what, errno);
+	serial_fpga_close(thr);
+	dev_error(serial_fpga, REASON_DEV_COMMS_ERROR);
+	if (info->work)
+		info->hashes_done += serial_fpga_end_job(thr, info, false);
+	info->nonce_got = 0;
+}
+
+// Read Whatever The Board Has Sent, Handling Each Whole Nonce
+static void serial_engine_read(struct thr_info *thr, struct FPGA_INFO *info)
+{
+	struct timeval tv_end;
+	int ret;
+
+	while (info->device_fd != -1) {
+		ret = read(info->device_fd, info->nonce_buf + info->nonce_got, SERIAL_READ_SIZE - info->nonce_got);
+		if (ret < 0 && (errno == EAGAIN || errno == EINTR))
+			break;
+		if (ret <= 0) {
+			serial_engine_error(thr, info, "Read");
+			break;
+		}
+
+		cgtime(&tv_end);
+		if (!info->nonce_got)
+			copy_time(&info->tv_nonce, &tv_end);
+		info->nonce_got += ret;
+		if (info->nonce_got < SERIAL_READ_SIZE)
+			continue;
+		info->nonce_got = 0;
+
+		// Nonces Arriving With No Job Out Belong To No Work We Still Have
+		if (info->work)
+			serial_fpga_nonce(thr, info, info->nonce_buf, &tv_end);
+	}
+}
+
+// Start, End Or Time Out One Board's Job, Lowering *timeout To When It Next
+// Needs Looking At
+static void serial_engine_service(int epfd, int idx, struct thr_info *thr, struct timeval *now, int *timeout)
+{
+	struct cgpu_info *serial_fpga = thr->cgpu;
+	struct FPGA_INFO *info = serial_fpga->device_data;
+	struct epoll_event ev;
+	int elapsed_ms, wait_ms, ret;
+
+	// Half A Nonce That Never Completed Means The Stream Is Out Of Step
+	if (info->nonce_got) {
+		wait_ms = SERIAL_READ_TIMEOUT * 100 - ms_tdiff(now, &info->tv_nonce);
+		if (wait_ms <= 0) {
+			errno = 0;
+			serial_engine_error(thr, info, "Read");
+		} else if (wait_ms < *timeout)
+			*timeout = wait_ms;
+	}
+
+	if (info->work) {
+		elapsed_ms = ms_tdiff(now, &info->tv_start);
+		if (elapsed_ms < info->read_time) {
+			wait_ms = info->read_time - elapsed_ms;
+			if (wait_ms < *timeout)
+				*timeout = wait_ms;
+			serial_engine_hashmeter(thr, info, now);
+			return;
+		}
+		applog(LOG_DEBUG, "%s%i: End Scan For Nonces - Time = %d ms", serial_fpga->drv->name, serial_fpga->device_id, elapsed_ms);
+		info->hashes_done += serial_fpga_end_job(thr, info, true);
+	}
+	serial_engine_hashmeter(thr, info, now);
+
+	if (serial_fpga->deven != DEV_ENABLED || thr->pause) {
+		serial_fpga_discard_next(info);
+		return;
+	}
+
+	if (info->tv_retry.tv_sec) {
+		wait_ms = ms_tdiff(&info->tv_retry, now);
+		if (wait_ms > 0) {
+			if (wait_ms < *timeout)
+				*timeout = wait_ms;
+			return;
+		}
+		info->tv_retry.tv_sec = 0;
+	}
+
+	if (info->next_work && stale_work(info->next_work, false))
+		serial_fpga_discard_next(info);
+	if (!info->next_work && !serial_fpga_preload(thr, info)) {
+		if (SERIAL_WORK_WAIT < *timeout)
+			*timeout = SERIAL_WORK_WAIT;
+		return;
+	}
+
+	ret = serial_fpga_send_job(thr, info);
+	if (ret < 0) {
+		applog(LOG_ERR, "%s %d failure, disabling!", serial_fpga->drv->name, serial_fpga->device_id);
+		serial_fpga->deven = DEV_DISABLED;
+		dev_error(serial_fpga, REASON_THREAD_ZERO_HASH);
+		return;
+	}
+	if (ret == 0) {
+		cgtime(&info->tv_retry);
+		info->tv_retry.tv_usec += SERIAL_RETRY_TIME * 1000;
+		info->tv_retry.tv_sec += info->tv_retry.tv_usec / 1000000;
+		info->tv_retry.tv_usec %= 1000000;
+		if (SERIAL_RETRY_TIME < *timeout)
+			*timeout = SERIAL_RETRY_TIME;
+		return;
+	}
+
+	// A Reopened Port Is A New fd, The Old One Left epoll When Closed
+	if (info->ep_fd != info->device_fd) {
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.u64 = (uint64_t)idx << 1;
+		if (unlikely(epoll_ctl(epfd, EPOLL_CTL_ADD, info->device_fd, &ev)))
+			applog(LOG_WARNING, "Failed to add %s%i to serial engine", serial_fpga->drv->name, serial_fpga->device_id);
+		info->ep_fd = info->device_fd;
+	}
+	if (info->read_time < *timeout)
+		*timeout = info->read_time;
+}
+
+// Take The Boards Prepared Since Last Time Onto The Engine's Own List, Adding
+// Their Restart fds To epoll
+static void serial_engine_take(int epfd, struct SERIAL_SHARD *shard, struct thr_info ***thrs, int *count)
+{
+	struct epoll_event ev;
+	struct FPGA_INFO *info;
+	struct thr_info *thr;
+	struct timeval now;
+	int i;
+
+	cgtime(&now);
+	mutex_lock(&shard->lock);
+	if (shard->pending_count) {
+		*thrs = realloc(*thrs, sizeof(struct thr_info *) * (*count + shard->pending_count));
+		if (unlikely(!*thrs))
+			quit(1, "Failed to realloc serial engine thrs");
+	}
+	for (i = 0; i < shard->pending_count; i++) {
+		thr = shard->pending[i];
+		info = thr->cgpu->device_data;
+		info->ep_fd = -1;
+		copy_time(&info->tv_hashmeter, &now);
+
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.u64 = ((uint64_t)*count << 1) | SERIAL_EV_WAKE;
+		if (unlikely(epoll_ctl(epfd, EPOLL_CTL_ADD, thr->restart_wake.rfd, &ev)))
+			quit(1, "Failed to add restart fd to serial engine");
+		(*thrs)[(*count)++] = thr;
+	}
+	shard->pending_count = 0;
+	mutex_unlock(&shard->lock);
+}
+
+static void serial_fpga_engine(struct thr_info *mythr, struct SERIAL_SHARD *shard)
+{
+	struct epoll_event ev, evs[SERIAL_ENGINE_EVENTS];
+	struct thr_info **thrs = NULL;
+	struct FPGA_INFO *info;
+	struct thr_info *thr;
+	struct timeval now;
+	int epfd, i, count = 0, nfds, timeout;
+
+	epfd = epoll_create(SERIAL_ENGINE_EVENTS);
+	if (unlikely(epfd < 0))
+		quit(1, "Failed to epoll_create in serial_fpga_engine");
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.u64 = SERIAL_EV_SHARD;
+	if (unlikely(epoll_ctl(epfd, EPOLL_CTL_ADD, shard->wake.rfd, &ev)))
+		quit(1, "Failed to add shard wake to serial engine");
+	serial_engine_take(epfd, shard, &thrs, &count);
+
+	applog(LOG_INFO, "Serial engine on %s%i running %d boards", mythr->cgpu->drv->name,
+	       mythr->cgpu->device_id, count);
+
+	while (likely(!mythr->cgpu->shutdown)) {
+		timeout = 1000;
+		cgtime(&now);
+		for (i = 0; i < count; i++)
+			serial_engine_service(epfd, i, thrs[i], &now, &timeout);
+
+		nfds = epoll_wait(epfd, evs, SERIAL_ENGINE_EVENTS, timeout);
+		for (i = 0; i < nfds; i++) {
+			int idx;
+
+			if (evs[i].data.u64 == SERIAL_EV_SHARD) {
+				cgwake_clear(&shard->wake);
+				serial_engine_take(epfd, shard, &thrs, &count);
+				continue;
+			}
+
+			idx = evs[i].data.u64 >> 1;
+			thr = thrs[idx];
+			info = thr->cgpu->device_data;
+			if (!(evs[i].data.u64 & SERIAL_EV_WAKE)) {
+				serial_engine_read(thr, info);
+				continue;
+			}
+
+			cgwake_clear(&thr->restart_wake);
+			if (!thr->work_restart)
+				continue;
+			if (info->work)
+				info->hashes_done += serial_fpga_end_job(thr, info, false);
+			else
+				serial_fpga_discard_next(info);
+			thr->work_restart = false;
+		}
+	}
+
+	// Boards Still Pending Have Their Ports Open Too
+	serial_engine_take(epfd, shard, &thrs, &count);
+	for (i = 0; i < count; i++) {
+		thr = thrs[i];
+		info = thr->cgpu->device_data;
+		if (info->work)
+			serial_fpga_end_job(thr, info, false);
+		serial_fpga_discard_next(info);
+		serial_fpga_close(thr);
+		serial_fpga_remember(thr->cgpu, info);
+	}
+	free(thrs);
+	close(epfd);
+}
+#endif
+
+static void serial_fpga_hash_work(struct thr_info *thr)
+{
+	struct FPGA_INFO *info = thr->cgpu->device_data;
+
+	if (info->shard < 0) {
+		hash_driver_work(thr);
+		return;
+	}
+#ifdef USE_SERIAL_ENGINE
+	struct SERIAL_SHARD *shard = &serial_shards[info->shard];
+	bool leader;
+
+	// The Other Boards Of The Shard Are Run By Its Leader's Thread
+	mutex_lock(&shard->lock);
+	leader = shard->leader == thr->cgpu;
+	mutex_unlock(&shard->lock);
+	if (leader) {
+		cgsem_wait(&shard->ready);
+		serial_fpga_engine(thr, shard);
+	}
+#endif
+}
+
+static struct api_data *serial_fpga_api_stats(struct cgpu_info *cgpu)
+{
+	struct api_data *root = NULL;
+	struct FPGA_INFO *info = cgpu->device_data;
+
+	// Not Locked, As In The Icarus Driver
+	root = api_add_int(root, "read_time", &(info->read_time), false);
+	root = api_add_int(root, "scan_time", &(info->scan_time), false);
+	root = api_add_double(root, "fullnonce", &(info->fullnonce), false);
+	root = api_add_hs(root, "Hs", &(info->Hs), false);
+	root = api_add_double(root, "W", &(info->W), false);
+	root = api_add_bool(root, "Hs_measured", &(info->Hs_measured), false);
+	root = api_add_int(root, "history_count", &(info->history_count), false);
+	root = api_add_int(root, "outliers", &(info->outliers), false);
+	root = api_add_uint64(root, "samples", &(info->samples), false);
+	root = api_add_double(root, "latency", &(info->latency), false);
+	root = api_add_int(root, "timeout", &(info->timeout), false);
+	root = api_add_double(root, "idle", &(info->idle), false);
+	root = api_add_double(root, "last_idle", &(info->last_idle), false);
+
+	return root;
 }
 
 static void serial_fpga_statline_before(char *buf, size_t bufsiz, struct cgpu_info *cgpu)
@@ -321,9 +1100,18 @@ static void serial_fpga_statline_before(char *buf, size_t bufsiz, struct cgpu_in
 
 static void serial_fpga_shutdown(__maybe_unused struct thr_info *thr)
 {
+	struct FPGA_INFO *info = thr->cgpu->device_data;
+
 	applog(LOG_DEBUG, "serial_fpga_shutdown...");
 
+	// A Serial Engine Closes Its Boards When It Stops
+	if (info->shard >= 0)
+		return;
+
+	serial_fpga_discard_next(info);
+
 	serial_fpga_close(thr);
+	serial_fpga_remember(thr->cgpu, info);
 }
 
 static void serial_fpga_identify(struct cgpu_info *cgpu)
@@ -333,7 +1121,35 @@ static void serial_fpga_identify(struct cgpu_info *cgpu)
 
 static char *serial_fpga_set(struct cgpu_info *cgpu, char *option, char *setting, char *replybuf)
 {
+	struct FPGA_INFO *info = cgpu->device_data;
+	int val;
+
 	applog(LOG_DEBUG, "serial_fpga_set...");
+
+	if (strcasecmp(option, "help") == 0) {
+		sprintf(replybuf, "scantime: ms per work 0-%d, 0 for auto",
+				  SERIAL_FPGA_MAX_READ_TIME);
+		return replybuf;
+	}
+
+	if (strcasecmp(option, "scantime") == 0) {
+		if (!setting || !*setting) {
+			sprintf(replybuf, "missing scantime setting");
+			return replybuf;
+		}
+
+		val = atoi(setting);
+		if (val < 0 || val > SERIAL_FPGA_MAX_READ_TIME) {
+			sprintf(replybuf, "invalid scantime: '%s' valid range 0-%d",
+					  setting, SERIAL_FPGA_MAX_READ_TIME);
+			return replybuf;
+		}
+
+		// Takes Effect From The Next Work
+		info->scan_time = val;
+
+		return NULL;
+	}
 	
 	sprintf(replybuf, "Unknown option: %s", option);
 	return replybuf;
@@ -344,7 +1160,8 @@ struct device_drv serial_fpga_drv = {
 	.dname = "SerialFPGA",
 	.name = "SRL",
 	.drv_detect = serial_fpga_detect,
-	.hash_work = &hash_driver_work,
+	.hash_work = &serial_fpga_hash_work,
+	.get_api_stats = serial_fpga_api_stats,
 	.get_statline_before = serial_fpga_statline_before,
 	.set_device = serial_fpga_set,
 	.identify_device = serial_fpga_identify,
@@ -25,6 +25,7 @@
 **/
 #include "miner.h"
 #include <unistd.h>
+#include <math.h>
 #include <sha2.h>
 #include "libztex.h"
 #include "util.h"
@@ -33,6 +34,22 @@ struct device_drv ztex_drv;
 
 static int option_offset = -1;
 
+// The FPGA Only Holds Its Last Two Golden Nonces, So Poll Often Enough To
+// Expect Well Under Two Between Reads At The Current Clock
+#define ZTEX_GOLDEN_PER_POLL 0.5
+#define ZTEX_POLL_MIN_MS 10
+#define ZTEX_POLL_MAX_MS 1000
+// Weight Of Each Poll In The Measured Golden Nonce Rate
+#define ZTEX_GOLDEN_DECAY 0.02
+// Results Read This Soon After Sending Work May Still Be For The Old Work
+#define ZTEX_HW_GRACE_MS 500
+// Learned Clock Profiles Lose Half Their Weight A Day, So Drifting Boards Get
+// Re-Probed, And Are Saved This Often While Mining
+#define ZTEX_PROFILE_HALFLIFE 86400.0
+#define ZTEX_PROFILE_SAVE_SECS 600
+// Standard Deviations Added To The Error Rate When Choosing A Clock
+#define ZTEX_CONFIDENCE_Z 2.0
+
 static void ztex_disable(struct thr_info* thr);
 static bool ztex_prepare(struct thr_info *thr);
 extern uint32_t ztex_checkNonce(struct work *work, uint32_t nonce);
@@ -53,21 +70,572 @@ void set_starttime(char *f, struct timeval *tv)
 		tm->tm_sec);
 }
 
+// Selecting An FPGA Holds The Board Lock Until It Is Released. The Hardware
+// Selection Outlives The Lock So Only Actual Changes Go Over USB
 static void ztex_selectFpga(struct libztex_device* ztex)
 {
 	if (ztex->root->numberOfFpgas > 1) {
-		if (ztex->root->selectedFpga != ztex->fpgaNum)
-			mutex_lock(&ztex->root->mutex);
+		mutex_lock(&ztex->root->mutex);
 		libztex_selectFpga(ztex);
 	}
 }
 
 static void ztex_releaseFpga(struct libztex_device* ztex)
 {
-	if (ztex->root->numberOfFpgas > 1) {
-		ztex->root->selectedFpga = -1;
+	if (ztex->root->numberOfFpgas > 1)
 		mutex_unlock(&ztex->root->mutex);
+}
+
+// The Error Statistics Learned For Each Clock Step, Kept In --ztex-profiles
+// Per Board Serial Number And FPGA Across Restarts
+struct ztex_profile {
+	char snString[LIBZTEX_SNSTRING_LEN + 1];
+	int fpgaNum;
+	int freqM;
+	time_t saved;
+	double errorCount;
+	double errorWeight;
+	double maxErrorRate;
+};
+
+// The Bitstream Each FPGA Was Last Configured With, Kept In The Same File
+struct ztex_bitstream {
+	char snString[LIBZTEX_SNSTRING_LEN + 1];
+	int fpgaNum;
+	uint64_t fingerprint;
+};
+
+static struct ztex_profile *profiles;
+static int profile_count;
+static struct ztex_bitstream *bitstreams;
+static int bitstream_count;
+static bool profiles_loaded;
+static pthread_mutex_t profile_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Must Be Called With profile_lock Held
+static void ztex_profilesLoad(void)
+{
+	struct ztex_profile entry;
+	char line[256];
+	FILE *fp;
+
+	profiles_loaded = true;
+	if (!opt_ztex_profiles)
+		return;
+	fp = fopen(opt_ztex_profiles, "r");
+	if (!fp)
+		return;
+	while (fgets(line, sizeof(line), fp)) {
+		struct ztex_bitstream bitstream;
+		unsigned long long fingerprint;
+		long saved;
+
+		memset(&bitstream, 0, sizeof(bitstream));
+		if (sscanf(line, "bitstream %10s %d %llx", bitstream.snString, &bitstream.fpgaNum,
+			   &fingerprint) == 3) {
+			bitstream.fingerprint = fingerprint;
+			bitstreams = realloc(bitstreams, sizeof(*bitstreams) * (bitstream_count + 1));
+			if (unlikely(!bitstreams))
+				quit(1, "Failed to realloc ztex bitstreams");
+			bitstreams[bitstream_count++] = bitstream;
+			continue;
+		}
+
+		memset(&entry, 0, sizeof(entry));
+		if (sscanf(line, "%10s %d %d %ld %lf %lf %lf", entry.snString, &entry.fpgaNum,
+			   &entry.freqM, &saved, &entry.errorCount, &entry.errorWeight,
+			   &entry.maxErrorRate) != 7)
+			continue;
+		if (entry.freqM < 0 || entry.freqM > 255 || entry.errorWeight <= 0)
+			continue;
+		entry.saved = saved;
+
+		profiles = realloc(profiles, sizeof(*profiles) * (profile_count + 1));
+		if (unlikely(!profiles))
+			quit(1, "Failed to realloc ztex profiles");
+		profiles[profile_count++] = entry;
+	}
+	fclose(fp);
+	applog(LOG_DEBUG, "Loaded %d ztex profile entries from %s", profile_count, opt_ztex_profiles);
+}
+
+// Must Be Called With profile_lock Held
+static void ztex_profilesSave(void)
+{
+	char tmpname[PATH_MAX];
+	FILE *fp;
+	int i;
+
+	snprintf(tmpname, sizeof(tmpname), "%s.tmp", opt_ztex_profiles);
+	fp = fopen(tmpname, "w");
+	if (!fp) {
+		applog(LOG_ERR, "Failed to write ztex profiles %s", tmpname);
+		return;
+	}
+	for (i = 0; i < profile_count; i++) {
+		fprintf(fp, "%s\t%d\t%d\t%ld\t%.6e\t%.6e\t%.6e\n", profiles[i].snString,
+			profiles[i].fpgaNum, profiles[i].freqM, (long)profiles[i].saved,
+			profiles[i].errorCount, profiles[i].errorWeight, profiles[i].maxErrorRate);
+	}
+	for (i = 0; i < bitstream_count; i++) {
+		fprintf(fp, "bitstream\t%s\t%d\t%016llx\n", bitstreams[i].snString,
+			bitstreams[i].fpgaNum, (unsigned long long)bitstreams[i].fingerprint);
+	}
+	fclose(fp);
+#ifdef WIN32
+	remove(opt_ztex_profiles);
+#endif
+	if (rename(tmpname, opt_ztex_profiles))
+		applog(LOG_ERR, "Failed to replace ztex profiles %s", opt_ztex_profiles);
+}
+
+// Load The Board's Learned Clock Steps, Decayed By Their Age
+static void ztex_profileLoad(struct libztex_device *ztex)
+{
+	time_t now = time(NULL);
+	double decay;
+	int i, found = 0;
+
+	if (!opt_ztex_profiles)
+		return;
+
+	mutex_lock(&profile_lock);
+	if (!profiles_loaded)
+		ztex_profilesLoad();
+	for (i = 0; i < profile_count; i++) {
+		struct ztex_profile *entry = &profiles[i];
+		int m = entry->freqM;
+
+		if (strcmp(entry->snString, (char *)ztex->snString) || entry->fpgaNum != ztex->fpgaNum)
+			continue;
+
+		decay = now > entry->saved ? pow(0.5, (now - entry->saved) / ZTEX_PROFILE_HALFLIFE) : 1.0;
+		ztex->errorCount[m] = entry->errorCount * decay;
+		ztex->errorWeight[m] = entry->errorWeight * decay;
+		ztex->errorRate[m] = ztex->errorCount[m] / ztex->errorWeight[m] * (ztex->errorWeight[m] < 100 ? ztex->errorWeight[m] * 0.01 : 1.0);
+		ztex->maxErrorRate[m] = ztex->errorRate[m];
+		if (entry->maxErrorRate > ztex->errorRate[m])
+			ztex->maxErrorRate[m] += (entry->maxErrorRate - ztex->errorRate[m]) * decay;
+		found++;
+	}
+	for (i = 0; i < bitstream_count; i++) {
+		if (!strcmp(bitstreams[i].snString, (char *)ztex->snString) && bitstreams[i].fpgaNum == ztex->fpgaNum)
+			ztex->configuredFingerprint = bitstreams[i].fingerprint;
+	}
+	mutex_unlock(&profile_lock);
+
+	ztex->profileLoaded = found > 0;
+	ztex->profileSaved = now;
+	if (found)
+		applog(LOG_INFO, "%s: Loaded %d clock steps from the ztex profiles", ztex->repr, found);
+}
+
+// Replace The FPGA's Entries With Its Current Clock Steps And Bitstream. Must
+// Be Called With profile_lock Held
+static void ztex_profileStore(struct libztex_device *ztex, time_t now)
+{
+	int i, j;
+
+	for (i = j = 0; i < profile_count; i++) {
+		if (strcmp(profiles[i].snString, (char *)ztex->snString) || profiles[i].fpgaNum != ztex->fpgaNum)
+			profiles[j++] = profiles[i];
+	}
+	profile_count = j;
+	for (i = 0; i < 256; i++) {
+		struct ztex_profile *entry;
+
+		if (ztex->errorWeight[i] <= 0)
+			continue;
+		profiles = realloc(profiles, sizeof(*profiles) * (profile_count + 1));
+		if (unlikely(!profiles))
+			quit(1, "Failed to realloc ztex profiles");
+		entry = &profiles[profile_count++];
+		memset(entry, 0, sizeof(*entry));
+		strcpy(entry->snString, (char *)ztex->snString);
+		entry->fpgaNum = ztex->fpgaNum;
+		entry->freqM = i;
+		entry->saved = now;
+		entry->errorCount = ztex->errorCount[i];
+		entry->errorWeight = ztex->errorWeight[i];
+		entry->maxErrorRate = ztex->maxErrorRate[i];
+	}
+
+	for (i = j = 0; i < bitstream_count; i++) {
+		if (strcmp(bitstreams[i].snString, (char *)ztex->snString) || bitstreams[i].fpgaNum != ztex->fpgaNum)
+			bitstreams[j++] = bitstreams[i];
+	}
+	bitstream_count = j;
+	if (ztex->configuredFingerprint != 0) {
+		bitstreams = realloc(bitstreams, sizeof(*bitstreams) * (bitstream_count + 1));
+		if (unlikely(!bitstreams))
+			quit(1, "Failed to realloc ztex bitstreams");
+		memset(&bitstreams[bitstream_count], 0, sizeof(*bitstreams));
+		strcpy(bitstreams[bitstream_count].snString, (char *)ztex->snString);
+		bitstreams[bitstream_count].fpgaNum = ztex->fpgaNum;
+		bitstreams[bitstream_count].fingerprint = ztex->configuredFingerprint;
+		bitstream_count++;
+	}
+
+	ztex->profileSaved = now;
+}
+
+// Store The FPGAs' Entries And Rewrite The File Once
+static void ztex_profileSaveAll(struct libztex_device **fpgas, int count)
+{
+	time_t now = time(NULL);
+	int i, oldstate;
+
+	if (!opt_ztex_profiles)
+		return;
+
+	// Don't Leave A Half Written File If The Thread Is Cancelled At Shutdown
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldstate);
+	mutex_lock(&profile_lock);
+	if (!profiles_loaded)
+		ztex_profilesLoad();
+	for (i = 0; i < count; i++)
+		ztex_profileStore(fpgas[i], now);
+	ztex_profilesSave();
+	mutex_unlock(&profile_lock);
+	pthread_setcancelstate(oldstate, NULL);
+}
+
+static void ztex_profileSave(struct libztex_device *ztex)
+{
+	ztex_profileSaveAll(&ztex, 1);
+}
+
+static double ztex_hashRate(struct libztex_device *ztex)
+{
+	return ztex->freqM1 * (ztex->freqM + 1) * 1000000.0 * ztex->hashesPerClock;
+}
+
+// Pick The Poll Interval From The Expected Golden Nonce Rate At The Current Clock
+static int ztex_pollInterval(struct libztex_device *ztex)
+{
+	double ms;
+
+	ms = ZTEX_GOLDEN_PER_POLL / (ztex_hashRate(ztex) * ztex->goldenPerHash) * 1000.0;
+	if (ms < ZTEX_POLL_MIN_MS)
+		return ZTEX_POLL_MIN_MS;
+	if (ms > ZTEX_POLL_MAX_MS)
+		return ZTEX_POLL_MAX_MS;
+	return ms;
+}
+
+// Fold The New Golden Nonces Seen Over The Last ms Into The Measured Rate. Both
+// Slots Changing Means Some May Have Been Missed, So Count That As More
+static void ztex_updateGolden(struct libztex_device *ztex, int found, int ms)
+{
+	double hashes = ztex_hashRate(ztex) * ms / 1000.0;
+
+	if (hashes <= 0)
+		return;
+	if (found >= 2)
+		found = 4;
+	ztex->goldenPerHash += ((double)found / hashes - ztex->goldenPerHash) * ZTEX_GOLDEN_DECAY;
+	if (ztex->goldenPerHash < LIBZTEX_GOLDEN_PER_HASH / 16)
+		ztex->goldenPerHash = LIBZTEX_GOLDEN_PER_HASH / 16;
+}
+
+// Read Results Asynchronously So A Restart Doesn't Wait On A Slow Or Stuck
+// Transfer, Cancelling The Read In Flight Instead
+static int ztex_readHashData(struct thr_info *thr, struct libztex_device *ztex, struct libztex_hash_data *hdata)
+{
+	int rc;
+
+	rc = libztex_submitReadHashData(ztex);
+	if (rc < 0)
+		return rc;
+#ifndef WIN32
+	if (restart_poll(thr, libztex_readFd(ztex), LIBZTEX_READ_TIMEOUT * 2) != 1)
+		libztex_cancelReadHashData(ztex);
+#endif
+	return libztex_collectReadHashData(ztex, hdata);
+}
+
+// Multi FPGA Boards Get A Scheduler Thread Owning The USB Handle. Each FPGA's
+// Thread Queues Its Sends And Reads, And The Scheduler Serves Them In One Pass
+// Over The FPGAs Per Poll Cycle, So Each Is Selected Once And The FPGA Threads
+// Never Wait On The Board Lock
+#define ZTEX_REQ_SEND 1
+#define ZTEX_REQ_READ 2
+
+struct ztex_slot {
+	struct libztex_device *ztex;
+	int request;
+	unsigned char sendbuf[60];
+	struct libztex_hash_data hdata;
+	int rc;
+	cgsem_t done;
+#ifndef WIN32
+	cgwake_t wake;
+#endif
+};
+
+struct ztex_board {
+	struct libztex_device *root;
+	int fpgas;
+	struct ztex_slot *slots;
+	pthread_mutex_t lock;
+	cgsem_t wake;
+	bool shutdown;
+	pthread_t pth;
+};
+
+static void ztex_boardDone(struct ztex_slot *slot, int rc)
+{
+	slot->rc = rc;
+#ifndef WIN32
+	cgwake_signal(&slot->wake);
+#endif
+	cgsem_post(&slot->done);
+}
+
+static void *ztex_boardThread(void *userdata)
+{
+	struct ztex_board *board = userdata;
+	struct timeval tv_cycle, now;
+	struct ztex_slot *slot;
+	int i, n, start, req, rc, interval;
+	bool reads;
+
+	RenameThread("ZtexBoard");
+
+	cgtime(&tv_cycle);
+	while (42) {
+		// Sleep Until The Next Poll Cycle Or Until A Request Is Queued
+		interval = ZTEX_POLL_MAX_MS;
+		mutex_lock(&board->lock);
+		for (i = 0; i < board->fpgas; i++) {
+			if (board->slots[i].request & ZTEX_REQ_READ) {
+				n = ztex_pollInterval(board->slots[i].ztex);
+				if (n < interval)
+					interval = n;
+			}
+		}
+		mutex_unlock(&board->lock);
+
+		cgtime(&now);
+		n = interval - ms_tdiff(&now, &tv_cycle);
+		if (n > 0)
+			cgsem_mswait(&board->wake, n);
+		if (board->shutdown)
+			break;
+
+		cgtime(&now);
+		reads = ms_tdiff(&now, &tv_cycle) >= interval;
+		if (reads)
+			tv_cycle = now;
+
+		// Start From The FPGA Already Selected To Save A Switch
+		start = board->root->selectedFpga;
+		if (start < 0)
+			start = 0;
+		for (i = 0; i < board->fpgas; i++) {
+			slot = &board->slots[(start + i) % board->fpgas];
+
+			mutex_lock(&board->lock);
+			req = slot->request & (reads ? ZTEX_REQ_SEND | ZTEX_REQ_READ : ZTEX_REQ_SEND);
+			slot->request &= ~req;
+			mutex_unlock(&board->lock);
+			if (!req)
+				continue;
+
+			ztex_selectFpga(slot->ztex);
+			if (req & ZTEX_REQ_SEND)
+				rc = libztex_sendHashData(slot->ztex, slot->sendbuf);
+			else
+				rc = libztex_readHashData(slot->ztex, &slot->hdata);
+			ztex_releaseFpga(slot->ztex);
+			ztex_boardDone(slot, rc);
+		}
+	}
+
+	// Fail Anything Still Queued So No FPGA Thread Waits Forever
+	mutex_lock(&board->lock);
+	for (i = 0; i < board->fpgas; i++) {
+		slot = &board->slots[i];
+		if (slot->request) {
+			slot->request = 0;
+			ztex_boardDone(slot, LIBUSB_ERROR_NO_DEVICE);
+		}
+	}
+	mutex_unlock(&board->lock);
+	return NULL;
+}
+
+static void ztex_boardStart(struct libztex_device *root, struct libztex_device **fpgas, int fpgacount)
+{
+	struct ztex_board *board;
+	int i;
+
+	board = calloc(1, sizeof(*board));
+	if (unlikely(!board))
+		quit(1, "Failed to calloc ztex_board");
+	board->slots = calloc(fpgacount, sizeof(*board->slots));
+	if (unlikely(!board->slots))
+		quit(1, "Failed to calloc ztex_board slots");
+	board->root = root;
+	board->fpgas = fpgacount;
+	mutex_init(&board->lock);
+	cgsem_init(&board->wake);
+	for (i = 0; i < fpgacount; i++) {
+		board->slots[i].ztex = fpgas[i];
+		cgsem_init(&board->slots[i].done);
+#ifndef WIN32
+		cgwake_init(&board->slots[i].wake);
+#endif
+		fpgas[i]->board = board;
+	}
+
+	if (unlikely(pthread_create(&board->pth, NULL, ztex_boardThread, board)))
+		quit(1, "Failed to create ztex board thread");
+}
+
+// The Board Stays Allocated As The Other FPGA Threads May Still Look At It
+static void ztex_boardStop(struct ztex_board *board)
+{
+	mutex_lock(&board->lock);
+	board->shutdown = true;
+	mutex_unlock(&board->lock);
+	cgsem_post(&board->wake);
+	pthread_join(board->pth, NULL);
+}
+
+// Queue A Request For The Board Scheduler And Wait For It. A Read Still Queued
+// When New Work Arrives Is Dropped Rather Than Waited For
+static int ztex_boardRequest(struct thr_info *thr, struct libztex_device *ztex, int request,
+			     unsigned char *sendbuf, struct libztex_hash_data *hdata)
+{
+	struct ztex_board *board = ztex->board;
+	struct ztex_slot *slot = &board->slots[ztex->fpgaNum];
+
+	mutex_lock(&board->lock);
+	if (board->shutdown) {
+		mutex_unlock(&board->lock);
+		return LIBUSB_ERROR_NO_DEVICE;
+	}
+	if (sendbuf)
+		memcpy(slot->sendbuf, sendbuf, sizeof(slot->sendbuf));
+	slot->request = request;
+	mutex_unlock(&board->lock);
+
+	cgsem_post(&board->wake);
+#ifndef WIN32
+	if ((request & ZTEX_REQ_READ) && restart_poll(thr, slot->wake.rfd, ZTEX_POLL_MAX_MS + LIBZTEX_READ_TIMEOUT) != 1) {
+		mutex_lock(&board->lock);
+		if (slot->request) {
+			slot->request = 0;
+			mutex_unlock(&board->lock);
+			return LIBUSB_ERROR_INTERRUPTED;
+		}
+		mutex_unlock(&board->lock);
+	}
+#endif
+	cgsem_wait(&slot->done);
+#ifndef WIN32
+	cgwake_clear(&slot->wake);
+#endif
+	if (hdata && slot->rc >= 0)
+		*hdata = slot->hdata;
+	return slot->rc;
+}
+
+static int ztex_sendHashData(struct thr_info *thr, struct libztex_device *ztex, unsigned char *sendbuf)
+{
+	if (ztex->board)
+		return ztex_boardRequest(thr, ztex, ZTEX_REQ_SEND, sendbuf, NULL);
+	return libztex_sendHashData(ztex, sendbuf);
+}
+
+// Wait For The Next Poll And Read The Results, Returning 0 On New Work
+static int ztex_pollHashData(struct thr_info *thr, struct libztex_device *ztex, struct libztex_hash_data *hdata)
+{
+	if (ztex->board)
+		return ztex_boardRequest(thr, ztex, ZTEX_REQ_READ, NULL, hdata);
+
+	restart_poll(thr, -1, ztex_pollInterval(ztex));
+	if (thr->work_restart)
+		return 0;
+	return ztex_readHashData(thr, ztex, hdata);
+}
+
+// Configure Boards In Parallel Ahead Of ztex_prepare, Which Then Finds Them
+// Done. A Board's FPGAs Are Configured In Turn As They Share Its USB Handle
+#define ZTEX_CONFIG_THREADS 16
+
+struct ztex_config_pool {
+	struct libztex_device **roots;
+	int count;
+	int next;
+	pthread_mutex_t lock;
+};
+
+static void ztex_configureBoard(struct libztex_device *root)
+{
+	struct libztex_device **fpgas;
+	int i, count = 1;
+
+	if (root->board != NULL)
+		count = root->board->fpgas;
+	fpgas = calloc(count, sizeof(*fpgas));
+	if (unlikely(!fpgas))
+		quit(1, "Failed to calloc ztex fpgas");
+	fpgas[0] = root;
+	for (i = 1; i < count; i++)
+		fpgas[i] = root->board->slots[i].ztex;
+
+	for (i = 0; i < count; i++) {
+		ztex_selectFpga(fpgas[i]);
+		if (libztex_configureFpga(fpgas[i]) != 0)
+			applog(LOG_WARNING, "%s: Failed to configure, will retry", fpgas[i]->repr);
+		ztex_releaseFpga(fpgas[i]);
+	}
+	ztex_profileSaveAll(fpgas, count);
+	free(fpgas);
+}
+
+static void *ztex_configThread(void *userdata)
+{
+	struct ztex_config_pool *pool = (struct ztex_config_pool *)userdata;
+	int i;
+
+	RenameThread("ZtexConfig");
+
+	while (42) {
+		mutex_lock(&pool->lock);
+		i = pool->next++;
+		mutex_unlock(&pool->lock);
+		if (i >= pool->count)
+			break;
+		ztex_configureBoard(pool->roots[i]);
+	}
+	return NULL;
+}
+
+static void ztex_configureBoards(struct libztex_device **roots, int count)
+{
+	pthread_t pth[ZTEX_CONFIG_THREADS];
+	struct ztex_config_pool pool;
+	int i, threads;
+
+	threads = count;
+	if (threads > ZTEX_CONFIG_THREADS)
+		threads = ZTEX_CONFIG_THREADS;
+	applog(LOG_DEBUG, "Configuring %d ztex boards from %d threads", count, threads);
+
+	pool.roots = roots;
+	pool.count = count;
+	pool.next = 0;
+	mutex_init(&pool.lock);
+	for (i = 0; i < threads; i++) {
+		if (unlikely(pthread_create(&pth[i], NULL, ztex_configThread, &pool)))
+			quit(1, "Failed to create ztex config thread");
 	}
+	for (i = 0; i < threads; i++)
+		pthread_join(pth[i], NULL);
+	mutex_destroy(&pool.lock);
 }
 
 static void ztex_detect(bool __maybe_unused hotplug)
@@ -77,6 +645,7 @@ static void ztex_detect(bool __maybe_unused hotplug)
 	int fpgacount;
 	struct libztex_dev_list **ztex_devices;
 	struct libztex_device *ztex_slave;
+	struct libztex_device **fpgas, **roots;
 	struct cgpu_info *ztex;
 
 	cnt = libztex_scanDevices(&ztex_devices);
@@ -94,8 +663,14 @@ static void ztex_detect(bool __maybe_unused hotplug)
 
 		fpgacount = libztex_numberOfFpgas(ztex->device_ztex);
 
-		if (fpgacount > 1)
+		fpgas = NULL;
+		if (fpgacount > 1) {
 			pthread_mutex_init(&ztex->device_ztex->mutex, NULL);
+			fpgas = calloc(fpgacount, sizeof(*fpgas));
+			if (unlikely(!fpgas))
+				quit(1, "Failed to calloc ztex fpgas");
+			fpgas[0] = ztex->device_ztex;
+		}
 
 		for (j = 1; j < fpgacount; j++) {
 			ztex = calloc(1, sizeof(struct cgpu_info));
@@ -107,17 +682,48 @@ static void ztex_detect(bool __maybe_unused hotplug)
 			ztex_slave->fpgaNum = j;
 			ztex_slave->root = ztex_devices[i]->dev;
 			ztex_slave->repr[strlen(ztex_slave->repr) - 1] = ('1' + j);
+			ztex_profileLoad(ztex_slave);
 			add_cgpu(ztex);
+			fpgas[j] = ztex_slave;
+		}
+
+		ztex_profileLoad(ztex_devices[i]->dev);
+
+		if (fpgacount > 1) {
+			ztex_boardStart(fpgas[0], fpgas, fpgacount);
+			free(fpgas);
 		}
 
 		applog(LOG_WARNING,"%s: Found Ztex (fpga count = %d) , mark as %d", ztex->device_ztex->repr, fpgacount, ztex->device_id);
 	}
 
-	if (cnt > 0)
+	if (cnt > 0) {
+		roots = calloc(cnt, sizeof(*roots));
+		if (unlikely(!roots))
+			quit(1, "Failed to calloc ztex roots");
+		for (i = 0; i < cnt; i++)
+			roots[i] = ztex_devices[i]->dev;
+		ztex_configureBoards(roots, cnt);
+		free(roots);
 		libztex_freeDevList(ztex_devices);
+	}
 }
 
-static bool ztex_updateFreq(struct libztex_device* ztex)
+// Upper Confidence Bound Of A Clock's Error Rate, So A Clock Isn't Chosen On
+// The Luck Of A Few Polls. Clocks Without Errors Stay At Zero And So Are Still
+// Probed As Before
+static double ztex_errorBound(struct libztex_device *ztex, int freqM)
+{
+	double p = ztex->maxErrorRate[freqM];
+
+	if (p <= 0 || p >= 1)
+		return p;
+	p += ZTEX_CONFIDENCE_Z * sqrt(p * (1 - p) / (ztex->errorWeight[freqM] + 1));
+	return p < 1 ? p : 1;
+}
+
+// The Clock With The Best Throughput After Errors Within The Probed Range
+static int ztex_bestFreq(struct libztex_device *ztex)
 {
 	int i, maxM, bestM;
 	double bestR, r;
@@ -135,12 +741,20 @@ static bool ztex_updateFreq(struct libztex_device* ztex)
 	bestM = 0;
 	bestR = 0;
 	for (i = 0; i <= maxM; i++) {
-		r = (i + 1 + (i == ztex->freqM? LIBZTEX_ERRORHYSTERESIS: 0)) * (1 - ztex->maxErrorRate[i]);
+		r = (i + 1 + (i == ztex->freqM? LIBZTEX_ERRORHYSTERESIS: 0)) * (1 - ztex_errorBound(ztex, i));
 		if (r > bestR) {
 			bestM = i;
 			bestR = r;
 		}
 	}
+	return bestM;
+}
+
+static bool ztex_updateFreq(struct libztex_device* ztex)
+{
+	int maxM, bestM;
+
+	bestM = ztex_bestFreq(ztex);
 
 	if (bestM != ztex->freqM) {
 		ztex_selectFpga(ztex);
@@ -159,6 +773,9 @@ static bool ztex_updateFreq(struct libztex_device* ztex)
 		       ztex->repr, (1.0 - 1.0 * bestM / maxM) * 100);
 		return false;
 	}
+
+	if (time(NULL) - ztex->profileSaved >= ZTEX_PROFILE_SAVE_SECS)
+		ztex_profileSave(ztex);
 	return true;
 }
 
@@ -166,10 +783,10 @@ static int64_t ztex_scanwork(struct thr_info *thr)
 {
 	struct libztex_device *ztex;
 	struct libztex_hash_data hdata;
-	struct timeval tv_start, tv_end, diff;
+	struct timeval tv_start, tv_end, tv_read, diff;
 	unsigned char sendbuf[60];
-	int count, validNonces, errorCount;
-	int i, rc;
+	int validNonces, errorCount, found, read_ms;
+	int rc;
 	uint32_t nonce, hash_count;
 	uint32_t golden_nonce1, golden_nonce2;
 	uint32_t last_nonce, last_golden1, last_golden2;
@@ -207,19 +824,18 @@ static int64_t ztex_scanwork(struct thr_info *thr)
 	swap256(sendbuf + 28, work->midstate);
 
 	// Send Work To FPGA
-	ztex_selectFpga(ztex);
-	rc = libztex_sendHashData(ztex, sendbuf);
+	rc = ztex_sendHashData(thr, ztex, sendbuf);
 	if (rc < 0) {
 		applog(LOG_ERR, "%s: Failed to send hash data with err %d, retrying", ztex->repr, rc);
 		cgsleep_ms(500);
+		ztex_selectFpga(ztex);
 		rc = libztex_sendHashData(ztex, sendbuf);
+		ztex_releaseFpga(ztex);
 		if (rc < 0) {
 			ztex_disable(thr);
-			ztex_releaseFpga(ztex);
 			return -1;
 		}
 	}
-	ztex_releaseFpga(ztex);
 
 	applog(LOG_DEBUG, "%s: sent hashdata", ztex->repr);
 	
@@ -227,36 +843,27 @@ static int64_t ztex_scanwork(struct thr_info *thr)
 	last_golden1 = 0;
 	last_golden2 = 0;
 	last_nonce = 0;
-	count = 0;
 	validNonces = 0;
 	hash_count = 0;
 	errorCount = 0;
 	cgtime(&tv_start);
 
 	applog(LOG_DEBUG, "%s: entering poll loop", ztex->repr);
+	tv_read = tv_start;
 	while (!(overflow || thr->work_restart)) {
-		count++;
-
-		int sleepcount = 0;
-		while (thr->work_restart == 0 && sleepcount < 25) {
-			cgsleep_ms(10);
-			sleepcount += 1;
-		}
-
-		// Read Results From FPGA
-		ztex_selectFpga(ztex);
-		rc = libztex_readHashData(ztex, &hdata);
-		if (rc < 0) {
+		// Wait For The Next Poll And Read Results From FPGA
+		rc = ztex_pollHashData(thr, ztex, &hdata);
+		if (rc < 0 && !thr->work_restart) {
 			applog(LOG_ERR, "%s: Failed to read hash data with err %d, retrying", ztex->repr, rc);
 			cgsleep_ms(500);
+			ztex_selectFpga(ztex);
 			rc = libztex_readHashData(ztex, &hdata);
+			ztex_releaseFpga(ztex);
 			if (rc < 0) {
 				ztex_disable(thr);
-				ztex_releaseFpga(ztex);
 				return -1;
 			}
 		}
-		ztex_releaseFpga(ztex);
 
 		// Check If New Work Is Available
 		if (thr->work_restart) {
@@ -264,6 +871,10 @@ static int64_t ztex_scanwork(struct thr_info *thr)
 			break;
 		}
 
+		cgtime(&tv_end);
+		read_ms = ms_tdiff(&tv_end, &tv_read);
+		tv_read = tv_end;
+
 		ztex->errorCount[ztex->freqM] *= 0.995;
 		ztex->errorWeight[ztex->freqM] = ztex->errorWeight[ztex->freqM] * 0.995 + 1.0;
 
@@ -276,7 +887,7 @@ static int64_t ztex_scanwork(struct thr_info *thr)
 
 		// Check For Hardware Errors On The FPGA
 		if (ztex_checkNonce(work, nonce) != (hdata.hash7)) {
-			if (count > 2) {	// Only Count Errors After The First 500ms Of Work Being Sent To FPGA
+			if (ms_tdiff(&tv_end, &tv_start) > ZTEX_HW_GRACE_MS) {
 				thr->cgpu->hw_errors++;
 				errorCount += 1;
 				applog(LOG_WARNING, "%s: Check Nonce Failed - %08X", ztex->repr, nonce);
@@ -295,6 +906,7 @@ static int64_t ztex_scanwork(struct thr_info *thr)
 
 		hash_count = nonce;
 		validNonces++;
+		found = 0;
 
 		//
 		// Golden Nonce 1 Check
@@ -315,6 +927,7 @@ static int64_t ztex_scanwork(struct thr_info *thr)
 			
 			applog(LOG_DEBUG, "%s: Submitted Nonce %08x", ztex->repr, golden_nonce1);
 			submit_nonce(thr, work, golden_nonce1);
+			found++;
 		}
 
 		//
@@ -336,9 +949,11 @@ static int64_t ztex_scanwork(struct thr_info *thr)
 			
 			applog(LOG_DEBUG, "%s: Submitted Nonce %08x", ztex->repr, golden_nonce2);
 			submit_nonce(thr, work, golden_nonce2);
+			found++;
 		}
-		
-		cgtime(&tv_end);
+
+		ztex_updateGolden(ztex, found, read_ms);
+
 		timersub(&tv_end, &tv_start, &diff);
 		if (diff.tv_sec > opt_scantime) {
 			applog(LOG_DEBUG, "%s: time = %d sec, scan-time = %d sec", ztex->repr, diff.tv_sec, opt_scantime);
@@ -384,6 +999,7 @@ static bool ztex_prepare(struct thr_info *thr)
 	cgtime(&now);
 	set_starttime(cgpu->init, &now);
 
+	// Normally Already Configured At Detect Time, So This Only Checks
 	ztex_selectFpga(ztex);
 	if (libztex_configureFpga(ztex) != 0) {
 		libztex_resetFpga(ztex);
@@ -470,7 +1086,8 @@ static bool ztex_prepare(struct thr_info *thr)
 	ztex->freqM = ztex->freqMaxM+1;		// KRAMBLE is in original
 	// ztex_updateFreq(ztex);			// KRAMBLE Was already commented out in original
 
-	libztex_setFreq(ztex, ztex->freqMDefault);
+	// Start From The Best Clock Learned Before, If Any
+	libztex_setFreq(ztex, ztex->profileLoaded ? ztex_bestFreq(ztex) : ztex->freqMDefault);
 	ztex_releaseFpga(ztex);
 	applog(LOG_DEBUG, "%s: prepare", ztex->repr);
 	return true;
@@ -479,6 +1096,9 @@ static bool ztex_prepare(struct thr_info *thr)
 static void ztex_shutdown(struct thr_info *thr)
 {
 	if (thr->cgpu->device_ztex != NULL) {
+		ztex_profileSave(thr->cgpu->device_ztex);
+		if (thr->cgpu->device_ztex->board != NULL && thr->cgpu->device_ztex->fpgaNum == 0)
+			ztex_boardStop(thr->cgpu->device_ztex->board);
 		if (thr->cgpu->device_ztex->fpgaNum == 0)
 			pthread_mutex_destroy(&thr->cgpu->device_ztex->mutex);  
 		applog(LOG_DEBUG, "%s: shutdown", thr->cgpu->device_ztex->repr);
@@ -497,6 +1117,37 @@ static void ztex_disable(struct thr_info *thr)
 	ztex_shutdown(thr);
 }
 
+// The Learned Clock Table, One Entry Per Probed Clock Step
+static struct api_data *ztex_api_stats(struct cgpu_info *cgpu)
+{
+	struct api_data *root = NULL;
+	struct libztex_device *ztex = cgpu->device_ztex;
+	char name[32], buf[128];
+	double mhz;
+	int i;
+
+	if (ztex == NULL)
+		return NULL;
+
+	// Not Locked, As In The Icarus Driver
+	mhz = ztex->freqM1 * (ztex->freqM + 1);
+	root = api_add_double(root, "Clock MHz", &mhz, true);
+	mhz = ztex->freqM1 * (ztex->freqMaxM + 1);
+	root = api_add_double(root, "Max Clock MHz", &mhz, true);
+	root = api_add_bool(root, "Profile Loaded", &(ztex->profileLoaded), false);
+	for (i = 0; i <= ztex->freqMaxM; i++) {
+		if (ztex->errorWeight[i] <= 0)
+			continue;
+		snprintf(name, sizeof(name), "Clock %.1f", ztex->freqM1 * (i + 1));
+		snprintf(buf, sizeof(buf), "Weight=%.1f Error=%.4f MaxError=%.4f Bound=%.4f",
+			 ztex->errorWeight[i], ztex->errorRate[i], ztex->maxErrorRate[i],
+			 ztex_errorBound(ztex, i));
+		root = api_add_string(root, name, buf, true);
+	}
+
+	return root;
+}
+
 static void ztex_identify(struct cgpu_info *cgpu)
 {
 	return;
@@ -513,7 +1164,7 @@ struct device_drv ztex_drv = {
 	.name = "ZTX",
 	.drv_detect = ztex_detect,
 	.hash_work = &hash_driver_work,
-//	.get_api_stats = ztex_api_stats,
+	.get_api_stats = ztex_api_stats,
 	.get_statline_before = ztex_statline_before,
 	.set_device = ztex_set,
 	.identify_device = ztex_identify,
@@ -0,0 +1,592 @@
+/*
+ * SerialFPGA board simulator for testing and benchmarking the serial_fpga
+ * driver without hardware. Each simulated board is a pseudo-terminal that
+ * takes the same 44 byte jobs a board does and answers with 4 byte nonces at
+ * the rate and latency asked for, optionally with hardware errors, short
+ * reads and disconnects injected. All the boards are run from one thread so
+ * hundreds of them fit on one machine.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <signal.h>
+#include <termios.h>
+#include <sys/resource.h>
+
+#include <ccan/opt/opt.h>
+
+#include "miner.h"
+#include "sph_blake.h"
+
+/* Midstate then the 12 header bytes before the nonce, as the driver sends */
+#define SIM_JOB_SIZE 44
+#define SIM_NONCE_SIZE 4
+/* Header bytes after the nonce, which the boards have no way of being sent */
+#define SIM_TAIL_SIZE 36
+#define SIM_RANGE 4294967296.0
+/* Highest hash word of a diff 1 Blake-256 share, as test_nonce checks */
+#define SIM_DIFF1 0x000000ff
+/* Nonces found but not yet due to be sent, per board */
+#define SIM_PENDING 64
+/* Nonces hashed per board before checking on the ptys again with --real */
+#define SIM_CHUNK 4096
+/* Gap between the two halves of a short read */
+#define SIM_SHORT_DELAY 0.01
+
+static int opt_boards = 1;
+static float opt_rate = 200.0;
+static float opt_nonces = 256.0;
+static bool opt_real;
+static char *opt_real_tail;
+static int opt_latency = 20;
+static int opt_jitter;
+static float opt_hw_errors;
+static float opt_short_reads;
+static int opt_disconnect;
+static int opt_disconnect_time = 2000;
+static char *opt_link_dir;
+static int opt_stats_interval = 10;
+
+/* What blake.c and the miner.h helpers need from the rest of cgminer */
+bool opt_debug;
+bool opt_log_output;
+bool use_syslog;
+int opt_log_level = LOG_NOTICE;
+
+void _applog(int prio, const char *str, __maybe_unused bool force)
+{
+	struct timeval tv;
+	struct tm tm;
+
+	if (prio > opt_log_level && !opt_debug)
+		return;
+	gettimeofday(&tv, NULL);
+	localtime_r(&tv.tv_sec, &tm);
+	fprintf(stderr, " [%d-%02d-%02d %02d:%02d:%02d] %s\n", tm.tm_year + 1900,
+		tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec, str);
+}
+
+void _quit(int status)
+{
+	exit(status);
+}
+
+struct sim_nonce {
+	double due;
+	uint32_t nonce;
+	/* Bytes already written when a short read was injected */
+	int sent;
+};
+
+struct sim_board {
+	int id;
+	int master, slave;
+	char name[PATH_MAX];
+
+	unsigned char buf[SIM_JOB_SIZE];
+	size_t buflen;
+
+	/* The current job, from when the board starts hashing it */
+	bool busy;
+	double tv_start, tv_end;
+	/* Statistical model: position of the last nonce drawn in the range */
+	double pos;
+	/* Real hashing: state after the midstate and the next nonce to try */
+	sph_blake256_context ctx;
+	uint64_t search;
+
+	struct sim_nonce pending[SIM_PENDING];
+	int pend_head, pend_count;
+
+	double down_until, next_disconnect;
+
+	uint64_t jobs, nonces, hw_errors, short_reads, dropped, disconnects;
+	double idle;
+};
+
+static struct sim_board *boards;
+static unsigned char real_tail[SIM_TAIL_SIZE];
+static uint64_t hashes_done;
+
+static double sim_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+static double sim_rand(void)
+{
+	return (random() + 0.5) / (RAND_MAX + 1.0);
+}
+
+static bool sim_chance(float pct)
+{
+	return pct > 0 && sim_rand() * 100 < pct;
+}
+
+static bool sim_hex2bin(unsigned char *p, const char *s, size_t len)
+{
+	size_t i;
+
+	if (strlen(s) != len * 2)
+		return false;
+	for (i = 0; i < len; i++) {
+		unsigned int b;
+
+		if (sscanf(s + i * 2, "%2x", &b) != 1)
+			return false;
+		p[i] = b;
+	}
+	return true;
+}
+
+static bool sim_open(struct sim_board *board)
+{
+	struct termios tio;
+	char *pts;
+
+	board->master = posix_openpt(O_RDWR | O_NOCTTY);
+	if (board->master < 0)
+		return false;
+	if (grantpt(board->master) || unlockpt(board->master) ||
+	    !(pts = ptsname(board->master)))
+		goto out_close;
+	/* Held open so the master never sees a hangup between driver opens */
+	board->slave = open(pts, O_RDWR | O_NOCTTY);
+	if (board->slave < 0)
+		goto out_close;
+	if (!tcgetattr(board->slave, &tio)) {
+		cfmakeraw(&tio);
+		tcsetattr(board->slave, TCSANOW, &tio);
+	}
+	fcntl(board->master, F_SETFL, fcntl(board->master, F_GETFL) | O_NONBLOCK);
+
+	if (opt_link_dir) {
+		snprintf(board->name, sizeof(board->name), "%s/fpga%d", opt_link_dir, board->id);
+		unlink(board->name);
+		if (symlink(pts, board->name)) {
+			applog(LOG_ERR, "Board %d failed to link %s to %s, errno %d",
+			       board->id, board->name, pts, errno);
+			close(board->slave);
+			goto out_close;
+		}
+	} else
+		snprintf(board->name, sizeof(board->name), "%s", pts);
+
+	board->buflen = 0;
+	board->busy = false;
+	board->pend_count = 0;
+	board->down_until = 0;
+	if (opt_disconnect)
+		board->next_disconnect = sim_now() - opt_disconnect * log(sim_rand());
+	return true;
+
+out_close:
+	close(board->master);
+	board->master = -1;
+	return false;
+}
+
+static void sim_disconnect(struct sim_board *board, double now)
+{
+	applog(LOG_INFO, "Board %d disconnected", board->id);
+	close(board->master);
+	close(board->slave);
+	board->master = board->slave = -1;
+	if (opt_link_dir)
+		unlink(board->name);
+	board->busy = false;
+	board->pend_count = 0;
+	board->down_until = now + opt_disconnect_time / 1000.0;
+	board->disconnects++;
+}
+
+static void sim_reconnect(struct sim_board *board, double now)
+{
+	if (!sim_open(board)) {
+		board->down_until = now + opt_disconnect_time / 1000.0;
+		return;
+	}
+	applog(LOG_INFO, "Board %d reconnected as %s", board->id, board->name);
+}
+
+static void sim_queue(struct sim_board *board, uint32_t nonce)
+{
+	struct sim_nonce *pend;
+
+	pend = &board->pending[(board->pend_head + board->pend_count) % SIM_PENDING];
+	pend->due = board->tv_start + nonce / (opt_rate * 1000000.0);
+	pend->nonce = nonce;
+	pend->sent = 0;
+	board->pend_count++;
+}
+
+static void sim_job(struct sim_board *board, const unsigned char *data, double now)
+{
+	uint32_t job[SIM_JOB_SIZE / 4];
+	int i;
+
+	/* Idle from the end of the last range until this job arrived */
+	if (board->jobs && board->tv_end < now)
+		board->idle += now - board->tv_end;
+
+	board->jobs++;
+	board->busy = true;
+	board->tv_start = now + opt_latency / 1000.0;
+	if (opt_jitter)
+		board->tv_start += (sim_rand() * 2 - 1) * opt_jitter / 1000.0;
+	if (board->tv_start < now)
+		board->tv_start = now;
+	board->tv_end = board->tv_start + SIM_RANGE / (opt_rate * 1000000.0);
+	/* A new job replaces the current one, losing what it hadn't sent */
+	board->pend_count = 0;
+	board->pos = 0;
+
+	if (!opt_real)
+		return;
+
+	/* Carry on from the midstate as if the first 128 bytes were hashed */
+	memcpy(job, data, SIM_JOB_SIZE);
+	sph_blake256_init(&board->ctx);
+	for (i = 0; i < 8; i++)
+		board->ctx.H[i] = swab32(job[i]);
+	board->ctx.T0 = 1024;
+	sph_blake256(&board->ctx, data + 32, SIM_JOB_SIZE - 32);
+	board->search = 0;
+}
+
+/* Hash the next chunk of nonces, returning whether there are any left */
+static bool sim_search(struct sim_board *board)
+{
+	unsigned char block[SIM_NONCE_SIZE + SIM_TAIL_SIZE], hash[32];
+	uint64_t start, end;
+
+	if (!board->busy || board->search >= 0x100000000ULL)
+		return false;
+	if (board->pend_count >= SIM_PENDING)
+		return true;
+
+	memcpy(block + SIM_NONCE_SIZE, real_tail, SIM_TAIL_SIZE);
+	start = board->search;
+	end = start + SIM_CHUNK;
+	if (end > 0x100000000ULL)
+		end = 0x100000000ULL;
+	for (; board->search < end; board->search++) {
+		uint32_t nonce = board->search, hash7;
+		sph_blake256_context ctx;
+
+		/* The header holds the nonce big endian, as blake256_regenhash does */
+		block[0] = nonce >> 24;
+		block[1] = nonce >> 16;
+		block[2] = nonce >> 8;
+		block[3] = nonce;
+		memcpy(&ctx, &board->ctx, sizeof(ctx));
+		sph_blake256(&ctx, block, sizeof(block));
+		sph_blake256_close(&ctx, hash);
+		hash7 = hash[28] | hash[29] << 8 | hash[30] << 16 | (uint32_t)hash[31] << 24;
+		if (hash7 <= SIM_DIFF1) {
+			sim_queue(board, nonce);
+			if (board->pend_count >= SIM_PENDING) {
+				board->search++;
+				break;
+			}
+		}
+	}
+	hashes_done += board->search - start;
+	return board->search < 0x100000000ULL;
+}
+
+/* Draw the next nonce in the range with the statistical model */
+static void sim_draw(struct sim_board *board)
+{
+	if (!board->busy || board->pend_count || board->pos >= SIM_RANGE)
+		return;
+	board->pos -= SIM_RANGE / opt_nonces * log(sim_rand());
+	if (board->pos < SIM_RANGE)
+		sim_queue(board, (uint32_t)board->pos);
+}
+
+static bool sim_write(struct sim_board *board, const unsigned char *p, int len)
+{
+	if (write(board->master, p, len) != len) {
+		board->dropped++;
+		return false;
+	}
+	return true;
+}
+
+/* Send any nonces due, returning when the next one is */
+static double sim_send(struct sim_board *board, double now)
+{
+	while (board->pend_count) {
+		struct sim_nonce *pend = &board->pending[board->pend_head];
+		unsigned char out[SIM_NONCE_SIZE];
+
+		if (pend->due > now)
+			return pend->due;
+
+		if (!pend->sent && sim_chance(opt_hw_errors)) {
+			pend->nonce ^= 1U << (random() % 32);
+			board->hw_errors++;
+		}
+		/* Big endian, which the driver swaps back on little endian hosts */
+		out[0] = pend->nonce >> 24;
+		out[1] = pend->nonce >> 16;
+		out[2] = pend->nonce >> 8;
+		out[3] = pend->nonce;
+
+		if (!pend->sent && sim_chance(opt_short_reads)) {
+			pend->sent = 1 + random() % (SIM_NONCE_SIZE - 1);
+			pend->due = now + SIM_SHORT_DELAY;
+			board->short_reads++;
+			if (!sim_write(board, out, pend->sent))
+				pend->sent = SIM_NONCE_SIZE;
+			continue;
+		}
+		if (pend->sent < SIM_NONCE_SIZE &&
+		    sim_write(board, out + pend->sent, SIM_NONCE_SIZE - pend->sent))
+			board->nonces++;
+		board->pend_head = (board->pend_head + 1) % SIM_PENDING;
+		board->pend_count--;
+	}
+	return 0;
+}
+
+static void sim_read(struct sim_board *board, double now)
+{
+	ssize_t ret;
+
+	while ((ret = read(board->master, board->buf + board->buflen,
+			   SIM_JOB_SIZE - board->buflen)) > 0) {
+		board->buflen += ret;
+		if (board->buflen == SIM_JOB_SIZE) {
+			sim_job(board, board->buf, now);
+			board->buflen = 0;
+		}
+	}
+}
+
+static void show_stats(double secs)
+{
+	static uint64_t last_nonces, last_hashes;
+	uint64_t jobs = 0, nonces = 0, hw = 0, shorts = 0, dropped = 0, disconnects = 0;
+	double idle = 0;
+	int i, up = 0;
+
+	for (i = 0; i < opt_boards; i++) {
+		struct sim_board *board = &boards[i];
+
+		up += board->master >= 0;
+		jobs += board->jobs;
+		nonces += board->nonces;
+		hw += board->hw_errors;
+		shorts += board->short_reads;
+		dropped += board->dropped;
+		disconnects += board->disconnects;
+		idle += board->idle;
+	}
+	applog(LOG_NOTICE, "Boards %d/%d jobs %"PRIu64" nonces %"PRIu64" (%.1f/s) hw %"PRIu64" short %"PRIu64" dropped %"PRIu64" disconnects %"PRIu64" idle %.1fs",
+	       up, opt_boards, jobs, nonces, (double)(nonces - last_nonces) / secs,
+	       hw, shorts, dropped, disconnects, idle);
+	if (opt_real)
+		applog(LOG_NOTICE, "Hashing at %.2fMH/s", (double)(hashes_done - last_hashes) / secs / 1000000);
+	last_nonces = nonces;
+	last_hashes = hashes_done;
+}
+
+static char *set_debug(bool *flag)
+{
+	*flag = true;
+	opt_log_level = LOG_DEBUG;
+	return NULL;
+}
+
+static char *set_verbose(__maybe_unused void *arg)
+{
+	opt_log_level = LOG_INFO;
+	return NULL;
+}
+
+static char *usage(__maybe_unused void *arg)
+{
+	printf("%s", opt_usage("fpgasim", NULL));
+	exit(0);
+}
+
+static struct opt_table opt_table[] = {
+	OPT_WITH_ARG("--boards",
+		     opt_set_intval, opt_show_intval, &opt_boards,
+		     "Number of boards to simulate"),
+	OPT_WITHOUT_ARG("--debug|-D",
+			set_debug, &opt_debug,
+			"Enable debug output"),
+	OPT_WITH_ARG("--disconnect",
+		     opt_set_intval, opt_show_intval, &opt_disconnect,
+		     "Average seconds between each board disconnecting, 0 for never"),
+	OPT_WITH_ARG("--disconnect-time",
+		     opt_set_intval, opt_show_intval, &opt_disconnect_time,
+		     "Milliseconds a board stays disconnected for"),
+	OPT_WITH_ARG("--hw-errors",
+		     opt_set_floatval, opt_show_floatval, &opt_hw_errors,
+		     "Percentage of nonces to corrupt"),
+	OPT_WITH_ARG("--jitter",
+		     opt_set_intval, opt_show_intval, &opt_jitter,
+		     "Vary the latency by up to this many milliseconds either way"),
+	OPT_WITH_ARG("--latency",
+		     opt_set_intval, opt_show_intval, &opt_latency,
+		     "Milliseconds from a job arriving until the board starts hashing it"),
+	OPT_WITH_ARG("--link-dir",
+		     opt_set_charp, NULL, &opt_link_dir,
+		     "Directory for fpgaN links to each board that stay the same across disconnects"),
+	OPT_WITH_ARG("--nonces",
+		     opt_set_floatval, opt_show_floatval, &opt_nonces,
+		     "Average nonces found per nonce range without --real"),
+	OPT_WITH_ARG("--rate",
+		     opt_set_floatval, opt_show_floatval, &opt_rate,
+		     "Hash rate of each board in MH/s"),
+	OPT_WITHOUT_ARG("--real",
+			opt_set_bool, &opt_real,
+			"Find nonces by Blake-256 hashing each job instead of drawing them at random"),
+	OPT_WITH_ARG("--real-tail",
+		     opt_set_charp, NULL, &opt_real_tail,
+		     "Hex of the 36 header bytes after the nonce to hash with --real, default zeros"),
+	OPT_WITH_ARG("--short-reads",
+		     opt_set_floatval, opt_show_floatval, &opt_short_reads,
+		     "Percentage of nonces to send in two parts"),
+	OPT_WITH_ARG("--stats-interval",
+		     opt_set_intval, opt_show_intval, &opt_stats_interval,
+		     "Seconds between statistics output"),
+	OPT_WITHOUT_ARG("--verbose",
+			set_verbose, NULL,
+			"Log each board connecting and disconnecting"),
+	OPT_WITHOUT_ARG("--help|-h",
+			usage, NULL,
+			"Print this message"),
+	OPT_ENDTABLE
+};
+
+int main(int argc, char *argv[])
+{
+	struct pollfd *pfds;
+	struct sim_board **pboards;
+	struct rlimit rlim;
+	double tv_stats, now;
+	int i;
+
+	opt_register_table(opt_table, NULL);
+	opt_parse(&argc, argv, opt_log_stderr_exit);
+	if (argc != 1)
+		opt_log_stderr_exit("Unexpected extra commandline arguments");
+	if (opt_boards < 1 || opt_rate <= 0 || opt_nonces <= 0 || opt_latency < 0 ||
+	    opt_jitter < 0 || opt_hw_errors < 0 || opt_hw_errors > 100 ||
+	    opt_short_reads < 0 || opt_short_reads > 100 || opt_disconnect < 0 ||
+	    opt_disconnect_time < 0)
+		opt_log_stderr_exit("Invalid option value");
+	if (opt_real_tail && !sim_hex2bin(real_tail, opt_real_tail, SIM_TAIL_SIZE))
+		opt_log_stderr_exit("--real-tail must be %d hex bytes", SIM_TAIL_SIZE);
+
+	/* Two descriptors a board, so lots of boards need more than the default */
+	if (!getrlimit(RLIMIT_NOFILE, &rlim) && rlim.rlim_cur < rlim.rlim_max) {
+		rlim.rlim_cur = rlim.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rlim);
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+	srandom(time(NULL));
+
+	boards = calloc(opt_boards, sizeof(*boards));
+	pfds = calloc(opt_boards, sizeof(*pfds));
+	pboards = calloc(opt_boards, sizeof(*pboards));
+	if (unlikely(!boards || !pfds || !pboards))
+		quit(1, "Failed to calloc boards");
+	for (i = 0; i < opt_boards; i++) {
+		boards[i].id = i;
+		if (!sim_open(&boards[i]))
+			quit(1, "Failed to create board %d, errno %d", i, errno);
+		printf("%s\n", boards[i].name);
+	}
+	fflush(stdout);
+	applog(LOG_NOTICE, "Simulating %d SerialFPGA boards at %.1fMH/s%s", opt_boards,
+	       opt_rate, opt_real ? " hashing each job" : "");
+
+	tv_stats = sim_now();
+	while (42) {
+		double next = 0;
+		bool searching = false;
+		int timeout, nfds = 0;
+
+		now = sim_now();
+		for (i = 0; i < opt_boards; i++) {
+			struct sim_board *board = &boards[i];
+			double due;
+
+			if (board->master < 0) {
+				if (now >= board->down_until)
+					sim_reconnect(board, now);
+				if (board->master < 0) {
+					if (!next || board->down_until < next)
+						next = board->down_until;
+					continue;
+				}
+			}
+			if (opt_disconnect && now >= board->next_disconnect) {
+				sim_disconnect(board, now);
+				continue;
+			}
+
+			if (opt_real)
+				searching |= sim_search(board);
+			else
+				sim_draw(board);
+			due = sim_send(board, now);
+			if (due && (!next || due < next))
+				next = due;
+			if (opt_disconnect && (!next || board->next_disconnect < next))
+				next = board->next_disconnect;
+
+			pfds[nfds].fd = board->master;
+			pfds[nfds].events = POLLIN;
+			pboards[nfds++] = board;
+		}
+
+		if (searching)
+			timeout = 0;
+		else {
+			timeout = opt_stats_interval ? opt_stats_interval * 1000 : 1000;
+			if (next && (next - now) * 1000 < timeout)
+				timeout = next > now ? ceil((next - now) * 1000) : 0;
+		}
+		if (poll(pfds, nfds, timeout) > 0) {
+			now = sim_now();
+			for (i = 0; i < nfds; i++) {
+				if (pfds[i].revents & POLLIN)
+					sim_read(pboards[i], now);
+			}
+		}
+
+		now = sim_now();
+		if (opt_stats_interval && now - tv_stats >= opt_stats_interval) {
+			show_stats(now - tv_stats);
+			tv_stats = now;
+		}
+	}
+	return 0;
+}
@@ -13,6 +13,8 @@
 
 #include <sys/types.h>
 #include <dirent.h>
+#include <limits.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "miner.h"
@@ -147,6 +149,342 @@ int _serial_detect(struct device_drv *drv, detectone_func_t detectone, autoscan_
 	return found;
 }
 
+/* Most ports probed at once by serial_detect_parallel */
+#define SERIAL_DETECT_THREADS 16
+
+/* Each port a driver found, kept in --serial-inventory across restarts */
+struct serial_inventory {
+	char dname[32];
+	char devpath[PATH_MAX];
+	char ident[SERIAL_IDENT_SIZE];
+	char serial[SERIAL_IDENT_SIZE];
+	char settings[SERIAL_SETTINGS_SIZE];
+};
+
+static struct serial_inventory *inventory;
+static int inventory_count;
+static bool inventory_loaded;
+static pthread_mutex_t inventory_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Copy the next tab separated field of a line, returning where the next starts */
+static char *inventory_field(char *dst, size_t dstsiz, char *s)
+{
+	char *tab;
+	size_t len;
+
+	if (!s)
+		return NULL;
+	tab = strpbrk(s, "\t\r\n");
+	len = tab ? (size_t)(tab - s) : strlen(s);
+	if (len >= dstsiz)
+		len = dstsiz - 1;
+	memcpy(dst, s, len);
+	dst[len] = '\0';
+	return (tab && *tab == '\t') ? tab + 1 : NULL;
+}
+
+/* Must be called with inventory_lock held */
+static void inventory_load(void)
+{
+	char line[sizeof(struct serial_inventory) + 8];
+	FILE *fp;
+
+	inventory_loaded = true;
+	if (!opt_serial_inventory)
+		return;
+	fp = fopen(opt_serial_inventory, "r");
+	if (!fp)
+		return;
+	while (fgets(line, sizeof(line), fp)) {
+		struct serial_inventory entry;
+		char *s = line;
+
+		memset(&entry, 0, sizeof(entry));
+		s = inventory_field(entry.dname, sizeof(entry.dname), s);
+		s = inventory_field(entry.devpath, sizeof(entry.devpath), s);
+		s = inventory_field(entry.ident, sizeof(entry.ident), s);
+		s = inventory_field(entry.serial, sizeof(entry.serial), s);
+		inventory_field(entry.settings, sizeof(entry.settings), s);
+		if (!*entry.dname || !*entry.devpath || !*entry.ident)
+			continue;
+
+		inventory = realloc(inventory, sizeof(*inventory) * (inventory_count + 1));
+		if (unlikely(!inventory))
+			quit(1, "Failed to realloc serial inventory");
+		inventory[inventory_count++] = entry;
+	}
+	fclose(fp);
+	applog(LOG_DEBUG, "Loaded %d serial inventory entries from %s",
+	       inventory_count, opt_serial_inventory);
+}
+
+/* Must be called with inventory_lock held */
+static void inventory_save(void)
+{
+	char tmpname[PATH_MAX];
+	FILE *fp;
+	int i;
+
+	if (!opt_serial_inventory)
+		return;
+	snprintf(tmpname, sizeof(tmpname), "%s.tmp", opt_serial_inventory);
+	fp = fopen(tmpname, "w");
+	if (!fp) {
+		applog(LOG_ERR, "Failed to write serial inventory %s", tmpname);
+		return;
+	}
+	for (i = 0; i < inventory_count; i++) {
+		fprintf(fp, "%s\t%s\t%s\t%s\t%s\n", inventory[i].dname,
+			inventory[i].devpath, inventory[i].ident,
+			inventory[i].serial, inventory[i].settings);
+	}
+	fclose(fp);
+#ifdef WIN32
+	remove(opt_serial_inventory);
+#endif
+	if (rename(tmpname, opt_serial_inventory))
+		applog(LOG_ERR, "Failed to replace serial inventory %s", opt_serial_inventory);
+}
+
+/* Must be called with inventory_lock held */
+static struct serial_inventory *inventory_find(struct device_drv *drv, const char *devpath)
+{
+	int i;
+
+	for (i = 0; i < inventory_count; i++) {
+		if (!strcmp(inventory[i].dname, drv->dname) &&
+		    !strcmp(inventory[i].devpath, devpath))
+			return &inventory[i];
+	}
+	return NULL;
+}
+
+/* Must be called with inventory_lock held */
+static void inventory_remove(struct serial_inventory *entry)
+{
+	int i = entry - inventory;
+
+	memmove(entry, entry + 1, sizeof(*inventory) * (inventory_count - i - 1));
+	inventory_count--;
+}
+
+/* Save a driver's own settings for a port it found, to be handed back to it in
+ * serial_probe.settings when the port is unchanged on the next start */
+void serial_inventory_update(struct device_drv *drv, const char *devpath, const char *settings)
+{
+	struct serial_inventory *entry;
+	int cancelstate;
+
+	/* Mining threads are cancelled on shutdown, which mustn't happen mid write */
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &cancelstate);
+	mutex_lock(&inventory_lock);
+	entry = inventory_find(drv, devpath);
+	if (entry && strcmp(entry->settings, settings)) {
+		snprintf(entry->settings, sizeof(entry->settings), "%s", settings);
+		inventory_save();
+	}
+	mutex_unlock(&inventory_lock);
+	pthread_setcancelstate(cancelstate, NULL);
+}
+
+/* What identifies the device behind a port, so a port that was unplugged or
+ * recreated since the inventory was saved is probed again */
+static void serial_ident(struct serial_probe *probe)
+{
+#ifndef WIN32
+	struct stat st;
+
+	if (stat(probe->devpath, &st))
+		return;
+	snprintf(probe->ident, sizeof(probe->ident), "%lx:%lx",
+		 (unsigned long)st.st_rdev, (unsigned long)st.st_ctime);
+#endif
+#ifdef __linux
+	{
+		char path[PATH_MAX], dir[PATH_MAX], *name;
+		int depth;
+		FILE *fp;
+
+		if (!realpath(probe->devpath, path) || !(name = strrchr(path, '/')))
+			return;
+		snprintf(dir, sizeof(dir), "/sys/class/tty/%s/device", name + 1);
+		if (!realpath(dir, path))
+			return;
+		/* The tty's USB device, a few levels up, has the serial number */
+		for (depth = 0; depth < 4 && (name = strrchr(path, '/')); depth++) {
+			snprintf(dir, sizeof(dir), "%s/serial", path);
+			fp = fopen(dir, "r");
+			if (fp) {
+				inventory_field(probe->serial, sizeof(probe->serial),
+						fgets(dir, sizeof(dir), fp));
+				fclose(fp);
+				break;
+			}
+			*name = '\0';
+		}
+	}
+#endif
+}
+
+struct serial_detect_pool {
+	struct serial_probe *probes;
+	int count;
+	int next;
+	probeone_func_t probeone;
+	pthread_mutex_t lock;
+};
+
+static void *serial_probe_thread(void *userdata)
+{
+	struct serial_detect_pool *pool = (struct serial_detect_pool *)userdata;
+	int i;
+
+	RenameThread("SerialDetect");
+
+	while (42) {
+		mutex_lock(&pool->lock);
+		do {
+			i = pool->next++;
+		} while (i < pool->count && pool->probes[i].cached);
+		mutex_unlock(&pool->lock);
+		if (i >= pool->count)
+			break;
+		pool->probes[i].found = pool->probeone(&pool->probes[i]);
+	}
+	return NULL;
+}
+
+/* As _serial_detect without autoscan, but probing the ports given from a pool
+ * of threads, and not at all if --serial-inventory has them unchanged since
+ * they were last found. The ports are still added in the order given */
+int serial_detect_parallel(struct device_drv *drv, probeone_func_t probeone, addone_func_t addone)
+{
+	struct serial_detect_pool pool;
+	struct string_elist *iter, *tmp, **iters;
+	pthread_t pth[SERIAL_DETECT_THREADS];
+	const char *dev, *colon;
+	int i, threads, cached = 0, found = 0;
+	size_t namel = strlen(drv->name);
+	size_t dnamel = strlen(drv->dname);
+	bool changed = false;
+
+	memset(&pool, 0, sizeof(pool));
+	iters = NULL;
+	list_for_each_entry_safe(iter, tmp, &scan_devices, list) {
+		dev = iter->string;
+		if ((colon = strchr(dev, ':')) && colon[1] != '\0') {
+			size_t idlen = colon - dev;
+
+			// allow either name:device or dname:device
+			if ((idlen != namel || strncasecmp(dev, drv->name, idlen))
+			&&  (idlen != dnamel || strncasecmp(dev, drv->dname, idlen)))
+				continue;
+
+			dev = colon + 1;
+		}
+		if (!strcmp(dev, "auto") || !strcmp(dev, "noauto"))
+			continue;
+
+		pool.probes = realloc(pool.probes, sizeof(*pool.probes) * (pool.count + 1));
+		iters = realloc(iters, sizeof(*iters) * (pool.count + 1));
+		if (unlikely(!pool.probes || !iters))
+			quit(1, "Failed to realloc serial probes");
+		memset(&pool.probes[pool.count], 0, sizeof(*pool.probes));
+		pool.probes[pool.count].devpath = dev;
+		iters[pool.count++] = iter;
+	}
+	if (!pool.count)
+		return 0;
+
+	mutex_lock(&inventory_lock);
+	if (!inventory_loaded)
+		inventory_load();
+	for (i = 0; i < pool.count; i++) {
+		struct serial_probe *probe = &pool.probes[i];
+		struct serial_inventory *entry;
+
+		serial_ident(probe);
+		entry = inventory_find(drv, probe->devpath);
+		if (!entry)
+			continue;
+		if (*probe->ident && !strcmp(entry->ident, probe->ident) &&
+		    !strcmp(entry->serial, probe->serial)) {
+			strcpy(probe->settings, entry->settings);
+			probe->cached = probe->found = true;
+			cached++;
+		}
+	}
+	mutex_unlock(&inventory_lock);
+
+	threads = pool.count - cached;
+	if (threads > SERIAL_DETECT_THREADS)
+		threads = SERIAL_DETECT_THREADS;
+	applog(LOG_DEBUG, "%s: probing %d ports from %d threads, %d unchanged in the inventory",
+	       drv->dname, pool.count - cached, threads, cached);
+
+	pool.probeone = probeone;
+	mutex_init(&pool.lock);
+	for (i = 0; i < threads; i++) {
+		if (unlikely(pthread_create(&pth[i], NULL, serial_probe_thread, &pool)))
+			quit(1, "Failed to create serial detect thread");
+	}
+	for (i = 0; i < threads; i++)
+		pthread_join(pth[i], NULL);
+	mutex_destroy(&pool.lock);
+
+	for (i = 0; i < pool.count; i++) {
+		struct serial_probe *probe = &pool.probes[i];
+
+		if (probe->found && !addone(probe))
+			probe->found = false;
+		if (probe->found)
+			found++;
+	}
+
+	mutex_lock(&inventory_lock);
+	for (i = 0; i < pool.count; i++) {
+		struct serial_probe *probe = &pool.probes[i];
+		struct serial_inventory *entry;
+
+		entry = inventory_find(drv, probe->devpath);
+		if (!probe->found) {
+			if (entry) {
+				inventory_remove(entry);
+				changed = true;
+			}
+			continue;
+		}
+		if (probe->cached)
+			continue;
+		if (!entry) {
+			inventory = realloc(inventory, sizeof(*inventory) * (inventory_count + 1));
+			if (unlikely(!inventory))
+				quit(1, "Failed to realloc serial inventory");
+			entry = &inventory[inventory_count++];
+			memset(entry, 0, sizeof(*entry));
+			snprintf(entry->dname, sizeof(entry->dname), "%s", drv->dname);
+			snprintf(entry->devpath, sizeof(entry->devpath), "%s", probe->devpath);
+		}
+		strcpy(entry->ident, probe->ident);
+		strcpy(entry->serial, probe->serial);
+		strcpy(entry->settings, probe->settings);
+		changed = true;
+	}
+	if (changed)
+		inventory_save();
+	mutex_unlock(&inventory_lock);
+
+	/* Last, as this frees the devpaths */
+	for (i = 0; i < pool.count; i++) {
+		if (pool.probes[i].found)
+			string_elist_del(iters[i]);
+	}
+	free(iters);
+	free(pool.probes);
+
+	return found;
+}
+
 // This code is purely for debugging but is very useful for that
 // It also took quite a bit of effort so I left it in
 // #define TERMIOS_DEBUG 1
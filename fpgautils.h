@@ -23,6 +23,26 @@ extern int _serial_detect(struct device_drv *drv, detectone_func_t, autoscan_fun
 	_serial_detect(drv, detectone, autoscan, false)
 #define serial_detect(drv, detectone)  \
 	_serial_detect(drv, detectone, NULL, false)
+#define SERIAL_IDENT_SIZE 64
+#define SERIAL_SETTINGS_SIZE 128
+
+/* A port being detected in parallel. probeone is called from several threads
+ * at once for different ports and must only look at the port itself, then
+ * addone is called one port at a time in scan order for each port found */
+struct serial_probe {
+	const char *devpath;
+	char ident[SERIAL_IDENT_SIZE];		/* changes if the port is recreated */
+	char serial[SERIAL_IDENT_SIZE];		/* USB serial number, if any */
+	char settings[SERIAL_SETTINGS_SIZE];	/* the driver's own, kept in the inventory */
+	bool cached;				/* unchanged in the inventory so not probed */
+	bool found;
+};
+
+typedef bool(*probeone_func_t)(struct serial_probe *);
+typedef bool(*addone_func_t)(struct serial_probe *);
+
+extern int serial_detect_parallel(struct device_drv *drv, probeone_func_t, addone_func_t);
+extern void serial_inventory_update(struct device_drv *drv, const char *devpath, const char *settings);
 extern int serial_autodetect_devserial(detectone_func_t, const char *prodname);
 extern int serial_autodetect_udev(detectone_func_t, const char *prodname);
 
@@ -49,6 +49,8 @@
 //* Capability index for multi FPGA support.
 #define CAPABILITY_MULTI_FPGA 0,7
 
+static void libztex_freeRead(struct libztex_device *ztex);
+
 static int libztex_get_string_descriptor_ascii(libusb_device_handle *dev, uint8_t desc_index,
 		unsigned char *data, int length)
 {
@@ -491,16 +493,58 @@ static int libztex_configureFpgaLS(struct libztex_device *ztex, const char* firm
 	return 0;
 }
 
+/* FNV-1a over the bitstream file, so an FPGA still holding it can be told
+ * apart from one holding another bitstream of the same size */
+static int libztex_bitstreamFingerprint(struct libztex_device *ztex, const char *firmware)
+{
+	unsigned char buf[65536];
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	uint32_t bytes = 0;
+	size_t i, length;
+	FILE *fp;
+
+	fp = open_bitstream("ztex", firmware);
+	if (!fp)
+		return -2;
+	while ((length = fread(buf, 1, sizeof(buf), fp)) > 0) {
+		for (i = 0; i < length; i++) {
+			hash ^= buf[i];
+			hash *= 0x100000001b3ULL;
+		}
+		bytes += length;
+	}
+	fclose(fp);
+
+	ztex->bitFingerprint = hash ^ bytes;
+	ztex->bitBytes = bytes;
+	return 0;
+}
+
 int libztex_configureFpga(struct libztex_device *ztex)
 {
+	struct libztex_fpgastate state;
 	char buf[256];
 	int rv;
 
 	strcpy(buf, ztex->bitFileName);
 	strcat(buf, ".bit");
+
+	/* Skip the upload if the FPGA is still configured with the bitstream we
+	 * last recorded uploading to it. The firmware's byte count, when it
+	 * keeps one, must match too */
+	if (ztex->bitFingerprint == 0)
+		libztex_bitstreamFingerprint(ztex, buf);
+	if (ztex->bitFingerprint != 0 && ztex->configuredFingerprint == ztex->bitFingerprint &&
+	    libztex_getFpgaState(ztex, &state) == 0 && state.fpgaConfigured &&
+	    (state.fpgaBytes == 0 || state.fpgaBytes == ztex->bitBytes)) {
+		applog(LOG_INFO, "%s: FPGA already configured with %s, skipping upload", ztex->repr, buf);
+		return 0;
+	}
+
 	rv = libztex_configureFpgaHS(ztex, buf, true, 2);
 	if (rv != 0)
 		rv = libztex_configureFpgaLS(ztex, buf, true, 2);
+	ztex->configuredFingerprint = rv == 0 ? ztex->bitFingerprint : 0;
 	return rv;
 }
 
@@ -696,7 +740,7 @@ int libztex_prepare_device(struct libusb_device *dev, struct libztex_device** zt
 		applog(LOG_WARNING, "HASHES_PER_CLOCK not defined, assuming %0.2f", newdev->hashesPerClock);
 	}
 
-	for (cnt=0; cnt < 255; cnt++) {
+	for (cnt=0; cnt < 256; cnt++) {
 		newdev->errorCount[cnt] = 0;
 		newdev->errorWeight[cnt] = 0;
 		newdev->errorRate[cnt] = 0;
@@ -706,6 +750,15 @@ int libztex_prepare_device(struct libusb_device *dev, struct libztex_device** zt
 	// fake that the last round found something valid
 	newdev->nonceCheckValid = 1;
 
+	newdev->read = NULL;
+	newdev->goldenPerHash = LIBZTEX_GOLDEN_PER_HASH;
+	newdev->board = NULL;
+	newdev->profileLoaded = false;
+	newdev->profileSaved = 0;
+	newdev->bitFingerprint = 0;
+	newdev->bitBytes = 0;
+	newdev->configuredFingerprint = 0;
+
 	newdev->usbbus = libusb_get_bus_number(dev);
 	newdev->usbaddress = libusb_get_device_address(dev);
 	sprintf(newdev->repr, "ZTEX %s-1", newdev->snString);
@@ -714,6 +767,7 @@ int libztex_prepare_device(struct libusb_device *dev, struct libztex_device** zt
 
 void libztex_destroy_device(struct libztex_device* ztex)
 {
+	libztex_freeRead(ztex);
 	if (ztex->hndl != NULL) {
 		libusb_close(ztex->hndl);
 		ztex->hndl = NULL;
@@ -849,17 +903,32 @@ int libztex_sendHashData(struct libztex_device *ztex, unsigned char *sendbuf)
 	return cnt;
 }
 
+static void libztex_decodeHashData(struct libztex_device *ztex, unsigned char *rbuf, struct libztex_hash_data *nonces)
+{
+	memcpy((char*)&nonces->goldenNonce[0], &rbuf[0], 4);
+	memcpy((char*)&nonces->nonce,          &rbuf[4], 4);
+	memcpy((char*)&nonces->hash7,          &rbuf[8], 4);
+	memcpy((char*)&nonces->goldenNonce[1], &rbuf[12], 4);
+
+	nonces->nonce = htole32(nonces->nonce);
+	nonces->hash7 = htole32(nonces->hash7);
+	nonces->goldenNonce[0] = htole32(nonces->goldenNonce[0]);
+	nonces->goldenNonce[1] = htole32(nonces->goldenNonce[1]);
+
+	applog(LOG_DEBUG, "%s: GN1: %08X, N: %08X, H: %08X, GN2: %08X", ztex->repr, nonces->goldenNonce[0], nonces->nonce, nonces->hash7, nonces->goldenNonce[1]);
+}
+
 int libztex_readHashData(struct libztex_device *ztex, struct libztex_hash_data *nonces)
 {
-	unsigned char rbuf[16];		// Stores GN1, Nonce, Hash, GN2
-	int ret = 16;
+	unsigned char rbuf[LIBZTEX_HASHDATA_LEN];	// Stores GN1, Nonce, Hash, GN2
+	int ret = LIBZTEX_HASHDATA_LEN;
 	int cnt = 0, len = 0;
 
 	if (ztex->hndl == NULL)
 		return 0;
 
 	while (ret > 0) {
-		cnt = libusb_control_transfer(ztex->hndl, 0xc0, 0x81, 0, 0, rbuf + len, ret, 1000);
+		cnt = libusb_control_transfer(ztex->hndl, 0xc0, 0x81, 0, 0, rbuf + len, ret, LIBZTEX_READ_TIMEOUT);
 		if (cnt >= 0) {
 			ret -= cnt;
 			len += cnt;
@@ -872,19 +941,165 @@ int libztex_readHashData(struct libztex_device *ztex, struct libztex_hash_data *
 		return cnt;
 	}
 
-	memcpy((char*)&nonces->goldenNonce[0], &rbuf[0], 4);
-	memcpy((char*)&nonces->nonce,          &rbuf[4], 4);
-	memcpy((char*)&nonces->hash7,          &rbuf[8], 4);
-	memcpy((char*)&nonces->goldenNonce[1], &rbuf[12], 4);
+	libztex_decodeHashData(ztex, rbuf, nonces);
+	return cnt;
+}
 
-	nonces->nonce = htole32(nonces->nonce);
-	nonces->hash7 = htole32(nonces->hash7);
-	nonces->goldenNonce[0] = htole32(nonces->goldenNonce[0]);
-	nonces->goldenNonce[1] = htole32(nonces->goldenNonce[0]);
+/* Nothing else may be handling libusb events for us (the usbutils poll thread
+ * only exists with usbutils drivers built in) so asynchronous reads get their
+ * own event thread, started with the first one. Two threads handling events
+ * is fine since libusb serialises them */
+static pthread_once_t libztex_events_once = PTHREAD_ONCE_INIT;
 
-	applog(LOG_DEBUG, "%s: GN1: %08X, N: %08X, H: %08X, GN2: %08X", ztex->repr, nonces->goldenNonce[0], nonces->nonce, nonces->hash7, nonces->goldenNonce[1]);
-	
-	return cnt;
+static void *libztex_events(void __maybe_unused *arg)
+{
+	struct timeval tv_timeout = { 0, 100000 };
+
+	RenameThread("ZtexEvents");
+
+	while (42)
+		libusb_handle_events_timeout_completed(NULL, &tv_timeout, NULL);
+	return NULL;
+}
+
+static void libztex_start_events(void)
+{
+	pthread_t pth;
+
+	if (unlikely(pthread_create(&pth, NULL, libztex_events, NULL)))
+		quit(1, "Failed to create ztex events thread");
+	pthread_detach(pth);
+}
+
+static void LIBUSB_CALL libztex_read_callback(struct libusb_transfer *transfer)
+{
+	struct libztex_read *rd = transfer->user_data;
+
+#ifndef WIN32
+	cgwake_signal(&rd->wake);
+#endif
+	cgsem_post(&rd->done);
+}
+
+/* Starts a readHashData without waiting for it so reads on several boards can
+ * be in flight at once. Every successful submit must be followed by exactly
+ * one libztex_collectReadHashData */
+int libztex_submitReadHashData(struct libztex_device *ztex)
+{
+	struct libztex_read *rd;
+	int err;
+
+	if (ztex->hndl == NULL)
+		return LIBUSB_ERROR_NO_DEVICE;
+
+	rd = ztex->read;
+	if (rd == NULL) {
+		rd = calloc(1, sizeof(*rd));
+		if (unlikely(!rd))
+			quit(1, "Failed to calloc libztex_read");
+		rd->transfer = libusb_alloc_transfer(0);
+		if (unlikely(!rd->transfer))
+			quit(1, "Failed to libusb_alloc_transfer in libztex_submitReadHashData");
+		cgsem_init(&rd->done);
+#ifndef WIN32
+		cgwake_init(&rd->wake);
+#endif
+		ztex->read = rd;
+		pthread_once(&libztex_events_once, libztex_start_events);
+	}
+
+	libusb_fill_control_setup(rd->buf, 0xc0, 0x81, 0, 0, LIBZTEX_HASHDATA_LEN);
+	libusb_fill_control_transfer(rd->transfer, ztex->hndl, rd->buf, libztex_read_callback, rd, LIBZTEX_READ_TIMEOUT);
+	err = libusb_submit_transfer(rd->transfer);
+	if (unlikely(err)) {
+		applog(LOG_ERR, "%s: Failed to submit readHashData with err %d", ztex->repr, err);
+		return err;
+	}
+	rd->pending = true;
+	return 0;
+}
+
+#ifndef WIN32
+/* Readable once the read in flight has completed */
+int libztex_readFd(struct libztex_device *ztex)
+{
+	return ztex->read->wake.rfd;
+}
+#endif
+
+void libztex_cancelReadHashData(struct libztex_device *ztex)
+{
+	if (ztex->read != NULL && ztex->read->pending)
+		libusb_cancel_transfer(ztex->read->transfer);
+}
+
+/* Waits for the submitted read to complete or be cancelled, returning the
+ * number of bytes read like libztex_readHashData */
+int libztex_collectReadHashData(struct libztex_device *ztex, struct libztex_hash_data *nonces)
+{
+	struct libztex_read *rd = ztex->read;
+	struct libusb_transfer *transfer;
+	int err;
+
+	if (rd == NULL || !rd->pending)
+		return LIBUSB_ERROR_NOT_FOUND;
+
+	cgsem_wait(&rd->done);
+	rd->pending = false;
+#ifndef WIN32
+	cgwake_clear(&rd->wake);
+#endif
+
+	transfer = rd->transfer;
+	switch (transfer->status) {
+		case LIBUSB_TRANSFER_COMPLETED:
+			err = transfer->actual_length < LIBZTEX_HASHDATA_LEN ? LIBUSB_ERROR_IO : 0;
+			break;
+		case LIBUSB_TRANSFER_CANCELLED:
+			return LIBUSB_ERROR_INTERRUPTED;
+		case LIBUSB_TRANSFER_TIMED_OUT:
+			err = LIBUSB_ERROR_TIMEOUT;
+			break;
+		case LIBUSB_TRANSFER_STALL:
+			err = LIBUSB_ERROR_PIPE;
+			break;
+		case LIBUSB_TRANSFER_NO_DEVICE:
+			err = LIBUSB_ERROR_NO_DEVICE;
+			break;
+		case LIBUSB_TRANSFER_OVERFLOW:
+			err = LIBUSB_ERROR_OVERFLOW;
+			break;
+		default:
+			err = LIBUSB_ERROR_IO;
+			break;
+	}
+	if (unlikely(err)) {
+		applog(LOG_ERR, "%s: Failed readHashData with err %d", ztex->repr, err);
+		return err;
+	}
+
+	libztex_decodeHashData(ztex, libusb_control_transfer_get_data(transfer), nonces);
+	return transfer->actual_length;
+}
+
+static void libztex_freeRead(struct libztex_device *ztex)
+{
+	struct libztex_read *rd = ztex->read;
+	struct libztex_hash_data nonces;
+
+	if (rd == NULL)
+		return;
+	if (rd->pending) {
+		libusb_cancel_transfer(rd->transfer);
+		libztex_collectReadHashData(ztex, &nonces);
+	}
+	libusb_free_transfer(rd->transfer);
+	cgsem_destroy(&rd->done);
+#ifndef WIN32
+	cgwake_destroy(&rd->wake);
+#endif
+	free(rd);
+	ztex->read = NULL;
 }
 
 void libztex_freeDevList(struct libztex_dev_list **devs)
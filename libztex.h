@@ -34,6 +34,11 @@
 #define LIBZTEX_ERRORHYSTERESIS 0.1
 #define LIBZTEX_OVERHEATTHRESHOLD 0.4
 
+#define LIBZTEX_HASHDATA_LEN 16
+#define LIBZTEX_READ_TIMEOUT 1000
+// Golden nonces are diff 1 Blake-256 shares
+#define LIBZTEX_GOLDEN_PER_HASH (1.0 / 16777216.0)
+
 struct libztex_fpgastate {
 	bool fpgaConfigured;
 	unsigned char fpgaChecksum;
@@ -43,6 +48,18 @@ struct libztex_fpgastate {
 	bool fpgaFlashBitSwap;
 };
 
+struct ztex_board;
+
+struct libztex_read {
+	struct libusb_transfer *transfer;
+	cgsem_t done;
+#ifndef WIN32
+	cgwake_t wake;
+#endif
+	bool pending;
+	unsigned char buf[LIBUSB_CONTROL_SETUP_SIZE + LIBZTEX_HASHDATA_LEN];
+};
+
 struct libztex_device {
 	pthread_mutex_t	mutex;
 	struct libztex_device *root;
@@ -64,6 +81,9 @@ struct libztex_device {
 	uint8_t freqMaxM;
 	uint8_t freqMDefault;
 	char* bitFileName;
+	uint64_t bitFingerprint;
+	uint32_t bitBytes;
+	uint64_t configuredFingerprint;
 	bool suspendSupported;
 	double hashesPerClock;
 	uint8_t extraSolutions;
@@ -75,9 +95,16 @@ struct libztex_device {
 
 	int16_t nonceCheckValid;
 
+	struct libztex_read *read;
+	double goldenPerHash;
+
+	bool profileLoaded;
+	time_t profileSaved;
+
 	int16_t numberOfFpgas;
 	int selectedFpga;
 	bool parallelConfigSupport;
+	struct ztex_board *board;
 	
 	char repr[20];
 };
@@ -101,6 +128,12 @@ extern int libztex_configureFpga (struct libztex_device *dev);
 extern int libztex_setFreq (struct libztex_device *ztex, uint16_t freq);
 extern int libztex_sendHashData (struct libztex_device *ztex, unsigned char *sendbuf);
 extern int libztex_readHashData (struct libztex_device *ztex, struct libztex_hash_data *nonces);
+extern int libztex_submitReadHashData (struct libztex_device *ztex);
+#ifndef WIN32
+extern int libztex_readFd (struct libztex_device *ztex);
+#endif
+extern void libztex_cancelReadHashData (struct libztex_device *ztex);
+extern int libztex_collectReadHashData (struct libztex_device *ztex, struct libztex_hash_data *nonces);
 extern int libztex_resetFpga (struct libztex_device *ztex);
 extern int libztex_selectFpga(struct libztex_device *ztex);
 extern int libztex_numberOfFpgas(struct libztex_device *ztex);
@@ -476,9 +476,9 @@ struct cgpu_info {
 	char *name;
 	char *device_path;
 	void *device_data;
-#ifdef USE_ZTEX
+	/* Not under USE_ZTEX, which cgminer.c defines for itself, so the layout
+	 * is the same in the separately compiled drivers */
 	struct libztex_device *device_ztex;
-#endif
 #ifdef USE_USBUTILS
 	struct cg_usb_device *usbdev;
 #endif
@@ -514,6 +514,7 @@ struct cgpu_info {
 	int accepted;
 	int rejected;
 	int hw_errors;
+	int dup_nonces;
 	double rolling;
 	double total_mhashes;
 	double utility;
@@ -590,6 +591,16 @@ struct cgpu_info {
 
 	struct cgminer_stats cgminer_stats;
 
+	/* Fingerprints of nonces already returned by this device */
+	pthread_mutex_t nonce_lock;
+	uint64_t *nonce_filter;
+	unsigned int nonce_filter_block;
+
+	/* Time from a restarting notify arriving to this device being handed
+	 * work from it, and the restart last recorded. Under lat_lock */
+	struct latency_hist job_latency;
+	unsigned int job_restart;
+
 	pthread_rwlock_t qlock;
 	struct work *queued_work;
 	struct work *unqueued_work;
@@ -630,6 +641,10 @@ struct thr_info {
 
 	bool	work_restart;
 	bool	work_update;
+#ifndef WIN32
+	/* Signalled along with work_restart for drivers to poll on */
+	cgwake_t restart_wake;
+#endif
 };
 
 struct string_elist {
@@ -1054,6 +1069,10 @@ extern bool opt_nogpu;
 extern char *opt_icarus_options;
 extern char *opt_icarus_timing;
 extern char *opt_ztex_clock;
+extern char *opt_ztex_profiles;
+extern char *opt_serial_inventory;
+extern char *opt_serial_fpga_scantime;
+extern int opt_serial_fpga_engine;
 extern bool opt_worktime;
 #ifdef USE_AVALON
 extern char *opt_avalon_options;
@@ -1066,6 +1085,9 @@ extern char *opt_klondike_options;
 extern char *opt_usb_select;
 extern int opt_usbdump;
 extern bool opt_usb_list_all;
+extern char *opt_usb_emulate;
+extern int opt_usb_emulate_latency;
+extern char *opt_usb_record;
 extern cgsem_t usb_resource_sem;
 #endif
 #ifdef USE_BITFORCE
@@ -1084,11 +1106,17 @@ extern const uint32_t sha256_init_state[];
 extern json_t *json_rpc_call(CURL *curl, const char *url, const char *cert,
 			     const char *userpass, const char *rpc_req, bool,
 			     bool, int *, struct pool *pool, bool);
+typedef void (*json_rpc_cb)(json_t *val, int rolltime, void *userdata);
+extern void json_rpc_async(const char *url, const char *cert,
+			   const char *userpass, const char *rpc_req, bool,
+			   bool, struct pool *pool, bool, json_rpc_cb cb,
+			   void *userdata);
 #endif
 extern const char *proxytype(proxytypes_t proxytype);
 extern char *get_proxy(char *url, struct pool *pool);
-extern void __bin2hex(char *s, const unsigned char *p, size_t len);
+extern size_t __bin2hex(char *s, const unsigned char *p, size_t len);
 extern char *bin2hex(const unsigned char *p, size_t len);
+extern size_t __hex2bin(unsigned char *p, const char *hexstr, size_t len);
 extern bool hex2bin(unsigned char *p, const char *hexstr, size_t len);
 
 typedef bool (*sha256_func)(struct thr_info*, const unsigned char *pmidstate,
@@ -1120,10 +1148,12 @@ extern pthread_rwlock_t devices_lock;
 
 extern pthread_mutex_t restart_lock;
 extern pthread_cond_t restart_cond;
+extern pthread_mutex_t lat_lock;
 
 extern void clear_stratum_shares(struct pool *pool);
 extern void set_target(unsigned char *dest_target, double diff);
 extern int restart_wait(struct thr_info *thr, unsigned int mstime);
+extern int restart_poll(struct thr_info *thr, int fd, unsigned int mstime);
 
 extern void kill_work(void);
 
@@ -1259,12 +1289,6 @@ typedef struct {
 } dev_blk_ctx;
 #endif
 
-struct curl_ent {
-	CURL *curl;
-	struct list_head node;
-	struct timeval tv;
-};
-
 /* Disabled needs to be the lowest enum as a freshly calloced value will then
  * equal disabled */
 enum pool_enable {
@@ -1273,19 +1297,33 @@ enum pool_enable {
 	POOL_REJECTING,
 };
 
+/* Stages between a stratum notify arriving and devices being restarted,
+ * each timed from the moment the notify was received */
+enum latency_stage {
+	LAT_PARSE,	/* Notify parsed into the pool's stratum work */
+	LAT_DETECT,	/* A work restart decided on */
+	LAT_DISCARD,	/* Stale staged work discarded */
+	LAT_FLUSH,	/* Device queues and driver work flushed */
+	LAT_WAKE,	/* Threads waiting on restart_cond woken */
+	LAT_STAGES
+};
+
 struct stratum_work {
+	/* Buffers are reused across notifies and only grown, the _size
+	 * members hold their allocated sizes */
 	char *job_id;
-	char *prev_hash;
-	unsigned char **merkle_bin;
-	char *bbversion;
-	char *nbit;
+	size_t job_id_size;
+	unsigned char (*merkle_bin)[32];
+	int merkle_size;
 	char *ntime;
+	size_t ntime_size;
 	bool clean;
 
 	size_t cb_len;
-	size_t header_len;
 	int merkles;
 	double diff;
+
+	int64_t us_notify;
 };
 
 #define RBUFSIZE 8192
@@ -1297,6 +1335,7 @@ struct pool {
 	int accepted, rejected;
 	int seq_rejects;
 	int seq_getfails;
+	struct timeval tv_getfail;
 	int solved;
 	int diff1;
 	char diff[8];
@@ -1323,6 +1362,10 @@ struct pool {
 
 	unsigned int getwork_requested;
 	unsigned int stale_shares;
+	unsigned int dup_nonces;
+
+	/* Notify to restart latencies, under lat_lock */
+	struct latency_hist latency[LAT_STAGES];
 	unsigned int discarded_work;
 	unsigned int getfail_occasions;
 	unsigned int remotefail_occasions;
@@ -1349,10 +1392,6 @@ struct pool {
 	pthread_t test_thread;
 	bool testing;
 
-	int curls;
-	pthread_cond_t cr_cond;
-	struct list_head curlring;
-
 	time_t last_share_time;
 	double last_share_diff;
 	uint64_t best_diff;
@@ -1370,6 +1409,10 @@ struct pool {
 	SOCKETTYPE sock;
 	char *sockbuf;
 	size_t sockbuf_size;
+	size_t sockbuf_head; /* First byte not yet handed out by recv_line */
+	size_t sockbuf_tail; /* End of received data */
+	size_t sockbuf_scan; /* Searched for \n up to here */
+	int64_t us_recv; /* cgtimer_us when recv_line last returned a line */
 	char *sockaddr_url; /* stripped url used for sockaddr */
 	char *sockaddr_proxy_url;
 	char *sockaddr_proxy_port;
@@ -1387,6 +1430,15 @@ struct pool {
 	struct stratum_work swork;
 	pthread_t stratum_sthread;
 	pthread_t stratum_rthread;
+	int reactor_fd;
+	bool reactor_attached;
+	/* Bumped under stratum_lock each time sock is closed, so a new socket
+	 * that reuses the same fd number is still told apart */
+	unsigned int sock_gen;
+	unsigned int reactor_gen;
+	/* A client.reconnect the reactor has left to a helper thread */
+	bool reconnect_pending;
+	struct timeval tv_reactor_recv;
 	pthread_mutex_t stratum_lock;
 	struct thread_q *stratum_q;
 	int sshares; /* stratum shares submitted waiting on response */
@@ -1403,12 +1455,14 @@ struct pool {
 	uint32_t gbt_version;
 	uint32_t curtime;
 	uint32_t gbt_bits;
-	unsigned char *txn_hashes;
+	unsigned char *merklebin;
+	int merkles;
 	int gbt_txns;
 	int coinbase_len;
 
 	/* Shared by both stratum & GBT */
 	unsigned char *coinbase;
+	size_t coinbase_size;
 	int nonce2_offset;
 	unsigned char header_bin[128];
 	int merkle_offset;
@@ -1482,6 +1536,10 @@ struct work {
 	struct timeval	tv_work_start;
 	struct timeval	tv_work_found;
 	char		getwork_mode;
+
+	/* cgtimer_us when the notify this work came from was received, 0 if
+	 * it did not come from a stratum notify */
+	int64_t		us_notify;
 };
 
 #ifdef USE_MODMINER 
@@ -1526,6 +1584,7 @@ struct modminer_fpga_state {
 
 extern void get_datestamp(char *, size_t, struct timeval *);
 extern void inc_hw_errors(struct thr_info *thr);
+extern bool dup_nonce(struct thr_info *thr, struct work *work, uint32_t nonce);
 extern bool test_nonce(struct work *work, uint32_t nonce);
 extern bool test_nonce_diff(struct work *work, uint32_t nonce, double diff);
 extern void submit_tested_work(struct thr_info *thr, struct work *work);
@@ -1533,6 +1592,7 @@ extern bool submit_nonce(struct thr_info *thr, struct work *work, uint32_t nonce
 extern bool submit_noffset_nonce(struct thr_info *thr, struct work *work, uint32_t nonce,
 			  int noffset);
 extern struct work *get_work(struct thr_info *thr, const int thr_id);
+extern struct work *get_work_nowait(struct thr_info *thr, const int thr_id);
 extern void __add_queued(struct cgpu_info *cgpu, struct work *work);
 extern struct work *get_queued(struct cgpu_info *cgpu);
 extern void add_queued(struct cgpu_info *cgpu, struct work *work);
@@ -0,0 +1,795 @@
+/*
+ * Mock stratum pool for load and latency testing cgminer on a local machine
+ * without a real pool. It hands out Blake-256 stratum jobs built the same way
+ * cgminer builds work from them and checks the shares submitted against them
+ * with the same blake256 code cgminer uses.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <ccan/opt/opt.h>
+#include <jansson.h>
+
+#include "miner.h"
+#include "sha2.h"
+#include "blake.h"
+
+/* Jobs kept for checking shares against, older ones are reported not found */
+#define MOCK_JOBS 16
+#define MOCK_N1SIZE 4
+#define MOCK_RBUFSIZE 8192
+/* Shares each client submitted since the last new block, a direct mapped
+ * table so an old share may be evicted but no two shares are confused */
+#define MOCK_DUPS 1024
+
+static int opt_port = 3333;
+static int opt_notify_interval = 30000;
+static int opt_clean_every = 10;
+static int opt_merkles = 8;
+static int opt_coinbase_size = 128;
+static int opt_n2size = 4;
+static float opt_diff = 1.0;
+static float opt_diff_max;
+static int opt_diff_every;
+static int opt_reject;
+static int opt_latency;
+static int opt_jitter;
+static int opt_reconnect;
+static int opt_stats_interval = 10;
+
+/* What blake.c and the miner.h helpers need from the rest of cgminer */
+bool opt_debug;
+bool opt_log_output;
+bool use_syslog;
+int opt_log_level = LOG_NOTICE;
+
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void _applog(int prio, const char *str, __maybe_unused bool force)
+{
+	struct timeval tv;
+	struct tm tm;
+
+	if (prio > opt_log_level && !opt_debug)
+		return;
+	gettimeofday(&tv, NULL);
+	localtime_r(&tv.tv_sec, &tm);
+	mutex_lock(&log_lock);
+	fprintf(stderr, " [%d-%02d-%02d %02d:%02d:%02d] %s\n", tm.tm_year + 1900,
+		tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec, str);
+	mutex_unlock(&log_lock);
+}
+
+void _quit(int status)
+{
+	exit(status);
+}
+
+struct mock_job {
+	unsigned int seq;
+	char job_id[16];
+	unsigned int block;
+	double diff;
+	unsigned char prev_hash[32];
+	unsigned char *coinbase1, *coinbase2;
+	size_t cb1_len, cb2_len;
+	unsigned char (*merkle)[32];
+	int merkles;
+	unsigned char version[4], nbit[4];
+	char *notify;
+};
+
+static struct mock_job *jobs[MOCK_JOBS];
+static unsigned int job_seq, block_no;
+static double pool_diff;
+static pthread_rwlock_t jobs_lock;
+
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t shares_accepted, shares_rejected, shares_invalid, notifies_sent;
+static int clients;
+
+/* Everything that makes a submitted share distinct, nonce2 padded with zeroes */
+struct mock_share {
+	bool used;
+	unsigned int job_seq;
+	unsigned char ntime[4], nonce2[8], nonce[4];
+};
+
+struct mock_client {
+	int sock;
+	int id;
+	unsigned char nonce1[MOCK_N1SIZE];
+	bool subscribed, authorised;
+	unsigned int job_seq;
+	double diff;
+	time_t connected;
+	char buf[MOCK_RBUFSIZE];
+	size_t buflen;
+	struct mock_share dups[MOCK_DUPS];
+	unsigned int dup_block;
+};
+
+static void mock_bin2hex(char *s, const unsigned char *p, size_t len)
+{
+	static const char hex[] = "0123456789abcdef";
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		*s++ = hex[p[i] >> 4];
+		*s++ = hex[p[i] & 0xf];
+	}
+	*s = '\0';
+}
+
+static bool mock_hex2bin(unsigned char *p, const char *s, size_t len)
+{
+	size_t i;
+
+	if (strlen(s) != len * 2)
+		return false;
+	for (i = 0; i < len * 2; i++) {
+		int c = s[i], v;
+
+		if (c >= '0' && c <= '9')
+			v = c - '0';
+		else if (c >= 'a' && c <= 'f')
+			v = c - 'a' + 10;
+		else if (c >= 'A' && c <= 'F')
+			v = c - 'A' + 10;
+		else
+			return false;
+		if (i & 1)
+			p[i / 2] |= v;
+		else
+			p[i / 2] = v << 4;
+	}
+	return true;
+}
+
+static void random_bytes(unsigned char *p, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		p[i] = random();
+}
+
+static char *job_notify(struct mock_job *job, bool clean)
+{
+	size_t len = 512 + (job->cb1_len + job->cb2_len) * 2 + job->merkles * 67;
+	char *s = malloc(len), *p;
+	int i;
+
+	if (unlikely(!s))
+		quit(1, "Failed to malloc notify");
+	p = s + sprintf(s, "{\"id\": null, \"method\": \"mining.notify\", \"params\": [\"%s\", \"", job->job_id);
+	mock_bin2hex(p, job->prev_hash, 32);
+	p += strlen(p);
+	p += sprintf(p, "\", \"");
+	mock_bin2hex(p, job->coinbase1, job->cb1_len);
+	p += strlen(p);
+	p += sprintf(p, "\", \"");
+	mock_bin2hex(p, job->coinbase2, job->cb2_len);
+	p += strlen(p);
+	p += sprintf(p, "\", [");
+	for (i = 0; i < job->merkles; i++) {
+		p += sprintf(p, "%s\"", i ? ", " : "");
+		mock_bin2hex(p, job->merkle[i], 32);
+		p += strlen(p);
+		*p++ = '"';
+	}
+	p += sprintf(p, "], \"");
+	mock_bin2hex(p, job->version, 4);
+	p += strlen(p);
+	p += sprintf(p, "\", \"");
+	mock_bin2hex(p, job->nbit, 4);
+	p += strlen(p);
+	sprintf(p, "\", \"%08x\", %s]}\n", (unsigned int)time(NULL), clean ? "true" : "false");
+	return s;
+}
+
+static void free_job(struct mock_job *job)
+{
+	if (!job)
+		return;
+	free(job->coinbase1);
+	free(job->coinbase2);
+	free(job->merkle);
+	free(job->notify);
+	free(job);
+}
+
+/* Every opt_clean_every jobs is a new block and every opt_diff_every jobs the
+ * difficulty doubles, going back to opt_diff once past opt_diff_max */
+static void new_job(void)
+{
+	static unsigned char prev_hash[32];
+	struct mock_job *job = calloc(sizeof(*job), 1), *old;
+	int cb_len, seq;
+	bool clean;
+
+	if (unlikely(!job))
+		quit(1, "Failed to calloc job");
+
+	wr_lock(&jobs_lock);
+	seq = job_seq + 1;
+	clean = seq == 1 || (opt_clean_every && !(seq % opt_clean_every));
+	if (clean) {
+		random_bytes(prev_hash, 32);
+		block_no++;
+	}
+	if (opt_diff_every && !(seq % opt_diff_every)) {
+		pool_diff *= 2;
+		if (pool_diff > opt_diff_max)
+			pool_diff = opt_diff;
+	}
+	wr_unlock(&jobs_lock);
+
+	job->seq = seq;
+	sprintf(job->job_id, "%x", seq);
+	job->block = block_no;
+	job->diff = pool_diff;
+	memcpy(job->prev_hash, prev_hash, 32);
+	cb_len = opt_coinbase_size - MOCK_N1SIZE - opt_n2size;
+	if (cb_len < 2)
+		cb_len = 2;
+	job->cb1_len = cb_len / 2;
+	job->cb2_len = cb_len - job->cb1_len;
+	job->coinbase1 = malloc(job->cb1_len);
+	job->coinbase2 = malloc(job->cb2_len);
+	job->merkles = opt_merkles;
+	job->merkle = malloc(32 * (opt_merkles + 1));
+	if (unlikely(!job->coinbase1 || !job->coinbase2 || !job->merkle))
+		quit(1, "Failed to malloc job");
+	random_bytes(job->coinbase1, job->cb1_len);
+	random_bytes(job->coinbase2, job->cb2_len);
+	random_bytes((unsigned char *)job->merkle, 32 * opt_merkles);
+	memcpy(job->version, "\x00\x00\x00\x01", 4);
+	memcpy(job->nbit, "\x1a\x2b\x3c\x4d", 4);
+	job->notify = job_notify(job, clean);
+
+	wr_lock(&jobs_lock);
+	old = jobs[seq % MOCK_JOBS];
+	jobs[seq % MOCK_JOBS] = job;
+	job_seq = seq;
+	wr_unlock(&jobs_lock);
+	free_job(old);
+
+	applog(LOG_INFO, "New job %s%s diff %g", job->job_id, clean ? " (clean)" : "", job->diff);
+}
+
+static void *job_thread(__maybe_unused void *userdata)
+{
+	while (42) {
+		struct timespec ts;
+
+		ts.tv_sec = opt_notify_interval / 1000;
+		ts.tv_nsec = (opt_notify_interval % 1000) * 1000000;
+		nanosleep(&ts, NULL);
+		new_job();
+	}
+	return NULL;
+}
+
+/* Sleeps for the injected latency plus or minus up to the jitter */
+static void inject_latency(void)
+{
+	struct timespec ts;
+	int ms = opt_latency;
+
+	if (opt_jitter)
+		ms += random() % (opt_jitter * 2 + 1) - opt_jitter;
+	if (ms <= 0)
+		return;
+	ts.tv_sec = ms / 1000;
+	ts.tv_nsec = (ms % 1000) * 1000000;
+	nanosleep(&ts, NULL);
+}
+
+static bool client_send(struct mock_client *client, const char *s)
+{
+	size_t len = strlen(s), sent = 0;
+
+	inject_latency();
+	while (sent < len) {
+		ssize_t n = send(client->sock, s + sent, len - sent, MSG_NOSIGNAL);
+
+		if (n <= 0)
+			return false;
+		sent += n;
+	}
+	return true;
+}
+
+static bool client_reply(struct mock_client *client, json_t *id, const char *result, const char *error)
+{
+	char s[512], *ids = json_dumps(id, JSON_ENCODE_ANY);
+	bool ret;
+
+	snprintf(s, sizeof(s), "{\"id\": %s, \"result\": %s, \"error\": %s}\n",
+		 ids ? ids : "null", result, error);
+	free(ids);
+	ret = client_send(client, s);
+	return ret;
+}
+
+static bool client_diff(struct mock_client *client, double diff)
+{
+	char s[128];
+
+	client->diff = diff;
+	snprintf(s, sizeof(s), "{\"id\": null, \"method\": \"mining.set_difficulty\", \"params\": [%g]}\n", diff);
+	return client_send(client, s);
+}
+
+/* Sends the latest job, with its difficulty first if it changed */
+static bool client_notify(struct mock_client *client)
+{
+	struct mock_job *job;
+	double diff;
+	char *notify;
+
+	rd_lock(&jobs_lock);
+	job = jobs[job_seq % MOCK_JOBS];
+	client->job_seq = job_seq;
+	diff = job->diff;
+	notify = strdup(job->notify);
+	rd_unlock(&jobs_lock);
+	if (unlikely(!notify))
+		quit(1, "Failed to strdup notify");
+
+	if (diff != client->diff && !client_diff(client, diff)) {
+		free(notify);
+		return false;
+	}
+	if (!client_send(client, notify)) {
+		free(notify);
+		return false;
+	}
+	free(notify);
+
+	mutex_lock(&stats_lock);
+	notifies_sent++;
+	mutex_unlock(&stats_lock);
+	return true;
+}
+
+static double le256todouble(const unsigned char *hash)
+{
+	double dcut64 = 0;
+	int i;
+
+	for (i = 3; i >= 0; i--)
+		dcut64 = dcut64 * 18446744073709551616.0 + le64toh(*(const uint64_t *)(hash + i * 8));
+	return dcut64;
+}
+
+/* Rebuilds the work cgminer generated for this share the same way as
+ * gen_stratum_work and hashes it with blake256_regenhash, returning the
+ * difficulty of the share */
+static double share_diff(struct mock_client *client, struct mock_job *job,
+			 const unsigned char *nonce2, const unsigned char *ntime,
+			 const unsigned char *nonce)
+{
+	static const double truediffone = 26959535291011309493156476344723991336010898738574164086137773096960.0;
+	unsigned char merkle_root[32], merkle_sha[64], *coinbase, *p;
+	size_t cb_len = job->cb1_len + MOCK_N1SIZE + opt_n2size + job->cb2_len;
+	struct work work;
+	double d;
+	int i;
+
+	coinbase = malloc(cb_len);
+	if (unlikely(!coinbase))
+		quit(1, "Failed to malloc coinbase");
+	p = coinbase;
+	memcpy(p, job->coinbase1, job->cb1_len);
+	p += job->cb1_len;
+	memcpy(p, client->nonce1, MOCK_N1SIZE);
+	p += MOCK_N1SIZE;
+	memcpy(p, nonce2, opt_n2size);
+	p += opt_n2size;
+	memcpy(p, job->coinbase2, job->cb2_len);
+
+	sha256(coinbase, cb_len, merkle_root);
+	free(coinbase);
+	memcpy(merkle_sha, merkle_root, 32);
+	for (i = 0; i < job->merkles; i++) {
+		unsigned char hash1[32];
+
+		memcpy(merkle_sha + 32, job->merkle[i], 32);
+		sha256(merkle_sha, 64, hash1);
+		sha256(hash1, 32, merkle_root);
+		memcpy(merkle_sha, merkle_root, 32);
+	}
+	flip32(merkle_root, merkle_sha);
+
+	/* version, prev_hash, merkle root, ntime, nbit, nonce, workpadding */
+	memset(&work, 0, sizeof(work));
+	memcpy(work.data, job->version, 4);
+	memcpy(work.data + 4, job->prev_hash, 32);
+	memcpy(work.data + 36, merkle_root, 32);
+	memcpy(work.data + 68, ntime, 4);
+	memcpy(work.data + 72, job->nbit, 4);
+	mock_hex2bin(work.data + 80, "000000800000000000000000000000000000000000000000000000000000000000000000000000000000000080020000", 48);
+	memcpy(work.data + 140, nonce, 4);
+
+	blake256_regenhash(&work);
+	d = le256todouble(work.hash);
+	if (d <= 0)
+		return truediffone;
+	return truediffone / d;
+}
+
+/* FNV-1a of the whole share, the struct is zeroed first so padding matches */
+static unsigned int share_slot(const struct mock_share *share)
+{
+	const unsigned char *p = (const unsigned char *)share;
+	uint32_t hash = 2166136261U;
+	size_t i;
+
+	for (i = 0; i < sizeof(*share); i++) {
+		hash ^= p[i];
+		hash *= 16777619U;
+	}
+	return hash % MOCK_DUPS;
+}
+
+static bool client_submit(struct mock_client *client, json_t *id, json_t *params)
+{
+	const char *job_id, *nonce2hex, *ntimehex, *noncehex;
+	unsigned char nonce2[8] = {0}, ntime[4], nonce[4];
+	struct mock_share share, *slot;
+	struct mock_job *job = NULL;
+	const char *error = NULL;
+	double diff = 0;
+	int i;
+
+	job_id = json_string_value(json_array_get(params, 1));
+	nonce2hex = json_string_value(json_array_get(params, 2));
+	ntimehex = json_string_value(json_array_get(params, 3));
+	noncehex = json_string_value(json_array_get(params, 4));
+	if (!client->authorised)
+		error = "[24, \"Unauthorized worker\", null]";
+	else if (!job_id || !nonce2hex || !ntimehex || !noncehex ||
+		 opt_n2size > (int)sizeof(nonce2) ||
+		 !mock_hex2bin(nonce2, nonce2hex, opt_n2size) ||
+		 !mock_hex2bin(ntime, ntimehex, 4) || !mock_hex2bin(nonce, noncehex, 4))
+		error = "[20, \"Malformed share\", null]";
+	if (error)
+		goto out;
+
+	rd_lock(&jobs_lock);
+	for (i = 0; i < MOCK_JOBS; i++) {
+		if (jobs[i] && jobs[i]->block == block_no && !strcmp(jobs[i]->job_id, job_id)) {
+			job = jobs[i];
+			break;
+		}
+	}
+	if (job)
+		diff = share_diff(client, job, nonce2, ntime, nonce);
+	rd_unlock(&jobs_lock);
+
+	if (!job) {
+		error = "[21, \"Job not found\", null]";
+		goto out;
+	}
+
+	memset(&share, 0, sizeof(share));
+	share.used = true;
+	share.job_seq = job->seq;
+	memcpy(share.ntime, ntime, sizeof(ntime));
+	memcpy(share.nonce2, nonce2, sizeof(nonce2));
+	memcpy(share.nonce, nonce, sizeof(nonce));
+	if (client->dup_block != job->block) {
+		memset(client->dups, 0, sizeof(client->dups));
+		client->dup_block = job->block;
+	}
+	slot = &client->dups[share_slot(&share)];
+	if (!memcmp(slot, &share, sizeof(share)))
+		error = "[22, \"Duplicate share\", null]";
+	else if (diff < client->diff)
+		error = "[23, \"Low difficulty share\", null]";
+	else if (opt_reject && random() % 100 < opt_reject)
+		error = "[20, \"Injected reject\", null]";
+	memcpy(slot, &share, sizeof(share));
+out:
+	mutex_lock(&stats_lock);
+	if (!error)
+		shares_accepted++;
+	else if (!job || diff < client->diff)
+		shares_invalid++;
+	else
+		shares_rejected++;
+	mutex_unlock(&stats_lock);
+
+	applog(LOG_DEBUG, "Client %d share on job %s diff %.3f %s", client->id,
+	       job_id ? job_id : "?", diff, error ? error : "accepted");
+	if (error)
+		return client_reply(client, id, "false", error);
+	return client_reply(client, id, "true", "null");
+}
+
+static bool client_request(struct mock_client *client, const char *s)
+{
+	json_t *val, *id, *params;
+	const char *method;
+	json_error_t err;
+	bool ret = true;
+
+	val = JSON_LOADS(s, &err);
+	if (!val) {
+		applog(LOG_INFO, "Client %d sent invalid JSON: %s", client->id, s);
+		return true;
+	}
+	id = json_object_get(val, "id");
+	params = json_object_get(val, "params");
+	method = json_string_value(json_object_get(val, "method"));
+	if (!method)
+		goto out;
+
+	if (!strcmp(method, "mining.subscribe")) {
+		char result[128], n1hex[MOCK_N1SIZE * 2 + 1];
+
+		mock_bin2hex(n1hex, client->nonce1, MOCK_N1SIZE);
+		snprintf(result, sizeof(result), "[[[\"mining.notify\", \"%08x\"]], \"%s\", %d]",
+			 client->id, n1hex, opt_n2size);
+		client->subscribed = true;
+		ret = client_reply(client, id, result, "null");
+	} else if (!strcmp(method, "mining.authorize")) {
+		client->authorised = true;
+		ret = client_reply(client, id, "true", "null");
+		if (ret && client->subscribed)
+			ret = client_notify(client);
+	} else if (!strcmp(method, "mining.submit"))
+		ret = client_submit(client, id, params);
+	else
+		ret = client_reply(client, id, "null", "[20, \"Unknown method\", null]");
+out:
+	json_decref(val);
+	return ret;
+}
+
+/* Handles every complete line buffered from the client */
+static bool client_read(struct mock_client *client)
+{
+	char *eol, *s;
+	ssize_t n;
+
+	n = recv(client->sock, client->buf + client->buflen, MOCK_RBUFSIZE - 1 - client->buflen, 0);
+	if (n <= 0)
+		return false;
+	client->buflen += n;
+	client->buf[client->buflen] = '\0';
+
+	s = client->buf;
+	while ((eol = strchr(s, '\n')) != NULL) {
+		*eol = '\0';
+		if (*s && !client_request(client, s))
+			return false;
+		s = eol + 1;
+	}
+	client->buflen -= s - client->buf;
+	memmove(client->buf, s, client->buflen);
+	if (client->buflen >= MOCK_RBUFSIZE - 1) {
+		applog(LOG_INFO, "Client %d line too long", client->id);
+		return false;
+	}
+	return true;
+}
+
+static void *client_thread(void *userdata)
+{
+	struct mock_client *client = (struct mock_client *)userdata;
+
+	pthread_detach(pthread_self());
+
+	while (42) {
+		struct pollfd pfd;
+
+		pfd.fd = client->sock;
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, 100) > 0 && !client_read(client))
+			break;
+		if (client->authorised && client->job_seq != job_seq && !client_notify(client))
+			break;
+		if (opt_reconnect && time(NULL) - client->connected >= opt_reconnect) {
+			client_send(client, "{\"id\": null, \"method\": \"client.reconnect\", \"params\": []}\n");
+			applog(LOG_INFO, "Client %d asked to reconnect", client->id);
+			break;
+		}
+	}
+
+	close(client->sock);
+	mutex_lock(&stats_lock);
+	clients--;
+	mutex_unlock(&stats_lock);
+	applog(LOG_INFO, "Client %d disconnected", client->id);
+	free(client);
+	return NULL;
+}
+
+static void show_stats(double secs)
+{
+	static uint64_t last_accepted;
+	uint64_t accepted;
+
+	mutex_lock(&stats_lock);
+	accepted = shares_accepted;
+	applog(LOG_NOTICE, "Clients %d notifies %"PRIu64" accepted %"PRIu64" rejected %"PRIu64" invalid %"PRIu64" (%.1f shares/s)",
+	       clients, notifies_sent, shares_accepted, shares_rejected,
+	       shares_invalid, (double)(accepted - last_accepted) / secs);
+	mutex_unlock(&stats_lock);
+	last_accepted = accepted;
+}
+
+static char *set_debug(bool *flag)
+{
+	*flag = true;
+	opt_log_level = LOG_DEBUG;
+	return NULL;
+}
+
+static char *set_verbose(__maybe_unused void *arg)
+{
+	opt_log_level = LOG_INFO;
+	return NULL;
+}
+
+static char *usage(__maybe_unused void *arg)
+{
+	printf("%s", opt_usage("mockpool", NULL));
+	exit(0);
+}
+
+static struct opt_table opt_table[] = {
+	OPT_WITH_ARG("--clean-every",
+		     opt_set_intval, opt_show_intval, &opt_clean_every,
+		     "Make every Nth job a clean job for a new block, 0 for only the first"),
+	OPT_WITH_ARG("--coinbase-size",
+		     opt_set_intval, opt_show_intval, &opt_coinbase_size,
+		     "Size in bytes of the coinbase including nonce1 and nonce2"),
+	OPT_WITHOUT_ARG("--debug|-D",
+			set_debug, &opt_debug,
+			"Enable debug output"),
+	OPT_WITH_ARG("--diff",
+		     opt_set_floatval, opt_show_floatval, &opt_diff,
+		     "Share difficulty"),
+	OPT_WITH_ARG("--diff-every",
+		     opt_set_intval, opt_show_intval, &opt_diff_every,
+		     "Double the share difficulty every N jobs up to --diff-max, 0 to keep it fixed"),
+	OPT_WITH_ARG("--diff-max",
+		     opt_set_floatval, opt_show_floatval, &opt_diff_max,
+		     "Highest share difficulty before going back to --diff"),
+	OPT_WITH_ARG("--jitter",
+		     opt_set_intval, opt_show_intval, &opt_jitter,
+		     "Vary the injected latency by up to this many milliseconds either way"),
+	OPT_WITH_ARG("--latency",
+		     opt_set_intval, opt_show_intval, &opt_latency,
+		     "Milliseconds of latency to inject before each message sent"),
+	OPT_WITH_ARG("--merkles",
+		     opt_set_intval, opt_show_intval, &opt_merkles,
+		     "Number of merkle branches in each job"),
+	OPT_WITH_ARG("--nonce2-size",
+		     opt_set_intval, opt_show_intval, &opt_n2size,
+		     "Size in bytes of nonce2 (1 - 8)"),
+	OPT_WITH_ARG("--notify-interval",
+		     opt_set_intval, opt_show_intval, &opt_notify_interval,
+		     "Milliseconds between new jobs"),
+	OPT_WITH_ARG("--port",
+		     opt_set_intval, opt_show_intval, &opt_port,
+		     "Port to listen on"),
+	OPT_WITH_ARG("--reconnect",
+		     opt_set_intval, opt_show_intval, &opt_reconnect,
+		     "Send client.reconnect to each client this many seconds after it connects, 0 for never"),
+	OPT_WITH_ARG("--reject",
+		     opt_set_intval, opt_show_intval, &opt_reject,
+		     "Percentage of valid shares to reject anyway"),
+	OPT_WITH_ARG("--stats-interval",
+		     opt_set_intval, opt_show_intval, &opt_stats_interval,
+		     "Seconds between statistics output"),
+	OPT_WITHOUT_ARG("--verbose",
+			set_verbose, NULL,
+			"Log each job and client connection"),
+	OPT_WITHOUT_ARG("--help|-h",
+			usage, NULL,
+			"Print this message"),
+	OPT_ENDTABLE
+};
+
+int main(int argc, char *argv[])
+{
+	struct sockaddr_in addr;
+	struct timeval tv_stats, now;
+	int lsock, one = 1, next_id = 0;
+	pthread_t pth;
+
+	opt_register_table(opt_table, NULL);
+	opt_parse(&argc, argv, opt_log_stderr_exit);
+	if (argc != 1)
+		opt_log_stderr_exit("Unexpected extra commandline arguments");
+	if (opt_n2size < 1 || opt_n2size > 8)
+		opt_log_stderr_exit("--nonce2-size must be 1 - 8");
+	if (opt_notify_interval < 1 || opt_merkles < 0 || opt_diff <= 0 ||
+	    opt_reject < 0 || opt_reject > 100 || opt_latency < 0 || opt_jitter < 0)
+		opt_log_stderr_exit("Invalid option value");
+	if (opt_diff_max < opt_diff)
+		opt_diff_max = opt_diff;
+
+	signal(SIGPIPE, SIG_IGN);
+	srandom(time(NULL));
+	rwlock_init(&jobs_lock);
+	pool_diff = opt_diff;
+	new_job();
+
+	lsock = socket(AF_INET, SOCK_STREAM, 0);
+	if (lsock < 0)
+		quit(1, "Failed to create socket");
+	setsockopt(lsock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	addr.sin_port = htons(opt_port);
+	if (bind(lsock, (struct sockaddr *)&addr, sizeof(addr)) || listen(lsock, 128))
+		quit(1, "Failed to listen on port %d, errno %d", opt_port, errno);
+
+	if (unlikely(pthread_create(&pth, NULL, job_thread, NULL)))
+		quit(1, "Failed to create job thread");
+	applog(LOG_NOTICE, "Mock stratum pool listening on port %d", opt_port);
+
+	gettimeofday(&tv_stats, NULL);
+	while (42) {
+		struct pollfd pfd;
+		double secs;
+
+		pfd.fd = lsock;
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, 1000) > 0) {
+			struct mock_client *client = calloc(sizeof(*client), 1);
+			int sock = accept(lsock, NULL, NULL);
+
+			if (unlikely(!client))
+				quit(1, "Failed to calloc client");
+			if (sock < 0) {
+				free(client);
+				continue;
+			}
+			setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+			client->sock = sock;
+			client->id = ++next_id;
+			memcpy(client->nonce1, &client->id, MOCK_N1SIZE);
+			client->connected = time(NULL);
+			mutex_lock(&stats_lock);
+			clients++;
+			mutex_unlock(&stats_lock);
+			applog(LOG_INFO, "Client %d connected", client->id);
+			if (unlikely(pthread_create(&pth, NULL, client_thread, (void *)client)))
+				quit(1, "Failed to create client thread");
+		}
+
+		gettimeofday(&now, NULL);
+		secs = now.tv_sec - tv_stats.tv_sec + (now.tv_usec - tv_stats.tv_usec) / 1000000.0;
+		if (opt_stats_interval && secs >= opt_stats_interval) {
+			show_stats(secs);
+			tv_stats = now;
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,931 @@
+/*
+ * USB device emulation for exercising and profiling the usbutils drivers
+ * without hardware. --usb-emulate adds emulated devices that usb_detect finds
+ * alongside the real ones, either from a built in model of a device's
+ * protocol or by replaying a script recorded from a real device with
+ * --usb-record. usbutils routes their bulk and control transfers here in
+ * place of libusb, with --usb-emulate-latency ms added to each.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+#include "config.h"
+
+#include <ctype.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "logging.h"
+#include "miner.h"
+#include "usbemu.h"
+
+/* Emulated devices are numbered from this bus up, 127 to a bus, to stay clear
+ * of the real ones */
+#define USBEMU_BUS 128
+#define USBEMU_PER_BUS 127
+
+#define USBEMU_LINE 4096
+
+/* Data the device has ready on an IN endpoint, readable from due */
+struct usbemu_chunk {
+	struct usbemu_chunk *next;
+	unsigned char endpoint;
+	int64_t due;
+	int length;
+	unsigned char data[];
+};
+
+enum usbemu_op {
+	USBEMU_WRITE,
+	USBEMU_READ,
+};
+
+struct usbemu_step {
+	enum usbemu_op op;
+	unsigned char endpoint;
+	int delay;
+	unsigned char *data;
+	int length;
+};
+
+struct usbemu_control {
+	uint8_t bmRequestType;
+	uint8_t bRequest;
+	uint16_t wValue;
+	uint16_t wIndex;
+	unsigned char *data;
+	int length;
+};
+
+/* A recorded session, shared by every device replaying it */
+struct usbemu_script {
+	char *path;
+	uint16_t idVendor;
+	uint16_t idProduct;
+	char *manufacturer;
+	char *product;
+	struct usbemu_step *steps;
+	int step_count;
+	int first_write;
+	struct usbemu_control *controls;
+	int control_count;
+};
+
+struct usbemu_model {
+	const char *name;
+	uint16_t idVendor;
+	uint16_t idProduct;
+	const char *manufacturer;
+	const char *product;
+	/* Reads start with the 2 FTDI status bytes */
+	bool ftdi;
+	/* Called with the device locked */
+	void (*open)(struct usbemu_dev *edev);
+	void (*write)(struct usbemu_dev *edev, unsigned char endpoint,
+		      unsigned char *data, int length);
+	int (*control)(struct usbemu_dev *edev, uint8_t bmRequestType,
+		       uint8_t bRequest, uint16_t wValue, uint16_t wIndex,
+		       unsigned char *data, uint16_t wLength);
+};
+
+struct usbemu_dev {
+	const struct usbemu_model *model;
+	struct usbemu_script *script;
+	int index;
+	char serial[32];
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct usbemu_chunk *head;
+	uint32_t seed;
+
+	/* Replay position */
+	int pos;
+
+	/* Work being written to the Icarus and BitForce models */
+	unsigned char work[128];
+	int work_length;
+
+	/* BitForce model */
+	int work_expect;
+	bool working;
+	int64_t work_done;
+	double work_hashes;
+};
+
+struct usbemu_record {
+	FILE *fp;
+	int64_t last_write;
+	pthread_mutex_t lock;
+};
+
+static struct usbemu_dev *emu_devices;
+static int emu_count;
+
+static int64_t usbemu_now(void)
+{
+	struct timeval now;
+
+	cgtime(&now);
+	return (int64_t)now.tv_sec * 1000000 + now.tv_usec;
+}
+
+/* xorshift32, rand_r() isn't on every platform. Returns 1..2^32-1 */
+static uint32_t usbemu_random(struct usbemu_dev *edev)
+{
+	uint32_t x = edev->seed;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return edev->seed = x;
+}
+
+/* Must be called with the device locked */
+static void usbemu_queue(struct usbemu_dev *edev, unsigned char endpoint,
+			 const unsigned char *data, int length, int64_t due)
+{
+	struct usbemu_chunk *chunk, **prev;
+
+	chunk = malloc(sizeof(*chunk) + length);
+	if (unlikely(!chunk))
+		quit(1, "Failed to malloc usbemu chunk");
+	chunk->next = NULL;
+	chunk->endpoint = endpoint;
+	chunk->due = due;
+	chunk->length = length;
+	memcpy(chunk->data, data, length);
+
+	/* Kept in due order */
+	prev = &edev->head;
+	while (*prev && (*prev)->due <= due)
+		prev = &(*prev)->next;
+	chunk->next = *prev;
+	*prev = chunk;
+	pthread_cond_broadcast(&edev->cond);
+}
+
+/* Must be called with the device locked */
+static void usbemu_flush(struct usbemu_dev *edev)
+{
+	struct usbemu_chunk *chunk;
+
+	while ((chunk = edev->head)) {
+		edev->head = chunk->next;
+		free(chunk);
+	}
+}
+
+/* Icarus: takes 64 byte work and answers with a 4 byte nonce. The detect work
+ * gets its known nonce back. Other work gets a nonce at the time a Rev3 Icarus
+ * would be expected to find a share, if it finds one before the nonce range
+ * runs out, so it is counted as a HW error but loads the host like a real
+ * one */
+#define USBEMU_ICARUS_HASH_TIME 0.0000000026316
+#define USBEMU_ICARUS_WORK 64
+
+static const char icarus_golden_ob[] =
+	"4679ba4ec99876bf4bfe086082b40025"
+	"4df6c356451471139a3afa71e48f544a"
+	"00000000000000000000000000000000"
+	"0000000087320b1a1426674f2fa722ce";
+
+static unsigned char icarus_golden[64];
+
+static void icarus_open(struct usbemu_dev *edev)
+{
+	if (!icarus_golden[0])
+		hex2bin(icarus_golden, icarus_golden_ob, sizeof(icarus_golden));
+	edev->work_length = 0;
+}
+
+static void icarus_write(struct usbemu_dev *edev, __maybe_unused unsigned char endpoint,
+			 unsigned char *data, int length)
+{
+	unsigned char nonce_bin[4];
+	uint32_t nonce;
+	double secs, u;
+	int use;
+
+	while (length > 0) {
+		use = USBEMU_ICARUS_WORK - edev->work_length;
+		if (use > length)
+			use = length;
+		memcpy(edev->work + edev->work_length, data, use);
+		edev->work_length += use;
+		data += use;
+		length -= use;
+		if (edev->work_length < USBEMU_ICARUS_WORK)
+			continue;
+		edev->work_length = 0;
+
+		/* New work aborts the old */
+		usbemu_flush(edev);
+
+		/* The 4 bytes after the midstate may be set for Cairnsmore2 */
+		if (!memcmp(edev->work, icarus_golden, 32) &&
+		    !memcmp(edev->work + 52, icarus_golden + 52, 12)) {
+			nonce = 0x000187a2;
+			secs = nonce * USBEMU_ICARUS_HASH_TIME;
+		} else {
+			u = usbemu_random(edev) / 4294967296.0;
+			secs = -log(u) * 4294967296.0 * USBEMU_ICARUS_HASH_TIME;
+			if (secs >= 4294967296.0 * USBEMU_ICARUS_HASH_TIME)
+				continue;
+			nonce = secs / USBEMU_ICARUS_HASH_TIME;
+		}
+		nonce = htobe32(nonce);
+		memcpy(nonce_bin, &nonce, sizeof(nonce_bin));
+		usbemu_queue(edev, LIBUSB_ENDPOINT_IN, nonce_bin, sizeof(nonce_bin),
+			     usbemu_now() + (int64_t)(secs * 1000000));
+	}
+}
+
+/* The PL2303 setup requests only need to succeed */
+static int icarus_control(__maybe_unused struct usbemu_dev *edev, uint8_t bmRequestType,
+			  __maybe_unused uint8_t bRequest, __maybe_unused uint16_t wValue,
+			  __maybe_unused uint16_t wIndex, unsigned char *data, uint16_t wLength)
+{
+	if ((bmRequestType & LIBUSB_ENDPOINT_DIR_MASK) == LIBUSB_ENDPOINT_IN) {
+		memset(data, 0, wLength);
+		return wLength;
+	}
+	return 0;
+}
+
+/* BitForce Single: text commands answered with a line each, full work (ZDX)
+ * or a 1/5th nonce range (ZPX) hashed at 832MH/s. As with the Icarus model,
+ * nonces found are drawn at random and show as HW errors */
+#define USBEMU_BITFORCE_HASHRATE 832000000.0
+#define USBEMU_BITFORCE_WORK 60
+#define USBEMU_BITFORCE_RANGE 68
+#define USBEMU_BITFORCE_RANGE_HASHES 858993459.0
+
+static void bitforce_reply(struct usbemu_dev *edev, const char *reply)
+{
+	usbemu_queue(edev, LIBUSB_ENDPOINT_IN, (const unsigned char *)reply,
+		     strlen(reply), usbemu_now());
+}
+
+static void bitforce_open(struct usbemu_dev *edev)
+{
+	edev->work_length = 0;
+	edev->work_expect = 0;
+	edev->working = false;
+}
+
+static void bitforce_status(struct usbemu_dev *edev)
+{
+	char reply[64];
+	double shares, u;
+
+	if (!edev->working) {
+		bitforce_reply(edev, "IDLE\n");
+		return;
+	}
+	if (usbemu_now() < edev->work_done) {
+		bitforce_reply(edev, "BUSY\n");
+		return;
+	}
+	edev->working = false;
+
+	/* A share is expected every 2^32 hashes */
+	shares = edev->work_hashes / 4294967296.0;
+	u = usbemu_random(edev) / 4294967296.0;
+	if (-log(u) >= shares) {
+		bitforce_reply(edev, "NO-NONCE\n");
+		return;
+	}
+	snprintf(reply, sizeof(reply), "NONCE-FOUND:%08X\n", (unsigned int)usbemu_random(edev));
+	bitforce_reply(edev, reply);
+}
+
+static void bitforce_write(struct usbemu_dev *edev, __maybe_unused unsigned char endpoint,
+			   unsigned char *data, int length)
+{
+	int use;
+
+	while (length > 0) {
+		if (!edev->work_expect) {
+			/* Commands are 3 bytes, Z?X */
+			use = 3 - edev->work_length;
+			if (use > length)
+				use = length;
+			memcpy(edev->work + edev->work_length, data, use);
+			edev->work_length += use;
+			data += use;
+			length -= use;
+			if (edev->work_length < 3)
+				continue;
+			edev->work_length = 0;
+
+			switch (edev->work[1]) {
+				case 'G':
+					bitforce_reply(edev, ">>>ID: BitFORCE SHA256 Emulated>>>\n");
+					break;
+				case 'L':
+					bitforce_reply(edev, "TEMP:45.0\n");
+					break;
+				case 'D':
+				case 'P':
+					if (edev->working && usbemu_now() < edev->work_done) {
+						bitforce_reply(edev, "BUSY\n");
+						break;
+					}
+					edev->work_expect = edev->work[1] == 'D' ?
+						USBEMU_BITFORCE_WORK : USBEMU_BITFORCE_RANGE;
+					bitforce_reply(edev, "OK\n");
+					break;
+				case 'F':
+					bitforce_status(edev);
+					break;
+				case 'M':
+					break;
+				default:
+					bitforce_reply(edev, "ERR:UNKNOWN COMMAND\n");
+			}
+			continue;
+		}
+
+		use = edev->work_expect - edev->work_length;
+		if (use > length)
+			use = length;
+		memcpy(edev->work + edev->work_length, data, use);
+		edev->work_length += use;
+		data += use;
+		length -= use;
+		if (edev->work_length < edev->work_expect)
+			continue;
+
+		if (edev->work_expect == USBEMU_BITFORCE_WORK)
+			edev->work_hashes = 4294967296.0;
+		else
+			edev->work_hashes = USBEMU_BITFORCE_RANGE_HASHES;
+		edev->work_done = usbemu_now() +
+			(int64_t)(edev->work_hashes / USBEMU_BITFORCE_HASHRATE * 1000000);
+		edev->working = true;
+		edev->work_length = 0;
+		edev->work_expect = 0;
+		bitforce_reply(edev, "OK\n");
+	}
+}
+
+/* FTDI setup requests only need to succeed, the modem status reads as
+ * clear to send */
+static int ftdi_control(__maybe_unused struct usbemu_dev *edev, uint8_t bmRequestType,
+			__maybe_unused uint8_t bRequest, __maybe_unused uint16_t wValue,
+			__maybe_unused uint16_t wIndex, unsigned char *data, uint16_t wLength)
+{
+	if ((bmRequestType & LIBUSB_ENDPOINT_DIR_MASK) == LIBUSB_ENDPOINT_IN) {
+		memset(data, 0, wLength);
+		if (wLength > 0)
+			data[0] = 0x10;
+		return wLength;
+	}
+	return 0;
+}
+
+/* Replay: each host write consumes the next write step of the script and
+ * queues the reads recorded after it, delayed as they were recorded. At the
+ * end it starts again from the first write. Control requests are answered
+ * with the last reply recorded for the same request */
+static void replay_open(struct usbemu_dev *edev)
+{
+	struct usbemu_script *script = edev->script;
+	int64_t now = usbemu_now();
+	int i;
+
+	for (i = 0; i < script->first_write; i++) {
+		struct usbemu_step *step = &script->steps[i];
+
+		usbemu_queue(edev, step->endpoint, step->data, step->length,
+			     now + step->delay * 1000);
+	}
+	edev->pos = script->first_write;
+}
+
+static void replay_write(struct usbemu_dev *edev, __maybe_unused unsigned char endpoint,
+			 __maybe_unused unsigned char *data, __maybe_unused int length)
+{
+	struct usbemu_script *script = edev->script;
+	int64_t now = usbemu_now();
+
+	if (script->first_write >= script->step_count)
+		return;
+	if (edev->pos >= script->step_count)
+		edev->pos = script->first_write;
+	edev->pos++;
+	while (edev->pos < script->step_count && script->steps[edev->pos].op == USBEMU_READ) {
+		struct usbemu_step *step = &script->steps[edev->pos++];
+
+		usbemu_queue(edev, step->endpoint, step->data, step->length,
+			     now + step->delay * 1000);
+	}
+}
+
+static int replay_control(struct usbemu_dev *edev, uint8_t bmRequestType,
+			  uint8_t bRequest, uint16_t wValue, uint16_t wIndex,
+			  unsigned char *data, uint16_t wLength)
+{
+	struct usbemu_script *script = edev->script;
+	int i, length;
+
+	if ((bmRequestType & LIBUSB_ENDPOINT_DIR_MASK) == LIBUSB_ENDPOINT_OUT)
+		return 0;
+
+	memset(data, 0, wLength);
+	for (i = script->control_count - 1; i >= 0; i--) {
+		struct usbemu_control *control = &script->controls[i];
+
+		if (control->bmRequestType == bmRequestType && control->bRequest == bRequest &&
+		    control->wValue == wValue && control->wIndex == wIndex) {
+			length = control->length < wLength ? control->length : wLength;
+			memcpy(data, control->data, length);
+			return length;
+		}
+	}
+	return wLength;
+}
+
+static const struct usbemu_model models[] = {
+	{
+		.name = "icarus",
+		.idVendor = 0x067b,
+		.idProduct = 0x2303,
+		.manufacturer = "Prolific Technology Inc.",
+		.product = "USB-Serial Controller",
+		.open = icarus_open,
+		.write = icarus_write,
+		.control = icarus_control,
+	},
+	{
+		.name = "bitforce",
+		.idVendor = 0x0403,
+		.idProduct = 0x6014,
+		.manufacturer = "Butterfly Labs Inc.",
+		.product = "BitFORCE SHA256",
+		.ftdi = true,
+		.open = bitforce_open,
+		.write = bitforce_write,
+		.control = ftdi_control,
+	},
+	{
+		.name = NULL,
+	}
+};
+
+static const struct usbemu_model replay_model = {
+	.name = "replay",
+	.open = replay_open,
+	.write = replay_write,
+	.control = replay_control,
+};
+
+static char *script_hex(char *hex, int *length)
+{
+	unsigned char *data;
+	size_t len;
+
+	if (!hex)
+		hex = "";
+	len = strlen(hex) / 2;
+	data = malloc(len + 1);
+	if (unlikely(!data))
+		quit(1, "Failed to malloc usbemu script data");
+	if (len && !hex2bin(data, hex, len))
+		len = 0;
+	*length = len;
+	return (char *)data;
+}
+
+static char *script_rest(char *s)
+{
+	char *end;
+
+	while (isspace(*s))
+		s++;
+	end = s + strlen(s);
+	while (end > s && isspace(end[-1]))
+		*(--end) = '\0';
+	return strdup(s);
+}
+
+static struct usbemu_script *script_load(const char *path)
+{
+	struct usbemu_script *script;
+	char line[USBEMU_LINE], *word, *save;
+	unsigned int vid, pid;
+	int lineno = 0;
+	FILE *fp;
+
+	fp = fopen(path, "r");
+	if (!fp)
+		quit(1, "Failed to open --usb-emulate script '%s'", path);
+
+	script = calloc(1, sizeof(*script));
+	if (unlikely(!script))
+		quit(1, "Failed to calloc usbemu script");
+	script->path = strdup(path);
+
+	while (fgets(line, sizeof(line), fp)) {
+		lineno++;
+		word = strtok_r(line, " \t\r\n", &save);
+		if (!word || *word == '#')
+			continue;
+
+		if (!strcmp(word, "device")) {
+			word = strtok_r(NULL, " \t\r\n", &save);
+			if (!word || sscanf(word, "%x:%x", &vid, &pid) != 2)
+				quit(1, "Invalid device in %s line %d", path, lineno);
+			script->idVendor = vid;
+			script->idProduct = pid;
+		} else if (!strcmp(word, "manufacturer"))
+			script->manufacturer = script_rest(save);
+		else if (!strcmp(word, "product"))
+			script->product = script_rest(save);
+		else if (!strcmp(word, "write") || !strcmp(word, "read")) {
+			struct usbemu_step step;
+			char *ep, *delay = "0";
+
+			memset(&step, 0, sizeof(step));
+			step.op = *word == 'w' ? USBEMU_WRITE : USBEMU_READ;
+			ep = strtok_r(NULL, " \t\r\n", &save);
+			if (step.op == USBEMU_READ)
+				delay = strtok_r(NULL, " \t\r\n", &save);
+			if (!ep || !delay)
+				quit(1, "Invalid %s in %s line %d", word, path, lineno);
+			step.endpoint = strtol(ep, NULL, 16);
+			step.delay = atoi(delay);
+			step.data = (unsigned char *)script_hex(strtok_r(NULL, " \t\r\n", &save), &step.length);
+
+			script->steps = realloc(script->steps, sizeof(*script->steps) * (script->step_count + 1));
+			if (unlikely(!script->steps))
+				quit(1, "Failed to realloc usbemu script steps");
+			script->steps[script->step_count++] = step;
+		} else if (!strcmp(word, "control")) {
+			struct usbemu_control control;
+			char *f[4];
+			int i;
+
+			memset(&control, 0, sizeof(control));
+			for (i = 0; i < 4; i++) {
+				f[i] = strtok_r(NULL, " \t\r\n", &save);
+				if (!f[i])
+					quit(1, "Invalid control in %s line %d", path, lineno);
+			}
+			control.bmRequestType = strtol(f[0], NULL, 16);
+			control.bRequest = strtol(f[1], NULL, 16);
+			control.wValue = strtol(f[2], NULL, 16);
+			control.wIndex = strtol(f[3], NULL, 16);
+			control.data = (unsigned char *)script_hex(strtok_r(NULL, " \t\r\n", &save), &control.length);
+
+			script->controls = realloc(script->controls, sizeof(*script->controls) * (script->control_count + 1));
+			if (unlikely(!script->controls))
+				quit(1, "Failed to realloc usbemu script controls");
+			script->controls[script->control_count++] = control;
+		} else
+			quit(1, "Unknown '%s' in %s line %d", word, path, lineno);
+	}
+	fclose(fp);
+
+	/* Reads before the first write are what the device sends unprompted */
+	while (script->first_write < script->step_count &&
+	       script->steps[script->first_write].op != USBEMU_WRITE)
+		script->first_write++;
+
+	if (!script->idVendor && !script->idProduct)
+		quit(1, "No device in --usb-emulate script '%s'", path);
+
+	applog(LOG_DEBUG, "USB emulate: loaded %s %04x:%04x with %d steps and %d controls",
+	       path, script->idVendor, script->idProduct, script->step_count,
+	       script->control_count);
+	return script;
+}
+
+static void usbemu_add(const struct usbemu_model *model, struct usbemu_script *script, int count)
+{
+	struct usbemu_dev *edev;
+	int i;
+
+	emu_devices = realloc(emu_devices, sizeof(*emu_devices) * (emu_count + count));
+	if (unlikely(!emu_devices))
+		quit(1, "Failed to realloc usbemu devices");
+
+	for (i = 0; i < count; i++) {
+		edev = &emu_devices[emu_count];
+		memset(edev, 0, sizeof(*edev));
+		edev->model = model;
+		edev->script = script;
+		edev->index = emu_count;
+		edev->seed = emu_count + 1;
+		snprintf(edev->serial, sizeof(edev->serial), "EMU%05d", emu_count);
+		mutex_init(&edev->lock);
+		if (unlikely(pthread_cond_init(&edev->cond, NULL)))
+			quit(1, "Failed to pthread_cond_init usbemu device");
+		emu_count++;
+	}
+}
+
+/* --usb-emulate is a comma separated list of model[:count], where model is a
+ * built in model or the path of a recorded script */
+void usbemu_initialise(void)
+{
+	char *buf, *ptr, *comma, *colon;
+	int count, i;
+
+	if (!opt_usb_emulate || !*opt_usb_emulate)
+		return;
+
+	buf = ptr = strdup(opt_usb_emulate);
+	if (unlikely(!buf))
+		quit(1, "Failed to strdup --usb-emulate");
+	do {
+		comma = strchr(ptr, ',');
+		if (comma)
+			*(comma++) = '\0';
+		count = 1;
+		colon = strrchr(ptr, ':');
+		if (colon) {
+			*(colon++) = '\0';
+			count = atoi(colon);
+			if (count < 1 || emu_count + count > USBEMU_PER_BUS * (256 - USBEMU_BUS))
+				quit(1, "Invalid --usb-emulate count '%s'", colon);
+		}
+
+		for (i = 0; models[i].name; i++)
+			if (!strcasecmp(ptr, models[i].name))
+				break;
+		if (models[i].name)
+			usbemu_add(&models[i], NULL, count);
+		else
+			usbemu_add(&replay_model, script_load(ptr), count);
+
+		ptr = comma;
+	} while (ptr);
+	free(buf);
+
+	/* Pointers handed out must not move after this */
+	applog(LOG_WARNING, "USB emulate: %d emulated device%s", emu_count,
+	       emu_count == 1 ? "" : "s");
+}
+
+int usbemu_count(void)
+{
+	return emu_count;
+}
+
+libusb_device *usbemu_device(int i)
+{
+	return (libusb_device *)(&emu_devices[i]);
+}
+
+struct usbemu_dev *usbemu_dev(libusb_device *dev)
+{
+	struct usbemu_dev *edev = (struct usbemu_dev *)dev;
+
+	if (emu_count && edev >= emu_devices && edev < emu_devices + emu_count)
+		return edev;
+	return NULL;
+}
+
+uint8_t usbemu_bus_number(struct usbemu_dev *edev)
+{
+	return USBEMU_BUS + edev->index / USBEMU_PER_BUS;
+}
+
+uint8_t usbemu_device_address(struct usbemu_dev *edev)
+{
+	return 1 + edev->index % USBEMU_PER_BUS;
+}
+
+void usbemu_get_device_descriptor(struct usbemu_dev *edev, struct libusb_device_descriptor *desc)
+{
+	memset(desc, 0, sizeof(*desc));
+	desc->bLength = LIBUSB_DT_DEVICE_SIZE;
+	desc->bDescriptorType = LIBUSB_DT_DEVICE;
+	desc->bcdUSB = 0x0200;
+	desc->bMaxPacketSize0 = 64;
+	desc->idVendor = edev->script ? edev->script->idVendor : edev->model->idVendor;
+	desc->idProduct = edev->script ? edev->script->idProduct : edev->model->idProduct;
+	desc->iManufacturer = 1;
+	desc->iProduct = 2;
+	desc->iSerialNumber = 3;
+	desc->bNumConfigurations = 1;
+}
+
+const char *usbemu_manufacturer(struct usbemu_dev *edev)
+{
+	if (edev->script)
+		return edev->script->manufacturer ? : "";
+	return edev->model->manufacturer;
+}
+
+const char *usbemu_product(struct usbemu_dev *edev)
+{
+	if (edev->script)
+		return edev->script->product ? : "";
+	return edev->model->product;
+}
+
+const char *usbemu_serial(struct usbemu_dev *edev)
+{
+	return edev->serial;
+}
+
+/* Starts the device afresh each time a driver initialises it */
+void usbemu_open(struct usbemu_dev *edev)
+{
+	mutex_lock(&edev->lock);
+	usbemu_flush(edev);
+	edev->model->open(edev);
+	mutex_unlock(&edev->lock);
+}
+
+static void usbemu_latency(void)
+{
+	if (opt_usb_emulate_latency > 0)
+		cgsleep_ms(opt_usb_emulate_latency);
+}
+
+/* Reads return the next chunk due on the endpoint, or as much of it as fits,
+ * waiting up to timeout ms for one */
+int usbemu_bulk_transfer(struct usbemu_dev *edev, unsigned char endpoint,
+			 unsigned char *data, int length, int *transferred,
+			 unsigned int timeout)
+{
+	struct usbemu_chunk *chunk, **prev;
+	struct timespec abstime;
+	int64_t now, ready, end, wake;
+	int err = LIBUSB_ERROR_TIMEOUT;
+
+	*transferred = 0;
+
+	if ((endpoint & LIBUSB_ENDPOINT_DIR_MASK) == LIBUSB_ENDPOINT_OUT) {
+		usbemu_latency();
+		mutex_lock(&edev->lock);
+		edev->model->write(edev, endpoint, data, length);
+		mutex_unlock(&edev->lock);
+		*transferred = length;
+		return LIBUSB_SUCCESS;
+	}
+
+	/* Nothing is returned sooner than the latency */
+	now = usbemu_now();
+	end = now + (int64_t)timeout * 1000;
+	ready = now + (int64_t)opt_usb_emulate_latency * 1000;
+
+	mutex_lock(&edev->lock);
+	while (42) {
+		/* Models that don't know the endpoint queue to LIBUSB_ENDPOINT_IN */
+		prev = &edev->head;
+		while (*prev && (*prev)->endpoint != endpoint &&
+		       (*prev)->endpoint != LIBUSB_ENDPOINT_IN)
+			prev = &(*prev)->next;
+		chunk = *prev;
+
+		now = usbemu_now();
+		wake = end;
+		if (chunk) {
+			wake = chunk->due > ready ? chunk->due : ready;
+			if (wake <= now)
+				break;
+			if (wake > end)
+				wake = end;
+		}
+		if (now >= end)
+			goto out;
+
+		abstime.tv_sec = wake / 1000000;
+		abstime.tv_nsec = (wake % 1000000) * 1000;
+		pthread_cond_timedwait(&edev->cond, &edev->lock, &abstime);
+	}
+
+	if (edev->model->ftdi) {
+		if (length < 2)
+			goto out;
+		*(data++) = 0x01;
+		*(data++) = 0x60;
+		length -= 2;
+		*transferred = 2;
+	}
+
+	if (chunk->length <= length) {
+		memcpy(data, chunk->data, chunk->length);
+		*transferred += chunk->length;
+		*prev = chunk->next;
+		free(chunk);
+	} else {
+		memcpy(data, chunk->data, length);
+		*transferred += length;
+		chunk->length -= length;
+		memmove(chunk->data, chunk->data + length, chunk->length);
+	}
+	err = LIBUSB_SUCCESS;
+out:
+	mutex_unlock(&edev->lock);
+	return err;
+}
+
+int usbemu_control_transfer(struct usbemu_dev *edev, uint8_t bmRequestType,
+			    uint8_t bRequest, uint16_t wValue, uint16_t wIndex,
+			    unsigned char *data, uint16_t wLength)
+{
+	int ret;
+
+	usbemu_latency();
+	mutex_lock(&edev->lock);
+	ret = edev->model->control(edev, bmRequestType, bRequest, wValue, wIndex, data, wLength);
+	mutex_unlock(&edev->lock);
+	return ret;
+}
+
+struct usbemu_record *usbemu_record_open(const char *devpath,
+					 struct libusb_device_descriptor *desc,
+					 const char *manufacturer, const char *product,
+					 const char *serial)
+{
+	struct usbemu_record *rec;
+	char filename[PATH_MAX], *s;
+	FILE *fp;
+
+	snprintf(filename, sizeof(filename), "%s-%s.usb", opt_usb_record, devpath);
+	for (s = filename + strlen(opt_usb_record); *s; s++)
+		if (*s == ':')
+			*s = '-';
+	fp = fopen(filename, "w");
+	if (!fp) {
+		applog(LOG_ERR, "USB record: failed to create %s", filename);
+		return NULL;
+	}
+
+	/* Whole lines, so a session cut short still replays */
+	setvbuf(fp, NULL, _IOLBF, 0);
+
+	rec = calloc(1, sizeof(*rec));
+	if (unlikely(!rec))
+		quit(1, "Failed to calloc usbemu record");
+	rec->fp = fp;
+	rec->last_write = usbemu_now();
+	mutex_init(&rec->lock);
+
+	fprintf(fp, "# %s serial %s\n", devpath, serial);
+	fprintf(fp, "device %04x:%04x\n", desc->idVendor, desc->idProduct);
+	if (*manufacturer)
+		fprintf(fp, "manufacturer %s\n", manufacturer);
+	if (*product)
+		fprintf(fp, "product %s\n", product);
+	applog(LOG_WARNING, "USB record: recording %s to %s", devpath, filename);
+	return rec;
+}
+
+static void record_hex(FILE *fp, unsigned char *data, int length)
+{
+	int i;
+
+	if (length > 0)
+		fputc(' ', fp);
+	for (i = 0; i < length; i++)
+		fprintf(fp, "%02x", data[i]);
+	fputc('\n', fp);
+}
+
+void usbemu_record_bulk(struct usbemu_record *rec, unsigned char endpoint,
+			unsigned char *data, int length)
+{
+	int64_t now = usbemu_now();
+
+	if (!rec)
+		return;
+	mutex_lock(&rec->lock);
+	if ((endpoint & LIBUSB_ENDPOINT_DIR_MASK) == LIBUSB_ENDPOINT_OUT) {
+		fprintf(rec->fp, "write %02x", endpoint);
+		rec->last_write = now;
+	} else
+		fprintf(rec->fp, "read %02x %d", endpoint, (int)((now - rec->last_write) / 1000));
+	record_hex(rec->fp, data, length);
+	mutex_unlock(&rec->lock);
+}
+
+void usbemu_record_control(struct usbemu_record *rec, uint8_t bmRequestType,
+			   uint8_t bRequest, uint16_t wValue, uint16_t wIndex,
+			   unsigned char *data, int length)
+{
+	if (!rec)
+		return;
+	mutex_lock(&rec->lock);
+	fprintf(rec->fp, "control %02x %02x %04x %04x", bmRequestType, bRequest, wValue, wIndex);
+	record_hex(rec->fp, data, length);
+	mutex_unlock(&rec->lock);
+}
+
+void usbemu_record_close(struct usbemu_record *rec)
+{
+	if (!rec)
+		return;
+	fclose(rec->fp);
+	mutex_destroy(&rec->lock);
+	free(rec);
+}
@@ -0,0 +1,53 @@
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+#ifndef USBEMU_H
+#define USBEMU_H
+
+#include <stdio.h>
+#include <libusb.h>
+
+/* Emulated devices are given to usb_detect as fake libusb_device pointers.
+ * Nothing from libusb may be called on them, usbemu_dev() tells them apart */
+struct usbemu_dev;
+
+/* A recording of a real device's session, in the script format replayed by
+ * --usb-emulate */
+struct usbemu_record;
+
+extern void usbemu_initialise(void);
+extern int usbemu_count(void);
+extern libusb_device *usbemu_device(int i);
+extern struct usbemu_dev *usbemu_dev(libusb_device *dev);
+
+extern uint8_t usbemu_bus_number(struct usbemu_dev *edev);
+extern uint8_t usbemu_device_address(struct usbemu_dev *edev);
+extern void usbemu_get_device_descriptor(struct usbemu_dev *edev, struct libusb_device_descriptor *desc);
+extern const char *usbemu_manufacturer(struct usbemu_dev *edev);
+extern const char *usbemu_product(struct usbemu_dev *edev);
+extern const char *usbemu_serial(struct usbemu_dev *edev);
+
+extern void usbemu_open(struct usbemu_dev *edev);
+extern int usbemu_bulk_transfer(struct usbemu_dev *edev, unsigned char endpoint,
+				unsigned char *data, int length, int *transferred,
+				unsigned int timeout);
+extern int usbemu_control_transfer(struct usbemu_dev *edev, uint8_t bmRequestType,
+				   uint8_t bRequest, uint16_t wValue, uint16_t wIndex,
+				   unsigned char *data, uint16_t wLength);
+
+extern struct usbemu_record *usbemu_record_open(const char *devpath,
+						struct libusb_device_descriptor *desc,
+						const char *manufacturer, const char *product,
+						const char *serial);
+extern void usbemu_record_bulk(struct usbemu_record *rec, unsigned char endpoint,
+			       unsigned char *data, int length);
+extern void usbemu_record_control(struct usbemu_record *rec, uint8_t bmRequestType,
+				  uint8_t bRequest, uint16_t wValue, uint16_t wIndex,
+				  unsigned char *data, int length);
+extern void usbemu_record_close(struct usbemu_record *rec);
+
+#endif
@@ -17,6 +17,7 @@
 #include "logging.h"
 #include "miner.h"
 #include "usbutils.h"
+#include "usbemu.h"
 
 #define NODEV(err) ((err) == LIBUSB_ERROR_NO_DEVICE || \
 			(err) == LIBUSB_ERROR_PIPE || \
@@ -262,6 +263,8 @@ static struct usb_intinfo cmr2_ints[] = {
 		.intinfos = _ints
 
 #define USBEP(_usbdev, _intinfo, _epinfo) (_usbdev->found->intinfos[_intinfo].epinfos[_epinfo].ep)
+#define USBRING(_usbdev, _intinfo, _epinfo) \
+	(_usbdev->ring[USBEP(_usbdev, _intinfo, _epinfo) & (USB_RINGS - 1)])
 #define THISIF(_found, _this) (_found->intinfos[_this].interface)
 #define USBIF(_usbdev, _this) THISIF(_usbdev->found, _this)
 
@@ -575,11 +578,20 @@ struct cg_usb_stats_item {
 #define CMD_TIMEOUT 1
 #define CMD_ERROR 2
 
+/*
+ * Transfer times of every result, a histogram is only allocated the first
+ * time it's needed. They are updated unlocked like the rest of the stats,
+ * but atomically so concurrent transfers and resets don't lose counts
+ */
+#define USB_HIST_READ 0
+#define USB_HIST_WRITE 1
+
 // One for each C_CMD
 struct cg_usb_stats_details {
 	int seq;
 	uint32_t modes;
 	struct cg_usb_stats_item item[CMD_ERROR+1];
+	struct latency_hist *hist[USB_HIST_WRITE+1];
 };
 
 // One for each device
@@ -1135,9 +1147,39 @@ static bool is_in_use_bd(uint8_t bus_number, uint8_t device_address)
 	return ret;
 }
 
+/* Emulated devices can't be passed to libusb */
+static uint8_t usb_bus_number(libusb_device *dev)
+{
+	struct usbemu_dev *edev = usbemu_dev(dev);
+
+	if (edev)
+		return usbemu_bus_number(edev);
+	return libusb_get_bus_number(dev);
+}
+
+static uint8_t usb_device_address(libusb_device *dev)
+{
+	struct usbemu_dev *edev = usbemu_dev(dev);
+
+	if (edev)
+		return usbemu_device_address(edev);
+	return libusb_get_device_address(dev);
+}
+
+static int usb_device_descriptor(libusb_device *dev, struct libusb_device_descriptor *desc)
+{
+	struct usbemu_dev *edev = usbemu_dev(dev);
+
+	if (edev) {
+		usbemu_get_device_descriptor(edev, desc);
+		return LIBUSB_SUCCESS;
+	}
+	return libusb_get_device_descriptor(dev, desc);
+}
+
 static bool is_in_use(libusb_device *dev)
 {
-	return is_in_use_bd(libusb_get_bus_number(dev), libusb_get_device_address(dev));
+	return is_in_use_bd(usb_bus_number(dev), usb_device_address(dev));
 }
 
 static void add_in_use(uint8_t bus_number, uint8_t device_address)
@@ -1259,7 +1301,7 @@ static bool cgminer_usb_lock_bd(struct device_drv *drv, uint8_t bus_number, uint
 
 static bool cgminer_usb_lock(struct device_drv *drv, libusb_device *dev)
 {
-	return cgminer_usb_lock_bd(drv, libusb_get_bus_number(dev), libusb_get_device_address(dev));
+	return cgminer_usb_lock_bd(drv, usb_bus_number(dev), usb_device_address(dev));
 }
 
 static void cgminer_usb_unlock_bd(struct device_drv *drv, uint8_t bus_number, uint8_t device_address)
@@ -1288,11 +1330,13 @@ static void cgminer_usb_unlock_bd(struct device_drv *drv, uint8_t bus_number, ui
 
 static void cgminer_usb_unlock(struct device_drv *drv, libusb_device *dev)
 {
-	cgminer_usb_unlock_bd(drv, libusb_get_bus_number(dev), libusb_get_device_address(dev));
+	cgminer_usb_unlock_bd(drv, usb_bus_number(dev), usb_device_address(dev));
 }
 
 static struct cg_usb_device *free_cgusb(struct cg_usb_device *cgusb)
 {
+	int i;
+
 	applog(LOG_DEBUG, "USB free %s", cgusb->found->name);
 
 	if (cgusb->serial_string && cgusb->serial_string != BLANK)
@@ -1307,6 +1351,11 @@ static struct cg_usb_device *free_cgusb(struct cg_usb_device *cgusb)
 	if (cgusb->descriptor)
 		free(cgusb->descriptor);
 
+	for (i = 0; i < USB_RINGS; i++)
+		free(cgusb->ring[i]);
+
+	usbemu_record_close(cgusb->record);
+
 	free(cgusb->found);
 
 	free(cgusb);
@@ -1314,9 +1363,16 @@ static struct cg_usb_device *free_cgusb(struct cg_usb_device *cgusb)
 	return NULL;
 }
 
+#ifndef WIN32
+static void readahead_stop(struct usb_ring *ring);
+#endif
+
 static void _usb_uninit(struct cgpu_info *cgpu)
 {
 	int ifinfo;
+#ifndef WIN32
+	int i;
+#endif
 
 	// May have happened already during a failed initialisation
 	//  if release_cgpu() was called due to a USB NODEV(err)
@@ -1326,6 +1382,14 @@ static void _usb_uninit(struct cgpu_info *cgpu)
 	applog(LOG_DEBUG, "USB uninit %s%i",
 			cgpu->drv->name, cgpu->device_id);
 
+#ifndef WIN32
+	// The transfers must end before the handle is closed
+	for (i = 0; i < USB_RINGS; i++) {
+		if (cgpu->usbdev->ring[i])
+			readahead_stop(cgpu->usbdev->ring[i]);
+	}
+#endif
+
 	if (cgpu->usbdev->handle) {
 		for (ifinfo = cgpu->usbdev->found->intinfo_count - 1; ifinfo >= 0; ifinfo--) {
 			libusb_release_interface(cgpu->usbdev->handle,
@@ -1489,8 +1553,8 @@ static int _usb_init(struct cgpu_info *cgpu, struct libusb_device *dev, struct u
 
 	DEVWLOCK(cgpu, pstate);
 
-	cgpu->usbinfo.bus_number = libusb_get_bus_number(dev);
-	cgpu->usbinfo.device_address = libusb_get_device_address(dev);
+	cgpu->usbinfo.bus_number = usb_bus_number(dev);
+	cgpu->usbinfo.device_address = usb_device_address(dev);
 
 	if (found->intinfo_count > 1) {
 		snprintf(devpath, sizeof(devpath), "%d:%d-i%d",
@@ -1521,7 +1585,7 @@ static int _usb_init(struct cgpu_info *cgpu, struct libusb_device *dev, struct u
 	if (unlikely(!cgusb->descriptor))
 		quit(1, "USB failed to calloc _usb_init cgusb descriptor");
 
-	err = libusb_get_device_descriptor(dev, cgusb->descriptor);
+	err = usb_device_descriptor(dev, cgusb->descriptor);
 	if (err) {
 		applog(LOG_DEBUG,
 			"USB init failed to get descriptor, err %d %s",
@@ -1529,6 +1593,38 @@ static int _usb_init(struct cgpu_info *cgpu, struct libusb_device *dev, struct u
 		goto dame;
 	}
 
+	cgusb->emu = usbemu_dev(dev);
+	if (cgusb->emu) {
+		const char *man = usbemu_manufacturer(cgusb->emu);
+		const char *prod = usbemu_product(cgusb->emu);
+
+		if ((found->iManufacturer && strcmp(man, found->iManufacturer)) ||
+		    (found->iProduct && strcmp(prod, found->iProduct))) {
+			applog(LOG_DEBUG, "USB init, emulated iManufacturer/iProduct mismatch %s",
+			       devstr);
+			bad = USB_INIT_IGNORE;
+			goto dame;
+		}
+
+		/* An emulated device has whatever endpoints the driver wants */
+		for (ifinfo = 0; ifinfo < found->intinfo_count; ifinfo++) {
+			for (epinfo = 0; epinfo < found->intinfos[ifinfo].epinfo_count; epinfo++) {
+				struct usb_epinfo *epinfos = found->intinfos[ifinfo].epinfos;
+
+				epinfos[epinfo].found = true;
+				epinfos[epinfo].wMaxPacketSize = epinfos[epinfo].size;
+			}
+		}
+
+		usbemu_open(cgusb->emu);
+
+		cgusb->usbver = cgusb->descriptor->bcdUSB;
+		cgusb->prod_string = strdup(prod);
+		cgusb->manuf_string = strdup(man);
+		cgusb->serial_string = strdup(usbemu_serial(cgusb->emu));
+		goto emulated;
+	}
+
 	cg_wlock(&cgusb_fd_lock);
 	err = libusb_open(dev, &(cgusb->handle));
 	cg_wunlock(&cgusb_fd_lock);
@@ -1760,6 +1856,22 @@ static int _usb_init(struct cgpu_info *cgpu, struct libusb_device *dev, struct u
 //	cgusb->fwVersion <- for temp1/temp2 decision? or serial? (driver-modminer.c)
 //	cgusb->interfaceVersion
 
+emulated:
+	for (ifinfo = 0; ifinfo < found->intinfo_count; ifinfo++) {
+		for (epinfo = 0; epinfo < found->intinfos[ifinfo].epinfo_count; epinfo++) {
+			if (USBRING(cgusb, ifinfo, epinfo))
+				continue;
+			USBRING(cgusb, ifinfo, epinfo) = calloc(1, sizeof(struct usb_ring));
+			if (unlikely(!USBRING(cgusb, ifinfo, epinfo)))
+				quit(1, "USB failed to calloc ring");
+		}
+	}
+
+	if (opt_usb_record && *opt_usb_record)
+		cgusb->record = usbemu_record_open(devpath, cgusb->descriptor,
+						   cgusb->manuf_string, cgusb->prod_string,
+						   cgusb->serial_string);
+
 	applog(LOG_DEBUG,
 		"USB init %s usbver=%04x prod='%s' manuf='%s' serial='%s'",
 		devstr, cgusb->usbver, cgusb->prod_string,
@@ -1768,7 +1880,8 @@ static int _usb_init(struct cgpu_info *cgpu, struct libusb_device *dev, struct u
 	cgpu->usbdev = cgusb;
 	cgpu->usbinfo.nodev = false;
 
-	libusb_free_config_descriptor(config);
+	if (config)
+		libusb_free_config_descriptor(config);
 
 	// Allow a name change based on the idVendor+idProduct
 	// N.B. must be done before calling add_cgpu()
@@ -1849,7 +1962,7 @@ static bool usb_check_device(struct device_drv *drv, struct libusb_device *dev,
 	int err, i;
 	bool ok;
 
-	err = libusb_get_device_descriptor(dev, &desc);
+	err = usb_device_descriptor(dev, &desc);
 	if (err) {
 		applog(LOG_DEBUG, "USB check device: Failed to get descriptor, err %d", err);
 		return false;
@@ -1863,8 +1976,8 @@ static bool usb_check_device(struct device_drv *drv, struct libusb_device *dev,
 	}
 
 	if (busdev_count > 0) {
-		bus_number = (int)libusb_get_bus_number(dev);
-		device_address = (int)libusb_get_device_address(dev);
+		bus_number = (int)usb_bus_number(dev);
+		device_address = (int)usb_device_address(dev);
 		ok = false;
 		for (i = 0; i < busdev_count; i++) {
 			if (bus_number == busdev[i].bus_number) {
@@ -1927,8 +2040,9 @@ static struct usb_find_devices *usb_check(__maybe_unused struct device_drv *drv,
 
 void usb_detect(struct device_drv *drv, bool (*device_detect)(struct libusb_device *, struct usb_find_devices *))
 {
-	libusb_device **list;
+	libusb_device **real, **list;
 	ssize_t count, i;
+	int emulated;
 	struct usb_find_devices *found;
 
 	applog(LOG_DEBUG, "USB scan devices: checking for %s devices", drv->name);
@@ -1945,12 +2059,22 @@ void usb_detect(struct device_drv *drv, bool (*device_detect)(struct libusb_devi
 		return;
 	}
 
-	count = libusb_get_device_list(NULL, &list);
+	count = libusb_get_device_list(NULL, &real);
 	if (count < 0) {
 		applog(LOG_DEBUG, "USB scan devices: failed, err %d", (int)count);
 		return;
 	}
 
+	/* Emulated devices are found after the real ones */
+	emulated = usbemu_count();
+	list = malloc(sizeof(*list) * (count + emulated));
+	if (unlikely(!list))
+		quit(1, "USB failed to malloc device list");
+	memcpy(list, real, sizeof(*list) * count);
+	for (i = 0; i < emulated; i++)
+		list[count + i] = usbemu_device(i);
+	count += emulated;
+
 	if (count == 0)
 		applog(LOG_DEBUG, "USB scan devices: found no devices");
 	else
@@ -1985,7 +2109,8 @@ void usb_detect(struct device_drv *drv, bool (*device_detect)(struct libusb_devi
 		}
 	}
 
-	libusb_free_device_list(list, 1);
+	free(list);
+	libusb_free_device_list(real, 1);
 }
 
 #if DO_USB_STATS
@@ -2029,6 +2154,38 @@ static void modes_str(char *buf, uint32_t modes)
 }
 #endif
 
+#if DO_USB_STATS
+static struct api_data *api_add_hist(struct api_data *root, const char *dir, struct latency_hist *hist)
+{
+	struct latency_hist copy;
+	uint64_t p50, p99, p999;
+	char name[32];
+
+	if (!hist)
+		return root;
+
+	// Take a copy so the percentiles agree with the count
+	lat_hist_snapshot(&copy, hist);
+	if (copy.count == 0)
+		return root;
+
+	p50 = lat_hist_pct(&copy, 50);
+	p99 = lat_hist_pct(&copy, 99);
+	p999 = lat_hist_pct(&copy, 99.9);
+
+	snprintf(name, sizeof(name), "%s Transfers", dir);
+	root = api_add_uint64(root, name, &(copy.count), true);
+	snprintf(name, sizeof(name), "%s P50 us", dir);
+	root = api_add_uint64(root, name, &p50, true);
+	snprintf(name, sizeof(name), "%s P99 us", dir);
+	root = api_add_uint64(root, name, &p99, true);
+	snprintf(name, sizeof(name), "%s P999 us", dir);
+	root = api_add_uint64(root, name, &p999, true);
+
+	return root;
+}
+#endif
+
 // The stat data can be spurious due to not locking it before copying it -
 // however that would require the stat() function to also lock and release
 // a mutex every time a usb read or write is called which would slow
@@ -2103,6 +2260,8 @@ struct api_data *api_usb_stats(__maybe_unused int *count)
 					&(details->item[CMD_ERROR].first), true);
 		root = api_add_timeval(root, "Last Error",
 					&(details->item[CMD_ERROR].last), true);
+		root = api_add_hist(root, "Read", details->hist[USB_HIST_READ]);
+		root = api_add_hist(root, "Write", details->hist[USB_HIST_WRITE]);
 
 		return root;
 	}
@@ -2110,6 +2269,32 @@ struct api_data *api_usb_stats(__maybe_unused int *count)
 	return NULL;
 }
 
+/* Reset what the usbstats API command shows, the device list is kept.
+ * Anything recorded while this runs may or may not be kept */
+void usb_zero_stats(void)
+{
+#if DO_USB_STATS
+	struct cg_usb_stats_details *details;
+	int device, cmdseq, dir;
+
+	mutex_lock(&cgusb_lock);
+
+	for (device = 0; device < next_stat; device++) {
+		for (cmdseq = 0; cmdseq < C_MAX * 2; cmdseq++) {
+			details = &(usb_stats[device].details[cmdseq]);
+			details->modes = 0;
+			memset(details->item, 0, sizeof(details->item));
+			for (dir = USB_HIST_READ; dir <= USB_HIST_WRITE; dir++) {
+				if (details->hist[dir])
+					lat_hist_reset_atomic(details->hist[dir]);
+			}
+		}
+	}
+
+	mutex_unlock(&cgusb_lock);
+#endif
+}
+
 #if DO_USB_STATS
 static void newstats(struct cgpu_info *cgpu)
 {
@@ -2153,8 +2338,9 @@ void update_usb_stats(__maybe_unused struct cgpu_info *cgpu)
 static void stats(struct cgpu_info *cgpu, struct timeval *tv_start, struct timeval *tv_finish, int err, int mode, enum usb_cmds cmd, int seq, int timeout)
 {
 	struct cg_usb_stats_details *details;
+	struct latency_hist *hist;
 	double diff;
-	int item, extrams;
+	int item, extrams, dir;
 
 	if (cgpu->usbinfo.usbstat < 1)
 		newstats(cgpu);
@@ -2218,6 +2404,22 @@ static void stats(struct cgpu_info *cgpu, struct timeval *tv_start, struct timev
 	details->item[item].total_delay += diff;
 	memcpy(&(details->item[item].last), tv_start, sizeof(*tv_start));
 	details->item[item].count++;
+
+	dir = (mode & (MODE_CTRL_READ | MODE_BULK_READ)) ? USB_HIST_READ : USB_HIST_WRITE;
+	hist = details->hist[dir];
+	if (unlikely(!hist)) {
+		hist = calloc(1, sizeof(*hist));
+		if (unlikely(!hist))
+			quit(1, "USB failed to calloc hist");
+		lat_hist_reset_atomic(hist);
+		// Another thread may have got in first
+		if (!__sync_bool_compare_and_swap(&(details->hist[dir]), NULL, hist)) {
+			free(hist);
+			hist = details->hist[dir];
+		}
+	}
+
+	lat_hist_add_atomic(hist, (int64_t)us_tdiff(tv_finish, tv_start));
 }
 
 static void rejected_inc(struct cgpu_info *cgpu, uint32_t mode)
@@ -2234,34 +2436,80 @@ static void rejected_inc(struct cgpu_info *cgpu, uint32_t mode)
 }
 #endif
 
-static char *find_end(unsigned char *buf, unsigned char *ptr, int ptrlen, int tot, char *end, int endlen, bool first)
+/* Put back the byte the last frame's null terminator was written over */
+static void ring_unhold(struct usb_ring *ring)
 {
-	unsigned char *search;
+	if (ring->held) {
+		ring->buf[ring->head] = ring->held_byte;
+		ring->held = false;
+	}
+}
 
-	if (endlen > tot)
-		return NULL;
+static void ring_clear(struct usb_ring *ring)
+{
+	ring->head = ring->tail = ring->scanned = 0;
+	ring->held = false;
+}
 
-	// If end is only 1 char - do a faster search
-	if (endlen == 1) {
-		if (first)
-			search = buf;
+/* Make sure there's room for a full read after the data held */
+static void ring_room(struct usb_ring *ring, int size)
+{
+	int amt = ring->tail - ring->head;
+
+	if (amt == 0) {
+		ring->head = ring->tail = 0;
+		return;
+	}
+
+	if (ring->tail + size > USB_RING_SIZE) {
+		memmove(ring->buf, ring->buf + ring->head, amt);
+		ring->head = 0;
+		ring->tail = amt;
+	}
+}
+
+/*
+ * Return the offset from head just past end, or 0 if it isn't there yet.
+ * Anything already searched for the same end isn't searched again, apart
+ * from enough to find an end that was split across 2 reads
+ */
+static int ring_find_end(struct usb_ring *ring, const char *end, int endlen)
+{
+	unsigned char *start, *stop, *search;
+	int amt = ring->tail - ring->head;
+
+	if (endlen >= (int)sizeof(ring->scan_end) || strcmp(ring->scan_end, end)) {
+		ring->scanned = 0;
+		if (endlen < (int)sizeof(ring->scan_end))
+			strcpy(ring->scan_end, end);
 		else
-			search = ptr;
+			ring->scan_end[0] = '\0';
+	}
 
-		return strchr((char *)search, *end);
-	} else {
-		if (first)
-			search = buf;
-		else {
-			// must allow end to have been chopped in 2
-			if ((tot - ptrlen) >= (endlen - 1))
-				search = ptr - (endlen - 1);
-			else
-				search = ptr - (tot - ptrlen);
-		}
+	if (endlen > amt)
+		return 0;
+
+	start = ring->buf + ring->head + ring->scanned;
+	stop = ring->buf + ring->tail - endlen;
 
-		return strstr((char *)search, end);
+	// If end is only 1 char - do a faster search
+	if (endlen == 1)
+		search = memchr(start, *end, stop - start + 1);
+	else {
+		for (search = start; search <= stop; search++) {
+			search = memchr(search, *end, stop - search + 1);
+			if (!search || !memcmp(search, end, endlen))
+				break;
+		}
+		if (search > stop)
+			search = NULL;
 	}
+
+	if (search)
+		return search + endlen - (ring->buf + ring->head);
+
+	ring->scanned = amt - (endlen - 1);
+	return 0;
 }
 
 #define USB_MAX_READ 8192
@@ -2271,15 +2519,25 @@ struct usb_transfer {
 	cgsem_t cgsem;
 	struct libusb_transfer *transfer;
 	bool cancellable;
+	bool readahead;
+	volatile bool flying;
 	struct list_head list;
 };
 
+/* Read ahead transfers stay on the list between being queued, so only count
+ * them while they are actually in flight */
 bool async_usb_transfers(void)
 {
-	bool ret;
+	struct usb_transfer *ut;
+	bool ret = false;
 
 	cg_rlock(&cgusb_fd_lock);
-	ret = !list_empty(&ut_list);
+	list_for_each_entry(ut, &ut_list, list) {
+		if (!ut->readahead || ut->flying) {
+			ret = true;
+			break;
+		}
+	}
 	cg_runlock(&cgusb_fd_lock);
 
 	return ret;
@@ -2316,6 +2574,8 @@ static void init_usb_transfer(struct usb_transfer *ut)
 		quit(1, "Failed to libusb_alloc_transfer");
 	ut->transfer->user_data = ut;
 	ut->cancellable = false;
+	ut->readahead = false;
+	ut->flying = false;
 }
 
 static void complete_usb_transfer(struct usb_transfer *ut)
@@ -2333,6 +2593,7 @@ static void LIBUSB_CALL transfer_callback(struct libusb_transfer *transfer)
 	struct usb_transfer *ut = transfer->user_data;
 
 	ut->cancellable = false;
+	ut->flying = false;
 	cgsem_post(&ut->cgsem);
 }
 
@@ -2407,6 +2668,38 @@ static int usb_submit_transfer(struct usb_transfer *ut, struct libusb_transfer *
 	return err;
 }
 
+static int usb_clear_pipe(struct cgpu_info *cgpu, struct libusb_device_handle *dev_handle,
+			  unsigned char endpoint)
+{
+	int err, retries = 0;
+
+	do {
+		cgpu->usbinfo.last_pipe = time(NULL);
+		cgpu->usbinfo.pipe_count++;
+		applog(LOG_INFO, "%s%i: libusb pipe error, trying to clear",
+			cgpu->drv->name, cgpu->device_id);
+		err = libusb_clear_halt(dev_handle, endpoint);
+		applog(LOG_DEBUG, "%s%i: libusb pipe error%scleared",
+			cgpu->drv->name, cgpu->device_id, err ? " not " : " ");
+
+		if (err)
+			cgpu->usbinfo.clear_fail_count++;
+	} while (err && ++retries < USB_RETRY_MAX);
+
+	return err;
+}
+
+static void usb_record_bulk(struct cgpu_info *cgpu, unsigned char endpoint,
+			    unsigned char *data, int transferred)
+{
+	/* FTDI reads with nothing after the 2 status bytes aren't worth
+	 * replaying */
+	if (cgpu->usbdev->record && transferred > 0 &&
+	    ((endpoint & LIBUSB_ENDPOINT_DIR_MASK) == LIBUSB_ENDPOINT_OUT ||
+	     cgpu->usbdev->usb_type != USB_TYPE_FTDI || transferred > 2))
+		usbemu_record_bulk(cgpu->usbdev->record, endpoint, data, transferred);
+}
+
 static int
 usb_bulk_transfer(struct libusb_device_handle *dev_handle, int intinfo,
 		  int epinfo, unsigned char *data, int length,
@@ -2445,6 +2738,15 @@ usb_bulk_transfer(struct libusb_device_handle *dev_handle, int intinfo,
 	else
 		eot = true;
 
+	if (cgpu->usbdev->emu) {
+		STATS_TIMEVAL(&tv_start);
+		err = usbemu_bulk_transfer(cgpu->usbdev->emu, endpoint, data, length,
+					   transferred, timeout);
+		STATS_TIMEVAL(&tv_finish);
+		USB_STATS(cgpu, &tv_start, &tv_finish, err, mode, cmd, seq, timeout);
+		goto record;
+	}
+
 	/* Avoid any async transfers during shutdown to allow the polling
 	 * thread to be shut down after all existing transfers are complete */
 	if (unlikely(cgpu->shutdown))
@@ -2489,22 +2791,8 @@ usb_bulk_transfer(struct libusb_device_handle *dev_handle, int intinfo,
 				usb_cmdname(cmd), *transferred, err, errn);
 	}
 
-	if (err == LIBUSB_ERROR_PIPE) {
-		int retries = 0;
-
-		do {
-			cgpu->usbinfo.last_pipe = time(NULL);
-			cgpu->usbinfo.pipe_count++;
-			applog(LOG_INFO, "%s%i: libusb pipe error, trying to clear",
-				cgpu->drv->name, cgpu->device_id);
-			err = libusb_clear_halt(dev_handle, endpoint);
-			applog(LOG_DEBUG, "%s%i: libusb pipe error%scleared",
-				cgpu->drv->name, cgpu->device_id, err ? " not " : " ");
-
-			if (err)
-				cgpu->usbinfo.clear_fail_count++;
-		} while (err && ++retries < USB_RETRY_MAX);
-	}
+	if (err == LIBUSB_ERROR_PIPE)
+		err = usb_clear_pipe(cgpu, dev_handle, endpoint);
 	if ((endpoint & LIBUSB_ENDPOINT_DIR_MASK) == LIBUSB_ENDPOINT_IN)
 		memcpy(data, buf, *transferred);
 	else if (zlp) {
@@ -2514,28 +2802,233 @@ usb_bulk_transfer(struct libusb_device_handle *dev_handle, int intinfo,
 #endif
 	}
 
+record:
+	usb_record_bulk(cgpu, endpoint, data, *transferred);
+
 	return err;
 }
 
-int _usb_read(struct cgpu_info *cgpu, int intinfo, int epinfo, char *buf, size_t bufsiz, int *processed, int timeout, const char *end, enum usb_cmds cmd, bool readonce, bool cancellable)
+#ifndef WIN32
+/*
+ * Bulk transfers kept queued on each IN endpoint a driver reads, so data
+ * arrives while the driver is busy rather than when it next asks. Reads take
+ * them oldest first so the data stays in order, and a read that times out
+ * leaves them queued for the next one. They are cancellable while in flight so
+ * a work restart cancels them, which only ends a read early if the read itself
+ * is cancellable. They are reaped before the device is closed and aren't
+ * queued again once shutdown starts. Windows keeps one transfer per read since
+ * it relies on libusb's own transfer timeouts
+ */
+#define USB_READ_AHEAD 4
+
+/* ms to wait for a cancelled read ahead transfer to end */
+#define USB_READ_AHEAD_REAP 1000
+
+struct usb_readahead {
+	struct usb_transfer ut;
+	bool queued;		// Submitted and not yet taken by a read
+	unsigned char buf[512];
+};
+
+/* Set under cgusb_fd_lock by usb_cleanup() */
+static bool readahead_stopped;
+
+static int readahead_submit(struct cgpu_info *cgpu, struct usb_readahead *ra)
+{
+	int err;
+
+	cg_wlock(&cgusb_fd_lock);
+	if (readahead_stopped || cgpu->shutdown)
+		err = LIBUSB_ERROR_INTERRUPTED;
+	else {
+		ra->ut.cancellable = true;
+		ra->ut.flying = true;
+		err = libusb_submit_transfer(ra->ut.transfer);
+		if (unlikely(err)) {
+			ra->ut.cancellable = false;
+			ra->ut.flying = false;
+		}
+	}
+	cg_wunlock(&cgusb_fd_lock);
+
+	ra->queued = !err;
+	return err;
+}
+
+static void readahead_start(struct cgpu_info *cgpu, struct usb_ring *ring, int intinfo, int epinfo)
+{
+	struct usb_epinfo *usb_epinfo;
+	struct usb_readahead *ra;
+	int i, length;
+
+	usb_epinfo = &(cgpu->usbdev->found->intinfos[intinfo].epinfos[epinfo]);
+	/* One packet each, as for usb_bulk_transfer(), since FTDI puts its 2
+	 * status bytes at the start of every packet */
+	length = MIN(usb_epinfo->wMaxPacketSize, (int)sizeof(ra->buf));
+
+	ring->ahead = calloc(USB_READ_AHEAD, sizeof(*ring->ahead));
+	if (unlikely(!ring->ahead))
+		quit(1, "USB failed to calloc read ahead");
+	ring->ahead_next = 0;
+
+	for (i = 0; i < USB_READ_AHEAD; i++) {
+		ra = &ring->ahead[i];
+		init_usb_transfer(&ra->ut);
+		ra->ut.readahead = true;
+		libusb_fill_bulk_transfer(ra->ut.transfer, cgpu->usbdev->handle,
+					  usb_epinfo->ep, ra->buf, length,
+					  transfer_callback, &ra->ut, 0);
+		INIT_LIST_HEAD(&ra->ut.list);
+		cg_wlock(&cgusb_fd_lock);
+		list_add(&ra->ut.list, &ut_list);
+		cg_wunlock(&cgusb_fd_lock);
+		readahead_submit(cgpu, ra);
+	}
+}
+
+/* Cancel an endpoint's read ahead and wait for its transfers to end */
+static void readahead_stop(struct usb_ring *ring)
+{
+	struct usb_readahead *ra;
+	int i;
+
+	if (!ring->ahead)
+		return;
+
+	cg_wlock(&cgusb_fd_lock);
+	for (i = 0; i < USB_READ_AHEAD; i++) {
+		if (ring->ahead[i].ut.flying)
+			libusb_cancel_transfer(ring->ahead[i].ut.transfer);
+	}
+	cg_wunlock(&cgusb_fd_lock);
+
+	// Every queued transfer posts once when it ends, whether taken or not
+	for (i = 0; i < USB_READ_AHEAD; i++) {
+		ra = &ring->ahead[i];
+		if (ra->queued && cgsem_mswait(&ra->ut.cgsem, USB_READ_AHEAD_REAP)) {
+			/* Without the polling thread it will never end, so
+			 * it can't be freed */
+			applog(LOG_WARNING, "USB read ahead transfer didn't end when cancelled");
+			ring->ahead = NULL;
+			return;
+		}
+	}
+
+	for (i = 0; i < USB_READ_AHEAD; i++)
+		complete_usb_transfer(&ring->ahead[i].ut);
+	free(ring->ahead);
+	ring->ahead = NULL;
+}
+
+/* Start reading ahead on an endpoint the first time it's read, and stop
+ * again for the synchronous reads at shutdown */
+static void readahead_check(struct cgpu_info *cgpu, struct usb_ring *ring, int intinfo, int epinfo)
+{
+	if (cgpu->usbdev->emu)
+		return;
+	if (cgpu->shutdown || readahead_stopped)
+		readahead_stop(ring);
+	else if (!ring->ahead)
+		readahead_start(cgpu, ring, intinfo, epinfo);
+}
+
+/* Discard whatever already completed read ahead transfers got */
+static void readahead_drain(struct cgpu_info *cgpu, struct usb_ring *ring)
+{
+	struct usb_readahead *ra;
+
+	while (ring->ahead) {
+		ra = &ring->ahead[ring->ahead_next];
+		if (!ra->queued || cgsem_mswait(&ra->ut.cgsem, 0))
+			break;
+		ring->ahead_next = (ring->ahead_next + 1) % USB_READ_AHEAD;
+		readahead_submit(cgpu, ra);
+	}
+}
+
+/* Wait up to timeout for the oldest read ahead transfer, copy what it got to
+ * data and queue it again. Returns as usb_bulk_transfer() does */
+static int readahead_take(struct cgpu_info *cgpu, struct usb_ring *ring, unsigned char *data,
+			  int *transferred, unsigned int timeout, __maybe_unused int mode,
+			  enum usb_cmds cmd, __maybe_unused int seq, bool cancellable)
+{
+	struct usb_readahead *ra = &ring->ahead[ring->ahead_next];
+	struct libusb_transfer *transfer = ra->ut.transfer;
+#if DO_USB_STATS
+	struct timeval tv_start, tv_finish;
+#endif
+	int err;
+
+	*transferred = 0;
+
+	// One that couldn't be queued again last time gets another try
+	if (!ra->queued) {
+		err = readahead_submit(cgpu, ra);
+		if (err)
+			return err;
+	}
+
+	STATS_TIMEVAL(&tv_start);
+	if (cgsem_mswait(&ra->ut.cgsem, timeout)) {
+		STATS_TIMEVAL(&tv_finish);
+		USB_STATS(cgpu, &tv_start, &tv_finish, LIBUSB_ERROR_TIMEOUT, mode, cmd, seq, timeout);
+		return LIBUSB_ERROR_TIMEOUT;
+	}
+	STATS_TIMEVAL(&tv_finish);
+
+	ra->queued = false;
+	ring->ahead_next = (ring->ahead_next + 1) % USB_READ_AHEAD;
+
+	err = usb_transfer_toerr(transfer->status);
+	// A work restart cancelled it, which only ends cancellable reads
+	if (transfer->status == LIBUSB_TRANSFER_CANCELLED && !cancellable)
+		err = LIBUSB_SUCCESS;
+	*transferred = transfer->actual_length;
+	memcpy(data, ra->buf, *transferred);
+	USB_STATS(cgpu, &tv_start, &tv_finish, err, mode, cmd, seq, timeout);
+
+	if (err < 0) {
+		applog(LOG_DEBUG, "%s%i: %s (amt=%d err=%d)",
+				cgpu->drv->name, cgpu->device_id,
+				usb_cmdname(cmd), *transferred, err);
+	}
+
+	if (err == LIBUSB_ERROR_PIPE)
+		err = usb_clear_pipe(cgpu, cgpu->usbdev->handle, transfer->endpoint);
+	if (!NODEV(err))
+		readahead_submit(cgpu, ra);
+
+	usb_record_bulk(cgpu, transfer->endpoint, data, *transferred);
+
+	return err;
+}
+#endif
+
+/*
+ * Data is read into the endpoint's ring and the frame is left there,
+ * _usb_read() copies it to the caller's buffer, _usb_read_frame() doesn't
+ */
+static int __usb_read(struct cgpu_info *cgpu, int intinfo, int epinfo, char *buf, char **frame, size_t bufsiz, int *processed, int timeout, const char *end, enum usb_cmds cmd, bool readonce, bool cancellable)
 {
 	struct cg_usb_device *usbdev;
+	struct usb_ring *ring;
 	bool ftdi;
 	struct timeval read_start, tv_finish;
 	unsigned int initial_timeout;
-	int bufleft, err, got, tot, pstate;
-	bool first = true;
-	bool dobuffer;
-	char *search;
-	int endlen;
-	unsigned char *ptr, *usbbuf = cgpu->usbinfo.bulkbuf;
+	int err, got, tot, amt, pstate;
+	bool first = true, expired = false;
+	int endlen = 0;
+	unsigned char *ptr;
 	const size_t usbbufread = 512; /* Always read full size */
 	double done;
 
 	DEVRLOCK(cgpu, pstate);
 
 	if (cgpu->usbinfo.nodev) {
-		*buf = '\0';
+		if (buf)
+			*buf = '\0';
+		else
+			*frame = "";
 		*processed = 0;
 		USB_REJECT(cgpu, MODE_BULK_READ);
 
@@ -2545,6 +3038,7 @@ int _usb_read(struct cgpu_info *cgpu, int intinfo, int epinfo, char *buf, size_t
 
 	usbdev = cgpu->usbdev;
 	ftdi = (usbdev->usb_type == USB_TYPE_FTDI);
+	ring = USBRING(usbdev, intinfo, epinfo);
 
 	USBDEBUG("USB debug: _usb_read(%s (nodev=%s),intinfo=%d,epinfo=%d,buf=%p,bufsiz=%d,proc=%p,timeout=%u,end=%s,cmd=%s,ftdi=%s,readonce=%s)", cgpu->drv->name, bool_str(cgpu->usbinfo.nodev), intinfo, epinfo, buf, (int)bufsiz, processed, timeout, end ? (char *)str_text((char *)end) : "NULL", usb_cmdname(cmd), bool_str(ftdi), bool_str(readonce));
 
@@ -2554,95 +3048,44 @@ int _usb_read(struct cgpu_info *cgpu, int intinfo, int epinfo, char *buf, size_t
 	if (timeout == DEVTIMEOUT)
 		timeout = usbdev->found->timeout;
 
-	if (end == NULL) {
-		tot = usbdev->bufamt;
-		bufleft = bufsiz - tot;
-		if (tot)
-			memcpy(usbbuf, usbdev->buffer, tot);
-		ptr = usbbuf + tot;
-		usbdev->bufamt = 0;
+	if (end)
+		endlen = strlen(end);
 
-		err = LIBUSB_SUCCESS;
-		initial_timeout = timeout;
-		cgtime(&read_start);
-		while (bufleft > 0) {
-			got = 0;
-
-			err = usb_bulk_transfer(usbdev->handle, intinfo, epinfo,
-						ptr, usbbufread, &got, timeout,
-						cgpu, MODE_BULK_READ, cmd, first ? SEQ0 : SEQ1,
-						cancellable);
-			cgtime(&tv_finish);
-			ptr[got] = '\0';
-
-			USBDEBUG("USB debug: @_usb_read(%s (nodev=%s)) first=%s err=%d%s got=%d ptr='%s' usbbufread=%d", cgpu->drv->name, bool_str(cgpu->usbinfo.nodev), bool_str(first), err, isnodev(err), got, (char *)str_text((char *)ptr), (int)usbbufread);
-
-			IOERR_CHECK(cgpu, err);
-
-			if (ftdi) {
-				// first 2 bytes returned are an FTDI status
-				if (got > 2) {
-					got -= 2;
-					memmove(ptr, ptr+2, got+1);
-				} else {
-					got = 0;
-					*ptr = '\0';
-				}
-			}
-
-			tot += got;
-
-			if (err || readonce)
-				break;
-
-			ptr += got;
-			bufleft -= got;
-
-			first = false;
-
-			done = tdiff(&tv_finish, &read_start);
-			// N.B. this is: return last err with whatever size has already been read
-			timeout = initial_timeout - (done * 1000);
-			if (timeout <= 0)
-				break;
-		}
-
-		// N.B. usbdev->buffer was emptied before the while() loop
-		if (tot > (int)bufsiz) {
-			usbdev->bufamt = tot - bufsiz;
-			memcpy(usbdev->buffer, usbbuf + bufsiz, usbdev->bufamt);
-			tot -= usbdev->bufamt;
-			usbbuf[tot] = '\0';
-			applog(LOG_DEBUG, "USB: %s%i read1 buffering %d extra bytes",
-			       cgpu->drv->name, cgpu->device_id, usbdev->bufamt);
-		}
-
-		*processed = tot;
-		memcpy((char *)buf, (const char *)usbbuf, (tot < (int)bufsiz) ? tot + 1 : (int)bufsiz);
-
-		goto out_unlock;
-	}
-
-	tot = usbdev->bufamt;
-	bufleft = bufsiz - tot;
-	if (tot)
-		memcpy(usbbuf, usbdev->buffer, tot);
-	ptr = usbbuf + tot;
-	usbdev->bufamt = 0;
+	ring_unhold(ring);
+#ifndef WIN32
+	readahead_check(cgpu, ring, intinfo, epinfo);
+#endif
 
-	endlen = strlen(end);
 	err = LIBUSB_SUCCESS;
 	initial_timeout = timeout;
 	cgtime(&read_start);
+	while (42) {
+		amt = ring->tail - ring->head;
+		if (end && (tot = ring_find_end(ring, end, endlen)))
+			break;
+		tot = amt;
+		if (amt >= (int)bufsiz || err || expired)
+			break;
+		// Data held from before counts as the one read
+		if (readonce && (amt || !first))
+			break;
 
-	while (bufleft > 0) {
+		ring_room(ring, usbbufread);
+		ptr = ring->buf + ring->tail;
 		got = 0;
+
+#ifndef WIN32
+		if (ring->ahead)
+			err = readahead_take(cgpu, ring, ptr, &got, timeout,
+					     MODE_BULK_READ, cmd, first ? SEQ0 : SEQ1,
+					     cancellable);
+		else
+#endif
 		err = usb_bulk_transfer(usbdev->handle, intinfo, epinfo,
 					ptr, usbbufread, &got, timeout,
 					cgpu, MODE_BULK_READ, cmd, first ? SEQ0 : SEQ1,
 					cancellable);
 		cgtime(&tv_finish);
-		ptr[got] = '\0';
 
 		USBDEBUG("USB debug: @_usb_read(%s (nodev=%s)) first=%s err=%d%s got=%d ptr='%s' usbbufread=%d", cgpu->drv->name, bool_str(cgpu->usbinfo.nodev), bool_str(first), err, isnodev(err), got, (char *)str_text((char *)ptr), (int)usbbufread);
 
@@ -2652,67 +3095,48 @@ int _usb_read(struct cgpu_info *cgpu, int intinfo, int epinfo, char *buf, size_t
 			// first 2 bytes returned are an FTDI status
 			if (got > 2) {
 				got -= 2;
-				memmove(ptr, ptr+2, got+1);
-			} else {
+				memmove(ptr, ptr+2, got);
+			} else
 				got = 0;
-				*ptr = '\0';
-			}
 		}
 
-		tot += got;
-
-		if (err || readonce)
-			break;
-
-		if (find_end(usbbuf, ptr, got, tot, (char *)end, endlen, first))
-			break;
-
-		ptr += got;
-		bufleft -= got;
-
+		ring->tail += got;
 		first = false;
 
 		done = tdiff(&tv_finish, &read_start);
-		// N.B. this is: return LIBUSB_SUCCESS with whatever size has already been read
+		// N.B. this is: return last err with whatever size has already been read
 		timeout = initial_timeout - (done * 1000);
 		if (timeout <= 0)
-			break;
+			expired = true;
 	}
 
-	dobuffer = false;
+	if (tot > (int)bufsiz)
+		tot = bufsiz;
 
-	if ((search = find_end(usbbuf, usbbuf, tot, tot, (char *)end, endlen, true))) {
-		// end finishes after bufsiz
-		if ((search + endlen - (char *)usbbuf) > (int)bufsiz) {
-			usbdev->bufamt = tot - bufsiz;
-			dobuffer = true;
-		} else {
-			// extra data after end
-			if (*(search + endlen)) {
-				usbdev->bufamt = tot - (search + endlen - (char *)usbbuf);
-				dobuffer = true;
-			}
-		}
-	} else {
-		// no end, but still bigger than bufsiz
-		if (tot > (int)bufsiz) {
-			usbdev->bufamt = tot - bufsiz;
-			dobuffer = true;
-		}
-	}
+	ptr = ring->buf + ring->head;
+	ring->head += tot;
+	ring->scanned = 0;
 
-	if (dobuffer) {
-		tot -= usbdev->bufamt;
-		memcpy(usbdev->buffer, usbbuf + tot, usbdev->bufamt);
-		usbbuf[tot] = '\0';
-		applog(LOG_DEBUG, "USB: %s%i read2 buffering %d extra bytes",
-			cgpu->drv->name, cgpu->device_id, usbdev->bufamt);
+	if (ring->tail > ring->head) {
+		applog(LOG_DEBUG, "USB: %s%i read buffering %d extra bytes",
+		       cgpu->drv->name, cgpu->device_id, ring->tail - ring->head);
 	}
 
 	*processed = tot;
-	memcpy((char *)buf, (const char *)usbbuf, (tot < (int)bufsiz) ? tot + 1 : (int)bufsiz);
+	if (buf) {
+		memcpy(buf, ptr, tot);
+		if (tot < (int)bufsiz)
+			buf[tot] = '\0';
+	} else {
+		// The terminator goes over the next frame's first byte until the next read
+		if (ring->tail > ring->head) {
+			ring->held_byte = ring->buf[ring->head];
+			ring->held = true;
+		}
+		ring->buf[ring->head] = '\0';
+		*frame = (char *)ptr;
+	}
 
-out_unlock:
 	if (err && err != LIBUSB_ERROR_TIMEOUT) {
 		applog(LOG_WARNING, "%s %i %s usb read err:(%d) %s", cgpu->drv->name, cgpu->device_id, usb_cmdname(cmd),
 		       err, libusb_error_name(err));
@@ -2730,6 +3154,16 @@ out_noerrmsg:
 	return err;
 }
 
+int _usb_read(struct cgpu_info *cgpu, int intinfo, int epinfo, char *buf, size_t bufsiz, int *processed, int timeout, const char *end, enum usb_cmds cmd, bool readonce, bool cancellable)
+{
+	return __usb_read(cgpu, intinfo, epinfo, buf, NULL, bufsiz, processed, timeout, end, cmd, readonce, cancellable);
+}
+
+int _usb_read_frame(struct cgpu_info *cgpu, int intinfo, int epinfo, char **frame, size_t bufsiz, int *processed, int timeout, const char *end, enum usb_cmds cmd, bool readonce, bool cancellable)
+{
+	return __usb_read(cgpu, intinfo, epinfo, NULL, frame, bufsiz, processed, timeout, end, cmd, readonce, cancellable);
+}
+
 int _usb_write(struct cgpu_info *cgpu, int intinfo, int epinfo, char *buf, size_t bufsiz, int *processed, int timeout, enum usb_cmds cmd)
 {
 	struct cg_usb_device *usbdev;
@@ -2825,6 +3259,15 @@ static int usb_control_transfer(struct cgpu_info *cgpu, libusb_device_handle *de
 	unsigned char buf[70];
 	int err, transferred;
 
+	if (cgpu->usbdev->emu) {
+		err = usbemu_control_transfer(cgpu->usbdev->emu, bmRequestType, bRequest,
+					      wValue, wIndex, buffer, wLength);
+		if (err > 0 && (bmRequestType & LIBUSB_ENDPOINT_DIR_MASK) == LIBUSB_ENDPOINT_IN)
+			usbemu_record_control(cgpu->usbdev->record, bmRequestType, bRequest,
+					      wValue, wIndex, buffer, err);
+		return err;
+	}
+
 	if (unlikely(cgpu->shutdown))
 		return libusb_control_transfer(dev_handle, bmRequestType, bRequest, wValue, wIndex, buffer, wLength, timeout);
 
@@ -2839,9 +3282,12 @@ static int usb_control_transfer(struct cgpu_info *cgpu, libusb_device_handle *de
 	if (!err)
 		err = callback_wait(&ut, &transferred, timeout);
 	if (err == LIBUSB_SUCCESS && transferred) {
-		if ((bmRequestType & LIBUSB_ENDPOINT_DIR_MASK) == LIBUSB_ENDPOINT_IN)
+		if ((bmRequestType & LIBUSB_ENDPOINT_DIR_MASK) == LIBUSB_ENDPOINT_IN) {
 			memcpy(buffer, libusb_control_transfer_get_data(ut.transfer),
 			       transferred);
+			usbemu_record_control(cgpu->usbdev->record, bmRequestType, bRequest,
+					      wValue, wIndex, buffer, transferred);
+		}
 		err = transferred;
 		goto out;
 	}
@@ -3037,12 +3483,20 @@ int _usb_ftdi_set_latency(struct cgpu_info *cgpu, int intinfo)
 
 void usb_buffer_clear(struct cgpu_info *cgpu)
 {
-	int pstate;
+	int i, pstate;
 
 	DEVWLOCK(cgpu, pstate);
 
-	if (cgpu->usbdev)
-		cgpu->usbdev->bufamt = 0;
+	if (cgpu->usbdev) {
+		for (i = 0; i < USB_RINGS; i++) {
+			if (cgpu->usbdev->ring[i]) {
+#ifndef WIN32
+				readahead_drain(cgpu, cgpu->usbdev->ring[i]);
+#endif
+				ring_clear(cgpu->usbdev->ring[i]);
+			}
+		}
+	}
 
 	DEVWUNLOCK(cgpu, pstate);
 }
@@ -3050,12 +3504,16 @@ void usb_buffer_clear(struct cgpu_info *cgpu)
 uint32_t usb_buffer_size(struct cgpu_info *cgpu)
 {
 	uint32_t ret = 0;
-	int pstate;
+	int i, pstate;
 
 	DEVRLOCK(cgpu, pstate);
 
-	if (cgpu->usbdev)
-		ret = cgpu->usbdev->bufamt;
+	if (cgpu->usbdev) {
+		for (i = 0; i < USB_RINGS; i++) {
+			if (cgpu->usbdev->ring[i])
+				ret += cgpu->usbdev->ring[i]->tail - cgpu->usbdev->ring[i]->head;
+		}
+	}
 
 	DEVRUNLOCK(cgpu, pstate);
 
@@ -3171,6 +3629,12 @@ void usb_cleanup(void)
 
 	hotplug_time = 0;
 
+#ifndef WIN32
+	cg_wlock(&cgusb_fd_lock);
+	readahead_stopped = true;
+	cg_wunlock(&cgusb_fd_lock);
+#endif
+
 	cgsleep_ms(10);
 
 	count = 0;
@@ -3326,6 +3790,8 @@ void usb_initialise(void)
 			free(fre);
 		}
 	}
+
+	usbemu_initialise();
 }
 
 #ifndef WIN32
@@ -183,11 +183,41 @@ enum usb_types {
 
 #define USB_MAX_READ 8192
 
+/* Endpoint addresses without the direction bit, one ring per IN endpoint */
+#define USB_RINGS 16
+
+/*
+ * Data read from an IN endpoint that the driver hasn't taken yet.
+ * Transfers land directly after the data already held and frames are
+ * handed out from where they sit, so nothing is copied back and forth
+ * between reads. scanned is how much of the held data has already been
+ * searched for scan_end, so each read only searches the new bytes.
+ * There is room for a full USB_MAX_READ plus the largest leftover, and
+ * one byte more for the null terminator
+ */
+#define USB_RING_SIZE (USB_MAX_READ * 2)
+
+struct usb_readahead;
+
+struct usb_ring {
+	int head;
+	int tail;
+	int scanned;
+	char scan_end[8];
+	bool held;
+	unsigned char held_byte;
+	struct usb_readahead *ahead;	// Transfers queued on the endpoint, if any
+	int ahead_next;			// The oldest of them, which the next read takes
+	unsigned char buf[USB_RING_SIZE + 1];
+};
+
 struct cg_usb_device {
 	struct usb_find_devices *found;
 	libusb_device_handle *handle;
 	pthread_mutex_t *mutex;
 	struct libusb_device_descriptor *descriptor;
+	struct usbemu_dev *emu;
+	struct usbemu_record *record;
 	enum usb_types usb_type;
 	enum sub_ident ident;
 	uint16_t usbver;
@@ -198,9 +228,7 @@ struct cg_usb_device {
 	char *serial_string;
 	unsigned char fwVersion;	// ??
 	unsigned char interfaceVersion;	// ??
-	char buffer[USB_MAX_READ];
-	uint32_t bufsiz;
-	uint32_t bufamt;
+	struct usb_ring *ring[USB_RINGS];
 };
 
 #define USB_NOSTAT 0
@@ -250,13 +278,6 @@ struct cg_usb_info {
 	uint64_t write_delay_count;
 	double total_write_delay;
 
-	/*
-	 * We add 4: 1 for null, 2 for FTDI status and 1 to round to 4 bytes
-	 * If a single device ever has multiple end points then it will need
-	 * multiple of these
-	 */
-	unsigned char bulkbuf[USB_MAX_READ+4];
-
 	uint64_t tmo_count;
 	struct cg_usb_tmo usb_tmo[USB_TMOS];
 };
@@ -384,8 +405,10 @@ void usb_uninit(struct cgpu_info *cgpu);
 bool usb_init(struct cgpu_info *cgpu, struct libusb_device *dev, struct usb_find_devices *found);
 void usb_detect(struct device_drv *drv, bool (*device_detect)(struct libusb_device *, struct usb_find_devices *));
 struct api_data *api_usb_stats(int *count);
+void usb_zero_stats(void);
 void update_usb_stats(struct cgpu_info *cgpu);
 int _usb_read(struct cgpu_info *cgpu, int intinfo, int epinfo, char *buf, size_t bufsiz, int *processed, int timeout, const char *end, enum usb_cmds cmd, bool readonce, bool cancellable);
+int _usb_read_frame(struct cgpu_info *cgpu, int intinfo, int epinfo, char **frame, size_t bufsiz, int *processed, int timeout, const char *end, enum usb_cmds cmd, bool readonce, bool cancellable);
 int _usb_write(struct cgpu_info *cgpu, int intinfo, int epinfo, char *buf, size_t bufsiz, int *processed, int timeout, enum usb_cmds);
 int _usb_transfer(struct cgpu_info *cgpu, uint8_t request_type, uint8_t bRequest, uint16_t wValue, uint16_t wIndex, uint32_t *data, int siz, unsigned int timeout, enum usb_cmds cmd);
 int _usb_transfer_read(struct cgpu_info *cgpu, uint8_t request_type, uint8_t bRequest, uint16_t wValue, uint16_t wIndex, char *buf, int bufsiz, int *amount, unsigned int timeout, enum usb_cmds cmd);
@@ -459,6 +482,17 @@ void *usb_resource_thread(void *userdata);
 #define usb_read_ep_timeout(cgpu, ep, buf, bufsiz, read, timeout, cmd) \
 	_usb_read(cgpu, DEFAULT_INTINFO, ep, buf, bufsiz, read, timeout, NULL, cmd, false, false)
 
+/*
+ * The _frame versions return a pointer to the null terminated data in the
+ * endpoint's ring instead of copying it out. It is only valid until the
+ * next read or usb_buffer_clear() on the device
+ */
+#define usb_read_frame(cgpu, frame, bufsiz, read, cmd) \
+	_usb_read_frame(cgpu, DEFAULT_INTINFO, DEFAULT_EP_IN, frame, bufsiz, read, DEVTIMEOUT, NULL, cmd, false, false)
+
+#define usb_read_frame_timeout(cgpu, frame, bufsiz, read, timeout, cmd) \
+	_usb_read_frame(cgpu, DEFAULT_INTINFO, DEFAULT_EP_IN, frame, bufsiz, read, timeout, NULL, cmd, false, false)
+
 #define usb_write(cgpu, buf, bufsiz, wrote, cmd) \
 	_usb_write(cgpu, DEFAULT_INTINFO, DEFAULT_EP_OUT, buf, bufsiz, wrote, DEVTIMEOUT, cmd)
 
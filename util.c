@@ -21,13 +21,19 @@
 #endif
 #include <time.h>
 #include <errno.h>
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define USE_HEX_SSSE3
+#include <tmmintrin.h>
+#endif
 #include <unistd.h>
 #include <sys/types.h>
 #ifndef WIN32
 #include <fcntl.h>
 # ifdef __linux
 #  include <sys/prctl.h>
+#  include <sys/eventfd.h>
 # endif
+# include <poll.h>
 # include <sys/socket.h>
 # include <netinet/in.h>
 # include <netinet/tcp.h>
@@ -295,30 +301,50 @@ static int curl_debug_cb(__maybe_unused CURL *handle, curl_infotype type,
 	return 0;
 }
 
-json_t *json_rpc_call(CURL *curl, const char *url, const char *cert,
-		      const char *userpass, const char *rpc_req,
-		      bool probe, bool longpoll, int *rolltime,
-		      struct pool *pool, bool share)
+/* All HTTP requests are run concurrently by one thread on a curl multi handle.
+ * The multi handle's connection cache keeps the connections to each pool alive
+ * between requests, whichever easy handle they came from. */
+struct json_rpc_req {
+	CURL			*curl;
+	bool			own_curl;
+	struct pool		*pool;
+	char			*rpc_req;
+	bool			probing;
+	bool			longpoll;
+	int			rolltime;
+	struct data_buffer	all_data;
+	struct header_info	hi;
+	struct curl_slist	*headers;
+	struct upload_buffer	upload_data;
+	char			curl_err_str[CURL_ERROR_SIZE];
+	CURLcode		rc;
+	json_rpc_cb		cb;
+	void			*userdata;
+	cgsem_t			done;
+	struct list_head	node;
+};
+
+static CURLM *curlm;
+static pthread_mutex_t curlm_lock;
+static struct list_head curlm_queue;
+#ifndef WIN32
+static cgwake_t curlm_wake;
+#endif
+static pthread_once_t curlm_once = PTHREAD_ONCE_INIT;
+
+static void json_rpc_setup(struct json_rpc_req *req, const char *url,
+			   const char *cert, const char *userpass, bool probe,
+			   bool share)
 {
-	long timeout = longpoll ? (60 * 60) : 60;
-	struct data_buffer all_data = {NULL, 0};
-	struct header_info hi = {NULL, 0, NULL, NULL, false, false, false};
+	CURL *curl = req->curl;
+	long timeout = req->longpoll ? (60 * 60) : 60;
 	char len_hdr[64], user_agent_hdr[128];
-	char curl_err_str[CURL_ERROR_SIZE];
-	struct curl_slist *headers = NULL;
-	struct upload_buffer upload_data;
-	json_t *val, *err_val, *res_val;
-	bool probing = false;
-	double byte_count;
-	json_error_t err;
-	int rc;
-
-	memset(&err, 0, sizeof(err));
+	struct pool *pool = req->pool;
 
 	/* it is assumed that 'curl' is freshly [re]initialized at this pt */
 
 	if (probe)
-		probing = !pool->probed;
+		req->probing = !pool->probed;
 	curl_easy_setopt(curl, CURLOPT_TIMEOUT, timeout);
 
 	// CURLOPT_VERBOSE won't write to stderr if we use CURLOPT_DEBUGFUNCTION
@@ -338,13 +364,13 @@ json_t *json_rpc_call(CURL *curl, const char *url, const char *cert,
 	if (!opt_delaynet || share)
 		curl_easy_setopt(curl, CURLOPT_TCP_NODELAY, 1);
 	curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, all_data_cb);
-	curl_easy_setopt(curl, CURLOPT_WRITEDATA, &all_data);
+	curl_easy_setopt(curl, CURLOPT_WRITEDATA, &req->all_data);
 	curl_easy_setopt(curl, CURLOPT_READFUNCTION, upload_data_cb);
-	curl_easy_setopt(curl, CURLOPT_READDATA, &upload_data);
-	curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, curl_err_str);
+	curl_easy_setopt(curl, CURLOPT_READDATA, &req->upload_data);
+	curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, req->curl_err_str);
 	curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1);
 	curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, resp_hdr_cb);
-	curl_easy_setopt(curl, CURLOPT_HEADERDATA, &hi);
+	curl_easy_setopt(curl, CURLOPT_HEADERDATA, &req->hi);
 	curl_easy_setopt(curl, CURLOPT_USE_SSL, CURLUSESSL_TRY);
 	if (pool->rpc_proxy) {
 		curl_easy_setopt(curl, CURLOPT_PROXY, pool->rpc_proxy);
@@ -357,36 +383,38 @@ json_t *json_rpc_call(CURL *curl, const char *url, const char *cert,
 		curl_easy_setopt(curl, CURLOPT_USERPWD, userpass);
 		curl_easy_setopt(curl, CURLOPT_HTTPAUTH, CURLAUTH_BASIC);
 	}
-	if (longpoll)
+	if (req->longpoll)
 		keep_curlalive(curl);
 	curl_easy_setopt(curl, CURLOPT_POST, 1);
 
 	if (opt_protocol)
-		applog(LOG_DEBUG, "JSON protocol request:\n%s", rpc_req);
+		applog(LOG_DEBUG, "JSON protocol request:\n%s", req->rpc_req);
 
-	upload_data.buf = rpc_req;
-	upload_data.len = strlen(rpc_req);
+	req->upload_data.buf = req->rpc_req;
+	req->upload_data.len = strlen(req->rpc_req);
+	/* Otherwise curl also sends it chunked, contradicting Content-Length */
+	curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, (long)req->upload_data.len);
 	sprintf(len_hdr, "Content-Length: %lu",
-		(unsigned long) upload_data.len);
+		(unsigned long) req->upload_data.len);
 	sprintf(user_agent_hdr, "User-Agent: %s", PACKAGE_STRING);
 
-	headers = curl_slist_append(headers,
+	req->headers = curl_slist_append(req->headers,
 		"Content-type: application/json");
-	headers = curl_slist_append(headers,
+	req->headers = curl_slist_append(req->headers,
 		"X-Mining-Extensions: longpoll midstate rollntime submitold");
 
 	if (likely(global_hashrate)) {
 		char ghashrate[255];
 
 		sprintf(ghashrate, "X-Mining-Hashrate: %llu", global_hashrate);
-		headers = curl_slist_append(headers, ghashrate);
+		req->headers = curl_slist_append(req->headers, ghashrate);
 	}
 
-	headers = curl_slist_append(headers, len_hdr);
-	headers = curl_slist_append(headers, user_agent_hdr);
-	headers = curl_slist_append(headers, "Expect:"); /* disable Expect hdr*/
+	req->headers = curl_slist_append(req->headers, len_hdr);
+	req->headers = curl_slist_append(req->headers, user_agent_hdr);
+	req->headers = curl_slist_append(req->headers, "Expect:"); /* disable Expect hdr*/
 
-	curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+	curl_easy_setopt(curl, CURLOPT_HTTPHEADER, req->headers);
 
 	if (opt_delaynet) {
 		/* Don't delay share submission, but still track the nettime */
@@ -410,14 +438,26 @@ json_t *json_rpc_call(CURL *curl, const char *url, const char *cert,
 		}
 		set_nettime();
 	}
+}
+
+/* Decodes the response once the multi thread has finished the request */
+static json_t *json_rpc_finish(struct json_rpc_req *req)
+{
+	struct header_info *hi = &req->hi;
+	struct pool *pool = req->pool;
+	CURL *curl = req->curl;
+	json_t *val, *err_val, *res_val;
+	double byte_count;
+	json_error_t err;
+
+	memset(&err, 0, sizeof(err));
 
-	rc = curl_easy_perform(curl);
-	if (rc) {
-		applog(LOG_INFO, "HTTP request failed: %s", curl_err_str);
+	if (req->rc) {
+		applog(LOG_INFO, "HTTP request failed: %s", req->curl_err_str);
 		goto err_out;
 	}
 
-	if (!all_data.buf) {
+	if (!req->all_data.buf) {
 		applog(LOG_DEBUG, "Empty data received in json_rpc_call.");
 		goto err_out;
 	}
@@ -429,42 +469,34 @@ json_t *json_rpc_call(CURL *curl, const char *url, const char *cert,
 	if (curl_easy_getinfo(curl, CURLINFO_SIZE_DOWNLOAD, &byte_count) == CURLE_OK)
 		pool->cgminer_pool_stats.bytes_received += byte_count;
 
-	if (probing) {
+	if (req->probing) {
 		pool->probed = true;
 		/* If X-Long-Polling was found, activate long polling */
-		if (hi.lp_path) {
+		if (hi->lp_path) {
 			if (pool->hdr_path != NULL)
 				free(pool->hdr_path);
-			pool->hdr_path = hi.lp_path;
+			pool->hdr_path = hi->lp_path;
+			hi->lp_path = NULL;
 		} else
 			pool->hdr_path = NULL;
-		if (hi.stratum_url) {
-			pool->stratum_url = hi.stratum_url;
-			hi.stratum_url = NULL;
-		}
-	} else {
-		if (hi.lp_path) {
-			free(hi.lp_path);
-			hi.lp_path = NULL;
-		}
-		if (hi.stratum_url) {
-			free(hi.stratum_url);
-			hi.stratum_url = NULL;
+		if (hi->stratum_url) {
+			pool->stratum_url = hi->stratum_url;
+			hi->stratum_url = NULL;
 		}
 	}
 
-	*rolltime = hi.rolltime;
-	pool->cgminer_pool_stats.rolltime = hi.rolltime;
-	pool->cgminer_pool_stats.hadrolltime = hi.hadrolltime;
-	pool->cgminer_pool_stats.canroll = hi.canroll;
-	pool->cgminer_pool_stats.hadexpire = hi.hadexpire;
+	req->rolltime = hi->rolltime;
+	pool->cgminer_pool_stats.rolltime = hi->rolltime;
+	pool->cgminer_pool_stats.hadrolltime = hi->hadrolltime;
+	pool->cgminer_pool_stats.canroll = hi->canroll;
+	pool->cgminer_pool_stats.hadexpire = hi->hadexpire;
 
-	val = JSON_LOADS(all_data.buf, &err);
+	val = JSON_LOADS(req->all_data.buf, &err);
 	if (!val) {
 		applog(LOG_INFO, "JSON decode failed(%d): %s", err.line, err.text);
 
 		if (opt_protocol)
-			applog(LOG_DEBUG, "JSON protocol response:\n%s", (char *)(all_data.buf));
+			applog(LOG_DEBUG, "JSON protocol response:\n%s", (char *)(req->all_data.buf));
 
 		goto err_out;
 	}
@@ -493,30 +525,196 @@ json_t *json_rpc_call(CURL *curl, const char *url, const char *cert,
 		applog(LOG_INFO, "JSON-RPC call failed: %s", s);
 
 		free(s);
+		json_decref(val);
 
 		goto err_out;
 	}
 
-	if (hi.reason) {
-		json_object_set_new(val, "reject-reason", json_string(hi.reason));
-		free(hi.reason);
-		hi.reason = NULL;
+	if (hi->reason) {
+		json_object_set_new(val, "reject-reason", json_string(hi->reason));
+		free(hi->reason);
+		hi->reason = NULL;
 	}
 	successful_connect = true;
-	databuf_free(&all_data);
-	curl_slist_free_all(headers);
 	curl_easy_reset(curl);
 	return val;
 
 err_out:
-	databuf_free(&all_data);
-	curl_slist_free_all(headers);
 	curl_easy_reset(curl);
 	if (!successful_connect)
 		applog(LOG_DEBUG, "Failed to connect in json_rpc_call");
 	curl_easy_setopt(curl, CURLOPT_FRESH_CONNECT, 1);
 	return NULL;
 }
+
+static void json_rpc_free(struct json_rpc_req *req)
+{
+	databuf_free(&req->all_data);
+	curl_slist_free_all(req->headers);
+	free(req->hi.lp_path);
+	free(req->hi.reason);
+	free(req->hi.stratum_url);
+	free(req->rpc_req);
+	if (req->own_curl)
+		curl_easy_cleanup(req->curl);
+	free(req);
+}
+
+static void json_rpc_done(struct json_rpc_req *req)
+{
+	json_t *val;
+
+	if (!req->cb) {
+		cgsem_post(&req->done);
+		return;
+	}
+	val = json_rpc_finish(req);
+	req->cb(val, req->rolltime, req->userdata);
+	json_rpc_free(req);
+}
+
+static void *json_rpc_thread(void __maybe_unused *userdata)
+{
+	RenameThread("CurlMulti");
+
+	while (42) {
+		struct json_rpc_req *req, *tmp;
+		int running, msgs, limit;
+		CURLMsg *msg;
+
+		/* Limit connections per pool host the way the curls each
+		 * pool could recruit used to be limited */
+		limit = opt_delaynet ? 5 : (mining_threads + opt_queue) * 2;
+		if (limit < 2)
+			limit = 2;
+		curl_multi_setopt(curlm, CURLMOPT_MAX_HOST_CONNECTIONS, (long)limit);
+
+		mutex_lock(&curlm_lock);
+		list_for_each_entry_safe(req, tmp, &curlm_queue, node) {
+			list_del(&req->node);
+			curl_easy_setopt(req->curl, CURLOPT_PRIVATE, (char *)req);
+			curl_multi_add_handle(curlm, req->curl);
+		}
+		mutex_unlock(&curlm_lock);
+
+		curl_multi_perform(curlm, &running);
+		while ((msg = curl_multi_info_read(curlm, &msgs)) != NULL) {
+			char *priv;
+
+			if (msg->msg != CURLMSG_DONE)
+				continue;
+			curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, &priv);
+			req = (struct json_rpc_req *)priv;
+			req->rc = msg->data.result;
+			curl_multi_remove_handle(curlm, req->curl);
+			json_rpc_done(req);
+		}
+
+#ifndef WIN32
+		{
+			struct curl_waitfd wfd;
+
+			wfd.fd = curlm_wake.rfd;
+			wfd.events = CURL_WAIT_POLLIN;
+			wfd.revents = 0;
+			curl_multi_wait(curlm, &wfd, 1, 1000, NULL);
+			cgwake_clear(&curlm_wake);
+		}
+#else
+		/* No wakeup to wait on so check for new requests often */
+		curl_multi_wait(curlm, NULL, 0, 50, NULL);
+#endif
+	}
+	return NULL;
+}
+
+static void json_rpc_init(void)
+{
+	pthread_t pth;
+
+	curlm = curl_multi_init();
+	if (unlikely(!curlm))
+		quit(1, "Failed to curl_multi_init");
+	mutex_init(&curlm_lock);
+	INIT_LIST_HEAD(&curlm_queue);
+#ifndef WIN32
+	cgwake_init(&curlm_wake);
+#endif
+	if (unlikely(pthread_create(&pth, NULL, json_rpc_thread, NULL)))
+		quit(1, "Failed to create curl multi thread");
+	pthread_detach(pth);
+}
+
+static struct json_rpc_req *json_rpc_queue(CURL *curl, const char *url,
+					   const char *cert, const char *userpass,
+					   const char *rpc_req, bool probe,
+					   bool longpoll, struct pool *pool,
+					   bool share, json_rpc_cb cb,
+					   void *userdata)
+{
+	struct json_rpc_req *req;
+
+	pthread_once(&curlm_once, json_rpc_init);
+
+	req = calloc(sizeof(*req), 1);
+	if (unlikely(!req))
+		quit(1, "Failed to calloc req in json_rpc_queue");
+	req->own_curl = !curl;
+	req->curl = curl ? curl : curl_easy_init();
+	if (unlikely(!req->curl))
+		quit(1, "CURL initialisation failed in json_rpc_queue");
+	req->rpc_req = strdup(rpc_req);
+	if (unlikely(!req->rpc_req))
+		quit(1, "Failed to strdup rpc_req in json_rpc_queue");
+	req->pool = pool;
+	req->longpoll = longpoll;
+	req->cb = cb;
+	req->userdata = userdata;
+	if (!cb)
+		cgsem_init(&req->done);
+
+	json_rpc_setup(req, url, cert, userpass, probe, share);
+
+	mutex_lock(&curlm_lock);
+	list_add_tail(&req->node, &curlm_queue);
+	mutex_unlock(&curlm_lock);
+#ifndef WIN32
+	cgwake_signal(&curlm_wake);
+#endif
+	return req;
+}
+
+/* Runs the request on the curl multi thread and waits for its response */
+json_t *json_rpc_call(CURL *curl, const char *url, const char *cert,
+		      const char *userpass, const char *rpc_req,
+		      bool probe, bool longpoll, int *rolltime,
+		      struct pool *pool, bool share)
+{
+	struct json_rpc_req *req;
+	json_t *val;
+
+	req = json_rpc_queue(curl, url, cert, userpass, rpc_req, probe,
+			     longpoll, pool, share, NULL, NULL);
+	cgsem_wait(&req->done);
+	cgsem_destroy(&req->done);
+	val = json_rpc_finish(req);
+	*rolltime = req->rolltime;
+	json_rpc_free(req);
+	return val;
+}
+
+/* Queues the request on the curl multi thread with a fresh easy handle and
+ * returns at once. The callback is run on the curl multi thread with the
+ * response, or NULL on failure, which it must json_decref, and must not
+ * block. */
+void json_rpc_async(const char *url, const char *cert, const char *userpass,
+		    const char *rpc_req, bool probe, bool longpoll,
+		    struct pool *pool, bool share, json_rpc_cb cb,
+		    void *userdata)
+{
+	json_rpc_queue(NULL, url, cert, userpass, rpc_req, probe, longpoll,
+		       pool, share, cb, userdata);
+}
 #define PROXY_HTTP	CURLPROXY_HTTP
 #define PROXY_HTTP_1_0	CURLPROXY_HTTP_1_0
 #define PROXY_SOCKS4	CURLPROXY_SOCKS4
@@ -585,17 +783,90 @@ char *get_proxy(char *url, struct pool *pool)
 	return url;
 }
 
-/* Adequate size s==len*2 + 1 must be alloced to use this variant */
-void __bin2hex(char *s, const unsigned char *p, size_t len)
+#ifdef USE_HEX_SSSE3
+/* 16 bytes to 32 hex characters per iteration */
+__attribute__((target("ssse3")))
+static size_t bin2hex_ssse3(char *s, const unsigned char *p, size_t len)
 {
-	int i;
-	static const char hex[16] = {'0', '1', '2', '3', '4', '5', '6', '7', '8', '9', 'a', 'b', 'c', 'd', 'e', 'f'};
+	const __m128i lut = _mm_setr_epi8('0', '1', '2', '3', '4', '5', '6', '7',
+					  '8', '9', 'a', 'b', 'c', 'd', 'e', 'f');
+	const __m128i mask = _mm_set1_epi8(0x0f);
+	size_t done = 0;
+
+	for (; len - done >= 16; done += 16) {
+		__m128i in = _mm_loadu_si128((const __m128i *)(p + done));
+		__m128i hi = _mm_shuffle_epi8(lut, _mm_and_si128(_mm_srli_epi16(in, 4), mask));
+		__m128i lo = _mm_shuffle_epi8(lut, _mm_and_si128(in, mask));
+
+		_mm_storeu_si128((__m128i *)(s + done * 2), _mm_unpacklo_epi8(hi, lo));
+		_mm_storeu_si128((__m128i *)(s + done * 2 + 16), _mm_unpackhi_epi8(hi, lo));
+	}
+	return done;
+}
+
+/* Converts 16 hex characters to their nibble values, or returns false if any
+ * of them is not a hex character */
+__attribute__((target("ssse3")))
+static inline bool hex_nibbles_ssse3(__m128i c, __m128i *nibbles)
+{
+	__m128i digit = _mm_sub_epi8(c, _mm_set1_epi8('0'));
+	__m128i alpha = _mm_sub_epi8(_mm_or_si128(c, _mm_set1_epi8(0x20)), _mm_set1_epi8('a'));
+	__m128i is_digit = _mm_and_si128(_mm_cmpgt_epi8(digit, _mm_set1_epi8(-1)),
+					 _mm_cmplt_epi8(digit, _mm_set1_epi8(10)));
+	__m128i is_alpha = _mm_and_si128(_mm_cmpgt_epi8(alpha, _mm_set1_epi8(-1)),
+					 _mm_cmplt_epi8(alpha, _mm_set1_epi8(6)));
+
+	if (_mm_movemask_epi8(_mm_or_si128(is_digit, is_alpha)) != 0xffff)
+		return false;
+	*nibbles = _mm_or_si128(_mm_and_si128(is_digit, digit),
+				_mm_and_si128(is_alpha, _mm_add_epi8(alpha, _mm_set1_epi8(10))));
+	return true;
+}
+
+/* 32 hex characters to 16 bytes per iteration. Stops at the first block
+ * containing anything that is not hex, leaving it to the scalar code to find
+ * exactly where */
+__attribute__((target("ssse3")))
+static size_t hex2bin_ssse3(unsigned char *p, const char *hexstr, size_t len)
+{
+	const __m128i weights = _mm_set1_epi16(0x0110);
+	size_t done = 0;
+
+	for (; len - done >= 16; done += 16) {
+		__m128i lo, hi;
+
+		if (!hex_nibbles_ssse3(_mm_loadu_si128((const __m128i *)(hexstr + done * 2)), &lo) ||
+		    !hex_nibbles_ssse3(_mm_loadu_si128((const __m128i *)(hexstr + done * 2 + 16)), &hi))
+			break;
+		/* Each pair of nibbles becomes high * 16 + low */
+		lo = _mm_maddubs_epi16(lo, weights);
+		hi = _mm_maddubs_epi16(hi, weights);
+		_mm_storeu_si128((__m128i *)(p + done), _mm_packus_epi16(lo, hi));
+	}
+	return done;
+}
+#endif /* USE_HEX_SSSE3 */
+
+/* Adequate size s==len*2 + 1 must be alloced to use this variant. Returns the
+ * length of the hex string written, not counting the terminating null */
+size_t __bin2hex(char *s, const unsigned char *p, size_t len)
+{
+	size_t i = 0;
+
+#ifdef USE_HEX_SSSE3
+	if (len >= 16 && __builtin_cpu_supports("ssse3"))
+		i = bin2hex_ssse3(s, p, len);
+#endif
+	for (; i < len; i++) {
+		int hi = p[i] >> 4, lo = p[i] & 0xf;
 
-	for (i = 0; i < (int)len; i++) {
-		*s++ = hex[p[i] >> 4];
-		*s++ = hex[p[i] & 0xF];
+		/* Add the gap between '9' + 1 and 'a' for nibbles over 9 */
+		s[i * 2] = '0' + hi + (((9 - hi) >> 8) & ('a' - '0' - 10));
+		s[i * 2 + 1] = '0' + lo + (((9 - lo) >> 8) & ('a' - '0' - 10));
 	}
-	*s++ = '\0';
+	s[len * 2] = '\0';
+
+	return len * 2;
 }
 
 /* Returns a malloced array string of a binary value of arbitrary length. The
@@ -637,35 +908,43 @@ static const int hex2bin_tbl[256] = {
 	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
 	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
 };
-bool hex2bin(unsigned char *p, const char *hexstr, size_t len)
+/* Decodes up to len bytes from hexstr into p without needing hexstr to be null
+ * terminated after them. Returns the number of bytes decoded, which is short
+ * of len if the string ends or a character that is not hex is found first */
+size_t __hex2bin(unsigned char *p, const char *hexstr, size_t len)
 {
-	int nibble1, nibble2;
-	unsigned char idx;
-	bool ret = false;
+	size_t i = 0;
 
-	while (*hexstr && len) {
-		if (unlikely(!hexstr[1])) {
-			applog(LOG_ERR, "hex2bin str truncated");
-			return ret;
-		}
+	len = strnlen(hexstr, len * 2) / 2;
+#ifdef USE_HEX_SSSE3
+	if (len >= 16 && __builtin_cpu_supports("ssse3"))
+		i = hex2bin_ssse3(p, hexstr, len);
+#endif
+	for (; i < len; i++) {
+		int hi = hex2bin_tbl[(unsigned char)hexstr[i * 2]];
+		int lo = hex2bin_tbl[(unsigned char)hexstr[i * 2 + 1]];
 
-		idx = *hexstr++;
-		nibble1 = hex2bin_tbl[idx];
-		idx = *hexstr++;
-		nibble2 = hex2bin_tbl[idx];
+		if (unlikely((hi | lo) < 0))
+			break;
+		p[i] = (hi << 4) | lo;
+	}
+	return i;
+}
 
-		if (unlikely((nibble1 < 0) || (nibble2 < 0))) {
-			applog(LOG_ERR, "hex2bin scan failed");
-			return ret;
-		}
+bool hex2bin(unsigned char *p, const char *hexstr, size_t len)
+{
+	size_t done = __hex2bin(p, hexstr, len);
 
-		*p++ = (((unsigned char)nibble1) << 4) | ((unsigned char)nibble2);
-		--len;
+	hexstr += done * 2;
+	if (likely(done == len))
+		return *hexstr == '\0';
+	if (*hexstr) {
+		if (unlikely(!hexstr[1]))
+			applog(LOG_ERR, "hex2bin str truncated");
+		else
+			applog(LOG_ERR, "hex2bin scan failed");
 	}
-
-	if (likely(len == 0 && *hexstr == 0))
-		ret = true;
-	return ret;
+	return false;
 }
 
 bool fulltest(const unsigned char *hash, const unsigned char *target)
@@ -976,6 +1255,11 @@ int cgtimer_to_ms(cgtimer_t *cgt)
 	return timespec_to_ms(cgt);
 }
 
+int64_t cgtimer_to_us(cgtimer_t *cgt)
+{
+	return (int64_t)cgt->tv_sec * 1000000 + cgt->tv_nsec / 1000;
+}
+
 /* Subtracts b from a and stores it in res. */
 void cgtimer_sub(cgtimer_t *a, cgtimer_t *b, cgtimer_t *res)
 {
@@ -1059,6 +1343,11 @@ int cgtimer_to_ms(cgtimer_t *cgt)
 	return (int)(cgt->QuadPart / 10000LL);
 }
 
+int64_t cgtimer_to_us(cgtimer_t *cgt)
+{
+	return cgt->QuadPart / 10LL;
+}
+
 /* Subtracts b from a and stores it in res. */
 void cgtimer_sub(cgtimer_t *a, cgtimer_t *b, cgtimer_t *res)
 {
@@ -1189,6 +1478,146 @@ double tdiff(struct timeval *end, struct timeval *start)
 	return end->tv_sec - start->tv_sec + (end->tv_usec - start->tv_usec) / 1000000.0;
 }
 
+/* Microseconds on the cgtimer clock, for timestamps that are only ever
+ * compared with each other */
+int64_t cgtimer_us(void)
+{
+	cgtimer_t now;
+
+	cgtimer_time(&now);
+	return cgtimer_to_us(&now);
+}
+
+/* The first microsecond in bucket and how many it spans */
+static int64_t lat_bucket_low(int bucket)
+{
+	return bucket ? (int64_t)1 << bucket : 0;
+}
+
+static int64_t lat_bucket_width(int bucket)
+{
+	return bucket ? (int64_t)1 << bucket : 2;
+}
+
+/* The sub-bucket a latency of us microseconds, at least 0, falls in */
+static int lat_hist_index(int64_t us)
+{
+	int bucket = 0, sub;
+
+	while (bucket < LAT_BUCKETS - 1 && (us >> (bucket + 1)))
+		bucket++;
+	sub = (us - lat_bucket_low(bucket)) * LAT_SUB / lat_bucket_width(bucket);
+	if (sub >= LAT_SUB)
+		sub = LAT_SUB - 1;
+	return bucket * LAT_SUB + sub;
+}
+
+/* Adds a latency in microseconds to a histogram whose bucket n counts values
+ * from 2^n up to 2^(n+1) microseconds, in LAT_SUB linear steps */
+void lat_hist_add(struct latency_hist *hist, int64_t us)
+{
+	if (us < 0)
+		us = 0;
+	hist->bucket[lat_hist_index(us)]++;
+	if (!hist->count || us < hist->min)
+		hist->min = us;
+	if (us > hist->max)
+		hist->max = us;
+	hist->total += us;
+	hist->count++;
+}
+
+/* As lat_hist_add but lock free, for a histogram several threads record to
+ * at once. It must have been through lat_hist_reset_atomic, which starts min
+ * at INT64_MAX. max is raised before the bucket is counted so a reader never
+ * sees a bucket above max, and count may lag the buckets so read it through
+ * lat_hist_snapshot */
+void lat_hist_add_atomic(struct latency_hist *hist, int64_t us)
+{
+	int64_t old;
+
+	if (us < 0)
+		us = 0;
+	old = hist->min;
+	while (us < old && !__sync_bool_compare_and_swap(&hist->min, old, us))
+		old = hist->min;
+	old = hist->max;
+	while (us > old && !__sync_bool_compare_and_swap(&hist->max, old, us))
+		old = hist->max;
+	__sync_fetch_and_add(&hist->bucket[lat_hist_index(us)], 1);
+	__sync_fetch_and_add(&hist->total, us);
+	__sync_fetch_and_add(&hist->count, 1);
+}
+
+/* Empties a histogram lat_hist_add_atomic may be recording to, a field at a
+ * time. A sample landing part way through may be half kept, which only skews
+ * the totals until the next reset */
+void lat_hist_reset_atomic(struct latency_hist *hist)
+{
+	int i;
+
+	for (i = 0; i < LAT_BUCKETS * LAT_SUB; i++)
+		__sync_lock_test_and_set(&hist->bucket[i], 0);
+	__sync_lock_test_and_set(&hist->count, 0);
+	__sync_lock_test_and_set(&hist->total, 0);
+	__sync_lock_test_and_set(&hist->max, 0);
+	__sync_lock_test_and_set(&hist->min, INT64_MAX);
+}
+
+/* Copies a histogram lat_hist_add_atomic may be recording to, with count
+ * taken from the copied buckets so the two agree */
+void lat_hist_snapshot(struct latency_hist *copy, struct latency_hist *hist)
+{
+	int i;
+
+	copy->count = 0;
+	for (i = 0; i < LAT_BUCKETS * LAT_SUB; i++) {
+		copy->bucket[i] = __sync_fetch_and_add(&hist->bucket[i], 0);
+		copy->count += copy->bucket[i];
+	}
+	copy->total = __sync_fetch_and_add(&hist->total, 0);
+	copy->min = __sync_fetch_and_add(&hist->min, 0);
+	copy->max = __sync_fetch_and_add(&hist->max, 0);
+}
+
+/* Estimates the pct percentile as the top of the sub-bucket it falls in,
+ * which overstates it by at most a quarter */
+int64_t lat_hist_pct(struct latency_hist *hist, double pct)
+{
+	uint64_t count = 0, want, seen = 0;
+	int i, bucket;
+
+	/* Count from the buckets themselves so a count that disagrees with
+	 * them can't push the search off the end */
+	for (i = 0; i < LAT_BUCKETS * LAT_SUB; i++)
+		count += hist->bucket[i];
+	if (!count)
+		return 0;
+	want = (uint64_t)(count * pct / 100.0 + 0.5);
+	if (want < 1)
+		want = 1;
+	for (i = 0; i < LAT_BUCKETS * LAT_SUB - 1; i++) {
+		seen += hist->bucket[i];
+		if (seen >= want)
+			break;
+	}
+	bucket = i / LAT_SUB;
+	return MIN(lat_bucket_low(bucket) +
+		   (lat_bucket_width(bucket) * (i % LAT_SUB + 1) + LAT_SUB - 1) / LAT_SUB,
+		   hist->max);
+}
+
+/* The count of the whole power of 2 bucket, summed over its sub-buckets */
+uint64_t lat_hist_bucket(struct latency_hist *hist, int bucket)
+{
+	uint64_t count = 0;
+	int sub;
+
+	for (sub = 0; sub < LAT_SUB; sub++)
+		count += hist->bucket[bucket * LAT_SUB + sub];
+	return count;
+}
+
 bool extract_sockaddr(char *url, char **sockaddr_url, char **sockaddr_port)
 {
 	char *url_begin, *url_end, *ipv6_begin, *ipv6_end, *port_start = NULL;
@@ -1239,6 +1668,43 @@ bool extract_sockaddr(char *url, char **sockaddr_url, char **sockaddr_port)
 	return true;
 }
 
+/* Pool traffic capture. Each line sent to or received from a stratum pool is
+ * written as "<usecs> <S|R> <pool_no> <line>" with the time in microseconds
+ * since the first line captured, for replay with replay_start */
+static FILE *capture_file;
+static pthread_mutex_t capture_lock;
+static int64_t capture_start;
+
+/* Run from the command line parser so it must not use quit() on failure */
+bool capture_open(const char *fname)
+{
+	capture_file = fopen(fname, "w");
+	if (!capture_file) {
+		applog(LOG_ERR, "Failed to open %s for pool capture", fname);
+		return false;
+	}
+	mutex_init(&capture_lock);
+	fprintf(capture_file, "# cgminer pool capture v1\n");
+	return true;
+}
+
+static void capture_line(struct pool *pool, char dir, const char *s, size_t len)
+{
+	int64_t us;
+
+	if (likely(!capture_file))
+		return;
+
+	us = cgtimer_us();
+	mutex_lock(&capture_lock);
+	if (!capture_start)
+		capture_start = us;
+	fprintf(capture_file, "%"PRId64" %c %d %.*s\n", us - capture_start, dir,
+		pool->pool_no, (int)len, s);
+	fflush(capture_file);
+	mutex_unlock(&capture_lock);
+}
+
 enum send_ret {
 	SEND_OK,
 	SEND_SELECTFAIL,
@@ -1253,6 +1719,7 @@ static enum send_ret __stratum_send(struct pool *pool, char *s, ssize_t len)
 	SOCKETTYPE sock = pool->sock;
 	ssize_t ssent = 0;
 
+	capture_line(pool, 'S', s, len);
 	strcat(s, "\n");
 	len++;
 
@@ -1339,7 +1806,7 @@ static bool socket_full(struct pool *pool, int wait)
 /* Check to see if Santa's been good to you */
 bool sock_full(struct pool *pool)
 {
-	if (strlen(pool->sockbuf))
+	if (pool->sockbuf_tail > pool->sockbuf_head)
 		return true;
 
 	return (socket_full(pool, 0));
@@ -1347,6 +1814,7 @@ bool sock_full(struct pool *pool)
 
 static void clear_sockbuf(struct pool *pool)
 {
+	pool->sockbuf_head = pool->sockbuf_tail = pool->sockbuf_scan = 0;
 	strcpy(pool->sockbuf, "");
 }
 
@@ -1366,16 +1834,27 @@ static void clear_sock(struct pool *pool)
 	clear_sockbuf(pool);
 }
 
-/* Make sure the pool sockbuf is large enough to cope with any coinbase size
- * by reallocing it to a large enough size rounded up to a multiple of RBUFSIZE
- * and zeroing the new memory */
-static void recalloc_sock(struct pool *pool, size_t len)
+/* Make sure the pool sockbuf has room for another RECVSIZE bytes after the
+ * data already received. Space used by lines already handed out is reclaimed
+ * first by moving any partial line down to the start of the buffer, and only
+ * if that is not enough is it realloced to a multiple of RBUFSIZE. */
+static void recalloc_sock(struct pool *pool)
 {
-	size_t old, new;
+	size_t new;
+
+	if (pool->sockbuf_head) {
+		size_t left = pool->sockbuf_tail - pool->sockbuf_head;
 
-	old = strlen(pool->sockbuf);
-	new = old + len + 1;
-	if (new < pool->sockbuf_size)
+		if (left)
+			memmove(pool->sockbuf, pool->sockbuf + pool->sockbuf_head, left);
+		pool->sockbuf_scan -= pool->sockbuf_head;
+		pool->sockbuf_tail = left;
+		pool->sockbuf_head = 0;
+		pool->sockbuf[left] = '\0';
+	}
+
+	new = pool->sockbuf_tail + RECVSIZE + 1;
+	if (new <= pool->sockbuf_size)
 		return;
 	new = new + (RBUFSIZE - (new % RBUFSIZE));
 	// Avoid potentially recursive locking
@@ -1383,19 +1862,60 @@ static void recalloc_sock(struct pool *pool, size_t len)
 	pool->sockbuf = realloc(pool->sockbuf, new);
 	if (!pool->sockbuf)
 		quithere(1, "Failed to realloc pool sockbuf");
-	memset(pool->sockbuf + old, 0, new - old);
 	pool->sockbuf_size = new;
 }
 
-/* Peeks at a socket to find the first end of line and then reads just that
- * from the socket and returns that as a malloced char */
+/* Look for the end of the next line, only scanning bytes that have not been
+ * searched before. Empty lines are skipped. */
+static char *sockbuf_eol(struct pool *pool)
+{
+	char *eol;
+
+	while (pool->sockbuf_scan < pool->sockbuf_tail) {
+		eol = memchr(pool->sockbuf + pool->sockbuf_scan, '\n',
+			     pool->sockbuf_tail - pool->sockbuf_scan);
+		if (!eol) {
+			pool->sockbuf_scan = pool->sockbuf_tail;
+			break;
+		}
+		pool->sockbuf_scan = eol - pool->sockbuf + 1;
+		if (eol != pool->sockbuf + pool->sockbuf_head)
+			return eol;
+		pool->sockbuf_head = pool->sockbuf_scan;
+	}
+	return NULL;
+}
+
+/* Terminates the line ending at eol in place and hands it out */
+static char *sockbuf_line(struct pool *pool, char *eol)
+{
+	char *sret = pool->sockbuf + pool->sockbuf_head;
+	size_t len = eol - sret;
+
+	*eol = '\0';
+	pool->sockbuf_head = pool->sockbuf_scan;
+	pool->us_recv = cgtimer_us();
+	capture_line(pool, 'R', sret, len);
+
+	pool->cgminer_pool_stats.times_received++;
+	pool->cgminer_pool_stats.bytes_received += len;
+	pool->cgminer_pool_stats.net_bytes_received += len;
+	if (opt_protocol)
+		applog(LOG_DEBUG, "RECVD: %s", sret);
+	return sret;
+}
+
+/* Receives from the socket until a whole line is buffered and returns it in
+ * place, \0 terminated. The line lives in pool->sockbuf so it must not be
+ * freed and is only valid until the next call to recv_line or anything else
+ * that touches the socket buffer of this pool. */
 char *recv_line(struct pool *pool)
 {
-	char *tok, *sret = NULL;
-	ssize_t len, buflen;
+	char *eol, *sret = NULL;
 	int waited = 0;
 
-	if (!strstr(pool->sockbuf, "\n")) {
+	eol = sockbuf_eol(pool);
+	if (!eol) {
 		struct timeval rstart, now;
 
 		cgtime(&rstart);
@@ -1405,12 +1925,10 @@ char *recv_line(struct pool *pool)
 		}
 
 		do {
-			char s[RBUFSIZE];
-			size_t slen;
 			ssize_t n;
 
-			memset(s, 0, RBUFSIZE);
-			n = recv(pool->sock, s, RECVSIZE, 0);
+			recalloc_sock(pool);
+			n = recv(pool->sock, pool->sockbuf + pool->sockbuf_tail, RECVSIZE, 0);
 			if (!n) {
 				applog(LOG_DEBUG, "Socket closed waiting in recv_line");
 				suspend_stratum(pool);
@@ -1425,40 +1943,58 @@ char *recv_line(struct pool *pool)
 					break;
 				}
 			} else {
-				slen = strlen(s);
-				recalloc_sock(pool, slen);
-				strcat(pool->sockbuf, s);
+				pool->sockbuf_tail += n;
+				pool->sockbuf[pool->sockbuf_tail] = '\0';
+				eol = sockbuf_eol(pool);
 			}
-		} while (waited < DEFAULT_SOCKWAIT && !strstr(pool->sockbuf, "\n"));
+		} while (waited < DEFAULT_SOCKWAIT && !eol);
 	}
 
-	buflen = strlen(pool->sockbuf);
-	tok = strtok(pool->sockbuf, "\n");
-	if (!tok) {
+	if (!eol) {
 		applog(LOG_DEBUG, "Failed to parse a \\n terminated string in recv_line");
 		goto out;
 	}
-	sret = strdup(tok);
-	len = strlen(sret);
-
-	/* Copy what's left in the buffer after the \n, including the
-	 * terminating \0 */
-	if (buflen > len + 1)
-		memmove(pool->sockbuf, pool->sockbuf + len + 1, buflen - len + 1);
-	else
-		strcpy(pool->sockbuf, "");
-
-	pool->cgminer_pool_stats.times_received++;
-	pool->cgminer_pool_stats.bytes_received += len;
-	pool->cgminer_pool_stats.net_bytes_received += len;
+	sret = sockbuf_line(pool, eol);
 out:
 	if (!sret)
 		clear_sock(pool);
-	else if (opt_protocol)
-		applog(LOG_DEBUG, "RECVD: %s", sret);
 	return sret;
 }
 
+#ifndef WIN32
+/* Non blocking version of recv_line for callers that wait on the socket
+ * themselves. Reads whatever is already available and returns the next
+ * complete line, or NULL if there is none yet. closed is set if the
+ * connection was lost, in which case the socket is left to the caller. */
+char *recv_line_nowait(struct pool *pool, bool *closed)
+{
+	char *eol;
+	ssize_t n;
+
+	*closed = false;
+	eol = sockbuf_eol(pool);
+	if (eol)
+		return sockbuf_line(pool, eol);
+
+	recalloc_sock(pool);
+	n = recv(pool->sock, pool->sockbuf + pool->sockbuf_tail, RECVSIZE, MSG_DONTWAIT);
+	if (!n || (n < 0 && !sock_blocks())) {
+		applog(LOG_DEBUG, "Socket closed or failed in recv_line_nowait");
+		*closed = true;
+		return NULL;
+	}
+	if (n < 0)
+		return NULL;
+
+	pool->sockbuf_tail += n;
+	pool->sockbuf[pool->sockbuf_tail] = '\0';
+	eol = sockbuf_eol(pool);
+	if (eol)
+		return sockbuf_line(pool, eol);
+	return NULL;
+}
+#endif
+
 /* Extracts a string value from a json array with error checking. To be used
  * when the value of the string returned is only examined and not to be stored.
  * See json_array_string below */
@@ -1489,127 +2025,410 @@ static char *json_array_string(json_t *val, unsigned int entry)
 	return NULL;
 }
 
-static char *blank_merkel = "0000000000000000000000000000000000000000000000000000000000000000";
+/* Location of a json string value within the raw received line */
+struct json_tok {
+	const char *str;
+	size_t len;
+};
+
+/* The fields of a mining.notify found in place in the received line so they
+ * can be decoded straight into the pool's reusable work buffers */
+struct stratum_notify {
+	struct json_tok job_id, prev_hash, coinbase1, coinbase2, bbversion,
+			nbit, ntime;
+	const char *merkle;
+	int merkles;
+	bool clean;
+};
+
+static const char *json_ws(const char *p)
+{
+	while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')
+		p++;
+	return p;
+}
+
+/* p points to an opening quote. Escapes are rejected since nothing in a
+ * notify should ever need them. Returns the character after the closing
+ * quote or NULL */
+static const char *json_tok_string(const char *p, struct json_tok *tok)
+{
+	const char *end;
+
+	if (*p++ != '"')
+		return NULL;
+	end = p;
+	while (*end != '"') {
+		if (!*end || *end == '\\')
+			return NULL;
+		end++;
+	}
+	tok->str = p;
+	tok->len = end - p;
+	return end + 1;
+}
+
+/* Skips over any json value, returning the character after it or NULL */
+static const char *json_skip_value(const char *p)
+{
+	int depth = 0;
+
+	do {
+		p = json_ws(p);
+		switch (*p) {
+			case '\0':
+				return NULL;
+			case '"':
+				for (p++; *p != '"'; p++) {
+					if (!*p)
+						return NULL;
+					if (*p == '\\' && !*++p)
+						return NULL;
+				}
+				p++;
+				break;
+			case '[':
+			case '{':
+				depth++;
+				p++;
+				break;
+			case ']':
+			case '}':
+				if (--depth < 0)
+					return NULL;
+				p++;
+				break;
+			case ',':
+			case ':':
+				if (!depth)
+					return NULL;
+				p++;
+				break;
+			default:
+				while (*p && !strchr(" \t\r\n,:]}", *p))
+					p++;
+				break;
+		}
+	} while (depth);
+
+	return p;
+}
+
+/* Moves past the separator following a params entry */
+static const char *json_next(const char *p)
+{
+	p = json_ws(p);
+	if (*p != ',')
+		return NULL;
+	return json_ws(p + 1);
+}
+
+static bool json_tok_hex(const struct json_tok *tok)
+{
+	size_t i;
+
+	if (tok->len % 2)
+		return false;
+	for (i = 0; i < tok->len; i++) {
+		if (hex2bin_tbl[(unsigned char)tok->str[i]] < 0)
+			return false;
+	}
+	return true;
+}
 
-static bool parse_notify(struct pool *pool, json_t *val)
+/* Looks for a well formed mining.notify without building a json tree. Any
+ * other message, or a notify carrying an error, is left to jansson */
+static bool scan_notify(const char *s, struct stratum_notify *sn)
 {
-	char *job_id, *prev_hash, *coinbase1, *coinbase2, *bbversion, *nbit,
-	     *ntime, *header;
-	size_t cb1_len, cb2_len, alloc_len;
-	unsigned char *cb1, *cb2;
-	bool clean, ret = false;
+	struct json_tok key, method = {NULL, 0};
+	const char *p, *params = NULL;
+	struct json_tok *fields[] = { &sn->job_id, &sn->prev_hash,
+				      &sn->coinbase1, &sn->coinbase2 };
+	int i;
+
+	p = json_ws(s);
+	if (*p++ != '{')
+		return false;
+	p = json_ws(p);
+	while (*p != '}') {
+		p = json_tok_string(p, &key);
+		if (!p)
+			return false;
+		p = json_ws(p);
+		if (*p++ != ':')
+			return false;
+		p = json_ws(p);
+		if (key.len == 6 && !strncmp(key.str, "method", 6)) {
+			p = json_tok_string(p, &method);
+			if (!p)
+				return false;
+		} else {
+			if (key.len == 6 && !strncmp(key.str, "params", 6))
+				params = p;
+			else if (key.len == 5 && !strncmp(key.str, "error", 5) &&
+				 strncmp(p, "null", 4))
+				return false;
+			p = json_skip_value(p);
+			if (!p)
+				return false;
+		}
+		p = json_ws(p);
+		if (*p == ',')
+			p = json_ws(p + 1);
+		else if (*p != '}')
+			return false;
+	}
+
+	if (method.len < 13 || strncasecmp(method.str, "mining.notify", 13) || !params)
+		return false;
+
+	p = params;
+	if (*p++ != '[')
+		return false;
+	p = json_ws(p);
+	for (i = 0; i < 4; i++) {
+		p = json_tok_string(p, fields[i]);
+		if (!p || (fields[i] != &sn->job_id && !json_tok_hex(fields[i])))
+			return false;
+		p = json_next(p);
+		if (!p)
+			return false;
+	}
+
+	/* Merkle branch, each entry must be a 32 byte hash */
+	if (*p++ != '[')
+		return false;
+	p = json_ws(p);
+	sn->merkle = p;
+	sn->merkles = 0;
+	while (*p != ']') {
+		struct json_tok merkle;
+
+		p = json_tok_string(p, &merkle);
+		if (!p || merkle.len != 64 || !json_tok_hex(&merkle))
+			return false;
+		sn->merkles++;
+		p = json_ws(p);
+		if (*p == ',')
+			p = json_ws(p + 1);
+		else if (*p != ']')
+			return false;
+	}
+	p = json_next(p + 1);
+	if (!p)
+		return false;
+
+	p = json_tok_string(p, &sn->bbversion);
+	if (!p || (p = json_next(p)) == NULL)
+		return false;
+	p = json_tok_string(p, &sn->nbit);
+	if (!p || (p = json_next(p)) == NULL)
+		return false;
+	p = json_tok_string(p, &sn->ntime);
+	if (!p)
+		return false;
+	p = json_next(p);
+	sn->clean = p && !strncmp(p, "true", 4);
+
+	/* These are placed directly into the binary header template */
+	if (sn->bbversion.len != 8 || sn->prev_hash.len != 64 ||
+	    sn->ntime.len != 8 || sn->nbit.len != 8)
+		return false;
+	return json_tok_hex(&sn->bbversion) && json_tok_hex(&sn->nbit) &&
+	       json_tok_hex(&sn->ntime);
+}
+
+/* Copies a token into a string buffer that is only ever grown */
+static void swork_strcpy(char **buf, size_t *size, const struct json_tok *tok)
+{
+	if (unlikely(tok->len + 1 > *size)) {
+		*size = tok->len + 1;
+		align_len(size);
+		*buf = realloc(*buf, *size);
+		if (unlikely(!*buf))
+			quithere(1, "Failed to realloc swork string");
+	}
+	memcpy(*buf, tok->str, tok->len);
+	(*buf)[tok->len] = '\0';
+}
+
+/* Builds the coinbase around the pool's nonce1 and a zeroed nonce2, reusing
+ * the coinbase buffer unless it needs to grow. Called with data_lock held */
+static void notify_coinbase(struct pool *pool, const char *coinbase1, size_t cb1_len,
+			    const char *coinbase2, size_t cb2_len)
+{
+	size_t alloc_len;
+
+	alloc_len = pool->swork.cb_len = cb1_len + pool->n1_len + pool->n2size + cb2_len;
+	pool->nonce2_offset = cb1_len + pool->n1_len;
+	if (alloc_len > pool->coinbase_size) {
+		align_len(&alloc_len);
+		free(pool->coinbase);
+		pool->coinbase = malloc(alloc_len);
+		if (unlikely(!pool->coinbase))
+			quit(1, "Failed to malloc pool coinbase in parse_notify");
+		pool->coinbase_size = alloc_len;
+	}
+	__hex2bin(pool->coinbase, coinbase1, cb1_len);
+	memcpy(pool->coinbase + cb1_len, pool->nonce1bin, pool->n1_len);
+	memset(pool->coinbase + pool->nonce2_offset, 0, pool->n2size);
+	__hex2bin(pool->coinbase + pool->nonce2_offset + pool->n2size, coinbase2, cb2_len);
+}
+
+static void notify_done(struct pool *pool)
+{
+	mutex_lock(&lat_lock);
+	lat_hist_add(&pool->latency[LAT_PARSE], cgtimer_us() - pool->us_recv);
+	mutex_unlock(&lat_lock);
+
+	/* A notify message is the closest stratum gets to a getwork */
+	pool->getwork_requested++;
+	total_getworks++;
+	if (pool == current_pool())
+		opt_work_update = true;
+}
+
+/* Decodes the notify straight into the pool's swork, header_bin and coinbase
+ * buffers. These are reused from one notify to the next and only reallocated
+ * when they need to grow, so a notify normally costs no allocations at all */
+static bool parse_notify(struct pool *pool, struct stratum_notify *sn)
+{
+	size_t cb1_len, cb2_len;
+	unsigned char *hb = pool->header_bin;
+	const char *p;
+	int i;
+
+	cb1_len = sn->coinbase1.len / 2;
+	cb2_len = sn->coinbase2.len / 2;
+
+	cg_wlock(&pool->data_lock);
+	swork_strcpy(&pool->swork.job_id, &pool->swork.job_id_size, &sn->job_id);
+	swork_strcpy(&pool->swork.ntime, &pool->swork.ntime_size, &sn->ntime);
+	pool->swork.clean = sn->clean;
+	pool->swork.us_notify = pool->us_recv;
+
+	if (sn->merkles > pool->swork.merkle_size) {
+		pool->swork.merkle_bin = realloc(pool->swork.merkle_bin, 32 * sn->merkles);
+		if (unlikely(!pool->swork.merkle_bin))
+			quithere(1, "Failed to realloc pool swork merkle_bin");
+		pool->swork.merkle_size = sn->merkles;
+	}
+	for (i = 0, p = sn->merkle; i < sn->merkles; i++) {
+		__hex2bin(pool->swork.merkle_bin[i], p + 1, 32);
+		p = json_ws(p + 66);
+		if (*p == ',')
+			p = json_ws(p + 1);
+	}
+	pool->swork.merkles = sn->merkles;
+	if (sn->clean)
+		pool->nonce2 = 0;
+
+	/* version, prev_hash, merkle root, ntime, nbit, nonce, workpadding */
+	__hex2bin(hb, sn->bbversion.str, 4);
+	__hex2bin(hb + 4, sn->prev_hash.str, 32);
+	memset(hb + 36, 0, 32);
+	__hex2bin(hb + 68, sn->ntime.str, 4);
+	__hex2bin(hb + 72, sn->nbit.str, 4);
+	memset(hb + 76, 0, 4);
+	__hex2bin(hb + 80, workpadding, 48);
+	pool->merkle_offset = 36;
+
+	notify_coinbase(pool, sn->coinbase1.str, cb1_len, sn->coinbase2.str, cb2_len);
+	cg_wunlock(&pool->data_lock);
+
+	if (opt_protocol) {
+		applog(LOG_DEBUG, "job_id: %.*s", (int)sn->job_id.len, sn->job_id.str);
+		applog(LOG_DEBUG, "prev_hash: %.*s", (int)sn->prev_hash.len, sn->prev_hash.str);
+		applog(LOG_DEBUG, "coinbase1: %.*s", (int)sn->coinbase1.len, sn->coinbase1.str);
+		applog(LOG_DEBUG, "coinbase2: %.*s", (int)sn->coinbase2.len, sn->coinbase2.str);
+		applog(LOG_DEBUG, "bbversion: %.*s", (int)sn->bbversion.len, sn->bbversion.str);
+		applog(LOG_DEBUG, "nbit: %.*s", (int)sn->nbit.len, sn->nbit.str);
+		applog(LOG_DEBUG, "ntime: %.*s", (int)sn->ntime.len, sn->ntime.str);
+		applog(LOG_DEBUG, "clean: %s", sn->clean ? "yes" : "no");
+	}
+
+	notify_done(pool);
+	return true;
+}
+
+/* The jansson decoder for any notify scan_notify turns down, such as one
+ * with escaped strings or fields of a non-standard length */
+static bool parse_notify_json(struct pool *pool, json_t *val)
+{
+	const char *job_id, *prev_hash, *coinbase1, *coinbase2, *bbversion,
+		   *nbit, *ntime;
+	unsigned char header_bin[128];
+	struct json_tok tok;
+	size_t cb1_len, cb2_len, header_len;
+	char *header;
+	bool clean;
 	int merkles, i;
 	json_t *arr;
 
 	arr = json_array_get(val, 4);
 	if (!arr || !json_is_array(arr))
-		goto out;
+		return false;
 
 	merkles = json_array_size(arr);
+	for (i = 0; i < merkles; i++) {
+		if (!json_string_value(json_array_get(arr, i)))
+			return false;
+	}
 
-	job_id = json_array_string(val, 0);
-	prev_hash = json_array_string(val, 1);
-	coinbase1 = json_array_string(val, 2);
-	coinbase2 = json_array_string(val, 3);
-	bbversion = json_array_string(val, 5);
-	nbit = json_array_string(val, 6);
-	ntime = json_array_string(val, 7);
+	job_id = json_string_value(json_array_get(val, 0));
+	prev_hash = json_string_value(json_array_get(val, 1));
+	coinbase1 = json_string_value(json_array_get(val, 2));
+	coinbase2 = json_string_value(json_array_get(val, 3));
+	bbversion = json_string_value(json_array_get(val, 5));
+	nbit = json_string_value(json_array_get(val, 6));
+	ntime = json_string_value(json_array_get(val, 7));
 	clean = json_is_true(json_array_get(val, 8));
 
-	if (!job_id || !prev_hash || !coinbase1 || !coinbase2 || !bbversion || !nbit || !ntime) {
-		/* Annoying but we must not leak memory */
-		if (job_id)
-			free(job_id);
-		if (prev_hash)
-			free(prev_hash);
-		if (coinbase1)
-			free(coinbase1);
-		if (coinbase2)
-			free(coinbase2);
-		if (bbversion)
-			free(bbversion);
-		if (nbit)
-			free(nbit);
-		if (ntime)
-			free(ntime);
-		goto out;
-	}
+	if (!job_id || !prev_hash || !coinbase1 || !coinbase2 || !bbversion || !nbit || !ntime)
+		return false;
 
-	cg_wlock(&pool->data_lock);
-	free(pool->swork.job_id);
-	free(pool->swork.prev_hash);
-	free(pool->swork.bbversion);
-	free(pool->swork.nbit);
-	free(pool->swork.ntime);
-	pool->swork.job_id = job_id;
-	pool->swork.prev_hash = prev_hash;
 	cb1_len = strlen(coinbase1) / 2;
 	cb2_len = strlen(coinbase2) / 2;
-	pool->swork.bbversion = bbversion;
-	pool->swork.nbit = nbit;
-	pool->swork.ntime = ntime;
+
+	header_len = strlen(bbversion) + strlen(prev_hash) +
+	/* merkle_hash */ 64 +
+		     strlen(ntime) + strlen(nbit) +
+	/* nonce */	  8 +
+	/* workpadding */ 96 + 1;
+	header = alloca(header_len);
+	snprintf(header, header_len, "%s%s%064d%s%s%s%s",
+		 bbversion, prev_hash, 0, ntime, nbit,
+		 "00000000", /* nonce */
+		 workpadding);
+	if (!hex2bin(header_bin, header, 128))
+		return false;
+
+	cg_wlock(&pool->data_lock);
+	tok.str = job_id;
+	tok.len = strlen(job_id);
+	swork_strcpy(&pool->swork.job_id, &pool->swork.job_id_size, &tok);
+	tok.str = ntime;
+	tok.len = strlen(ntime);
+	swork_strcpy(&pool->swork.ntime, &pool->swork.ntime_size, &tok);
 	pool->swork.clean = clean;
-	alloc_len = pool->swork.cb_len = cb1_len + pool->n1_len + pool->n2size + cb2_len;
-	pool->nonce2_offset = cb1_len + pool->n1_len;
+	pool->swork.us_notify = pool->us_recv;
 
-	for (i = 0; i < pool->swork.merkles; i++)
-		free(pool->swork.merkle_bin[i]);
-	if (merkles) {
-		pool->swork.merkle_bin = realloc(pool->swork.merkle_bin,
-						 sizeof(char *) * merkles + 1);
-		for (i = 0; i < merkles; i++) {
-			char *merkle = json_array_string(arr, i);
-
-			pool->swork.merkle_bin[i] = malloc(32);
-			if (unlikely(!pool->swork.merkle_bin[i]))
-				quit(1, "Failed to malloc pool swork merkle_bin");
-			hex2bin(pool->swork.merkle_bin[i], merkle, 32);
-			free(merkle);
-		}
+	if (merkles > pool->swork.merkle_size) {
+		pool->swork.merkle_bin = realloc(pool->swork.merkle_bin, 32 * merkles);
+		if (unlikely(!pool->swork.merkle_bin))
+			quithere(1, "Failed to realloc pool swork merkle_bin");
+		pool->swork.merkle_size = merkles;
 	}
+	for (i = 0; i < merkles; i++)
+		hex2bin(pool->swork.merkle_bin[i], json_string_value(json_array_get(arr, i)), 32);
 	pool->swork.merkles = merkles;
 	if (clean)
 		pool->nonce2 = 0;
-	pool->merkle_offset = strlen(pool->swork.bbversion) +
-			      strlen(pool->swork.prev_hash);
-	pool->swork.header_len = pool->merkle_offset +
-	/* merkle_hash */	 32 +
-				 strlen(pool->swork.ntime) +
-				 strlen(pool->swork.nbit) +
-	/* nonce */		 8 +
-	/* workpadding */	 96;
-	pool->merkle_offset /= 2;
-	pool->swork.header_len = pool->swork.header_len * 2 + 1;
-	align_len(&pool->swork.header_len);
-	header = alloca(pool->swork.header_len);
-	snprintf(header, pool->swork.header_len,
-		"%s%s%s%s%s%s%s",
-		pool->swork.bbversion,
-		pool->swork.prev_hash,
-		blank_merkel,
-		pool->swork.ntime,
-		pool->swork.nbit,
-		"00000000", /* nonce */
-		workpadding);
-	if (unlikely(!hex2bin(pool->header_bin, header, 128)))
-		quit(1, "Failed to convert header to header_bin in parse_notify");
-
-	cb1 = calloc(cb1_len, 1);
-	if (unlikely(!cb1))
-		quithere(1, "Failed to calloc cb1 in parse_notify");
-	hex2bin(cb1, coinbase1, cb1_len);
-	cb2 = calloc(cb2_len, 1);
-	if (unlikely(!cb2))
-		quithere(1, "Failed to calloc cb2 in parse_notify");
-	hex2bin(cb2, coinbase2, cb2_len);
-	free(pool->coinbase);
-	align_len(&alloc_len);
-	pool->coinbase = calloc(alloc_len, 1);
-	if (unlikely(!pool->coinbase))
-		quit(1, "Failed to calloc pool coinbase in parse_notify");
-	memcpy(pool->coinbase, cb1, cb1_len);
-	memcpy(pool->coinbase + cb1_len, pool->nonce1bin, pool->n1_len);
-	memcpy(pool->coinbase + cb1_len + pool->n1_len + pool->n2size, cb2, cb2_len);
+
+	memcpy(pool->header_bin, header_bin, 128);
+	pool->merkle_offset = (strlen(bbversion) + strlen(prev_hash)) / 2;
+
+	notify_coinbase(pool, coinbase1, cb1_len, coinbase2, cb2_len);
 	cg_wunlock(&pool->data_lock);
 
 	if (opt_protocol) {
@@ -1622,19 +2441,9 @@ static bool parse_notify(struct pool *pool, json_t *val)
 		applog(LOG_DEBUG, "ntime: %s", ntime);
 		applog(LOG_DEBUG, "clean: %s", clean ? "yes" : "no");
 	}
-	free(coinbase1);
-	free(coinbase2);
-	free(cb1);
-	free(cb2);
 
-	/* A notify message is the closest stratum gets to a getwork */
-	pool->getwork_requested++;
-	total_getworks++;
-	ret = true;
-	if (pool == current_pool())
-		opt_work_update = true;
-out:
-	return ret;
+	notify_done(pool);
+	return true;
 }
 
 static bool parse_diff(struct pool *pool, json_t *val)
@@ -1688,6 +2497,13 @@ static bool parse_reconnect(struct pool *pool, json_t *val)
 
 	applog(LOG_NOTICE, "Reconnect requested from pool %d to %s", pool->pool_no, address);
 
+	/* The stratum reactor serves every pool so it can't wait on the
+	 * connect, it has a thread of the pool's own do it instead */
+	if (pool->reactor_attached) {
+		pool->reconnect_pending = true;
+		return true;
+	}
+
 	if (!restart_stratum(pool))
 		return false;
 
@@ -1724,6 +2540,7 @@ static bool show_message(struct pool *pool, json_t *val)
 
 bool parse_method(struct pool *pool, char *s)
 {
+	struct stratum_notify sn;
 	json_t *val = NULL, *method, *err_val, *params;
 	json_error_t err;
 	bool ret = false;
@@ -1732,6 +2549,11 @@ bool parse_method(struct pool *pool, char *s)
 	if (!s)
 		return ret;
 
+	if (scan_notify(s, &sn)) {
+		pool->stratum_notify = ret = parse_notify(pool, &sn);
+		return ret;
+	}
+
 	val = JSON_LOADS(s, &err);
 	if (!val) {
 		applog(LOG_INFO, "JSON decode failed(%d): %s", err.line, err.text);
@@ -1763,11 +2585,9 @@ bool parse_method(struct pool *pool, char *s)
 	if (!buf)
 		return ret;
 
+	/* Only a notify scan_notify couldn't handle gets here */
 	if (!strncasecmp(buf, "mining.notify", 13)) {
-		if (parse_notify(pool, params))
-			pool->stratum_notify = ret = true;
-		else
-			pool->stratum_notify = ret = false;
+		pool->stratum_notify = ret = parse_notify_json(pool, params);
 		return ret;
 	}
 
@@ -1776,7 +2596,10 @@ bool parse_method(struct pool *pool, char *s)
 		return ret;
 	}
 
-	if (!strncasecmp(buf, "client.reconnect", 16) && parse_reconnect(pool, params)) {
+	/* A reconnect reuses the socket buffer s points into, so the message
+	 * is treated as consumed whether or not the reconnect succeeded */
+	if (!strncasecmp(buf, "client.reconnect", 16)) {
+		parse_reconnect(pool, params);
 		ret = true;
 		return ret;
 	}
@@ -1811,14 +2634,11 @@ bool auth_stratum(struct pool *pool)
 		sret = recv_line(pool);
 		if (!sret)
 			return ret;
-		if (parse_method(pool, sret))
-			free(sret);
-		else
+		if (!parse_method(pool, sret))
 			break;
 	}
 
 	val = JSON_LOADS(sret, &err);
-	free(sret);
 	res_val = json_object_get(val, "result");
 	err_val = json_object_get(val, "error");
 
@@ -2086,8 +2906,10 @@ static bool setup_stratum_socket(struct pool *pool)
 
 	mutex_lock(&pool->stratum_lock);
 	pool->stratum_active = false;
-	if (pool->sock)
+	if (pool->sock) {
 		CLOSESOCKET(pool->sock);
+		pool->sock_gen++;
+	}
 	pool->sock = 0;
 	mutex_unlock(&pool->stratum_lock);
 
@@ -2253,12 +3075,389 @@ void suspend_stratum(struct pool *pool)
 
 	mutex_lock(&pool->stratum_lock);
 	pool->stratum_active = pool->stratum_notify = false;
-	if (pool->sock)
+	if (pool->sock) {
 		CLOSESOCKET(pool->sock);
+		pool->sock_gen++;
+	}
 	pool->sock = 0;
 	mutex_unlock(&pool->stratum_lock);
 }
 
+#ifndef WIN32
+struct bench_recv {
+	int sock;
+	char *buf;
+	size_t len;
+};
+
+/* Feeds the capture into the socket in typical TCP segment sized writes */
+static void *bench_recv_thread(void *userdata)
+{
+	struct bench_recv *br = (struct bench_recv *)userdata;
+	size_t sent = 0;
+
+	while (sent < br->len) {
+		size_t len = br->len - sent;
+		ssize_t n;
+
+		if (len > 1448)
+			len = 1448;
+		n = send(br->sock, br->buf + sent, len, 0);
+		if (n <= 0)
+			break;
+		sent += n;
+	}
+	close(br->sock);
+	return NULL;
+}
+
+/* Replays a file of raw captured stratum traffic through recv_line over a
+ * local socket pair and reports how fast lines were extracted. Run from the
+ * command line parser so it must not use quit() on failure. */
+bool bench_recv_line(const char *fname)
+{
+	struct timeval tv_start, tv_end;
+	struct bench_recv br;
+	struct pool *pool;
+	uint64_t lines = 0;
+	pthread_t pth;
+	int sv[2];
+	double secs;
+	FILE *fp;
+
+	fp = fopen(fname, "rb");
+	if (!fp) {
+		applog(LOG_ERR, "Failed to open %s for recv_line benchmark", fname);
+		return false;
+	}
+	fseek(fp, 0, SEEK_END);
+	br.len = ftell(fp);
+	rewind(fp);
+	br.buf = malloc(br.len + 1);
+	if (unlikely(!br.buf))
+		quithere(1, "Failed to malloc br.buf");
+	if (fread(br.buf, 1, br.len, fp) != br.len) {
+		applog(LOG_ERR, "Failed to read %s for recv_line benchmark", fname);
+		fclose(fp);
+		free(br.buf);
+		return false;
+	}
+	fclose(fp);
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv)) {
+		applog(LOG_ERR, "Failed to create socketpair for recv_line benchmark");
+		free(br.buf);
+		return false;
+	}
+
+	pool = calloc(sizeof(struct pool), 1);
+	if (unlikely(!pool))
+		quithere(1, "Failed to calloc pool");
+	mutex_init(&pool->stratum_lock);
+	pool->sock = sv[0];
+	pool->sockbuf = calloc(RBUFSIZE, 1);
+	if (unlikely(!pool->sockbuf))
+		quithere(1, "Failed to calloc pool sockbuf");
+	pool->sockbuf_size = RBUFSIZE;
+
+	br.sock = sv[1];
+	cgtime(&tv_start);
+	if (unlikely(pthread_create(&pth, NULL, bench_recv_thread, &br)))
+		quithere(1, "Failed to create recv_line benchmark thread");
+
+	while (recv_line(pool))
+		lines++;
+
+	cgtime(&tv_end);
+	pthread_join(pth, NULL);
+
+	secs = tdiff(&tv_end, &tv_start);
+	if (secs <= 0)
+		secs = 0.000001;
+	applog(LOG_WARNING, "recv_line benchmark: %"PRIu64" lines %"PRIu64" bytes in %.6fs, %.0f lines/s %.2f MB/s",
+	       lines, pool->cgminer_pool_stats.bytes_received, secs,
+	       (double)lines / secs, (double)br.len / secs / 1000000);
+
+	free(pool->sockbuf);
+	free(pool);
+	free(br.buf);
+	return true;
+}
+
+/* A recorded line and whether replaying should wait for the client to send
+ * it: only the subscribe and authorise handshake is waited for since shares
+ * submitted on replay won't match those in the capture */
+struct replay_line {
+	int64_t us;
+	bool sent;
+	bool handshake;
+	char *s;
+	size_t len;
+};
+
+struct replay_pool {
+	int pool_no;
+	struct replay_line *lines;
+	int count;
+	int alloced;
+	int sock;
+	int port;
+	float speed;
+};
+
+/* Counts the lines the client has sent, returning false once it's gone */
+static bool replay_drain(int sock, int *pending, int timeout)
+{
+	struct pollfd pfd;
+	char buf[4096];
+	ssize_t n, i;
+
+	pfd.fd = sock;
+	pfd.events = POLLIN;
+	if (poll(&pfd, 1, timeout) < 1)
+		return true;
+	n = recv(sock, buf, sizeof(buf), 0);
+	if (n <= 0)
+		return false;
+	for (i = 0; i < n; i++) {
+		if (buf[i] == '\n')
+			(*pending)++;
+	}
+	return true;
+}
+
+/* Plays one connection through the capture. The timeline is re-anchored
+ * after each handshake line the client sends so the time it takes us to
+ * respond doesn't make the following lines bunch up */
+static void replay_session(struct replay_pool *rp, int sock)
+{
+	int64_t base = cgtimer_us(), first = rp->lines[0].us;
+	struct timeval tv_start, tv_end;
+	int i, pending = 0;
+
+	cgtime(&tv_start);
+	for (i = 0; i < rp->count; i++) {
+		struct replay_line *rl = &rp->lines[i];
+		size_t sent = 0;
+
+		if (rl->sent) {
+			if (!rl->handshake)
+				continue;
+			while (!pending) {
+				if (!replay_drain(sock, &pending, 10000) || !pending)
+					return;
+			}
+			pending--;
+			if (rp->speed > 0)
+				base = cgtimer_us() - (int64_t)((rl->us - first) / rp->speed);
+			continue;
+		}
+
+		if (rp->speed > 0) {
+			int64_t due = base + (int64_t)((rl->us - first) / rp->speed), now;
+
+			while ((now = cgtimer_us()) < due) {
+				if (!replay_drain(sock, &pending, (due - now + 999) / 1000))
+					return;
+			}
+		} else if (!replay_drain(sock, &pending, 0))
+			return;
+
+		while (sent < rl->len) {
+			ssize_t n = send(sock, rl->s + sent, rl->len - sent, MSG_NOSIGNAL);
+
+			if (n <= 0)
+				return;
+			sent += n;
+		}
+	}
+	cgtime(&tv_end);
+	applog(LOG_NOTICE, "Replay of pool %d capture finished in %.3fs",
+	       rp->pool_no, tdiff(&tv_end, &tv_start));
+}
+
+/* Each replayed pool listens on its own loopback port and plays the capture
+ * from the start to every connection made to it */
+static void *replay_thread(void *userdata)
+{
+	struct replay_pool *rp = (struct replay_pool *)userdata;
+	char threadname[16];
+
+	pthread_detach(pthread_self());
+
+	snprintf(threadname, 16, "Replay/%d", rp->pool_no);
+	RenameThread(threadname);
+
+	while (42) {
+		int sock = accept(rp->sock, NULL, NULL);
+
+		if (sock < 0) {
+			applog(LOG_ERR, "Replay of pool %d failed to accept, errno %d", rp->pool_no, errno);
+			cgsleep_ms(1000);
+			continue;
+		}
+		replay_session(rp, sock);
+		close(sock);
+	}
+	return NULL;
+}
+
+static struct replay_pool *replay_pool(struct replay_pool **rps, int *count, int pool_no)
+{
+	struct replay_pool *rp;
+	int i;
+
+	for (i = 0; i < *count; i++) {
+		if ((*rps)[i].pool_no == pool_no)
+			return &(*rps)[i];
+	}
+	*rps = realloc(*rps, sizeof(struct replay_pool) * (*count + 1));
+	if (unlikely(!*rps))
+		quithere(1, "Failed to realloc rps");
+	rp = &(*rps)[(*count)++];
+	memset(rp, 0, sizeof(*rp));
+	rp->pool_no = pool_no;
+	return rp;
+}
+
+static int replay_pool_cmp(const void *a, const void *b)
+{
+	return ((const struct replay_pool *)a)->pool_no - ((const struct replay_pool *)b)->pool_no;
+}
+
+static bool replay_listen(struct replay_pool *rp)
+{
+	struct sockaddr_in addr;
+	socklen_t addrlen = sizeof(addr);
+
+	rp->sock = socket(AF_INET, SOCK_STREAM, 0);
+	if (rp->sock < 0)
+		return false;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (bind(rp->sock, (struct sockaddr *)&addr, sizeof(addr)) ||
+	    listen(rp->sock, 8) ||
+	    getsockname(rp->sock, (struct sockaddr *)&addr, &addrlen)) {
+		close(rp->sock);
+		return false;
+	}
+	rp->port = ntohs(addr.sin_port);
+	return true;
+}
+
+static void replay_free(struct replay_pool *rps, int count)
+{
+	int i, j;
+
+	for (i = 0; i < count; i++) {
+		for (j = 0; j < rps[i].count; j++)
+			free(rps[i].lines[j].s);
+		free(rps[i].lines);
+	}
+	free(rps);
+}
+
+/* Loads a capture written with capture_open and starts a loopback fake pool
+ * replaying the traffic of each pool recorded in it, speed times faster than
+ * it was captured or as fast as possible if speed is 0. The ports they listen
+ * on are returned in *ports in the order of the recorded pool numbers.
+ * Returns the number of pools or -1 on failure. */
+int replay_start(const char *fname, float speed, int **ports)
+{
+	struct replay_pool *rps = NULL;
+	int i, count = 0, lineno = 0;
+	char *buf = NULL;
+	size_t bufsiz = 0;
+	ssize_t len;
+	FILE *fp;
+
+	fp = fopen(fname, "r");
+	if (!fp) {
+		applog(LOG_ERR, "Failed to open %s for pool replay", fname);
+		return -1;
+	}
+	while ((len = getline(&buf, &bufsiz, fp)) > 0) {
+		struct replay_pool *rp;
+		struct replay_line *rl;
+		int64_t us;
+		int pool_no, off = 0;
+		char dir;
+
+		lineno++;
+		if (buf[0] == '#')
+			continue;
+		if (sscanf(buf, "%"SCNd64" %c %d %n", &us, &dir, &pool_no, &off) < 3 ||
+		    !off || (dir != 'S' && dir != 'R')) {
+			applog(LOG_ERR, "Invalid line %d in pool capture %s", lineno, fname);
+			fclose(fp);
+			free(buf);
+			replay_free(rps, count);
+			return -1;
+		}
+
+		rp = replay_pool(&rps, &count, pool_no);
+		if (rp->count == rp->alloced) {
+			rp->alloced = rp->alloced ? rp->alloced * 2 : 1024;
+			rp->lines = realloc(rp->lines, sizeof(struct replay_line) * rp->alloced);
+			if (unlikely(!rp->lines))
+				quithere(1, "Failed to realloc rp->lines");
+		}
+		rl = &rp->lines[rp->count++];
+		rl->us = us;
+		rl->sent = (dir == 'S');
+		rl->handshake = rl->sent && (strstr(buf + off, "\"mining.subscribe\"") ||
+					     strstr(buf + off, "\"mining.authorize\""));
+		/* Keep the newline to send it as is */
+		rl->len = len - off;
+		rl->s = malloc(rl->len + 1);
+		if (unlikely(!rl->s))
+			quithere(1, "Failed to malloc rl->s");
+		memcpy(rl->s, buf + off, rl->len + 1);
+	}
+	fclose(fp);
+	free(buf);
+
+	if (!count) {
+		applog(LOG_ERR, "No pool traffic found in capture %s", fname);
+		return -1;
+	}
+
+	qsort(rps, count, sizeof(struct replay_pool), replay_pool_cmp);
+	/* Listen on every port before starting any replay so nothing has to be
+	 * stopped again on failure */
+	for (i = 0; i < count; i++) {
+		rps[i].speed = speed;
+		if (!replay_listen(&rps[i])) {
+			applog(LOG_ERR, "Failed to listen for replay of pool %d", rps[i].pool_no);
+			while (i--)
+				close(rps[i].sock);
+			replay_free(rps, count);
+			return -1;
+		}
+	}
+
+	*ports = malloc(sizeof(int) * count);
+	if (unlikely(!*ports))
+		quithere(1, "Failed to malloc ports");
+	for (i = 0; i < count; i++) {
+		struct replay_pool *rp = malloc(sizeof(*rp));
+		pthread_t pth;
+
+		if (unlikely(!rp))
+			quithere(1, "Failed to malloc rp");
+		memcpy(rp, &rps[i], sizeof(*rp));
+		if (unlikely(pthread_create(&pth, NULL, replay_thread, (void *)rp)))
+			quithere(1, "Failed to create replay thread");
+		applog(LOG_NOTICE, "Replaying %d lines of pool %d capture on port %d",
+		       rp->count, rp->pool_no, rp->port);
+		(*ports)[i] = rp->port;
+	}
+	free(rps);
+	return count;
+}
+#endif
+
 bool initiate_stratum(struct pool *pool)
 {
 	bool ret = false, recvd = false, noresume = false, sockd = false;
@@ -2303,7 +3502,6 @@ resend:
 	recvd = true;
 
 	val = JSON_LOADS(sret, &err);
-	free(sret);
 	if (!val) {
 		applog(LOG_INFO, "JSON decode failed(%d): %s", err.line, err.text);
 		goto out;
@@ -2632,6 +3830,74 @@ void cgsem_destroy(cgsem_t *cgsem)
 }
 #endif
 
+#ifndef WIN32
+/* A level triggered wakeup that can be polled along with other fds. On linux
+ * it is an eventfd, elsewhere a non blocking pipe */
+void _cgwake_init(cgwake_t *cgwake, const char *file, const char *func, const int line)
+{
+#ifdef __linux
+	cgwake->rfd = cgwake->wfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (unlikely(cgwake->rfd == -1))
+		quitfrom(1, file, func, line, "Failed eventfd errno=%d", errno);
+#else
+	int pipefd[2], i;
+
+	if (pipe(pipefd) == -1)
+		quitfrom(1, file, func, line, "Failed pipe errno=%d", errno);
+	for (i = 0; i < 2; i++) {
+		if (fcntl(pipefd[i], F_SETFL, fcntl(pipefd[i], F_GETFL, 0) | O_NONBLOCK) == -1 ||
+		    fcntl(pipefd[i], F_SETFD, fcntl(pipefd[i], F_GETFD, 0) | FD_CLOEXEC) == -1)
+			quitfrom(1, file, func, line, "Failed to fcntl errno=%d", errno);
+	}
+	cgwake->rfd = pipefd[0];
+	cgwake->wfd = pipefd[1];
+#endif
+}
+
+/* Makes the wakeup readable until cgwake_clear. Signalling one that is
+ * already signalled, or destroyed, does nothing more */
+void cgwake_signal(cgwake_t *cgwake)
+{
+	uint64_t val = 1;
+	int ret;
+
+	if (unlikely(cgwake->wfd < 0))
+		return;
+#ifdef __linux
+	ret = write(cgwake->wfd, &val, sizeof(val));
+#else
+	ret = write(cgwake->wfd, &val, 1);
+#endif
+	if (unlikely(ret < 0 && errno != EAGAIN))
+		applog(LOG_WARNING, "Failed to signal wakeup errno=%d", errno);
+}
+
+void cgwake_clear(cgwake_t *cgwake)
+{
+#ifdef __linux
+	uint64_t val;
+
+	if (read(cgwake->rfd, &val, sizeof(val)) < 0 && errno != EAGAIN)
+		applog(LOG_WARNING, "Failed to clear wakeup errno=%d", errno);
+#else
+	char buf[64];
+
+	while (read(cgwake->rfd, buf, sizeof(buf)) > 0)
+		;
+#endif
+}
+
+/* The fds are marked closed so a late cgwake_signal can't write to an fd
+ * that has since been reused */
+void cgwake_destroy(cgwake_t *cgwake)
+{
+	close(cgwake->rfd);
+	if (cgwake->wfd != cgwake->rfd)
+		close(cgwake->wfd);
+	cgwake->rfd = cgwake->wfd = -1;
+}
+#endif /* WIN32 */
+
 /* Provide a completion_timeout helper function for unreliable functions that
  * may die due to driver issues etc that time out if the function fails and
  * can then reliably return. */
@@ -85,12 +85,31 @@ typedef struct cgsem cgsem_t;
 #else
 typedef sem_t cgsem_t;
 #endif
+#ifndef WIN32
+/* Both fds are the same eventfd on linux */
+typedef struct cgwake {
+	int rfd;
+	int wfd;
+} cgwake_t;
+#endif
+
 #ifdef WIN32
 typedef LARGE_INTEGER cgtimer_t;
 #else
 typedef struct timespec cgtimer_t;
 #endif
 
+/* Log2 bucketed histogram of latencies in microseconds, each power of 2
+ * split into LAT_SUB equal sub-buckets */
+#define LAT_BUCKETS 26
+#define LAT_SUB 4
+
+struct latency_hist {
+	uint64_t count;
+	int64_t min, max, total;
+	uint64_t bucket[LAT_BUCKETS * LAT_SUB];
+};
+
 struct thr_info;
 struct pool;
 enum dev_reason;
@@ -116,19 +135,35 @@ void cgtimer_time(cgtimer_t *ts_start);
 void cgsleep_ms_r(cgtimer_t *ts_start, int ms);
 void cgsleep_us_r(cgtimer_t *ts_start, int64_t us);
 int cgtimer_to_ms(cgtimer_t *cgt);
+int64_t cgtimer_to_us(cgtimer_t *cgt);
 void cgtimer_sub(cgtimer_t *a, cgtimer_t *b, cgtimer_t *res);
 double us_tdiff(struct timeval *end, struct timeval *start);
 int ms_tdiff(struct timeval *end, struct timeval *start);
 double tdiff(struct timeval *end, struct timeval *start);
+int64_t cgtimer_us(void);
+void lat_hist_add(struct latency_hist *hist, int64_t us);
+void lat_hist_add_atomic(struct latency_hist *hist, int64_t us);
+void lat_hist_reset_atomic(struct latency_hist *hist);
+void lat_hist_snapshot(struct latency_hist *copy, struct latency_hist *hist);
+int64_t lat_hist_pct(struct latency_hist *hist, double pct);
+uint64_t lat_hist_bucket(struct latency_hist *hist, int bucket);
 bool stratum_send(struct pool *pool, char *s, ssize_t len);
 bool sock_full(struct pool *pool);
 char *recv_line(struct pool *pool);
+#ifndef WIN32
+char *recv_line_nowait(struct pool *pool, bool *closed);
+#endif
 bool parse_method(struct pool *pool, char *s);
 bool extract_sockaddr(char *url, char **sockaddr_url, char **sockaddr_port);
 bool auth_stratum(struct pool *pool);
 bool initiate_stratum(struct pool *pool);
 bool restart_stratum(struct pool *pool);
 void suspend_stratum(struct pool *pool);
+bool capture_open(const char *fname);
+#ifndef WIN32
+bool bench_recv_line(const char *fname);
+int replay_start(const char *fname, float speed, int **ports);
+#endif
 void dev_error(struct cgpu_info *dev, enum dev_reason reason);
 void *realloc_strcat(char *ptr, char *s);
 void *str_text(char *ptr);
@@ -145,6 +180,15 @@ bool cg_completion_timeout(void *fn, void *fnarg, int timeout);
 #define cgsem_wait(_sem) _cgsem_wait(_sem, __FILE__, __func__, __LINE__)
 #define cgsem_mswait(_sem, _timeout) _cgsem_mswait(_sem, _timeout, __FILE__, __func__, __LINE__)
 
+#ifndef WIN32
+void _cgwake_init(cgwake_t *cgwake, const char *file, const char *func, const int line);
+void cgwake_signal(cgwake_t *cgwake);
+void cgwake_clear(cgwake_t *cgwake);
+void cgwake_destroy(cgwake_t *cgwake);
+
+#define cgwake_init(_wake) _cgwake_init(_wake, __FILE__, __func__, __LINE__)
+#endif
+
 /* Align a size_t to 4 byte boundaries for fussy arches */
 static inline void align_len(size_t *len)
 {